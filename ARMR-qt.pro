@@ -258,6 +258,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/compat.h \
     src/coincontrol.h \
     src/smessage.h \
+    src/smsgdict.h \
     src/sync.h \
     src/util.h \
     src/uint256.h \
@@ -303,6 +304,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/transactionview.h \
     src/qt/walletmodel.h \
     src/bitcoinrpc.h \
+    src/rpcwriter.h \
     src/qt/overviewpage.h \
     src/qt/csvmodelwriter.h \
     src/crypter.h \
@@ -328,6 +330,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/netbase.h \
     src/clientversion.h \
     src/bloom.h \
+    src/compactblock.h \
     src/checkqueue.h \
     src/hash.h \
     src/hashblock.h \
@@ -418,6 +421,7 @@ SOURCES += src/qt/bitcoin.cpp \
     src/rpcblockchain.cpp \
     src/rpcrawtransaction.cpp \
     src/rpcsmessage.cpp \
+    src/rpcwriter.cpp \
     src/qt/overviewpage.cpp \
     src/qt/csvmodelwriter.cpp \
     src/crypter.cpp \
@@ -442,6 +446,7 @@ SOURCES += src/qt/bitcoin.cpp \
     src/json/json_spirit_reader.cpp \
     src/json/json_spirit_writer.cpp \
     src/bloom.cpp \
+    src/compactblock.cpp \
     src/hash.cpp
 
 RESOURCES += \
@@ -0,0 +1,426 @@
+#!/usr/bin/env python3
+# Copyright (c) 2017-2018 The ARMR Developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""
+Loopback P2P benchmark.
+
+Starts several ARMRd instances on 127.0.0.1, joined into a private network
+(testnet rules, -netmagic message start, no Tor), drives scripted workloads
+through RPC and reports propagation latency percentiles and bytes sent.
+
+Workloads:
+  blocks   mine blocks one at a time, round robin over the nodes
+  burst    mine bursts of blocks back to back on one node
+  txs      flood transactions from every node
+  smsg     flood anonymous secure messages between nodes
+
+Latency is measured by one watcher thread per node polling RPC every
+--poll ms, so it includes up to that much polling delay.
+
+Example:
+  qa/bench/p2pbench.py --ARMRd=src/ARMRd --nodes=6 --topology=ring blocks txs
+"""
+
+import argparse
+import base64
+import http.client
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+NETMAGIC = "fab5dabe"
+BASE_PORT = 28000
+BASE_RPC_PORT = 29000
+RPC_USER = "bench"
+RPC_PASSWORD = "bench"
+
+
+class RPCError(Exception):
+    pass
+
+
+class RPC(object):
+    def __init__(self, port, timeout=120):
+        self.port = port
+        self.timeout = timeout
+        self.auth = "Basic " + base64.b64encode(("%s:%s" % (RPC_USER, RPC_PASSWORD)).encode()).decode()
+        self.conn = None
+        self.nextid = 0
+
+    def __call__(self, method, *params):
+        if self.conn is None:
+            self.conn = http.client.HTTPConnection("127.0.0.1", self.port, timeout=self.timeout)
+        self.nextid += 1
+        body = json.dumps({"version": "1.1", "method": method, "params": list(params), "id": self.nextid})
+        try:
+            self.conn.request("POST", "/", body, {"Authorization": self.auth, "Content-type": "application/json"})
+            resp = json.loads(self.conn.getresponse().read().decode())
+        except (OSError, http.client.HTTPException, ValueError):
+            self.conn.close()
+            self.conn = None
+            raise
+        if resp.get("error"):
+            raise RPCError("%s: %s" % (method, resp["error"]))
+        return resp["result"]
+
+
+class Node(object):
+    def __init__(self, index, binary, basedir, extra_args):
+        self.index = index
+        self.port = BASE_PORT + index
+        self.rpcport = BASE_RPC_PORT + index
+        self.datadir = os.path.join(basedir, "node%d" % index)
+        self.binary = binary
+        self.extra_args = extra_args
+        self.process = None
+        self.rpc = RPC(self.rpcport)
+
+    def start(self, connect_to):
+        os.makedirs(self.datadir)
+        with open(os.path.join(self.datadir, "ARMR.conf"), "w") as f:
+            f.write("rpcuser=%s\nrpcpassword=%s\n" % (RPC_USER, RPC_PASSWORD))
+        args = [self.binary,
+                "-datadir=" + self.datadir,
+                "-testnet",
+                "-netmagic=" + NETMAGIC,
+                "-server",
+                "-listen",
+                "-port=%d" % self.port,
+                "-rpcport=%d" % self.rpcport,
+                "-externalip=127.0.0.1",
+                "-dontuse=0",        # allow IPv4 peers
+                "-tor=127.0.0.1:9",  # don't start the bundled Tor
+                "-dnsseed=0",
+                "-staking=0",
+                "-keypool=10"]
+        args += ["-connect=127.0.0.1:%d" % (BASE_PORT + i) for i in connect_to]
+        if not connect_to:
+            args.append("-connect=0")
+        args += self.extra_args
+        self.process = subprocess.Popen(args, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+    def wait_ready(self, timeout=120):
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            if self.process.poll() is not None:
+                raise RuntimeError("node%d exited during startup" % self.index)
+            try:
+                self.rpc("getblockcount")
+                return
+            except (OSError, http.client.HTTPException, RPCError, ValueError):
+                time.sleep(0.25)
+        raise RuntimeError("node%d did not start" % self.index)
+
+    def stop(self):
+        if self.process is None:
+            return
+        try:
+            self.rpc("stop")
+        except Exception:
+            pass
+        try:
+            self.process.wait(30)
+        except subprocess.TimeoutExpired:
+            self.process.kill()
+
+
+def topology_peers(kind, n, i):
+    """Outbound peers of node i"""
+    if kind == "ring":
+        return [(i + 1) % n] if n > 1 else []
+    if kind == "line":
+        return [i + 1] if i + 1 < n else []
+    if kind == "star":
+        return [0] if i > 0 else []
+    if kind == "mesh":
+        return list(range(i + 1, n))
+    raise ValueError("unknown topology " + kind)
+
+
+class Watcher(threading.Thread):
+    """Polls one node and records when it first sees each tracked item"""
+
+    def __init__(self, node, poll_ms):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.rpc = RPC(node.rpcport)
+        self.poll = poll_ms / 1000.0
+        self.lock = threading.Lock()
+        self.seen = {}          # item -> time first seen
+        self.smsg_arrivals = []  # times the stored message count went up
+        self.mode = None
+        self.running = True
+        self.height = None
+        self.mempool = set()
+        self.smsg_count = None
+
+    def set_mode(self, mode):
+        with self.lock:
+            self.mode = mode
+            self.height = None
+            self.mempool = set()
+            self.smsg_count = None
+            self.seen = {}
+            self.smsg_arrivals = []
+
+    def run(self):
+        while self.running:
+            with self.lock:
+                mode = self.mode
+            try:
+                if mode == "blocks":
+                    self.poll_blocks()
+                elif mode == "txs":
+                    self.poll_mempool()
+                elif mode == "smsg":
+                    self.poll_smsg()
+            except (OSError, http.client.HTTPException, RPCError, ValueError):
+                pass
+            time.sleep(self.poll)
+
+    def poll_blocks(self):
+        height = self.rpc("getblockcount")
+        now = time.time()
+        if self.height is None:
+            self.height = height
+            return
+        for h in range(self.height + 1, height + 1):
+            with self.lock:
+                self.seen.setdefault(self.rpc("getblockhash", h), now)
+        self.height = height
+
+    def poll_mempool(self):
+        now = time.time()
+        for txid in self.rpc("getrawmempool"):
+            if txid not in self.mempool:
+                self.mempool.add(txid)
+                with self.lock:
+                    self.seen.setdefault(txid, now)
+
+    def poll_smsg(self):
+        count = int(self.rpc("smsgbuckets", "stats")["total"]["messages"])
+        now = time.time()
+        if self.smsg_count is None:
+            self.smsg_count = count
+            return
+        with self.lock:
+            self.smsg_arrivals += [now] * max(0, count - self.smsg_count)
+        self.smsg_count = count
+
+    def first_seen(self, item):
+        with self.lock:
+            return self.seen.get(item)
+
+
+def percentiles(values):
+    if not values:
+        return "no samples"
+    values = sorted(values)
+
+    def pct(p):
+        return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+    return "n=%d p50=%.1fms p90=%.1fms p99=%.1fms max=%.1fms" % (
+        len(values), pct(50) * 1000, pct(90) * 1000, pct(99) * 1000, values[-1] * 1000)
+
+
+def net_totals(nodes):
+    totals = [n.rpc("getnettotals") for n in nodes]
+    sent = sum(t["totalbytessent"] for t in totals)
+    per_msg = {}
+    for t in totals:
+        for cmd, stats in t.get("sent_per_msg", {}).items():
+            per_msg[cmd] = per_msg.get(cmd, 0) + stats["bytes"]
+    return sent, per_msg
+
+
+def report_bytes(before, after, items):
+    sent = after[0] - before[0]
+    print("  bytes sent: %d total, %.0f per item" % (sent, float(sent) / max(1, items)))
+    diff = [(cmd, after[1].get(cmd, 0) - before[1].get(cmd, 0)) for cmd in after[1]]
+    diff = sorted([d for d in diff if d[1] > 0], key=lambda d: -d[1])
+    print("  by message: " + ", ".join("%s=%d" % d for d in diff[:8]))
+
+
+def wait_for(predicate, timeout):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if predicate():
+            return True
+        time.sleep(0.05)
+    return False
+
+
+def propagation(nodes, watchers, items, timeout):
+    """items: list of (item, origin node index, send time)"""
+    def all_seen():
+        return all(w.first_seen(item) is not None
+                   for item, origin, _ in items for w in watchers if w is not watchers[origin])
+    if not wait_for(all_seen, timeout):
+        print("  warning: not everything propagated within %ds" % timeout)
+    latencies = []
+    for item, origin, t0 in items:
+        for w in watchers:
+            if w is watchers[origin]:
+                continue
+            t = w.first_seen(item)
+            if t is not None:
+                latencies.append(max(0.0, t - t0))
+    return latencies
+
+
+def run_blocks(nodes, watchers, args, burst):
+    for w in watchers:
+        w.set_mode("blocks")
+    time.sleep(0.5)
+    before = net_totals(nodes)
+    items = []
+    if burst:
+        for b in range(args.count):
+            origin = b % len(nodes)
+            t0 = time.time()
+            for h in nodes[origin].rpc("generate", args.burst_size):
+                items.append((h, origin, t0))
+            time.sleep(args.interval / 1000.0)
+    else:
+        for b in range(args.count):
+            origin = b % len(nodes)
+            t0 = time.time()
+            items.append((nodes[origin].rpc("generate", 1)[0], origin, t0))
+            time.sleep(args.interval / 1000.0)
+    latencies = propagation(nodes, watchers, items, args.timeout)
+    print("%s: %d blocks" % ("burst" if burst else "blocks", len(items)))
+    print("  propagation: " + percentiles(latencies))
+    report_bytes(before, net_totals(nodes), len(items))
+
+
+def run_txs(nodes, watchers, args):
+    # every node needs spendable coins and somewhere to send them
+    addresses = [n.rpc("getnewaddress") for n in nodes]
+    for n in nodes:
+        n.rpc("generate", 2)
+    time.sleep(2)
+
+    for w in watchers:
+        w.set_mode("txs")
+    time.sleep(0.5)
+    before = net_totals(nodes)
+    items = []
+    for t in range(args.count):
+        origin = t % len(nodes)
+        dest = addresses[(origin + 1) % len(nodes)]
+        t0 = time.time()
+        try:
+            items.append((nodes[origin].rpc("sendtoaddress", dest, 0.01), origin, t0))
+        except RPCError as e:
+            print("  sendtoaddress failed on node%d: %s" % (origin, e))
+        time.sleep(args.interval / 1000.0)
+    latencies = propagation(nodes, watchers, items, args.timeout)
+    print("txs: %d transactions" % len(items))
+    print("  propagation: " + percentiles(latencies))
+    report_bytes(before, net_totals(nodes), len(items))
+
+
+def run_smsg(nodes, watchers, args):
+    # each node gets an address whose key every other node knows
+    keys = []
+    for n in nodes:
+        addr = n.rpc("getnewaddress")
+        keys.append((addr, n.rpc("validateaddress", addr)["pubkey"]))
+    for n in nodes:
+        for addr, pubkey in keys:
+            try:
+                n.rpc("smsgaddkey", addr, pubkey)
+            except RPCError:
+                pass
+
+    for w in watchers:
+        w.set_mode("smsg")
+    time.sleep(1)
+    before = net_totals(nodes)
+    sends = []
+    for m in range(args.count):
+        origin = m % len(nodes)
+        dest = keys[(origin + 1) % len(nodes)][0]
+        t0 = time.time()
+        nodes[origin].rpc("smsgsendanon", dest, "bench %d %s" % (m, "x" * args.smsg_size))
+        sends.append(t0)
+        time.sleep(args.interval / 1000.0)
+
+    # messages are not tracked individually; match the k-th arrival at each
+    # node with the k-th send
+    wait_for(lambda: all(len(w.smsg_arrivals) >= len(sends) for w in watchers), args.timeout)
+    latencies = []
+    for w in watchers:
+        with w.lock:
+            arrivals = list(w.smsg_arrivals)
+        latencies += [max(0.0, a - s) for a, s in zip(arrivals, sends)]
+    print("smsg: %d messages" % len(sends))
+    print("  propagation: " + percentiles(latencies))
+    report_bytes(before, net_totals(nodes), len(sends))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("workloads", nargs="*", default=["blocks", "txs"],
+                        choices=["blocks", "burst", "txs", "smsg"])
+    parser.add_argument("--ARMRd", default=os.path.join(os.path.dirname(__file__), "../../src/ARMRd"),
+                        help="node binary (default: %(default)s)")
+    parser.add_argument("--nodes", type=int, default=4)
+    parser.add_argument("--topology", default="ring", choices=["ring", "line", "star", "mesh"])
+    parser.add_argument("--count", type=int, default=50, help="items per workload")
+    parser.add_argument("--burst-size", type=int, default=5, help="blocks per burst")
+    parser.add_argument("--interval", type=int, default=200, help="ms between items")
+    parser.add_argument("--smsg-size", type=int, default=200, help="secure message body bytes")
+    parser.add_argument("--poll", type=int, default=5, help="watcher poll interval in ms")
+    parser.add_argument("--timeout", type=int, default=60, help="seconds to wait for propagation")
+    parser.add_argument("--tmpdir", help="root for the node datadirs (default: a new temporary directory)")
+    parser.add_argument("--nocleanup", action="store_true", help="leave the datadirs behind")
+    parser.add_argument("--arg", action="append", default=[], help="extra argument for every node, e.g. --arg=-p2pcompress=0")
+    args = parser.parse_args()
+
+    basedir = args.tmpdir or tempfile.mkdtemp(prefix="armr-p2pbench.")
+    nodes = [Node(i, args.ARMRd, basedir, args.arg) for i in range(args.nodes)]
+    watchers = []
+    try:
+        for n in nodes:
+            n.start(topology_peers(args.topology, args.nodes, n.index))
+        for n in nodes:
+            n.wait_ready()
+        print("%d nodes, %s topology, datadirs in %s" % (args.nodes, args.topology, basedir))
+
+        # get past the special first blocks and give everyone the same tip
+        nodes[0].rpc("generate", 3)
+        if not wait_for(lambda: len(set(n.rpc("getbestblockhash") for n in nodes)) == 1, args.timeout):
+            raise RuntimeError("nodes did not sync the initial blocks; check the topology and debug.log")
+
+        watchers = [Watcher(n, args.poll) for n in nodes]
+        for w in watchers:
+            w.start()
+
+        for workload in args.workloads:
+            if workload == "blocks":
+                run_blocks(nodes, watchers, args, False)
+            elif workload == "burst":
+                run_blocks(nodes, watchers, args, True)
+            elif workload == "txs":
+                run_txs(nodes, watchers, args)
+            elif workload == "smsg":
+                run_smsg(nodes, watchers, args)
+        return 0
+    finally:
+        for w in watchers:
+            w.running = False
+        for n in nodes:
+            n.stop()
+        if not args.nocleanup and not args.tmpdir:
+            shutil.rmtree(basedir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
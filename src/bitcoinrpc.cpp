@@ -24,6 +24,9 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/version.hpp>
+#include <deque>
 #include <list>
 
 
@@ -40,7 +43,7 @@ static std::string strRPCUserColonPass;
 
 const Object emptyobj;
 
-void ThreadRPCServer3(void* parg);
+void ThreadRPCWorker(void* parg);
 
 static inline unsigned short GetDefaultRPCPort()
 {
@@ -265,8 +268,8 @@ Value uptime(const Array& params, bool fHelp)
 
 static const CRPCCommand vRPCCommands[] =
     {
-        //  category          name                     function                  safemd  unlocked
-        //  ----------------  -----------------------  ------------------------  ------  --------
+        //  category          name                     function                  safemd  unlocked  streamer  parallel
+        //  ----------------  -----------------------  ------------------------  ------  --------  --------  --------
 
         /* Overall control/query calls */
         {"control",           "help",                   &help,                   true,   true },
@@ -286,24 +289,25 @@ static const CRPCCommand vRPCCommands[] =
         {"network",           "clearbanned",              &clearbanned,            true,  false},
 
         /* Block chain mining and UTXO */
-        {"blockchain",        "getbestblockhash",       &getbestblockhash,       true,   false},
-        {"blockchain",        "getblockcount",          &getblockcount,          true,   false},
-        {"blockchain",        "getblock",               &getblock,               false,  false},
+        {"blockchain",        "getbestblockhash",       &getbestblockhash,       true,   false, NULL, true },
+        {"blockchain",        "getblockcount",          &getblockcount,          true,   false, NULL, true },
+        {"blockchain",        "getblock",               &RPCStreamAsValue<&getblock>, false, true, &getblock, true },
         {"blockchain",        "getblock_old",           &getblock_old            false,  false},
-        {"blockchain",        "getblockhash",           &getblockhash,           false,  false},
-        {"blockchain",        "getblockbynumber",       &getblockbynumber,       false,  false},
+        {"blockchain",        "getblockhash",           &getblockhash,           false,  false, NULL, true },
+        {"blockchain",        "getblockbynumber",       &getblockbynumber,       false,  false, NULL, true },
         {"blockchain",        "getcheckpoint",          &getcheckpoint,          true,   false},
-        {"blockchain",        "getblocktemplate",       &getblocktemplate,       true,   false},
-        {"blockchain",        "getdifficulty",          &getdifficulty,          true,   false},
+        {"blockchain",        "getblocktemplate",       &RPCStreamAsValue<&getblocktemplate>, true, true, &getblocktemplate },
+        {"blockchain",        "getdifficulty",          &getdifficulty,          true,   false, NULL, true },
         {"blockchain",        "getmininginfo",          &getmininginfo,          true,   false},
         {"blockchain",        "getnetworkhashps",       &getnetworkhashps,       true,   false},
-        {"blockchain",        "getrawmempool",          &getrawmempool,          true,   false},
+        {"blockchain",        "getrawmempool",          &RPCStreamAsValue<&getrawmempool>, true, true, &getrawmempool, true },
         {"blockchain",        "getstakinginfo",         &getstakinginfo,         true,   false},
         {"blockchain",        "getsubsidy",             &getsubsidy,             true,   false},
         {"blockchain",        "getwork",                &getwork,                true,   false},
         {"blockchain",        "getworkex",              &getworkex,              true,   false},
         {"blockchain",        "settxfee",               &settxfee,               false,  false},
         {"blockchain",        "submitblock",            &submitblock,            false,  false},
+        {"blockchain",        "generate",               &generate,               true,   true },
         {"blockchain",        "reservebalance",         &reservebalance,         false,  true },
         {"blockchain",        "gettxout",               &gettxout,                true,  false},
 
@@ -333,7 +337,7 @@ static const CRPCCommand vRPCCommands[] =
         {"wallet",            "listreceivedbyaddress",  &listreceivedbyaddress,  false,  false},
         {"wallet",            "listsinceblock",         &listsinceblock,         false,  false},
         {"wallet",            "listtransactions",       &listtransactions,       false,  false},
-        {"wallet",            "listunspent",            &listunspent,            false,  false},
+        {"wallet",            "listunspent",            &RPCStreamAsValue<&listunspent>, false, true, &listunspent},
         {"wallet",            "move",                   &movecmd,                false,  false},
         {"wallet",            "repairwallet",           &repairwallet,           false,  true },
         {"wallet",            "sendfrom",               &sendfrom,               false,  false},
@@ -354,10 +358,10 @@ static const CRPCCommand vRPCCommands[] =
 
         /* Raw transactions */
         {"rawtransactions",   "createrawtransaction",   &createrawtransaction,   false,  false},
-        {"rawtransactions",   "decoderawtransaction",   &decoderawtransaction,   false,  false},
+        {"rawtransactions",   "decoderawtransaction",   &decoderawtransaction,   false,  true, NULL, true },
         {"rawtransactions",   "decodescript",           &decodescript,           false,  false},
-        {"rawtransactions",   "getrawtransaction",      &getrawtransaction,      false,  false},
-        {"rawtransactions",   "listunspent",            &listunspent,            false,  false},
+        {"rawtransactions",   "getrawtransaction",      &getrawtransaction,      false,  true, NULL, true },
+        {"rawtransactions",   "listunspent",            &RPCStreamAsValue<&listunspent>, false, true, &listunspent},
         {"rawtransactions",   "sendrawtransaction",     &sendrawtransaction,     false,  false},
         {"rawtransactions",   "signrawtransaction",     &signrawtransaction,     false,  false},
 
@@ -386,8 +390,8 @@ static const CRPCCommand vRPCCommands[] =
         {"messages",          "smsggetpubkey",          &smsggetpubkey,          false,  false},
         {"messages",          "smsgsend",               &smsgsend,               false,  false},
         {"messages",          "smsgsendanon",           &smsgsendanon,           false,  false},
-        {"messages",          "smsginbox",              &smsginbox,              false,  false},
-        {"messages",          "smsgoutbox",             &smsgoutbox,             false,  false},
+        {"messages",          "smsginbox",              &RPCStreamAsValue<&smsginbox>, false, true, &smsginbox},
+        {"messages",          "smsgoutbox",             &RPCStreamAsValue<&smsgoutbox>, false, true, &smsgoutbox},
         {"messages",          "smsgbuckets",            &smsgbuckets,            false,  false},
 };
 
@@ -473,6 +477,7 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
     else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
     else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
     else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
+    else if (nStatus == HTTP_SERVICE_UNAVAILABLE) cStatus = "Service Unavailable";
     else cStatus = "";
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
@@ -492,6 +497,22 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
         strMsg.c_str());
 }
 
+// Transfer-Encoding: chunked reply, written as the result is produced
+static string HTTPReplyChunkedHeader(bool keepalive)
+{
+    return strprintf(
+            "HTTP/1.1 200 OK\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Content-Type: application/json\r\n"
+            "Server: ARMR-json-rpc/%s\r\n"
+            "\r\n",
+        rfc1123Time().c_str(),
+        keepalive ? "keep-alive" : "close",
+        FormatFullVersion().c_str());
+}
+
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto)
 {
     string str;
@@ -532,7 +553,35 @@ int ReadHTTPHeader(std::basic_istream<char>& stream, map<string, string>& mapHea
     return nLen;
 }
 
-int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet)
+static bool ReadHTTPChunked(std::basic_istream<char>& stream, string& strMessageRet)
+{
+    while (true)
+    {
+        string str;
+        getline(stream, str);
+        if (!stream)
+            return false;
+        unsigned long nChunk = strtoul(str.c_str(), NULL, 16);
+        if (nChunk == 0)
+            break;
+        if (nChunk > MAX_SIZE - strMessageRet.size())
+            return false;
+
+        size_t nOffset = strMessageRet.size();
+        strMessageRet.resize(nOffset + nChunk);
+        stream.read(&strMessageRet[nOffset], nChunk);
+        getline(stream, str); // CRLF after the data
+        if (!stream)
+            return false;
+    }
+
+    // Trailer, ends with an empty line
+    map<string, string> mapTrailers;
+    ReadHTTPHeader(stream, mapTrailers);
+    return true;
+}
+
+int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet, int* pnProtoRet = NULL)
 {
     mapHeadersRet.clear();
     strMessageRet = "";
@@ -540,6 +589,8 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
     // Read status
     int nProto = 0;
     int nStatus = ReadHTTPStatus(stream, nProto);
+    if (pnProtoRet)
+        *pnProtoRet = nProto;
 
     // Read header
     int nLen = ReadHTTPHeader(stream, mapHeadersRet);
@@ -547,7 +598,12 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (boost::iequals(mapHeadersRet["transfer-encoding"], "chunked"))
+    {
+        if (!ReadHTTPChunked(stream, strMessageRet))
+            return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
@@ -709,6 +765,16 @@ public:
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+
+    // True if more request data has already been read off the socket
+    virtual bool pending() = 0;
+    // Call handler from the listener's io_service once the peer sends more
+    virtual void async_wait_readable(boost::function<void (const boost::system::error_code&)> handler) = 0;
+
+    // Shut the socket down unless cancel_read_deadline() comes within
+    // nSeconds, so a worker blocked reading a stalled request gets EOF
+    virtual void set_read_deadline(int nSeconds) = 0;
+    virtual void cancel_read_deadline() = 0;
 };
 
 template <typename Protocol>
@@ -721,10 +787,17 @@ public:
             bool fUseSSL) :
         sslStream(io_service, context),
         _d(sslStream, fUseSSL),
-        _stream(_d)
+        _stream(_d),
+        fUseSSL(fUseSSL),
+        deadline(new ReadDeadline(io_service))
     {
     }
 
+    virtual ~AcceptedConnectionImpl()
+    {
+        cancel_read_deadline();
+    }
+
     virtual std::iostream& stream()
     {
         return _stream;
@@ -740,14 +813,191 @@ public:
         _stream.close();
     }
 
+    virtual bool pending()
+    {
+        if (_stream.rdbuf()->in_avail() > 0)
+            return true;
+        if (!fUseSSL)
+            return false;
+#if BOOST_VERSION >= 104700
+        return SSL_pending(sslStream.native_handle()) > 0;
+#else
+        return SSL_pending(sslStream.impl()->ssl) > 0;
+#endif
+    }
+
+    virtual void async_wait_readable(boost::function<void (const boost::system::error_code&)> handler)
+    {
+        sslStream.lowest_layer().async_read_some(asio::null_buffers(), handler);
+    }
+
+    virtual void set_read_deadline(int nSeconds)
+    {
+        boost::unique_lock<boost::mutex> lock(deadline->mutex);
+        deadline->pconn = this;
+        deadline->nArmed++;
+        deadline->timer.expires_from_now(boost::posix_time::seconds(nSeconds));
+        deadline->timer.async_wait(boost::bind(&AcceptedConnectionImpl<Protocol>::ReadDeadlineExpired,
+            deadline, deadline->nArmed, asio::placeholders::error));
+    }
+
+    virtual void cancel_read_deadline()
+    {
+        boost::unique_lock<boost::mutex> lock(deadline->mutex);
+        deadline->pconn = NULL;
+        deadline->timer.cancel();
+    }
+
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
 private:
+    // Outlives the connection while the timer handler is queued. The handler
+    // runs on the io_service thread, pconn is only followed under mutex.
+    struct ReadDeadline
+    {
+        ReadDeadline(asio::io_service& io_service) : timer(io_service), pconn(NULL), nArmed(0) {}
+
+        boost::mutex mutex;
+        asio::deadline_timer timer;
+        AcceptedConnectionImpl<Protocol>* pconn;
+        unsigned int nArmed;
+    };
+
+    static void ReadDeadlineExpired(boost::shared_ptr<ReadDeadline> deadline, unsigned int nArmed, const boost::system::error_code& error)
+    {
+        boost::unique_lock<boost::mutex> lock(deadline->mutex);
+        if (error || !deadline->pconn || deadline->nArmed != nArmed)
+            return;
+
+        // Only shut down, the worker reading still owns and closes the socket
+        printf("ThreadRPCServer read timed out for %s\n", deadline->pconn->peer_address_to_string().c_str());
+        boost::system::error_code ec;
+        deadline->pconn->sslStream.lowest_layer().shutdown(socket_base::shutdown_both, ec);
+        deadline->pconn = NULL;
+    }
+
     SSLIOStreamDevice<Protocol> _d;
     iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
+    bool fUseSSL;
+    boost::shared_ptr<ReadDeadline> deadline;
+};
+
+class CRPCBatch;
+
+/**
+ * Connections with a request waiting, served by the -rpcthreads workers.
+ * Bounded by -rpcworkqueue; past that callers get a 503 instead of a thread.
+ * Workers also pick up calls for help from batches being executed, ahead of
+ * connections and outside the bound.
+ */
+class CRPCWorkQueue
+{
+public:
+    CRPCWorkQueue() : nMaxDepth(0) {}
+
+    void SetMaxDepth(size_t nMaxDepthIn)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nMaxDepth = nMaxDepthIn;
+    }
+
+    bool Push(AcceptedConnection* conn)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (queue.size() >= nMaxDepth)
+            return false;
+        queue.push_back(conn);
+        cond.notify_one();
+        return true;
+    }
+
+    void PushHelpers(const boost::shared_ptr<CRPCBatch>& batch, int nHelpers)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (int i = 0; i < nHelpers; i++)
+            helpers.push_back(batch);
+        cond.notify_all();
+    }
+
+    // Sets either conn or batch, returns false once shutdown has started
+    bool Pop(AcceptedConnection*& conn, boost::shared_ptr<CRPCBatch>& batch)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fShutdown && queue.empty() && helpers.empty())
+            cond.timed_wait(lock, boost::posix_time::milliseconds(250));
+        if (fShutdown)
+            return false;
+        conn = NULL;
+        batch.reset();
+        if (!helpers.empty())
+        {
+            batch = helpers.front();
+            helpers.pop_front();
+        }
+        else
+        {
+            conn = queue.front();
+            queue.pop_front();
+        }
+        return true;
+    }
+
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<AcceptedConnection*> queue;
+    std::deque<boost::shared_ptr<CRPCBatch> > helpers;
+    size_t nMaxDepth;
 };
 
+static CRPCWorkQueue rpcWorkQueue;
+static int nRPCThreads = 0;
+static int nRPCReadTimeout = 30;
+
+static CCriticalSection cs_rpcLongWaits;
+static int nRPCLongWaits = 0;
+
+bool RPCBeginLongWait()
+{
+    // Keep a worker free for everything else
+    LOCK(cs_rpcLongWaits);
+    if (nRPCLongWaits >= nRPCThreads - 1)
+        return false;
+    nRPCLongWaits++;
+    return true;
+}
+
+void RPCEndLongWait()
+{
+    LOCK(cs_rpcLongWaits);
+    nRPCLongWaits--;
+}
+
+static void RPCQueueConnection(AcceptedConnection* conn, bool fCanReply)
+{
+    if (rpcWorkQueue.Push(conn))
+        return;
+
+    printf("ThreadRPCServer work queue depth exceeded, dropping %s\n", conn->peer_address_to_string().c_str());
+    if (fCanReply)
+        conn->stream() << HTTPReply(HTTP_SERVICE_UNAVAILABLE, "", false) << std::flush;
+    conn->close();
+    delete conn;
+}
+
+// A new or kept-alive connection sent its next request, or was closed
+static void RPCConnectionReadable(AcceptedConnection* conn, bool fCanReply, const boost::system::error_code& error)
+{
+    if (error)
+    {
+        conn->close();
+        delete conn;
+        return;
+    }
+    RPCQueueConnection(conn, fCanReply);
+}
+
 void ThreadRPCServer(void* parg)
 {
     // Make this thread recognisable as the RPC listener
@@ -836,11 +1086,11 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
         delete conn;
     }
 
-    // start HTTP client thread
-    else if (!NewThread(ThreadRPCServer3, conn)) {
-        printf("Failed to create RPC server client thread\n");
-        delete conn;
-    }
+    // Hand it to the worker pool once the client has sent something, an
+    // idle connection must not hold a worker. As with the 403, no 503 for
+    // SSL connections that have not finished their handshake.
+    else
+        conn->async_wait_readable(boost::bind(&RPCConnectionReadable, conn, !fUseSSL, boost::asio::placeholders::error));
 
     vnThreadsRunning[THREAD_RPCLISTENER]--;
 }
@@ -880,6 +1130,10 @@ void ThreadRPCServer2(void* parg)
 
     const bool fUseSSL = GetBoolArg("-rpcssl");
 
+    rpcWorkQueue.SetMaxDepth(std::max((int)GetArg("-rpcworkqueue", 16), 1));
+    nRPCReadTimeout = std::max((int)GetArg("-rpcreadtimeout", 30), 1);
+    StartRPCWorkers(std::max((int)GetArg("-rpcthreads", 4), 1));
+
     asio::io_service io_service;
 
     ssl::context context(io_service, ssl::context::sslv23);
@@ -1041,51 +1295,208 @@ static Object JSONRPCExecOne(const Value& req)
     return rpc_result;
 }
 
+// Whether a batch entry may run alongside its neighbours
+static bool JSONRPCIsParallel(const Value& req)
+{
+    if (req.type() != obj_type)
+        return false;
+    const Value& valMethod = find_value(req.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return false;
+    const CRPCCommand *pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && pcmd->okParallel;
+}
+
+/**
+ * A batch being executed. Runs of okParallel entries are shared with idle RPC
+ * workers, each entry still taking the locks its command needs. Any other
+ * entry runs alone and in order, so [walletpassphrase, sendtoaddress] still
+ * works as a batch.
+ */
+class CRPCBatch
+{
+public:
+    CRPCBatch(const Array& vReqIn, rpcbatchfn_type fnExecOneIn) :
+        vReq(vReqIn), vResults(vReqIn.size()), fnExecOne(fnExecOneIn), nNext(0), nEnd(0), nRunning(0) {}
+
+    // Execute entries of the current run until none are left unclaimed
+    void Help()
+    {
+        while (true)
+        {
+            size_t nIdx;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (nNext >= nEnd)
+                    return;
+                nIdx = nNext++;
+                nRunning++;
+            }
+
+            // The entry has to be counted done whatever happens, or
+            // Execute waits for it forever
+            Object result;
+            try
+            {
+                result = fnExecOne(vReq[nIdx]);
+            }
+            catch (...)
+            {
+                Value id = vReq[nIdx].type() == obj_type ? find_value(vReq[nIdx].get_obj(), "id") : Value::null;
+                result = JSONRPCReplyObj(Value::null, JSONRPCError(RPC_MISC_ERROR, "Unexpected exception"), id);
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            vResults[nIdx] = result;
+            if (--nRunning == 0 && nNext >= nEnd)
+                condDone.notify_all();
+        }
+    }
+
+    static Array Execute(const Array& vReq, rpcbatchfn_type fnExecOne)
+    {
+        boost::shared_ptr<CRPCBatch> batch(new CRPCBatch(vReq, fnExecOne));
+        size_t nSize = vReq.size();
+        size_t i = 0;
+        while (i < nSize)
+        {
+            size_t j = i;
+            while (j < nSize && JSONRPCIsParallel(vReq[j]))
+                j++;
+
+            if (j - i < 2 || nRPCThreads < 2)
+            {
+                // A lone entry, or nobody to share with
+                j = std::max(j, i + 1);
+                for (; i < j; i++)
+                    batch->vResults[i] = fnExecOne(vReq[i]);
+                continue;
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(batch->mutex);
+                batch->nNext = i;
+                batch->nEnd = j;
+            }
+            rpcWorkQueue.PushHelpers(batch, std::min((int)(j - i) - 1, nRPCThreads - 1));
+            batch->Help();
+            {
+                boost::unique_lock<boost::mutex> lock(batch->mutex);
+                while (batch->nRunning > 0)
+                    batch->condDone.wait(lock);
+            }
+            i = j;
+        }
+        return batch->vResults;
+    }
+
+private:
+    const Array vReq;
+    Array vResults;     // in request order
+    rpcbatchfn_type fnExecOne;
+    boost::mutex mutex;
+    boost::condition_variable condDone;
+    size_t nNext;       // next unclaimed entry of the current run
+    size_t nEnd;        // end of the current run
+    int nRunning;       // entries of the current run still executing
+};
+
+Array RPCExecBatch(const Array& vReq, rpcbatchfn_type fnExecOne)
+{
+    return CRPCBatch::Execute(vReq, fnExecOne);
+}
+
 static string JSONRPCExecBatch(const Array& vReq)
 {
-    Array ret;
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    Array ret = CRPCBatch::Execute(vReq, &JSONRPCExecOne);
 
     return write_string(Value(ret), false) + "\n";
 }
 
 static CCriticalSection cs_THREAD_RPCHANDLER;
 
-void ThreadRPCServer3(void* parg)
+/** Sends the chunks of a Transfer-Encoding: chunked reply. */
+class CHTTPChunkedReply
 {
-    // Make this thread recognisable as the RPC handler
-    RenameThread("ARMR-rpchand");
+public:
+    CHTTPChunkedReply(std::ostream& streamIn, bool fKeepAliveIn) : stream(streamIn), fKeepAlive(fKeepAliveIn), fStarted(false) {}
 
+    void Write(const string& strChunk)
     {
-        LOCK(cs_THREAD_RPCHANDLER);
-        vnThreadsRunning[THREAD_RPCHANDLER]++;
+        if (!fStarted)
+        {
+            stream << HTTPReplyChunkedHeader(fKeepAlive);
+            fStarted = true;
+        }
+        stream << strprintf("%x\r\n", (unsigned int)strChunk.size()) << strChunk << "\r\n" << std::flush;
     }
-    AcceptedConnection *conn = (AcceptedConnection *) parg;
 
-    bool fRun = true;
-    while (true)
+    void End()
+    {
+        stream << "0\r\n\r\n" << std::flush;
+    }
+
+private:
+    std::ostream& stream;
+    bool fKeepAlive;
+    bool fStarted;
+};
+
+/**
+ * Run a command that has a streamer and send its reply as it is written.
+ * Errors before anything was sent throw as usual and get an error reply.
+ * After that the reply can only be cut short: returns false and the
+ * connection is closed, which the client sees as a truncated reply.
+ */
+static bool RPCStreamReply(AcceptedConnection *conn, const JSONRequest& jreq, bool fKeepAlive)
+{
+    CHTTPChunkedReply reply(conn->stream(), fKeepAlive);
+    CJSONStreamWriter writer(boost::bind(&CHTTPChunkedReply::Write, &reply, _1));
+    try
+    {
+        writer.BeginObject();
+        writer.Key("result");
+        tableRPC.executeStream(jreq.strMethod, jreq.params, writer);
+        writer.Write("error", Value::null);
+        writer.Write("id", jreq.id);
+        writer.EndObject();
+        writer.Append("\n");
+        writer.Flush();
+    }
+    catch (...)
+    {
+        if (!writer.Flushed())
+            throw;
+        printf("ThreadRPCServer %s failed after its reply was started\n", jreq.strMethod.c_str());
+        return false;
+    }
+    reply.End();
+    return conn->stream().good();
+}
+
+/**
+ * Serve the requests a connection has sent, pipelined ones included.
+ * Returns true if the connection is kept alive for more.
+ */
+static bool RPCServiceConnection(AcceptedConnection *conn)
+{
+    do
     {
-        if (fShutdown || !fRun)
-        {
-            conn->close();
-            delete conn;
-            {
-                LOCK(cs_THREAD_RPCHANDLER);
-                --vnThreadsRunning[THREAD_RPCHANDLER];
-            }
-            return;
-        }
         map<string, string> mapHeaders;
         string strRequest;
+        int nProto = 0;
 
-        ReadHTTP(conn->stream(), mapHeaders, strRequest);
+        conn->set_read_deadline(nRPCReadTimeout);
+        ReadHTTP(conn->stream(), mapHeaders, strRequest, &nProto);
+        conn->cancel_read_deadline();
+        if (!conn->stream())
+            return false; // closed by the peer, or too slow
 
         // Check authorization
         if (mapHeaders.count("authorization") == 0)
         {
             conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            return false;
         }
         if (!HTTPAuthorized(mapHeaders))
         {
@@ -1097,10 +1508,9 @@ void ThreadRPCServer3(void* parg)
                 MilliSleep(250);
 
             conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            return false;
         }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+        bool fKeepAlive = mapHeaders["connection"] != "close";
 
         JSONRequest jreq;
         try
@@ -1111,15 +1521,27 @@ void ThreadRPCServer3(void* parg)
                 throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
             string strReply;
+            bool fStreamed = false;
 
             // singleton request
             if (valRequest.type() == obj_type) {
                 jreq.parse(valRequest);
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+                // Large results go out as they are written, HTTP/1.1 only
+                const CRPCCommand *pcmd = tableRPC[jreq.strMethod];
+                if (pcmd && pcmd->streamer && nProto >= 1)
+                {
+                    if (!RPCStreamReply(conn, jreq, fKeepAlive))
+                        return false;
+                    fStreamed = true;
+                }
+                else
+                {
+                    Value result = tableRPC.execute(jreq.strMethod, jreq.params);
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+                    // Send reply
+                    strReply = JSONRPCReply(result, Value::null, jreq.id);
+                }
 
             // array of requests
             } else if (valRequest.type() == array_type)
@@ -1127,28 +1549,74 @@ void ThreadRPCServer3(void* parg)
             else
                 throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
+            if (!fStreamed)
+                conn->stream() << HTTPReply(HTTP_OK, strReply, fKeepAlive) << std::flush;
         }
         catch (Object& objError)
         {
             ErrorReply(conn->stream(), objError, jreq.id);
-            break;
+            return false;
         }
         catch (std::exception& e)
         {
             ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+            return false;
+        }
+
+        if (!fKeepAlive || fShutdown)
+            return false;
+    } while (conn->pending());
+
+    return true;
+}
+
+void ThreadRPCWorker(void* parg)
+{
+    // Make this thread recognisable as an RPC handler
+    RenameThread("ARMR-rpcwork");
+
+    {
+        LOCK(cs_THREAD_RPCHANDLER);
+        vnThreadsRunning[THREAD_RPCHANDLER]++;
+    }
+
+    AcceptedConnection *conn;
+    boost::shared_ptr<CRPCBatch> batch;
+    while (rpcWorkQueue.Pop(conn, batch))
+    {
+        if (batch)
+        {
+            // Finds nothing to do if the batch has moved on or finished
+            batch->Help();
+            continue;
+        }
+
+        // Idle keep-alive connections wait in the listener's io_service,
+        // not in a thread
+        if (RPCServiceConnection(conn) && !fShutdown)
+            conn->async_wait_readable(boost::bind(&RPCConnectionReadable, conn, true, boost::asio::placeholders::error));
+        else
+        {
+            conn->close();
+            delete conn;
         }
     }
 
-    delete conn;
     {
         LOCK(cs_THREAD_RPCHANDLER);
         vnThreadsRunning[THREAD_RPCHANDLER]--;
     }
 }
 
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+void StartRPCWorkers(int nThreads)
+{
+    nRPCThreads = nThreads;
+    for (int i = 0; i < nRPCThreads; i++)
+        if (!NewThread(ThreadRPCWorker, NULL))
+            printf("Failed to create RPC worker thread\n");
+}
+
+static const CRPCCommand *FindRPCCommand(const std::string &strMethod)
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
@@ -1161,6 +1629,31 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    return pcmd;
+}
+
+void CRPCTable::executeStream(const std::string &strMethod, const json_spirit::Array &params, CJSONWriter &writer) const
+{
+    const CRPCCommand *pcmd = FindRPCCommand(strMethod);
+    if (!pcmd->streamer)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
+
+    try
+    {
+        // Execute, the streamer locks what it reads and releases it before
+        // writing, the writer may block on a slow client
+        pcmd->streamer(params, false, writer);
+    }
+    catch (std::exception& e)
+    {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+}
+
+json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    const CRPCCommand *pcmd = FindRPCCommand(strMethod);
+
     try
     {
         // Execute
@@ -1305,7 +1798,15 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "walletpassphrase"       && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "walletpassphrase"       && n > 2) ConvertTo<bool>(params[2]);
     if (strMethod == "getblocktemplate"       && n > 0) ConvertTo<Object>(params[0]);
+    if (strMethod == "generate"               && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "listsinceblock"         && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "smsgscanchain"          && n > 0) ConvertTo<bool>(params[0]);
+    if (strMethod == "smsginbox"              && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "smsginbox"              && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "smsginbox"              && n > 3) ConvertTo<boost::int64_t>(params[3]);
+    if (strMethod == "smsgoutbox"             && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "smsgoutbox"             && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "smsgoutbox"             && n > 3) ConvertTo<boost::int64_t>(params[3]);
 
     if (strMethod == "sendalert"              && n > 2) ConvertTo<boost::int64_t>(params[2]);
     if (strMethod == "sendalert"              && n > 3) ConvertTo<boost::int64_t>(params[3]);
@@ -17,6 +17,7 @@ class CBlockIndex;
 #include "json/json_spirit_writer_template.h"
 #include "json/json_spirit_utils.h"
 
+#include "rpcwriter.h"
 #include "util.h"
 #include "checkpoints.h"
 
@@ -29,6 +30,7 @@ enum HTTPStatusCode
     HTTP_FORBIDDEN             = 403,
     HTTP_NOT_FOUND             = 404,
     HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_SERVICE_UNAVAILABLE   = 503,
 };
 
 // Bitcoin RPC error codes
@@ -72,6 +74,23 @@ json_spirit::Object JSONRPCError(int code, const std::string& message);
 void ThreadRPCServer(void* parg);
 int CommandLineRPC(int argc, char *argv[]);
 
+/** Start the workers serving RPC connections and sharing batches, until fShutdown */
+void StartRPCWorkers(int nThreads);
+
+typedef boost::function<json_spirit::Object (const json_spirit::Value&)> rpcbatchfn_type;
+
+/**
+ * Execute a batch with fnExecOne per entry. Runs of okParallel entries are
+ * shared with idle workers, other entries run alone and in order.
+ * Returns the results in request order.
+ */
+json_spirit::Array RPCExecBatch(const json_spirit::Array& vReq, rpcbatchfn_type fnExecOne);
+
+/** Reserve a worker for a call that blocks for long (longpoll), false if only one would be left.
+ * -rpcthreads must exceed the number of such calls waiting at once. */
+bool RPCBeginLongWait();
+void RPCEndLongWait();
+
 /** Convert parameter values for RPC call from strings to command-specific JSON objects. */
 json_spirit::Array RPCConvertValues(const std::string &strMethod, const std::vector<std::string> &strParams);
 
@@ -90,6 +109,7 @@ void RPCTypeCheck(const json_spirit::Object& o,
                   const std::map<std::string, json_spirit::Value_type>& typesExpected, bool fAllowNull=false);
 
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 
 class CRPCCommand
 {
@@ -99,8 +119,20 @@ public:
     rpcfn_type actor;
     bool okSafeMode;
     bool unlocked;
+    rpcstreamfn_type streamer; // writes the result as it is produced, NULL for most commands;
+                               // unlocked, takes locks itself and never writes while holding them
+    bool okParallel;           // only reads, may run alongside other entries of a batch
 };
 
+/** The actor of a command that has a streamer, builds the same result as a Value. */
+template <rpcstreamfn_type F>
+json_spirit::Value RPCStreamAsValue(const json_spirit::Array& params, bool fHelp)
+{
+    CJSONValueWriter writer;
+    F(params, fHelp, writer);
+    return writer.GetValue();
+}
+
 /**
  * Bitcoin RPC command dispatcher.
  */
@@ -122,6 +154,13 @@ public:
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
 
+    /**
+     * Execute a method with a streamer, writing its result into writer.
+     * Throws like execute(); part of the result may have been written by then.
+     * No locks are taken around the streamer, writing may block on the client.
+     */
+    void executeStream(const std::string &method, const json_spirit::Array &params, CJSONWriter &writer) const;
+
     /**
     * Returns a list of registered commands
     * @returns List of registered commands.
@@ -176,8 +215,8 @@ extern json_spirit::Value getmininginfo(const json_spirit::Array& params, bool f
 extern json_spirit::Value getstakinginfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getwork(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getworkex(const json_spirit::Array& params, bool fHelp);
-extern json_spirit::Value getblocktemplate(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value submitblock(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value generate(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getnewaddress(const json_spirit::Array& params, bool fHelp); // in rpcwallet.cpp
 extern json_spirit::Value getaccountaddress(const json_spirit::Array& params, bool fHelp);
@@ -220,7 +259,7 @@ extern json_spirit::Value validatepubkey(const json_spirit::Array& params, bool
 extern json_spirit::Value getnewpubkey(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
-extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
+extern void listunspent(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value createrawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decoderawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decodescript(const json_spirit::Array& params, bool fHelp);
@@ -232,9 +271,10 @@ extern json_spirit::Value getblockcount(const json_spirit::Array& params, bool f
 extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockchaininfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
-extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern void getrawmempool(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
-extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
+extern void getblock(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
+extern void getblocktemplate(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer); // in rpcmining.cpp
 extern json_spirit::Value getblockbynumber(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getcheckpoint(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getnetworkhashps(const json_spirit::Array& params, bool fHelp);
@@ -258,8 +298,8 @@ extern json_spirit::Value smsgaddkey(const json_spirit::Array& params, bool fHel
 extern json_spirit::Value smsggetpubkey(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value smsgsend(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value smsgsendanon(const json_spirit::Array& params, bool fHelp);
-extern json_spirit::Value smsginbox(const json_spirit::Array& params, bool fHelp);
-extern json_spirit::Value smsgoutbox(const json_spirit::Array& params, bool fHelp);
+extern void smsginbox(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
+extern void smsgoutbox(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value smsgbuckets(const json_spirit::Array& params, bool fHelp);
 
 #endif
@@ -180,3 +180,100 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    double logFpRate = log(fpRate);
+    // The optimal number of hash functions is log(fpRate) / log(0.5), but
+    // restrict it to the range 1-50.
+    nHashFuncs = max(1, min((int)round(logFpRate / log(0.5)), (int)MAX_HASH_FUNCS));
+    // Three generations are kept, each holding half of nElements, so at
+    // least the last nElements inserted are always contained.
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    unsigned int nMaxElements = nEntriesPerGeneration * 3;
+    // The filter size that gives fpRate with nHashFuncs functions and
+    // nMaxElements entries, from fpRate = (1 - exp(-nHashFuncs * nMaxElements / nFilterBits)) ^ nHashFuncs
+    unsigned int nFilterBits = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    // One pair of 64-bit words per 64 filter positions
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+// The nHashFuncs positions are derived from two 32-bit hashes
+// (h1 + i * h2, Kirsch-Mitzenmacher), so each insert or lookup hashes the
+// key twice however many hash functions the filter uses.
+inline void CRollingBloomFilter::GetHashes(const vector<unsigned char>& vKey, uint32_t& h1, uint32_t& h2) const
+{
+    h1 = MurmurHash3(nTweak, vKey);
+    h2 = MurmurHash3(nTweak + 0xFBA4C795, vKey) | 1;
+}
+
+void CRollingBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        uint64_t nGenerationMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        // Wipe old entries that used this generation number
+        for (unsigned int p = 0; p < data.size(); p += 2)
+        {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    uint32_t h1, h2;
+    GetHashes(vKey, h1, h2);
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        uint32_t h = h1 + n * h2;
+        int bit = h & 0x3F;
+        unsigned int pos = (h >> 6) % data.size();
+        // The lowest bit of pos is ignored, and set to zero for the first bit, and to one for the second
+        data[pos & ~1] = (data[pos & ~1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration & 1)) << bit;
+        data[pos | 1] = (data[pos | 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration >> 1)) << bit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    uint32_t h1, h2;
+    GetHashes(vKey, h1, h2);
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        uint32_t h = h1 + n * h2;
+        int bit = h & 0x3F;
+        unsigned int pos = (h >> 6) % data.size();
+        // If the relevant bit is not set in either data[pos & ~1] or data[pos | 1], the filter does not contain vKey
+        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    vector<unsigned char> vKey(hash.begin(), hash.end());
+    insert(vKey);
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    vector<unsigned char> vKey(hash.begin(), hash.end());
+    return contains(vKey);
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
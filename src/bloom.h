@@ -88,4 +88,39 @@ public:
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * Construct it with the number of items to keep track of, and a false-positive rate.
+ *
+ * contains(item) will always return true if item was one of the last N things
+ * insert()'ed ... but may also return true for items that were not inserted.
+ *
+ * Memory use is fixed at construction: entries are tagged with one of three
+ * generations (two bits per filter position), and starting a new generation
+ * wipes the oldest one in a single pass, so nothing is ever allocated after
+ * the constructor. Used for per-peer "already known" tracking in relay.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    void reset();
+
+private:
+    unsigned int nEntriesPerGeneration;
+    unsigned int nEntriesThisGeneration;
+    unsigned int nGeneration;
+    std::vector<uint64_t> data; // pairs of words: generation bit 0, generation bit 1
+    unsigned int nTweak;
+    unsigned int nHashFuncs;
+
+    void GetHashes(const std::vector<unsigned char>& vKey, uint32_t& h1, uint32_t& h2) const;
+};
+
 #endif /* BITCOIN_BLOOM_H */
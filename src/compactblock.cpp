@@ -0,0 +1,115 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Copyright (c) 2017-2018 The ARMR Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "compactblock.h"
+#include "util.h"
+
+using namespace std;
+
+CCompactBlock::CCompactBlock(const CBlock &block) : header(block), nNonce(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+    header.vtx.clear();
+    header.vMerkleTree.clear();
+
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+        {
+            CPrefilledTransaction prefilled;
+            prefilled.nIndex = i;
+            prefilled.tx = block.vtx[i];
+            vPrefilledTxs.push_back(prefilled);
+        }
+        else
+            vShortTxIds.push_back(CShortTxId(GetShortTxId(block.vtx[i].GetHash())));
+    }
+}
+
+uint64_t CCompactBlock::GetShortTxId(const uint256 &hashTx) const
+{
+    if (hashShortIdKey == 0)
+    {
+        uint256 hashBlock = header.GetHash();
+        hashShortIdKey = Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(nNonce), END(nNonce));
+    }
+    uint256 hash = Hash(BEGIN(hashShortIdKey), END(hashShortIdKey), BEGIN(hashTx), END(hashTx));
+    return hash.Get64() & 0xffffffffffffULL;
+}
+
+bool CPartialBlock::Init(const CCompactBlock &cmpctblock, const map<uint256, CTransaction> &mapPool,
+                         const map<uint256, CTransaction> &mapOrphans)
+{
+    unsigned int nTxCount = cmpctblock.BlockTxCount();
+    if (nTxCount == 0 || nTxCount > MAX_COMPACT_BLOCK_TXS || cmpctblock.vPrefilledTxs.empty())
+        return false;
+
+    block = cmpctblock.header;
+    block.vtx.assign(nTxCount, CTransaction());
+    vMissing.clear();
+
+    // Place the prefilled transactions; the short ids fill the gaps in order
+    vector<bool> vPrefilled(nTxCount, false);
+    int nLastIndex = -1;
+    BOOST_FOREACH (const CPrefilledTransaction &prefilled, cmpctblock.vPrefilledTxs)
+    {
+        if (prefilled.nIndex >= nTxCount || (int)prefilled.nIndex <= nLastIndex)
+            return false;
+        block.vtx[prefilled.nIndex] = prefilled.tx;
+        vPrefilled[prefilled.nIndex] = true;
+        nLastIndex = prefilled.nIndex;
+    }
+
+    // Map short id -> block index; a repeated short id within the block
+    // cannot be resolved, so treat the block as malformed
+    map<uint64_t, unsigned short> mapShortIds;
+    unsigned int nShortId = 0;
+    for (unsigned int i = 0; i < nTxCount; i++)
+    {
+        if (vPrefilled[i])
+            continue;
+        if (!mapShortIds.insert(make_pair(cmpctblock.vShortTxIds[nShortId++].Get(), (unsigned short)i)).second)
+            return false;
+    }
+
+    vector<bool> vFound(nTxCount, false);
+    vector<bool> vCollision(nTxCount, false);
+    const map<uint256, CTransaction> *pools[] = {&mapPool, &mapOrphans};
+    for (unsigned int p = 0; p < 2; p++)
+    {
+        const map<uint256, CTransaction> *pmap = pools[p];
+        for (map<uint256, CTransaction>::const_iterator it = pmap->begin(); it != pmap->end(); ++it)
+        {
+            map<uint64_t, unsigned short>::iterator mi = mapShortIds.find(cmpctblock.GetShortTxId(it->first));
+            if (mi == mapShortIds.end())
+                continue;
+            unsigned short nIndex = mi->second;
+            if (vFound[nIndex] && block.vtx[nIndex].GetHash() != it->first)
+                vCollision[nIndex] = true;
+            block.vtx[nIndex] = it->second;
+            vFound[nIndex] = true;
+        }
+    }
+
+    for (unsigned int i = 0; i < nTxCount; i++)
+    {
+        if (vPrefilled[i])
+            continue;
+        if (!vFound[i] || vCollision[i])
+            vMissing.push_back(i);
+    }
+    return true;
+}
+
+bool CPartialBlock::Fill(const vector<CTransaction> &vtxMissing)
+{
+    if (vtxMissing.size() != vMissing.size())
+        return false;
+    for (unsigned int i = 0; i < vMissing.size(); i++)
+        block.vtx[vMissing[i]] = vtxMissing[i];
+    vMissing.clear();
+
+    block.vMerkleTree.clear();
+    return block.BuildMerkleTree() == block.hashMerkleRoot;
+}
@@ -0,0 +1,140 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Copyright (c) 2017-2018 The ARMR Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_COMPACTBLOCK_H
+#define BITCOIN_COMPACTBLOCK_H
+
+#include <map>
+#include <vector>
+
+#include "main.h"
+
+// Blocks are relayed as a header plus a short id for each transaction; the
+// receiver rebuilds them from its mempool and asks only for what it lacks.
+// Short ids are the low 48 bits of Hash(key, txid), keyed per block with a
+// random nonce so collisions cannot be precomputed.
+
+static const unsigned int MAX_COMPACT_BLOCK_TXS = 65535;
+
+/** A 48-bit short transaction id, serialized as 6 bytes. */
+class CShortTxId
+{
+  public:
+    uint32_t nLow;
+    uint16_t nHigh;
+
+    CShortTxId() : nLow(0), nHigh(0) {}
+    explicit CShortTxId(uint64_t n) : nLow((uint32_t)n), nHigh((uint16_t)(n >> 32)) {}
+
+    uint64_t Get() const { return ((uint64_t)nHigh << 32) | nLow; }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nLow);
+        READWRITE(nHigh);
+    )
+};
+
+/** A transaction sent in full inside a compact block, with its index in the block. */
+class CPrefilledTransaction
+{
+  public:
+    unsigned short nIndex;
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndex);
+        READWRITE(tx);
+    )
+};
+
+/** "cmpctblock" message */
+class CCompactBlock
+{
+  public:
+    CBlock header; // header fields and block signature only
+    uint64_t nNonce;
+    std::vector<CShortTxId> vShortTxIds;
+    std::vector<CPrefilledTransaction> vPrefilledTxs; // ordered by index
+
+    CCompactBlock() : nNonce(0) {}
+
+    // Prefills the coinbase and, for proof-of-stake blocks, the coinstake,
+    // which no peer can have in its mempool.
+    explicit CCompactBlock(const CBlock &block);
+
+    uint64_t GetShortTxId(const uint256 &hashTx) const;
+    unsigned int BlockTxCount() const { return vShortTxIds.size() + vPrefilledTxs.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlock *pheader = const_cast<CBlock *>(&header);
+        READWRITE(pheader->nVersion);
+        READWRITE(pheader->hashPrevBlock);
+        READWRITE(pheader->hashMerkleRoot);
+        READWRITE(pheader->nTime);
+        READWRITE(pheader->nBits);
+        READWRITE(pheader->nNonce);
+        READWRITE(pheader->vchBlockSig);
+        READWRITE(nNonce);
+        READWRITE(vShortTxIds);
+        READWRITE(vPrefilledTxs);
+    )
+
+  private:
+    mutable uint256 hashShortIdKey; // memory only, derived from header and nonce
+};
+
+/** "getblocktxn" message: the transactions a compact block left us missing */
+class CBlockTxRequest
+{
+  public:
+    uint256 hashBlock;
+    std::vector<unsigned short> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndexes);
+    )
+};
+
+/** "blocktxn" message: the answer to a CBlockTxRequest, in request order */
+class CBlockTxResponse
+{
+  public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+/** A block being rebuilt from a compact block. */
+class CPartialBlock
+{
+  public:
+    CBlock block;
+
+    // Returns false if the compact block is malformed. Transactions are
+    // looked up in the given pools; ambiguous short ids count as missing.
+    bool Init(const CCompactBlock &cmpctblock, const std::map<uint256, CTransaction> &mapPool,
+              const std::map<uint256, CTransaction> &mapOrphans);
+
+    const std::vector<unsigned short> &GetMissing() const { return vMissing; }
+
+    // Fill in the missing transactions, in GetMissing() order, and check the
+    // result against the merkle root. False means the block could not be
+    // rebuilt (short id collision or bad response) and must be fetched whole.
+    bool Fill(const std::vector<CTransaction> &vtxMissing);
+
+  private:
+    std::vector<unsigned short> vMissing;
+};
+
+#endif
@@ -242,6 +242,7 @@ std::string HelpMessage()
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -blockservecache=<n>   " + _("Set cache size for serving recent blocks to peers in megabytes (default: 16)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
@@ -258,6 +259,9 @@ std::string HelpMessage()
         "  -listen                " + _("Accept connections from outside (default: 1 if no -proxy or -connect)") + "\n" +
         "  -bind=<addr>           " + _("Bind to given address. Use [host]:port notation for IPv6") + "\n" +
         "  -dnsseed               " + _("Find peers using DNS lookup (default: 1)") + "\n" +
+        "  -headersfirst          " + _("Download block headers first, then blocks from several peers in parallel (default: 1)") + "\n" +
+        "  -netmagic=<hex>        " + _("Use a private network message start with -testnet, e.g. for benchmarks (4 bytes in hex)") + "\n" +
+        "  -p2pcompress           " + _("Compress large block and transaction messages to peers that support it (default: 1)") + "\n" +
         "  -staking               " + _("Stake your coins to support network and gain reward (default: 1)") + "\n" +
         "  -synctime              " + _("Sync time with other nodes. Disable if time on your system is precise e.g. syncing with NTP (default: 1)") + "\n" +
         "  -cppolicy              " + _("Sync checkpoints policy (default: strict)") + "\n" +
@@ -265,6 +269,9 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -maxuploadtarget=<n>   " + _("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: 0)") + "\n" +
+        "  -maxsendrate=<n>       " + _("Limit total upload rate to <n>*1000 bytes per second, 0 = no limit (default: 0)") + "\n" +
+        "  -msghandthreads=<n>    " + _("Number of threads handling peer messages (default: 2)") + "\n" +
 
 #ifdef USE_UPNP
 #if USE_UPNP
@@ -295,6 +302,9 @@ std::string HelpMessage()
         "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n" +
         "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 17570 or testnet: 18580)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
+        "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls, more than the number of longpolling miners (default: 4)") + "\n" +
+        "  -rpcworkqueue=<n>      " + _("Set the depth of the work queue to service RPC calls (default: 16)") + "\n" +
+        "  -rpcreadtimeout=<n>    " + _("Seconds a client has to send a request once it has started (default: 30)") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
@@ -322,7 +332,12 @@ std::string HelpMessage()
 		"\n" + _("Secure messaging options:") + "\n" +
         "  -nosmsg                                  " + _("Disable secure messaging.") + "\n" +
         "  -debugsmsg                               " + _("Log extra debug messages.") + "\n" +
-        "  -smsgscanchain                           " + _("Scan the block chain for public key addresses on startup.") + "\n";
+        "  -smsgscanchain                           " + _("Rescan the block chain for public key addresses on startup.") + "\n" +
+        "  -smsgpowthreads=<n>                      " + _("Number of threads for secure message proof of work (default: 0 = one per core)") + "\n" +
+        "  -smsgmaxbucketmsgs=<n>                   " + _("Most messages kept per 10 minute bucket (default: 8192)") + "\n" +
+        "  -smsgmaxbucketmb=<n>                     " + _("Most megabytes kept per 10 minute bucket (default: 64)") + "\n" +
+        "  -smsgmaxstoremsgs=<n>                    " + _("Most messages kept in the message store (default: 250000)") + "\n" +
+        "  -smsgmaxstoremb=<n>                      " + _("Most megabytes kept in the message store (default: 1024)") + "\n";
 
     return strUsage;
 }
@@ -378,6 +393,9 @@ bool AppInit2()
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fHeadersFirst = GetBoolArg("-headersfirst", true);
+    if (!GetBoolArg("-p2pcompress", true))
+        nLocalServices &= ~NODE_LZ4;
     nMinerSleep = GetArg("-minersleep", 500);
 
     CheckpointsMode = Checkpoints::STRICT;
@@ -13,9 +13,11 @@
 #include "ui_interface.h"
 #include "kernel.h"
 #include "smessage.h"
+#include "compactblock.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/thread/once.hpp>
 #include <iostream>
 #include <openssl/rsa.h>
 #include <openssl/rand.h>
@@ -34,6 +36,10 @@ set<CWallet*> setpwalletRegistered;
 
 CCriticalSection cs_main;
 
+// Signalled whenever the best chain tip changes (getblocktemplate longpoll)
+CWaitableCriticalSection csBestBlock;
+boost::condition_variable cvBlockChange;
+
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
@@ -1787,6 +1793,8 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, false, false);
 
+    SecureMsgBlockDisconnected(pindex);
+
     return true;
 }
 
@@ -1929,6 +1937,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, true);
 
+    // Harvest public keys for secure messaging
+    SecureMsgBlockConnected(*this, pindex);
+
     return true;
 }
 
@@ -2138,6 +2149,12 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
 
+    // Wake up getblocktemplate long pollers waiting on the old tip
+    {
+        boost::unique_lock<CWaitableCriticalSection> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
+
     CBigNum bnBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->bnChainTrust - pindexBest->pprev->bnChainTrust) : pindexBest->bnChainTrust;
     printf("SetBestChain: new best=%s  height=%d  tx=%lu  trust=%s  blocktrust=%" PRId64 " \n",
       hashBestChain.ToString().c_str(), nBestHeight,
@@ -2421,6 +2438,60 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     return true;
 }
 
+/** LRU cache of recent blocks already framed as "block" messages, so getdata
+ * for a fresh block is queued to each peer without touching disk or
+ * reserializing. Bounded by -blockservecache megabytes. */
+class CBlockMsgCache
+{
+  private:
+    typedef std::list<std::pair<uint256, CSerializedNetMsgRef> > list_type;
+    list_type lru; // most recently used at the front
+    std::map<uint256, list_type::iterator> mapIndex;
+    size_t nBytes;
+    size_t nMaxBytes;
+    CCriticalSection cs;
+
+  public:
+    CBlockMsgCache() : nBytes(0), nMaxBytes(0) {}
+
+    CSerializedNetMsgRef Get(const uint256& hash)
+    {
+        LOCK(cs);
+        std::map<uint256, list_type::iterator>::iterator mi = mapIndex.find(hash);
+        if (mi == mapIndex.end())
+            return CSerializedNetMsgRef();
+        lru.splice(lru.begin(), lru, mi->second);
+        return mi->second->second;
+    }
+
+    void Put(const uint256& hash, const CSerializedNetMsgRef& msg)
+    {
+        LOCK(cs);
+        if (nMaxBytes == 0)
+            nMaxBytes = (size_t)max((int64_t)0, GetArg("-blockservecache", 16)) << 20;
+        if (msg->size() > nMaxBytes || mapIndex.count(hash))
+            return;
+        lru.push_front(std::make_pair(hash, msg));
+        mapIndex[hash] = lru.begin();
+        nBytes += msg->size();
+        while (nBytes > nMaxBytes)
+        {
+            nBytes -= lru.back().second->size();
+            mapIndex.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+};
+static CBlockMsgCache blockMsgCache;
+
+static CSerializedNetMsgRef MakeBlockMessage(const CBlock& block)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    ss << block;
+    return MakeNetMessage("block", ss);
+}
+
 bool CBlock::AcceptBlock()
 {
     // Check for duplicate
@@ -2494,10 +2565,39 @@ bool CBlock::AcceptBlock()
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        // Peers will ask for the new tip right away; have it ready to serve
+        if (!IsInitialBlockDownload())
+            blockMsgCache.Put(hash, MakeBlockMessage(*this));
+
+        // Peers that support it get the block pushed as a compact block,
+        // framed once and shared, instead of an inv
+        CSerializedNetMsgRef msgCompact;
+        if (!IsInitialBlockDownload())
+        {
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+            ss << CCompactBlock(*this);
+            msgCompact = MakeNetMessage("cmpctblock", ss);
+        }
+
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            CInv inv(MSG_BLOCK, hash);
+            if (msgCompact && (pnode->nServices & NODE_COMPACT_BLOCKS) && pnode->nVersion != 0)
+            {
+                {
+                    LOCK(pnode->cs_inventory);
+                    if (pnode->filterInventoryKnown.contains(inv.hash))
+                        continue;
+                }
+                pnode->AddInventoryKnown(inv);
+                pnode->PushNetMessage(msgCompact);
+            }
+            else
+                pnode->PushInventory(inv);
+        }
     }
 
     // ARMR: check pending sync-checkpoint
@@ -2529,6 +2629,801 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Headers-first block download
+//
+// Header chains are fetched with getheaders (from one peer at a time during
+// initial sync) and kept in mapHeaders until their blocks arrive. Block
+// bodies are then requested along the best header chain from every peer
+// that has them, up to MAX_BLOCKS_IN_FLIGHT_PER_PEER each, within a window
+// of BLOCK_DOWNLOAD_WINDOW blocks past the first missing one. Blocks that
+// arrive ahead of their parent wait in mapOrphanBlocks as before. A peer
+// that sits on a requested block for BLOCK_STALLING_TIMEOUT is dropped so
+// its blocks can be fetched elsewhere.
+//
+// Headers of proof-of-stake blocks cannot be fully checked on their own (the
+// kernel is in the coinstake). A header whose hash meets its nBits counts as
+// proof-of-work; any other is taken as a proof-of-stake claim. Either way
+// nBits must stay within the retarget step from the last header of the same
+// kind, and the best header chain is the one with the most chain trust, as
+// for blocks. A stake claim is credited with no more trust than the last
+// stake block of our own chain earned, and no header is kept more than
+// MAX_HEADERS_PER_PEER past our best block, so free headers cannot outrank
+// the real chain. Full checks happen in ProcessBlock, and a header whose
+// block fails them is dropped together with everything built on it.
+//
+// Blocks are only requested from peers that sent or announced a header on
+// their chain. Each peer has a budget of headers kept for it, and all of
+// them together at most MAX_HEADERS_KEPT; when that is full, the peer with
+// the most loses those off the best header chain. The headers of a peer
+// that disconnects are dropped unless another peer is known to have them.
+// If no peer has the blocks of the best header chain we fall back to
+// getblocks until one does.
+//
+
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+static const unsigned int MAX_UNREQUESTED_HEADERS = 8;
+static const unsigned int MAX_BLOCKS_IN_FLIGHT_PER_PEER = 16;
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const int MAX_HEADERS_AHEAD = 8 * MAX_HEADERS_RESULTS;
+static const int MAX_HEADERS_PER_PEER = MAX_HEADERS_AHEAD + MAX_HEADERS_RESULTS;
+static const unsigned int MAX_HEADERS_KEPT = 2 * MAX_HEADERS_PER_PEER;
+static const int64_t HEADERS_RESPONSE_TIMEOUT = 2 * 60;
+static const int64_t BLOCK_STALLING_TIMEOUT = 2 * 60; // generous, IBD is often over Tor
+
+// Retarget state of one kind of block (work or stake) at some point of a chain
+struct CHeaderBits
+{
+    unsigned int nBits; // nBits of the last block of this kind
+    int nCount;         // blocks of this kind since genesis, counted up to 2
+
+    CHeaderBits() : nBits(0), nCount(0) {}
+};
+
+struct CHeaderEntry
+{
+    uint256 hashPrev;
+    int nHeight;
+    unsigned int nTime;
+    CBigNum bnChainTrust;
+    CHeaderBits work;
+    CHeaderBits stake;
+    NodeId nFrom;       // peer whose header budget this entry is charged to
+};
+
+struct CNodeSyncState
+{
+    int nSyncHeight;          // height of the best header the peer is known to have
+    uint256 hashBestKnown;    // that header
+    int nChainHeight;         // height up to which the peer has the best header chain
+    int nChainVersion;        // nHeaderChainVersion nChainHeight was computed for
+    int nHeadersKept;         // entries in mapHeaders charged to this peer
+    bool fSyncStarted;        // this peer is our initial header sync peer
+    bool fHeadersAsked;       // sent getheaders at least once
+    bool fWantHeaders;        // send getheaders at the next opportunity
+    int64_t nHeadersRequested; // time of the outstanding getheaders, 0 if none
+    std::map<uint256, std::pair<int64_t, int> > mapInFlight; // hash -> (time requested, height)
+
+    CNodeSyncState() : nSyncHeight(-1), hashBestKnown(0), nChainHeight(-1), nChainVersion(-1), nHeadersKept(0),
+                       fSyncStarted(false), fHeadersAsked(false), fWantHeaders(false), nHeadersRequested(0) {}
+};
+
+bool fHeadersFirst = true;
+
+// protected by cs_main
+static std::map<uint256, CHeaderEntry> mapHeaders; // headers of blocks we do not have yet
+static std::multimap<uint256, uint256> mapHeadersByPrev; // hashPrev -> hash, for mapHeaders
+static std::set<std::pair<CBigNum, uint256> > setHeadersByTrust; // (bnChainTrust, hash), for mapHeaders
+static int nBestHeaderHeight = -1;
+uint256 hashBestHeader = 0;
+static CBigNum bnBestHeaderTrust = 0;
+static std::deque<uint256> vHeaderChain; // best header chain from height nHeaderChainStart
+static int nHeaderChainStart = 0;
+static int nHeaderChainVersion = 0; // changes whenever vHeaderChain is rewritten
+static bool fHeaderChainUnserved = false; // no peer has blocks of vHeaderChain, use getblocks
+static int64_t nHeaderChainChecked = 0;
+static int64_t nLastGetBlocksFallback = 0;
+
+// protected by cs_nodeSync, which is taken last and never held across other locks
+static CCriticalSection cs_nodeSync;
+static std::map<NodeId, CNodeSyncState> mapNodeSync;
+static std::map<uint256, NodeId> mapBlocksInFlight;
+static int nHeaderSyncPeers = 0;
+static std::vector<NodeId> vFinalizedNodes; // headers still charged to them
+
+static CNodeSyncState* GetSyncState(NodeId nodeid)
+{
+    map<NodeId, CNodeSyncState>::iterator it = mapNodeSync.find(nodeid);
+    if (it == mapNodeSync.end())
+        return NULL;
+    return &(*it).second;
+}
+
+static int GetHeaderHeight(const uint256& hash)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second->nHeight;
+    map<uint256, CHeaderEntry>::iterator hi = mapHeaders.find(hash);
+    if (hi != mapHeaders.end())
+        return (*hi).second.nHeight;
+    return -1;
+}
+
+static CBigNum GetHeaderTrust(const uint256& hash)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second->bnChainTrust;
+    map<uint256, CHeaderEntry>::iterator hi = mapHeaders.find(hash);
+    if (hi != mapHeaders.end())
+        return (*hi).second.bnChainTrust;
+    return 0;
+}
+
+// Retarget state after pindex, as GetNextTargetRequired sees it
+static CHeaderBits GetIndexBits(const CBlockIndex* pindex, bool fProofOfStake)
+{
+    CHeaderBits bits;
+    const CBlockIndex* pindexLast = GetLastBlockIndex(pindex, fProofOfStake);
+    if (pindexLast->IsProofOfStake() != fProofOfStake || pindexLast->pprev == NULL)
+        return bits;
+    bits.nBits = pindexLast->nBits;
+    bits.nCount = 1;
+    const CBlockIndex* pindexLastPrev = GetLastBlockIndex(pindexLast->pprev, fProofOfStake);
+    if (pindexLastPrev->IsProofOfStake() == fProofOfStake && pindexLastPrev->pprev != NULL)
+        bits.nCount = 2;
+    return bits;
+}
+
+// nBits of a new block against the retarget state of its chain
+static bool CheckHeaderBits(unsigned int nBits, const CHeaderBits& prev, const CBigNum& bnLimit)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    if (prev.nCount < 2)
+        return bnTarget > 0 && bnTarget <= bnProofOfWorkLimit; // first blocks of a kind are special-cased
+
+    if (bnTarget <= 0 || bnTarget > bnLimit)
+        return false;
+
+    // Each retarget moves the target by a factor between 59.5/61 and 67/61
+    CBigNum bnPrev;
+    bnPrev.SetCompact(prev.nBits);
+    return bnTarget * 61 >= bnPrev * 59 && bnTarget * 61 <= bnPrev * 67;
+}
+
+// Most trust an unchecked proof-of-stake header is credited with
+static CBigNum GetHeaderStakeTrustLimit()
+{
+    const CBlockIndex* pindexLast = GetLastBlockIndex(pindexBest, true);
+    if (pindexLast->IsProofOfStake())
+        return pindexLast->GetBlockTrust();
+    return (CBigNum(1)<<256) / (bnProofOfStakeLimit+1);
+}
+
+static bool IsOnHeaderChain(const uint256& hash, int nHeight)
+{
+    return nHeight >= nHeaderChainStart && nHeight < nHeaderChainStart + (int)vHeaderChain.size() &&
+           vHeaderChain[nHeight - nHeaderChainStart] == hash;
+}
+
+static void AddHeader(const uint256& hash, const CHeaderEntry& entry)
+{
+    {
+        LOCK(cs_nodeSync);
+        CNodeSyncState* state = GetSyncState(entry.nFrom);
+        if (state)
+            state->nHeadersKept++;
+    }
+    mapHeaders.insert(make_pair(hash, entry));
+    mapHeadersByPrev.insert(make_pair(entry.hashPrev, hash));
+    setHeadersByTrust.insert(make_pair(entry.bnChainTrust, hash));
+}
+
+static void EraseHeader(map<uint256, CHeaderEntry>::iterator hi)
+{
+    const CHeaderEntry& entry = (*hi).second;
+    {
+        LOCK(cs_nodeSync);
+        CNodeSyncState* state = GetSyncState(entry.nFrom);
+        if (state)
+            state->nHeadersKept--;
+    }
+    for (multimap<uint256, uint256>::iterator mi = mapHeadersByPrev.lower_bound(entry.hashPrev);
+         mi != mapHeadersByPrev.end() && (*mi).first == entry.hashPrev;
+         ++mi)
+    {
+        if ((*mi).second == (*hi).first)
+        {
+            mapHeadersByPrev.erase(mi);
+            break;
+        }
+    }
+    setHeadersByTrust.erase(make_pair(entry.bnChainTrust, (*hi).first));
+    mapHeaders.erase(hi);
+}
+
+static void EraseHeader(const uint256& hash)
+{
+    map<uint256, CHeaderEntry>::iterator hi = mapHeaders.find(hash);
+    if (hi != mapHeaders.end())
+        EraseHeader(hi);
+}
+
+static void ForgetBlockInFlight(const uint256& hash)
+{
+    LOCK(cs_nodeSync);
+    map<uint256, NodeId>::iterator it = mapBlocksInFlight.find(hash);
+    if (it == mapBlocksInFlight.end())
+        return;
+    CNodeSyncState* state = GetSyncState((*it).second);
+    if (state)
+        state->mapInFlight.erase(hash);
+    mapBlocksInFlight.erase(it);
+}
+
+static void SetBestHeader(const uint256& hash)
+{
+    const CHeaderEntry& best = mapHeaders[hash];
+
+    // Walk back until we meet the current header chain or a block we have
+    vector<uint256> vNew;
+    uint256 hashWalk = hash;
+    int nWalk = best.nHeight;
+    map<uint256, CHeaderEntry>::iterator hi;
+    while ((hi = mapHeaders.find(hashWalk)) != mapHeaders.end())
+    {
+        if (nWalk >= nHeaderChainStart && nWalk < nHeaderChainStart + (int)vHeaderChain.size() &&
+            vHeaderChain[nWalk - nHeaderChainStart] == hashWalk)
+            break;
+        vNew.push_back(hashWalk);
+        hashWalk = (*hi).second.hashPrev;
+        nWalk--;
+    }
+
+    int nFirst = nWalk + 1;
+    if (vHeaderChain.empty() || nFirst < nHeaderChainStart || nFirst > nHeaderChainStart + (int)vHeaderChain.size())
+    {
+        vHeaderChain.clear();
+        nHeaderChainStart = nFirst;
+    }
+    else
+        vHeaderChain.resize(nFirst - nHeaderChainStart);
+    vHeaderChain.insert(vHeaderChain.end(), vNew.rbegin(), vNew.rend());
+    nHeaderChainVersion++;
+
+    hashBestHeader = hash;
+    nBestHeaderHeight = best.nHeight;
+    bnBestHeaderTrust = best.bnChainTrust;
+}
+
+// Drop these headers and every header built on them, so none of them is
+// requested again. Returns the number dropped.
+static unsigned int EraseHeaderTrees(const vector<uint256>& vRoots)
+{
+    vector<uint256> vErase;
+    set<uint256> setErase;
+    BOOST_FOREACH(const uint256& hash, vRoots)
+        if (mapHeaders.count(hash) && setErase.insert(hash).second)
+            vErase.push_back(hash);
+    for (unsigned int i = 0; i < vErase.size(); i++)
+    {
+        for (multimap<uint256, uint256>::iterator mi = mapHeadersByPrev.lower_bound(vErase[i]);
+             mi != mapHeadersByPrev.end() && (*mi).first == vErase[i];
+             ++mi)
+        {
+            if (setErase.insert((*mi).second).second)
+                vErase.push_back((*mi).second);
+        }
+    }
+
+    int nChainEnd = nHeaderChainStart + vHeaderChain.size();
+    BOOST_FOREACH(const uint256& hash, vErase)
+    {
+        int nHeight = mapHeaders[hash].nHeight;
+        if (nHeight < nChainEnd && IsOnHeaderChain(hash, nHeight))
+            nChainEnd = nHeight;
+    }
+    if (nChainEnd < nHeaderChainStart + (int)vHeaderChain.size())
+    {
+        vHeaderChain.resize(nChainEnd - nHeaderChainStart);
+        nHeaderChainVersion++;
+    }
+
+    BOOST_FOREACH(const uint256& hash, vErase)
+    {
+        ForgetBlockInFlight(hash);
+        EraseHeader(hash);
+    }
+
+    if (setErase.count(hashBestHeader))
+    {
+        // Fall back to the best remaining header
+        hashBestHeader = 0;
+        nBestHeaderHeight = -1;
+        bnBestHeaderTrust = 0;
+        if (!setHeadersByTrust.empty())
+            SetBestHeader((*setHeadersByTrust.rbegin()).second);
+    }
+    return vErase.size();
+}
+
+// Drop the headers charged to these peers. One that another peer is known
+// to have (below its best known header) is charged to that peer instead, and
+// with fKeepChain so is one on the best header chain.
+static void DropPeerHeaders(const set<NodeId>& setPeers, bool fKeepChain)
+{
+    vector<uint256> vDrop;
+    {
+        LOCK(cs_nodeSync);
+        map<uint256, NodeId> mapKnown;
+        for (map<NodeId, CNodeSyncState>::iterator it = mapNodeSync.begin(); it != mapNodeSync.end(); ++it)
+        {
+            if (setPeers.count((*it).first))
+                continue;
+            uint256 hashWalk = (*it).second.hashBestKnown;
+            map<uint256, CHeaderEntry>::iterator hi;
+            while ((hi = mapHeaders.find(hashWalk)) != mapHeaders.end() &&
+                   mapKnown.insert(make_pair(hashWalk, (*it).first)).second)
+                hashWalk = (*hi).second.hashPrev;
+        }
+
+        for (map<uint256, CHeaderEntry>::iterator hi = mapHeaders.begin(); hi != mapHeaders.end(); ++hi)
+        {
+            CHeaderEntry& entry = (*hi).second;
+            if (!setPeers.count(entry.nFrom) || (fKeepChain && IsOnHeaderChain((*hi).first, entry.nHeight)))
+                continue;
+            map<uint256, NodeId>::iterator it = mapKnown.find((*hi).first);
+            if (it == mapKnown.end())
+            {
+                vDrop.push_back((*hi).first);
+                continue;
+            }
+            CNodeSyncState* state = GetSyncState(entry.nFrom);
+            if (state)
+                state->nHeadersKept--;
+            entry.nFrom = (*it).second;
+            GetSyncState(entry.nFrom)->nHeadersKept++;
+        }
+    }
+    if (!vDrop.empty())
+        printf("DropPeerHeaders() : dropping %u headers\n", EraseHeaderTrees(vDrop));
+}
+
+static void DropFinalizedNodeHeaders()
+{
+    set<NodeId> setGone;
+    {
+        LOCK(cs_nodeSync);
+        setGone.insert(vFinalizedNodes.begin(), vFinalizedNodes.end());
+        vFinalizedNodes.clear();
+    }
+    if (!setGone.empty())
+        DropPeerHeaders(setGone, false);
+}
+
+// mapHeaders is full: make room by dropping the headers off the best header
+// chain of the peer with the most kept
+static bool MakeRoomForHeader(NodeId nodeidFrom)
+{
+    DropFinalizedNodeHeaders();
+    if (mapHeaders.size() < MAX_HEADERS_KEPT)
+        return true;
+
+    set<NodeId> setEvict;
+    {
+        LOCK(cs_nodeSync);
+        int nMost = 0;
+        NodeId nodeidMost = 0;
+        for (map<NodeId, CNodeSyncState>::iterator it = mapNodeSync.begin(); it != mapNodeSync.end(); ++it)
+        {
+            if ((*it).first != nodeidFrom && (*it).second.nHeadersKept > nMost)
+            {
+                nMost = (*it).second.nHeadersKept;
+                nodeidMost = (*it).first;
+            }
+        }
+        if (nMost == 0)
+            return false;
+        setEvict.insert(nodeidMost);
+    }
+    DropPeerHeaders(setEvict, true);
+    return mapHeaders.size() < MAX_HEADERS_KEPT;
+}
+
+bool AcceptBlockHeader(CNode* pfrom, const CBlock& header, int& nHeight)
+{
+    uint256 hash = header.GetHash();
+    nHeight = GetHeaderHeight(hash);
+    if (nHeight >= 0)
+        return true;
+
+    CHeaderEntry entry;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+    map<uint256, CHeaderEntry>::iterator hi = mapHeaders.find(header.hashPrevBlock);
+    if (mi != mapBlockIndex.end())
+    {
+        CBlockIndex* pindexPrev = (*mi).second;
+        entry.nHeight = pindexPrev->nHeight + 1;
+        entry.bnChainTrust = pindexPrev->bnChainTrust;
+        entry.work = GetIndexBits(pindexPrev, false);
+        entry.stake = GetIndexBits(pindexPrev, true);
+    }
+    else if (hi != mapHeaders.end())
+    {
+        entry.nHeight = (*hi).second.nHeight + 1;
+        entry.bnChainTrust = (*hi).second.bnChainTrust;
+        entry.work = (*hi).second.work;
+        entry.stake = (*hi).second.stake;
+    }
+    else
+        return error("AcceptBlockHeader() : header %s does not connect", hash.ToString().substr(0,20).c_str());
+    nHeight = entry.nHeight;
+    if (nHeight > nBestHeight + MAX_HEADERS_PER_PEER)
+        return error("AcceptBlockHeader() : header %s too far ahead of our best block", hash.ToString().substr(0,20).c_str());
+
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+    {
+        pfrom->Misbehaving(100);
+        return error("AcceptBlockHeader() : rejected by hardened checkpoint lock-in at %d", nHeight);
+    }
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+    {
+        pfrom->Misbehaving(20);
+        return error("AcceptBlockHeader() : block timestamp too far in the future");
+    }
+
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    bool fProofOfWork = bnTarget > 0 && bnTarget <= bnProofOfWorkLimit && hash <= bnTarget.getuint256();
+    CHeaderBits& bits = fProofOfWork ? entry.work : entry.stake;
+    if (!CheckHeaderBits(header.nBits, bits, fProofOfWork ? bnProofOfWorkLimit : bnProofOfStakeLimit))
+    {
+        pfrom->Misbehaving(100);
+        return error("AcceptBlockHeader() : incorrect %s nBits for header %s", fProofOfWork ? "proof-of-work" : "proof-of-stake", hash.ToString().substr(0,20).c_str());
+    }
+    bits.nBits = header.nBits;
+    bits.nCount = min(bits.nCount + 1, 2);
+
+    // Same as CBlockIndex::GetBlockTrust, except that the stake claim is
+    // unchecked and so worth no more than the real stake blocks we have
+    if (fProofOfWork)
+        entry.bnChainTrust += 1;
+    else
+        entry.bnChainTrust += min((CBigNum(1)<<256) / (bnTarget+1), GetHeaderStakeTrustLimit());
+    entry.hashPrev = header.hashPrevBlock;
+    entry.nTime = header.nTime;
+    entry.nFrom = pfrom->GetId();
+
+    {
+        LOCK(cs_nodeSync);
+        CNodeSyncState* state = GetSyncState(entry.nFrom);
+        if (!state)
+            return false;
+        if (state->nHeadersKept >= MAX_HEADERS_PER_PEER)
+            return error("AcceptBlockHeader() : too many headers kept for %s", pfrom->addrName.c_str());
+    }
+    if (mapHeaders.size() >= MAX_HEADERS_KEPT && !MakeRoomForHeader(entry.nFrom))
+        return error("AcceptBlockHeader() : too many headers kept");
+    AddHeader(hash, entry);
+
+    if (entry.bnChainTrust > bnBestHeaderTrust)
+        SetBestHeader(hash);
+    return true;
+}
+
+// Remember the best header the peer has shown us it has
+static void UpdateBlockAvailability(CNode* pnode, const uint256& hash)
+{
+    int nHeight = GetHeaderHeight(hash);
+    if (nHeight < 0)
+        return;
+    CBigNum bnTrust = GetHeaderTrust(hash);
+
+    LOCK(cs_nodeSync);
+    CNodeSyncState* state = GetSyncState(pnode->GetId());
+    if (!state || (state->hashBestKnown != 0 && bnTrust <= GetHeaderTrust(state->hashBestKnown)))
+        return;
+    state->hashBestKnown = hash;
+    state->nSyncHeight = nHeight;
+    state->nChainVersion = -1;
+}
+
+// Height up to which the peer has blocks of the best header chain. Requires
+// cs_main and cs_nodeSync.
+static int GetPeerChainHeight(CNodeSyncState* state)
+{
+    if (state->nChainVersion == nHeaderChainVersion)
+        return state->nChainHeight;
+
+    // A peer on a fork deeper than one headers message gets nothing from it
+    int nChainHeight = -1;
+    uint256 hashWalk = state->hashBestKnown;
+    int nWalk = GetHeaderHeight(hashWalk);
+    int nWalkEnd = max(nHeaderChainStart, nWalk - (int)MAX_HEADERS_RESULTS);
+    while (nWalk >= nWalkEnd)
+    {
+        if (nWalk < nHeaderChainStart + (int)vHeaderChain.size() && vHeaderChain[nWalk - nHeaderChainStart] == hashWalk)
+        {
+            nChainHeight = nWalk;
+            break;
+        }
+        map<uint256, CHeaderEntry>::iterator hi = mapHeaders.find(hashWalk);
+        if (hi == mapHeaders.end())
+            break;
+        hashWalk = (*hi).second.hashPrev;
+        nWalk--;
+    }
+
+    state->nChainHeight = nChainHeight;
+    state->nChainVersion = nHeaderChainVersion;
+    return nChainHeight;
+}
+
+static void RequestHeaders(CNode* pnode)
+{
+    LOCK(cs_nodeSync);
+    CNodeSyncState* state = GetSyncState(pnode->GetId());
+    if (state)
+        state->fWantHeaders = true;
+}
+
+static void MarkBlockReceived(const uint256& hash)
+{
+    // The block is in mapBlockIndex or mapOrphanBlocks now
+    if (mapBlockIndex.count(hash))
+        EraseHeader(hash);
+
+    ForgetBlockInFlight(hash);
+}
+
+// The block of this header failed validation: drop the header and every
+// header built on it, so none of them is requested again
+static void RemoveRejectedHeaders(const uint256& hashBad)
+{
+    if (!mapHeaders.count(hashBad))
+        return;
+    unsigned int nDropped = EraseHeaderTrees(vector<uint256>(1, hashBad));
+    printf("RemoveRejectedHeaders() : dropping %u headers from %s\n", nDropped, hashBad.ToString().substr(0,20).c_str());
+}
+
+void InitializeNode(NodeId nodeid)
+{
+    LOCK(cs_nodeSync);
+    mapNodeSync[nodeid];
+}
+
+void FinalizeNode(NodeId nodeid)
+{
+    LOCK(cs_nodeSync);
+    CNodeSyncState* state = GetSyncState(nodeid);
+    if (!state)
+        return;
+    if (state->fSyncStarted)
+        nHeaderSyncPeers--;
+    typedef std::map<uint256, std::pair<int64_t, int> >::value_type inflight_type;
+    BOOST_FOREACH(const inflight_type& item, state->mapInFlight)
+        mapBlocksInFlight.erase(item.first);
+    mapNodeSync.erase(nodeid);
+
+    // We cannot take cs_main here; SendBlockSyncMessages drops its headers
+    vFinalizedNodes.push_back(nodeid);
+}
+
+// Called from SendMessages with cs_main and pto->cs_vSend held
+static void SendBlockSyncMessages(CNode* pto)
+{
+    if (pto->fClient || pto->fOneShot || pto->fDisconnect)
+        return;
+
+    DropFinalizedNodeHeaders();
+
+    int64_t nNow = GetTime();
+    bool fGetHeaders = false;
+    bool fGetBlocks = false;
+    vector<CInv> vGetData;
+    {
+        LOCK(cs_nodeSync);
+        CNodeSyncState* state = GetSyncState(pto->GetId());
+        if (!state)
+            return;
+
+        // Stall detection
+        typedef std::map<uint256, std::pair<int64_t, int> >::value_type inflight_type;
+        BOOST_FOREACH(const inflight_type& item, state->mapInFlight)
+        {
+            if (item.second.first < nNow - BLOCK_STALLING_TIMEOUT)
+            {
+                printf("peer %s stalled on block %s, disconnecting\n", pto->addrName.c_str(), item.first.ToString().substr(0,20).c_str());
+                pto->fDisconnect = true;
+                return;
+            }
+        }
+        if (state->nHeadersRequested && state->nHeadersRequested < nNow - HEADERS_RESPONSE_TIMEOUT)
+        {
+            // Let someone else provide the headers
+            printf("peer %s did not answer getheaders\n", pto->addrName.c_str());
+            state->nHeadersRequested = 0;
+            if (state->fSyncStarted)
+            {
+                state->fSyncStarted = false;
+                nHeaderSyncPeers--;
+            }
+        }
+
+        // Header sync: one peer at a time until the best header is recent,
+        // then every peer once, so we learn which blocks each one has. Plus
+        // any peer that announced something we could not connect.
+        if (state->nHeadersRequested == 0 && nBestHeaderHeight - nBestHeight < MAX_HEADERS_AHEAD)
+        {
+            map<uint256, CHeaderEntry>::iterator hi = mapHeaders.find(hashBestHeader);
+            int64_t nBestHeaderTime = (hi != mapHeaders.end()) ? (int64_t)(*hi).second.nTime : pindexBest->GetBlockTime();
+            if (state->fWantHeaders)
+                fGetHeaders = true;
+            else if (!state->fSyncStarted && nHeaderSyncPeers == 0 &&
+                     pto->nStartingHeight > max(nBestHeaderHeight, nBestHeight))
+            {
+                state->fSyncStarted = true;
+                nHeaderSyncPeers++;
+                fGetHeaders = true;
+            }
+            else if (!state->fHeadersAsked && nBestHeaderTime > GetAdjustedTime() - 24 * 60 * 60)
+                fGetHeaders = true;
+            if (fGetHeaders)
+            {
+                state->fWantHeaders = false;
+                state->fHeadersAsked = true;
+                state->nHeadersRequested = nNow;
+            }
+        }
+
+        // Drop the part of the header chain we have blocks for
+        while (!vHeaderChain.empty() && nHeaderChainStart <= nBestHeight && mapBlockIndex.count(vHeaderChain.front()))
+        {
+            EraseHeader(vHeaderChain.front());
+            vHeaderChain.pop_front();
+            nHeaderChainStart++;
+        }
+
+        // If no peer has the blocks of the best header chain, fetch blocks
+        // with getblocks and inv as without headers-first until one does
+        if (nHeaderChainChecked != nNow)
+        {
+            nHeaderChainChecked = nNow;
+            bool fServed = vHeaderChain.empty() || !mapBlocksInFlight.empty();
+            for (map<NodeId, CNodeSyncState>::iterator it = mapNodeSync.begin(); !fServed && it != mapNodeSync.end(); ++it)
+                fServed = GetPeerChainHeight(&(*it).second) >= nHeaderChainStart;
+            if (fHeaderChainUnserved == fServed)
+                printf("best header chain %s\n", fServed ? "is available again" : "is not available from any peer, falling back to getblocks");
+            fHeaderChainUnserved = !fServed;
+        }
+        if (fHeaderChainUnserved && pto->nStartingHeight > nBestHeight && nLastGetBlocksFallback < nNow - 60)
+        {
+            nLastGetBlocksFallback = nNow;
+            fGetBlocks = true;
+        }
+
+        // Block download along the best header chain, from peers known to have it
+        int nPeerHeight = GetPeerChainHeight(state);
+        int nWindowEnd = -1;
+        for (int nHeight = nHeaderChainStart;
+             nHeight < nHeaderChainStart + (int)vHeaderChain.size() && nHeight <= nPeerHeight &&
+             state->mapInFlight.size() < MAX_BLOCKS_IN_FLIGHT_PER_PEER;
+             nHeight++)
+        {
+            const uint256& hash = vHeaderChain[nHeight - nHeaderChainStart];
+            if (mapBlockIndex.count(hash))
+                continue;
+            if (nWindowEnd < 0)
+                nWindowEnd = nHeight + BLOCK_DOWNLOAD_WINDOW;
+            if (nHeight >= nWindowEnd)
+                break;
+            if (mapOrphanBlocks.count(hash) || mapBlocksInFlight.count(hash))
+                continue;
+            vGetData.push_back(CInv(MSG_BLOCK, hash));
+            state->mapInFlight[hash] = make_pair(nNow, nHeight);
+            mapBlocksInFlight[hash] = pto->GetId();
+        }
+    }
+
+    if (fGetHeaders)
+    {
+        // Start from the parent of our best header (or tip), so a peer on the
+        // same chain answers with at least that header and we learn it has it
+        CBlockLocator locator(pindexBest->pprev ? pindexBest->pprev : pindexBest);
+        map<uint256, CHeaderEntry>::iterator hi = mapHeaders.find(hashBestHeader);
+        if (hi != mapHeaders.end())
+        {
+            locator = CBlockLocator(pindexBest);
+            locator.PushFront((*hi).second.hashPrev);
+        }
+        if (fDebug)
+            printf("getheaders from %s (best header %d)\n", pto->addrName.c_str(), nBestHeaderHeight);
+        pto->PushMessage("getheaders", locator, uint256(0));
+    }
+    if (fGetBlocks)
+        pto->PushGetBlocks(pindexBest, uint256(0));
+    if (!vGetData.empty())
+        pto->PushMessage("getdata", vGetData);
+}
+
+static void ProcessHeadersMessage(CNode* pfrom, CDataStream& vRecv)
+{
+    vector<CBlock> vHeaders;
+    vRecv >> vHeaders;
+    if (vHeaders.size() > MAX_HEADERS_RESULTS)
+    {
+        pfrom->Misbehaving(20);
+        error("headers message size = %" PRIszu "", vHeaders.size());
+        return;
+    }
+
+    {
+        LOCK(cs_nodeSync);
+        CNodeSyncState* state = GetSyncState(pfrom->GetId());
+        if (!state)
+            return;
+        if (state->nHeadersRequested == 0 && vHeaders.size() > MAX_UNREQUESTED_HEADERS)
+        {
+            // Not an answer to our getheaders (or too late for it)
+            if (fDebug)
+                printf("ignoring %" PRIszu " unrequested headers from %s\n", vHeaders.size(), pfrom->addrName.c_str());
+            return;
+        }
+    }
+
+    int nHeight = -1;
+    uint256 hashLast = 0;
+    bool fConnected = true;
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+    {
+        int nHeaderHeight;
+        if (!AcceptBlockHeader(pfrom, header, nHeaderHeight))
+        {
+            fConnected = false;
+            break;
+        }
+        nHeight = nHeaderHeight;
+        hashLast = header.GetHash();
+    }
+    if (nHeight >= 0)
+        UpdateBlockAvailability(pfrom, hashLast);
+
+    LOCK(cs_nodeSync);
+    CNodeSyncState* state = GetSyncState(pfrom->GetId());
+    if (!state)
+        return;
+    state->nHeadersRequested = 0;
+    if (fConnected && vHeaders.size() == MAX_HEADERS_RESULTS)
+    {
+        // There are more; continue from where this batch ended
+        state->fWantHeaders = true;
+    }
+    else if (state->fSyncStarted)
+    {
+        state->fSyncStarted = false;
+        nHeaderSyncPeers--;
+    }
+}
+
+bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats)
+{
+    LOCK(cs_nodeSync);
+    CNodeSyncState* state = GetSyncState(nodeid);
+    if (!state)
+        return false;
+    stats.nMisbehavior = 0;
+    stats.nSyncHeight = state->nSyncHeight;
+    stats.nCommonHeight = min(state->nSyncHeight, nBestHeight);
+    stats.vHeightInFlight.clear();
+    typedef std::map<uint256, std::pair<int64_t, int> >::value_type inflight_type;
+    BOOST_FOREACH(const inflight_type& item, state->mapInFlight)
+        stats.vHeightInFlight.push_back(item.second.second);
+    return true;
+}
+
 bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 {
     // Check for duplicate
@@ -2546,7 +3441,10 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 
     // Preliminary checks
     if (!pblock->CheckBlock())
+    {
+        RemoveRejectedHeaders(hash);
         return error("ProcessBlock() : CheckBlock FAILED");
+    }
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
     if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
@@ -2566,6 +3464,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         {
             if (pfrom)
                 pfrom->Misbehaving(100);
+            RemoveRejectedHeaders(hash);
             return error("ProcessBlock() : block with too little %s", pblock->IsProofOfStake()? "proof-of-stake" : "proof-of-work");
         }
     }
@@ -2593,7 +3492,14 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
         // Ask this guy to fill in what we're missing
-        if (pfrom)
+        if (pfrom && fHeadersFirst && !fHeaderChainUnserved)
+        {
+            // Blocks we requested along the header chain arrive out of order;
+            // anything else means we are missing headers
+            if (!mapHeaders.count(hash))
+                RequestHeaders(pfrom);
+        }
+        else if (pfrom)
         {
             pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
             // ARMR: getblocks may not obtain the ancestor block rejected
@@ -2606,7 +3512,10 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 
     // Store to disk
     if (!pblock->AcceptBlock())
+    {
+        RemoveRejectedHeaders(hash);
         return error("ProcessBlock() : AcceptBlock FAILED");
+    }
 
     // Recursively process any orphan blocks that depended on this one
     vector<uint256> vWorkQueue;
@@ -2621,6 +3530,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             CBlock* pblockOrphan = (*mi).second;
             if (pblockOrphan->AcceptBlock())
                 vWorkQueue.push_back(pblockOrphan->GetHash());
+            else
+                RemoveRejectedHeaders(pblockOrphan->GetHash());
             mapOrphanBlocks.erase(pblockOrphan->GetHash());
             setStakeSeenOrphan.erase(pblockOrphan->GetProofOfStake());
             delete pblockOrphan;
@@ -2795,6 +3706,16 @@ bool LoadBlockIndex(bool fAllowNew)
         nStakeMinAge = 20 * 60; // test net min age is 20 min
         nCoinbaseMaturity = 0; // test maturity is 10 blocks
         nModifierInterval = 60;
+
+        // Private test networks share the testnet rules but use their own
+        // message start, so their nodes never talk to the public testnet
+        if (mapArgs.count("-netmagic"))
+        {
+            vector<unsigned char> vchMagic = ParseHex(mapArgs["-netmagic"]);
+            if (vchMagic.size() != sizeof(pchMessageStart))
+                return error("LoadBlockIndex() : -netmagic must be %" PRIszu " bytes in hex", sizeof(pchMessageStart));
+            memcpy(pchMessageStart, &vchMagic[0], sizeof(pchMessageStart));
+        }
     }
     else
     {
@@ -3139,6 +4060,169 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 // a large 4-byte int at any alignment.
 unsigned char pchMessageStart[4] = { 0xd3, 0xf3, 0xdd, 0xf5 };
 
+static void ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hashBlock = block.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+    pfrom->AddInventoryKnown(inv);
+
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+    MarkBlockReceived(hashBlock);
+
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+}
+
+// Compact blocks waiting for a blocktxn answer, by block hash, and their
+// hashes in order of arrival
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+static const unsigned int MAX_PARTIAL_BLOCKS_PER_PEER = 2;
+static map<uint256, pair<NodeId, CPartialBlock> > mapPartialBlocks;
+static list<uint256> listPartialBlocks;
+
+static void ErasePartialBlock(const uint256& hash)
+{
+    mapPartialBlocks.erase(hash);
+    listPartialBlocks.remove(hash);
+}
+
+// Make room for a partial block from nodeid: its own oldest once it has
+// MAX_PARTIAL_BLOCKS_PER_PEER, otherwise the oldest of all when full
+static void LimitPartialBlocks(NodeId nodeid)
+{
+    list<uint256>::iterator itOldest = listPartialBlocks.end();
+    unsigned int nFromPeer = 0;
+    for (list<uint256>::iterator it = listPartialBlocks.begin(); it != listPartialBlocks.end(); ++it)
+    {
+        if (mapPartialBlocks[*it].first != nodeid)
+            continue;
+        if (nFromPeer++ == 0)
+            itOldest = it;
+    }
+    if (nFromPeer < MAX_PARTIAL_BLOCKS_PER_PEER)
+        itOldest = (listPartialBlocks.size() >= MAX_PARTIAL_BLOCKS) ? listPartialBlocks.begin() : listPartialBlocks.end();
+    if (itOldest != listPartialBlocks.end())
+    {
+        mapPartialBlocks.erase(*itOldest);
+        listPartialBlocks.erase(itOldest);
+    }
+}
+
+// The checks AcceptBlock makes that need only the header, the prefilled
+// coinstake and the parent, done before the mempool is searched
+static bool CheckCompactBlockHeader(CNode* pfrom, const CCompactBlock& cmpctblock, CBlockIndex* pindexPrev)
+{
+    const CBlock& header = cmpctblock.header;
+    uint256 hash = header.GetHash();
+    int nHeight = pindexPrev->nHeight + 1;
+
+    const CTransaction* ptxCoinStake = NULL;
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxs)
+        if (prefilled.nIndex == 1 && prefilled.tx.IsCoinStake())
+            ptxCoinStake = &prefilled.tx;
+    bool fProofOfStake = (ptxCoinStake != NULL);
+
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+    {
+        pfrom->Misbehaving(100);
+        return error("CheckCompactBlockHeader() : rejected by hardened checkpoint lock-in at %d", nHeight);
+    }
+    if (header.nBits != GetNextTargetRequired(pindexPrev, fProofOfStake))
+    {
+        pfrom->Misbehaving(100);
+        return error("CheckCompactBlockHeader() : incorrect %s", fProofOfStake ? "proof-of-stake" : "proof-of-work");
+    }
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+    {
+        pfrom->Misbehaving(20);
+        return error("CheckCompactBlockHeader() : block timestamp too far in the future");
+    }
+    if (header.GetBlockTime() <= pindexPrev->GetPastTimeLimit() || FutureDrift(header.GetBlockTime()) < pindexPrev->GetBlockTime())
+        return error("CheckCompactBlockHeader() : block's timestamp is too early");
+
+    if (fProofOfStake)
+    {
+        uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+        if (!CheckProofOfStake(*ptxCoinStake, header.nBits, hashProofOfStake, targetProofOfStake))
+            return error("CheckCompactBlockHeader() : check proof-of-stake failed for block %s", hash.ToString().substr(0,20).c_str());
+    }
+    else if (!CheckProofOfWork(hash, header.nBits))
+    {
+        pfrom->Misbehaving(50);
+        return error("CheckCompactBlockHeader() : proof of work failed");
+    }
+    return true;
+}
+
+static void ProcessCompactBlock(CNode* pfrom, const CCompactBlock& cmpctblock)
+{
+    uint256 hashBlock = cmpctblock.header.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+    pfrom->AddInventoryKnown(inv);
+    if (fDebug)
+        printf("received cmpctblock %s (%u txs)\n", hashBlock.ToString().substr(0,20).c_str(), cmpctblock.BlockTxCount());
+
+    if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock) || mapPartialBlocks.count(hashBlock))
+        return;
+
+    // We can only rebuild blocks that extend what we have; anything else is
+    // fetched the normal way
+    if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock))
+    {
+        if (fHeadersFirst)
+            RequestHeaders(pfrom);
+        pfrom->AskFor(inv);
+        return;
+    }
+    if (!CheckCompactBlockHeader(pfrom, cmpctblock, mapBlockIndex[cmpctblock.header.hashPrevBlock]))
+        return;
+
+    CPartialBlock partial;
+    bool fInit;
+    {
+        LOCK(mempool.cs);
+        fInit = partial.Init(cmpctblock, mempool.mapTx, mapOrphanTransactions);
+    }
+    if (!fInit)
+    {
+        pfrom->Misbehaving(100);
+        error("ProcessCompactBlock() : malformed compact block %s", hashBlock.ToString().c_str());
+        return;
+    }
+
+    if (partial.GetMissing().empty())
+    {
+        if (partial.Fill(vector<CTransaction>()))
+            ProcessReceivedBlock(pfrom, partial.block);
+        else
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+        return;
+    }
+
+    LimitPartialBlocks(pfrom->GetId());
+
+    CBlockTxRequest req;
+    req.hashBlock = hashBlock;
+    req.vIndexes = partial.GetMissing();
+    mapPartialBlocks[hashBlock] = make_pair(pfrom->GetId(), partial);
+    listPartialBlocks.push_back(hashBlock);
+    if (fDebug)
+        printf("cmpctblock %s: requesting %" PRIszu " missing transactions\n", hashBlock.ToString().substr(0,20).c_str(), req.vIndexes.size());
+    pfrom->PushMessage("getblocktxn", req);
+}
+
+// Salts for the deterministic addr relay and tx trickle choices, drawn once.
+// Messages are handled on several worker threads, so they are not set lazily.
+static uint256 hashAddrRelaySalt;
+static uint256 hashTrickleSalt;
+static boost::once_flag onceRelaySalts = BOOST_ONCE_INIT;
+
+static void InitRelaySalts()
+{
+    hashAddrRelaySalt = GetRandHash();
+    hashTrickleSalt = GetRandHash();
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     static map<CService, CPubKey> mapReuseKey;
@@ -3210,6 +4294,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         pfrom->PushMessage("verack");
         pfrom->vSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
+        // Our version message has been queued already, so from here on the
+        // peer knows we can inflate anything we send compressed
+        pfrom->fCompress = (pfrom->nServices & NODE_LZ4) && (nLocalServices & NODE_LZ4);
+
         if (!pfrom->fInbound)
         {
             // Advertise our address
@@ -3236,8 +4324,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
 
         // Ask the first connected node for block updates
+        // (with headers-first sync SendMessages takes care of this)
+        InitializeNode(pfrom->GetId());
         static int nAskedForBlocks = 0;
-        if (!pfrom->fClient && !pfrom->fOneShot &&
+        if (!fHeadersFirst && !pfrom->fClient && !pfrom->fOneShot &&
             (pfrom->nStartingHeight > (nBestHeight - 144)) &&
             (pfrom->nVersion < NOBLKS_VERSION_START ||
              pfrom->nVersion >= NOBLKS_VERSION_END) &&
@@ -3283,7 +4373,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
     }
 
 
@@ -3319,12 +4409,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
+                    // at a time so the addrKnown filters of the chosen nodes prevent repeats
+                    boost::call_once(onceRelaySalts, InitRelaySalts);
                     uint64_t hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
+                    uint256 hashRand = hashAddrRelaySalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     multimap<uint256, CNode*> mapMix;
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -3384,7 +4472,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave)
+            if (fHeadersFirst && inv.type == MSG_BLOCK && !fHeaderChainUnserved)
+            {
+                // Learn the header first; SendMessages fetches the block once
+                // it connects, or right away when it extends our tip
+                if (!fAlreadyHave && GetHeaderHeight(inv.hash) < 0)
+                {
+                    RequestHeaders(pfrom);
+                    if (!IsInitialBlockDownload())
+                        pfrom->AskFor(inv);
+                }
+                else
+                    UpdateBlockAvailability(pfrom, inv.hash);
+            }
+            else if (!fAlreadyHave)
                 pfrom->AskFor(inv);
             else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
                 pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
@@ -3429,9 +4530,32 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    // Stop serving blocks older than a week once the upload
+                    // target leaves only enough for relaying new blocks
+                    static const int nOneWeek = 60 * 60 * 24 * 7;
+                    if ((*mi).second->GetBlockTime() < GetAdjustedTime() - nOneWeek && CNode::OutboundTargetReached(true))
+                    {
+                        printf("historical block serving limit reached, disconnect peer %s\n", pfrom->addr.ToString().c_str());
+                        pfrom->fDisconnect = true;
+                        break;
+                    }
+
+                    CSerializedNetMsgRef msg = blockMsgCache.Get(inv.hash);
+                    if (!msg)
+                    {
+                        CBlock block;
+                        if (!block.ReadFromDisk((*mi).second))
+                        {
+                            printf("getdata: could not read block %s from disk\n", inv.hash.ToString().c_str());
+                            continue;
+                        }
+                        msg = MakeBlockMessage(block);
+                        // Only cache blocks near the tip; a peer syncing old
+                        // history would just churn the cache
+                        if ((*mi).second->nHeight > nBestHeight - 100)
+                            blockMsgCache.Put(inv.hash, msg);
+                    }
+                    pfrom->PushNetMessage(msg);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3452,9 +4576,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSerializedNetMsgRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushNetMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -3563,6 +4687,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers" && fHeadersFirst)
+    {
+        ProcessHeadersMessage(pfrom, vRecv);
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3634,20 +4764,68 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         CBlock block;
         vRecv >> block;
-        uint256 hashBlock = block.GetHash();
 
-        printf("received block %s\n", hashBlock.ToString().substr(0,20).c_str());
+        printf("received block %s\n", block.GetHash().ToString().substr(0,20).c_str());
         // block.print();
 
-        CInv inv(MSG_BLOCK, hashBlock);
-        pfrom->AddInventoryKnown(inv);
+        ProcessReceivedBlock(pfrom, block);
+    }
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
 
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
-        if (fSecMsgEnabled)
-            SecureMsgScanBlock(block);
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+        ProcessCompactBlock(pfrom, cmpctblock);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTxRequest req;
+        vRecv >> req;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return true;
+        CBlock block;
+        if (!block.ReadFromDisk((*mi).second))
+            return error("getblocktxn : ReadFromDisk failed for %s", req.hashBlock.ToString().c_str());
+
+        CBlockTxResponse resp;
+        resp.hashBlock = req.hashBlock;
+        BOOST_FOREACH(unsigned short nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("getblocktxn : index %u out of range", nIndex);
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        CBlockTxResponse resp;
+        vRecv >> resp;
+
+        map<uint256, pair<NodeId, CPartialBlock> >::iterator mi = mapPartialBlocks.find(resp.hashBlock);
+        if (mi == mapPartialBlocks.end() || (*mi).second.first != pfrom->GetId())
+            return true;
+        CPartialBlock partial = (*mi).second.second;
+        ErasePartialBlock(resp.hashBlock);
+
+        if (!partial.Fill(resp.vtx))
+        {
+            // Short id collision or a bad answer: get the whole block
+            printf("blocktxn : could not rebuild block %s, requesting it\n", resp.hashBlock.ToString().substr(0,20).c_str());
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.hashBlock)));
+            return true;
+        }
+        ProcessReceivedBlock(pfrom, partial.block);
     }
 
 
@@ -3655,7 +4833,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if(addr.nTime > nCutOff)
@@ -3797,13 +4978,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// Messages that touch no chain or mempool state and so can be handled by a
+// message handler worker without holding cs_main, concurrently with block
+// processing on another peer.
+// The smsg handlers take cs_smsg this way while SendMessages takes it under
+// cs_main, so the lock order is cs_main, then cs_smsg, then cs_smsgDB: code
+// holding cs_smsg must never wait for cs_main.
+static bool IsMessageIndependentOfChain(const string& strCommand)
+{
+    return strCommand == "ping" || strCommand == "pong" || strCommand == "addr" ||
+           strCommand.compare(0, 4, "smsg") == 0;
+}
+
 bool ProcessMessages(CNode* pfrom)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-        return true;
     //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
+    //    printf("ProcessMessages(%zu messages)\n", pfrom->vRecvMsg.size());
 
     //
     // Message format
@@ -3813,33 +5003,35 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) checksum
     //  (x) data
     //
+    bool fOk = true;
 
-    while (true)
+    std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
+    while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end())
     {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->vSend.size() >= SendBufferSize())
+        if (pfrom->nSendSize >= SendBufferSize())
+            break;
+
+        // get next message
+        CNetMessage& msg = *it;
+
+        // end, if an incomplete message is found
+        if (!msg.complete())
             break;
 
+        // at this point, any failure means we can delete the current message
+        it++;
+
         // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
+        if (memcmp(msg.hdr.pchMessageStart, pchMessageStart, sizeof(pchMessageStart)) != 0)
         {
-            if ((int)vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
+            printf("\n\nPROCESSMESSAGE: INVALID MESSAGESTART\n\n");
+            fOk = false;
             break;
         }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %" PRIpdd " BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
 
         // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
+        CMessageHeader& hdr = msg.hdr;
         if (!hdr.IsValid())
         {
             printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
@@ -3849,20 +5041,10 @@ bool ProcessMessages(CNode* pfrom)
 
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessages(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-            break;
-        }
 
         // Checksum
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        CDataStream& vMsg = msg.vRecv;
+        uint256 hash = Hash(vMsg.begin(), vMsg.begin() + nMessageSize);
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum)
@@ -3872,14 +5054,28 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
+        // Unwrap compressed messages (see CompressNetMessage)
+        if (strCommand == "lz4")
+        {
+            CDataStream vPlain(vMsg.nType, vMsg.nVersion);
+            if (!(nLocalServices & NODE_LZ4) || !DecompressNetMessage(vMsg, strCommand, vPlain))
+            {
+                printf("ProcessMessages(lz4, %u bytes) : bad compressed message\n", nMessageSize);
+                pfrom->Misbehaving(20);
+                continue;
+            }
+            vMsg.swap(vPlain);
+        }
 
         // Process message
         bool fRet = false;
         try
         {
+            if (IsMessageIndependentOfChain(strCommand))
+            {
+                fRet = ProcessMessage(pfrom, strCommand, vMsg);
+            }
+            else
             {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vMsg);
@@ -3914,8 +5110,14 @@ bool ProcessMessages(CNode* pfrom)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
     }
 
-    vRecv.Compact();
-    return true;
+    // In case the connection got shut down, its receive buffer was wiped
+    if (!pfrom->fDisconnect)
+        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+
+    if (!fOk)
+        pfrom->fDisconnect = true;
+
+    return fOk;
 }
 
 
@@ -3929,7 +5131,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
         // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
         // right now.
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty()) {
+        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty()) {
             uint64_t nonce = 0;
             if (pto->nVersion > BIP0031_VERSION)
                 pto->PushMessage("ping", nonce);
@@ -3948,9 +5150,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 LOCK(cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    // Periodically clear setAddrKnown to allow refresh broadcasts
+                    // Periodically clear addrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
-                        pnode->setAddrKnown.clear();
+                    {
+                        LOCK(pnode->cs_vAddrToSend);
+                        pnode->addrKnown.reset();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -3969,25 +5174,28 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            vector<CAddress> vAddrToSend;
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_vAddrToSend);
+                vAddrToSend.swap(pto->vAddrToSend);
+                vAddr.reserve(vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    vector<unsigned char> vchKey = addr.GetKey();
+                    if (!pto->addrKnown.contains(vchKey))
                     {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(vchKey);
+                        vAddr.push_back(addr);
                     }
                 }
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+            {
+                vector<CAddress> vAddrChunk(vAddr.begin() + i, vAddr.begin() + min(i + 1000, (unsigned int)vAddr.size()));
+                pto->PushMessage("addr", vAddrChunk);
+            }
         }
 
 
@@ -4002,17 +5210,15 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
                 if (inv.type == MSG_TX && !fSendTrickle)
                 {
                     // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
+                    boost::call_once(onceRelaySalts, InitRelaySalts);
+                    uint256 hashRand = inv.hash ^ hashTrickleSalt;
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     bool fTrickleWait = ((hashRand & 3) != 0);
 
@@ -4032,15 +5238,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -4055,9 +5258,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         vector<CInv> vGetData;
         int64_t nNow = GetTime() * 1000000;
         CTxDB txdb("r");
-        while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
+        while (!pto->vAskFor.empty() && pto->vAskFor.front().first <= nNow)
         {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
+            std::pop_heap(pto->vAskFor.begin(), pto->vAskFor.end(), std::greater<std::pair<int64_t, CInv> >());
+            const CInv inv = pto->vAskFor.back().second;
+            pto->vAskFor.pop_back();
             if (!AlreadyHave(txdb, inv))
             {
                 if (fDebugNet)
@@ -4070,11 +5275,16 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 }
                 mapAlreadyAskedFor[inv] = nNow;
             }
-            pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
+        //
+        // Message: getheaders/getdata (headers-first block download)
+        //
+        if (fHeadersFirst)
+            SendBlockSyncMessages(pto);
+
         if (fSecMsgEnabled)
             SecureMsgSendData(pto, fSendTrickle);
 
@@ -4082,8 +5292,3 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
     return true;
 }
 
-bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats)
-{
-    // TODO: incomplete
-    return false;
-}
@@ -61,6 +61,8 @@ static const uint256 hashGenesisBlockTestNet("0x00784c3a56f8bcf734b2c97aae3edf8d
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
+extern CWaitableCriticalSection csBestBlock;
+extern boost::condition_variable cvBlockChange;
 extern std::map<uint256, CBlockIndex*> mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
@@ -88,6 +90,7 @@ extern int64_t nTransactionFee;
 extern int64_t nReserveBalance;
 extern int64_t nMinimumInputValue;
 extern bool fUseFastIndex;
+extern bool fHeadersFirst;
 extern unsigned int nDerivationMethodIndex;
 
 // Minimum disk space required - used in CheckDiskSpace()
@@ -137,6 +140,8 @@ void ResendWalletTransactions(bool fForce = false);
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 // get node statistics (currently not implemented)
+void InitializeNode(NodeId nodeid);
+void FinalizeNode(NodeId nodeid);
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 
 /** Position on disk for a particular transaction. */
@@ -1507,6 +1512,12 @@ public:
         vHave.clear();
     }
 
+    // Put a hash ahead of the others, e.g. a header we have no block for yet
+    void PushFront(const uint256& hash)
+    {
+        vHave.insert(vHave.begin(), hash);
+    }
+
     bool IsNull()
     {
         return vHave.empty();
@@ -10,12 +10,18 @@
 #include "addrman.h"
 #include "ui_interface.h"
 #include "util.h"
+#include "lz4/lz4.h"
 #include <sys/stat.h>
 
 #ifdef WIN32
 #include <string.h>
 #endif
 
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -62,7 +68,7 @@ bool fClient = false;
 bool fDiscover = true;
 bool fUseUPnP = false;
 bool fTorEnabled = true;
-uint64_t nLocalServices = (fClient ? 0 : NODE_NETWORK);
+uint64_t nLocalServices = (fClient ? 0 : NODE_NETWORK | NODE_COMPACT_BLOCKS | NODE_LZ4);
 static CCriticalSection cs_mapLocalHost;
 static map<CNetAddr, LocalServiceInfo> mapLocalHost;
 static bool vfReachable[NET_MAX] = {};
@@ -76,7 +82,7 @@ CAddrMan addrman;
 
 vector<CNode *> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSerializedNetMsgRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
@@ -89,6 +95,40 @@ CCriticalSection cs_setservAddNodeAddresses;
 
 static CSemaphore *semOutbound = NULL;
 
+static const int MAX_SEND_IOV = 64;
+
+#ifdef USE_EPOLL
+static const int MAX_EPOLL_EVENTS = 256;
+static int hEpoll = -1;
+#endif
+
+// Register a node's socket with the socket handler's event set. Node sockets
+// carry the CNode pointer; listen sockets are registered with a NULL pointer.
+static void SocketEventsAdd(CNode *pnode)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == SOCKET_ERROR)
+        printf("SocketEventsAdd() : epoll_ctl failed, error %d\n", errno);
+#endif
+}
+
+static void SocketEventsRemove(CNode *pnode)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    epoll_ctl(hEpoll, EPOLL_CTL_DEL, pnode->hSocket, &event);
+#endif
+}
+
 NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
@@ -390,6 +430,17 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+mapMsgTypeStats_t CNode::mapTotalSendMsgStats;
+mapMsgTypeStats_t CNode::mapTotalRecvMsgStats;
+uint64_t CNode::nMaxOutboundTarget = 0;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+
+// Global send rate limit (-maxsendrate) as a token bucket holding up to one
+// second of sending. Only the socket handler thread touches it.
+static int64_t nSendRateLimit = 0; // bytes per second, 0 means unlimited
+static int64_t nSendTokens = 0;
+static int64_t nSendTokensTime = 0;
 
 CNode *FindNode(const CNetAddr &ip)
 {
@@ -478,6 +529,7 @@ CNode *ConnectNode(CAddress addrConnect, const char *pszDest)
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
+            SocketEventsAdd(pnode);
         }
 
         pnode->nTimeConnected = GetTime();
@@ -495,15 +547,182 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         printf("disconnecting node %s\n", addrName.c_str());
+        SocketEventsRemove(this);
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
-        vRecv.clear();
+
+        // in case this fails, we'll empty the recv buffer when the CNode is deleted
+        TRY_LOCK(cs_vRecv, lockRecv);
+        if (lockRecv)
+            vRecvMsg.clear();
         uiInterface.NotifyNetworkActiveChanged(false);
     }
 }
 
+CSerializedNetMsgRef MakeNetMessage(const char *pszCommand, const CDataStream &ssPayload)
+{
+    boost::shared_ptr<CSerializedNetMsg> pmsg(new CSerializedNetMsg(SER_NETWORK, ssPayload.nVersion));
+    pmsg->reserve(24 + ssPayload.size());
+
+    CMessageHeader hdr(pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    *pmsg << hdr;
+    pmsg->write(&ssPayload[0], ssPayload.size());
+    return pmsg;
+}
+
+// Payloads smaller than this are sent as they are
+static const unsigned int COMPRESS_MIN_SIZE = 512;
+
+static bool IsCompressibleCommand(const std::string &strCommand)
+{
+    return strCommand == "block" || strCommand == "tx" || strCommand == "blocktxn" ||
+           strCommand == "headers" || strCommand == "smsgMsg";
+}
+
+CSerializedNetMsgRef CompressNetMessage(const CDataStream &msg)
+{
+    unsigned int nHeaderSize = CMessageHeader::HEADER_SIZE;
+    if (msg.size() < nHeaderSize + COMPRESS_MIN_SIZE)
+        return CSerializedNetMsgRef();
+
+    const char *pszCommand = &msg[CMessageHeader::MESSAGE_START_SIZE];
+    std::string strCommand(pszCommand, strnlen(pszCommand, CMessageHeader::COMMAND_SIZE));
+    if (!IsCompressibleCommand(strCommand))
+        return CSerializedNetMsgRef();
+
+    unsigned int nRawSize = msg.size() - nHeaderSize;
+    CDataStream ssPayload(SER_NETWORK, msg.nVersion);
+    ssPayload.reserve(CMessageHeader::COMMAND_SIZE + sizeof(nRawSize) + LZ4_compressBound(nRawSize));
+    ssPayload.write(pszCommand, CMessageHeader::COMMAND_SIZE);
+    ssPayload << nRawSize;
+
+    unsigned int nPrefix = ssPayload.size();
+    ssPayload.resize(nPrefix + LZ4_compressBound(nRawSize));
+    int nCompressed = LZ4_compress(&msg[nHeaderSize], &ssPayload[nPrefix], nRawSize);
+    // not worth it unless it saves at least the wrapper
+    if (nCompressed <= 0 || nPrefix + nCompressed >= nRawSize)
+        return CSerializedNetMsgRef();
+    ssPayload.resize(nPrefix + nCompressed);
+
+    return MakeNetMessage("lz4", ssPayload);
+}
+
+CSerializedNetMsgRef CSerializedNetMsg::GetCompressed() const
+{
+    LOCK(cs_compressed);
+    if (!fCompressDone)
+    {
+        msgCompressed = CompressNetMessage(*this);
+        fCompressDone = true;
+    }
+    return msgCompressed;
+}
+
+bool DecompressNetMessage(const CDataStream &vMsg, std::string &strCommand, CDataStream &vPlain)
+{
+    unsigned int nRawSize;
+    unsigned int nPrefix = CMessageHeader::COMMAND_SIZE + sizeof(nRawSize);
+    if (vMsg.size() <= nPrefix)
+        return false;
+
+    const char *pszCommand = &vMsg[0];
+    strCommand = std::string(pszCommand, strnlen(pszCommand, CMessageHeader::COMMAND_SIZE));
+    memcpy(&nRawSize, &vMsg[CMessageHeader::COMMAND_SIZE], sizeof(nRawSize));
+    if (!IsCompressibleCommand(strCommand) || nRawSize > MAX_SIZE || nRawSize > ReceiveBufferSize())
+        return false;
+
+    vPlain.resize(nRawSize);
+    int nCompressed = vMsg.size() - nPrefix;
+    return LZ4_decompress_safe(&vMsg[nPrefix], &vPlain[0], nCompressed, nRawSize) == (int)nRawSize;
+}
+
+// requires LOCK(cs_vRecv)
+bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
+{
+    while (nBytes > 0)
+    {
+        // get current incomplete message, or create a new one
+        if (vRecvMsg.empty() || vRecvMsg.back().complete())
+            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+
+        CNetMessage &msg = vRecvMsg.back();
+
+        // absorb network data
+        int handled;
+        if (!msg.in_data)
+            handled = msg.readHeader(pch, nBytes);
+        else
+            handled = msg.readData(pch, nBytes);
+
+        if (handled < 0)
+            return false;
+
+        if (msg.complete())
+            RecordRecvMsg(msg);
+
+        pch += handled;
+        nBytes -= handled;
+    }
+
+    return true;
+}
+
+int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
+{
+    // copy data to temporary parsing buffer
+    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+
+    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    nHdrPos += nCopy;
+
+    // if header incomplete, exit
+    if (nHdrPos < 24)
+        return nCopy;
+
+    // deserialize to CMessageHeader
+    try
+    {
+        hdrbuf >> hdr;
+    }
+    catch (std::exception &e)
+    {
+        return -1;
+    }
+
+    // reject messages larger than MAX_SIZE or the receive buffer
+    if (hdr.nMessageSize > MAX_SIZE || hdr.nMessageSize > ReceiveBufferSize())
+        return -1;
+
+    // switch state to reading message data; the buffer grows as the payload
+    // arrives, so an unauthenticated header cannot make us allocate MAX_SIZE
+    in_data = true;
+
+    return nCopy;
+}
+
+int CNetMessage::readData(const char *pch, unsigned int nBytes)
+{
+    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+
+    if (vRecv.size() < nDataPos + nCopy)
+    {
+        // allocate up to 256 KiB ahead, but never more than the total message size
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+    }
+
+    memcpy(&vRecv[nDataPos], pch, nCopy);
+    nDataPos += nCopy;
+
+    return nCopy;
+}
+
 void CNode::Cleanup()
 {
+    FinalizeNode(GetId());
 }
 
 void CNode::PushVersion()
@@ -617,6 +836,11 @@ void CNode::copyStats(CNodeStats &stats)
     X(nMisbehavior);
     X(nSendBytes);
     X(nRecvBytes);
+    {
+        LOCK(cs_msgStats);
+        X(mapSendMsgStats);
+        X(mapRecvMsgStats);
+    }
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
@@ -633,6 +857,15 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME < now)
+    {
+        // timeframe expired, reset cycle
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += bytes;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -643,10 +876,181 @@ uint64_t CNode::GetTotalBytesRecv()
 
 uint64_t CNode::GetTotalBytesSent()
 {
-    LOCK(cs_totalBytesRecv);
+    LOCK(cs_totalBytesSent);
     return nTotalBytesSent;
 }
 
+void CNode::GetTotalMsgStats(mapMsgTypeStats_t &mapSend, mapMsgTypeStats_t &mapRecv)
+{
+    {
+        LOCK(cs_totalBytesSent);
+        mapSend = mapTotalSendMsgStats;
+    }
+    {
+        LOCK(cs_totalBytesRecv);
+        mapRecv = mapTotalRecvMsgStats;
+    }
+}
+
+static void AddMsgTypeStats(mapMsgTypeStats_t &mapStats, const std::string &strCommand, uint64_t nBytes)
+{
+    // Commands are peer controlled; don't let them grow the map without bound
+    mapMsgTypeStats_t::iterator it = mapStats.find(strCommand);
+    if (it == mapStats.end())
+    {
+        if (mapStats.size() >= MAX_MSG_TYPE_STATS)
+            it = mapStats.insert(std::make_pair(std::string("*other*"), CMsgTypeStats())).first;
+        else
+            it = mapStats.insert(std::make_pair(strCommand, CMsgTypeStats())).first;
+    }
+    it->second.nBytes += nBytes;
+    it->second.nCount++;
+}
+
+// msg is the message as built, nBytes what goes on the wire for it
+void CNode::RecordSendMsg(const CDataStream &msg, uint64_t nBytes)
+{
+    const char *pszCommand = &msg[CMessageHeader::MESSAGE_START_SIZE];
+    std::string strCommand(pszCommand, strnlen(pszCommand, CMessageHeader::COMMAND_SIZE));
+    {
+        LOCK(cs_msgStats);
+        AddMsgTypeStats(mapSendMsgStats, strCommand, nBytes);
+    }
+    {
+        LOCK(cs_totalBytesSent);
+        AddMsgTypeStats(mapTotalSendMsgStats, strCommand, nBytes);
+    }
+}
+
+void CNode::FlushDeferredSend()
+{
+    while (true)
+    {
+        // They stay in vSendDeferred meanwhile, so later messages queue behind
+        std::vector<CSerializedNetMsgRef> vMsgs;
+        {
+            LOCK(cs_vSend);
+            fDeferCompress = false;
+            if (vSendDeferred.empty())
+                return;
+            vMsgs.assign(vSendDeferred.begin(), vSendDeferred.end());
+        }
+
+        std::vector<CSerializedNetMsgRef> vSendNow;
+        vSendNow.reserve(vMsgs.size());
+        BOOST_FOREACH (const CSerializedNetMsgRef &msg, vMsgs)
+        {
+            CSerializedNetMsgRef msgCompressed = msg->GetCompressed();
+            vSendNow.push_back(msgCompressed ? msgCompressed : msg);
+        }
+
+        LOCK(cs_vSend);
+        for (unsigned int i = 0; i < vMsgs.size(); i++)
+        {
+            vSendDeferred.pop_front();
+            nSendSize += vSendNow[i]->size();
+            RecordSendMsg(*vMsgs[i], vSendNow[i]->size());
+            vSendMsg.push_back(vSendNow[i]);
+        }
+    }
+}
+
+void CNode::RecordRecvMsg(const CNetMessage &msg)
+{
+    // "lz4" messages count as the command they wrap
+    std::string strCommand = msg.hdr.GetCommand();
+    if (strCommand == "lz4" && msg.vRecv.size() >= CMessageHeader::COMMAND_SIZE)
+        strCommand = std::string(&msg.vRecv[0], strnlen(&msg.vRecv[0], CMessageHeader::COMMAND_SIZE));
+    uint64_t nBytes = CMessageHeader::HEADER_SIZE + msg.hdr.nMessageSize;
+    {
+        LOCK(cs_msgStats);
+        AddMsgTypeStats(mapRecvMsgStats, strCommand, nBytes);
+    }
+    {
+        LOCK(cs_totalBytesRecv);
+        AddMsgTypeStats(mapTotalRecvMsgStats, strCommand, nBytes);
+    }
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t nLimit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundTarget = nLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTarget;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTarget == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return MAX_UPLOAD_TIMEFRAME;
+
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - now;
+}
+
+bool CNode::OutboundTargetReached(bool fHistoricalBlockServing)
+{
+    uint64_t nTimeLeft = GetMaxOutboundTimeLeftInCycle();
+
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTarget == 0)
+        return false;
+
+    if (fHistoricalBlockServing)
+    {
+        // keep a buffer for relaying new blocks for the rest of the cycle
+        uint64_t nBuffer = nTimeLeft / 60 * UPLOAD_TARGET_RELAY_RESERVE;
+        if (nBuffer >= nMaxOutboundTarget || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundTarget - nBuffer)
+            return true;
+    }
+    else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundTarget)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTarget == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundTarget) ? 0 : nMaxOutboundTarget - nMaxOutboundTotalBytesSentInCycle;
+}
+
+// Bytes the send rate limit allows right now
+static int64_t SendTokensAvailable()
+{
+    if (nSendRateLimit == 0)
+        return std::numeric_limits<int64_t>::max();
+
+    int64_t nNow = GetTimeMicros();
+    nSendTokens = std::min(nSendRateLimit, nSendTokens + (nNow - nSendTokensTime) * nSendRateLimit / 1000000);
+    nSendTokensTime = nNow;
+    return nSendTokens;
+}
+
+static void SendTokensConsume(int64_t nBytes)
+{
+    if (nSendRateLimit != 0)
+        nSendTokens -= nBytes;
+}
+
+int64_t GetMaxSendRate()
+{
+    return nSendRateLimit;
+}
+
 void ThreadTorNet(void *parg)
 {
     // Make this thread recognisable as the connection opening thread
@@ -786,11 +1190,138 @@ void ThreadSocketHandler(void *parg)
     printf("ThreadSocketHandler exited\n");
 }
 
+// Write as much of a node's send queue as the socket will take in one call,
+// gathering up to MAX_SEND_IOV queued messages. Requires LOCK(cs_vSend).
+static int SocketSendQueue(CNode *pnode, size_t nMaxBytes, size_t &nOffered)
+{
+#ifdef WIN32
+    const CDataStream &msg = *pnode->vSendMsg.front();
+    nOffered = std::min(msg.size() - pnode->nSendOffset, nMaxBytes);
+    return send(pnode->hSocket, &msg[pnode->nSendOffset], nOffered, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+    struct iovec iov[MAX_SEND_IOV];
+    int nIov = 0;
+    size_t nOffset = pnode->nSendOffset;
+    nOffered = 0;
+    BOOST_FOREACH (const CSerializedNetMsgRef &msg, pnode->vSendMsg)
+    {
+        if (nIov == MAX_SEND_IOV || nOffered == nMaxBytes)
+            break;
+        iov[nIov].iov_base = (void *)&(*msg)[nOffset];
+        iov[nIov].iov_len = std::min(msg->size() - nOffset, nMaxBytes - nOffered);
+        nOffered += iov[nIov].iov_len;
+        nIov++;
+        nOffset = 0;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nIov;
+    return sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+}
+
+// Drop nBytes of sent data from the front of a node's send queue.
+// Requires LOCK(cs_vSend).
+static void SocketSendConsume(CNode *pnode, size_t nBytes)
+{
+    pnode->nSendSize -= nBytes;
+    while (nBytes > 0)
+    {
+        size_t nLeft = pnode->vSendMsg.front()->size() - pnode->nSendOffset;
+        if (nBytes < nLeft)
+        {
+            pnode->nSendOffset += nBytes;
+            break;
+        }
+        nBytes -= nLeft;
+        pnode->vSendMsg.pop_front();
+        pnode->nSendOffset = 0;
+    }
+}
+
+// Accept every pending connection on a listen socket. The listen sockets are
+// non-blocking, so this drains the backlog until accept() would block, which
+// the edge-triggered event loop relies on.
+static void AcceptConnections(SOCKET hListenSocket)
+{
+    while (!fShutdown)
+    {
+#ifdef USE_IPV6
+        struct sockaddr_storage sockaddr;
+#else
+        struct sockaddr sockaddr;
+#endif
+        socklen_t len = sizeof(sockaddr);
+        SOCKET hSocket = accept(hListenSocket, (struct sockaddr *)&sockaddr, &len);
+        CAddress addr;
+        int nInbound = 0;
+
+        if (hSocket == INVALID_SOCKET)
+        {
+            int nErr = WSAGetLastError();
+            if (nErr == WSAEINTR)
+                continue;
+            if (nErr != WSAEWOULDBLOCK)
+                printf("socket error accept failed: %d\n", nErr);
+            return;
+        }
+
+        if (!addr.SetSockAddr((const struct sockaddr *)&sockaddr))
+            printf("Warning: Unknown socket family\n");
+
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH (CNode *pnode, vNodes)
+                if (pnode->fInbound)
+                    nInbound++;
+        }
+
+#if !defined(WIN32) && !defined(USE_EPOLL)
+        if (hSocket >= FD_SETSIZE)
+        {
+            printf("connection from %s dropped (socket %d exceeds FD_SETSIZE)\n", addr.ToString().c_str(), hSocket);
+            closesocket(hSocket);
+            continue;
+        }
+#endif
+
+        if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+        {
+            closesocket(hSocket);
+        }
+        else if (CNode::IsBanned(addr))
+        {
+            printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+            closesocket(hSocket);
+        }
+        else
+        {
+#ifndef WIN32
+            // accepted sockets do not inherit O_NONBLOCK on Linux
+            if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
+                printf("AcceptConnections() : fcntl non-blocking setting failed, error %d\n", errno);
+#endif
+            printf("accepted connection %s\n", addr.ToString().c_str());
+            CNode *pnode = new CNode(hSocket, addr, "", true);
+            pnode->AddRef();
+            {
+                LOCK(cs_vNodes);
+                vNodes.push_back(pnode);
+                SocketEventsAdd(pnode);
+            }
+        }
+    }
+}
+
 void ThreadSocketHandler2(void *parg)
 {
     printf("ThreadSocketHandler started\n");
     list<CNode *> vNodesDisconnected;
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
+    bool fRecvPending = false;
 
     while (true)
     {
@@ -804,7 +1335,7 @@ void ThreadSocketHandler2(void *parg)
             BOOST_FOREACH (CNode *pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->vSendMsg.empty()))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -863,11 +1394,58 @@ void ThreadSocketHandler2(void *parg)
         }
 
         //
-        // Find which sockets have data to receive
+        // Find which sockets are ready
         //
+        bool fListenReady = false;
+        // A receive skipped because a message worker holds cs_vRecv stays
+        // latched but is only retried at the normal poll interval, so a busy
+        // peer does not turn the wait below into a spin.
+        bool fPending = fRecvPending;
+        bool fSendTokens = SendTokensAvailable() > 0;
+        if (!fPending && fSendTokens)
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH (CNode *pnode, vNodes)
+                if (pnode->fSendReady && pnode->nSendSize > 0)
+                    fPending = true;
+        }
+
+#ifdef USE_EPOLL
+        // Edge-triggered: readiness is latched in fRecvReady/fSendReady until
+        // recv/send report EWOULDBLOCK, so only wait when nothing is latched.
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+        int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, fPending ? 1 : 50);
+        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+        if (fShutdown)
+            return;
+        if (nEvents == SOCKET_ERROR)
+        {
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEINTR)
+            {
+                printf("socket epoll_wait error %d\n", nErr);
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+        for (int i = 0; i < nEvents; i++)
+        {
+            CNode *pnode = (CNode *)events[i].data.ptr;
+            if (pnode == NULL)
+            {
+                fListenReady = true;
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fRecvReady = true;
+            if (events[i].events & EPOLLOUT)
+                pnode->fSendReady = true;
+        }
+#else
         struct timeval timeout;
         timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = fPending ? 0 : 50000; // frequency to poll pnode->vSendMsg
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -896,7 +1474,7 @@ void ThreadSocketHandler2(void *parg)
                 have_fds = true;
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
+                    if (lockSend && !pnode->vSendMsg.empty())
                         FD_SET(pnode->hSocket, &fdsetSend);
                 }
             }
@@ -922,59 +1500,35 @@ void ThreadSocketHandler2(void *parg)
             MilliSleep(timeout.tv_usec / 1000);
         }
 
-        //
-        // Accept new connections
-        //
         BOOST_FOREACH (SOCKET hListenSocket, vhListenSocket)
+        {
             if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                fListenReady = true;
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH (CNode *pnode, vNodes)
             {
-#ifdef USE_IPV6
-                struct sockaddr_storage sockaddr;
-#else
-                struct sockaddr sockaddr;
+                if (pnode->hSocket == INVALID_SOCKET)
+                    continue;
+                if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+                    pnode->fRecvReady = true;
+                pnode->fSendReady = FD_ISSET(pnode->hSocket, &fdsetSend);
+            }
+        }
 #endif
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket, (struct sockaddr *)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr *)&sockaddr))
-                        printf("Warning: Unknown socket family\n");
 
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH (CNode *pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET)
-                {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        printf("socket error accept failed: %d\n", nErr);
-                }
-                else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-                {
-                    closesocket(hSocket);
-                }
-                else if (CNode::IsBanned(addr))
-                {
-                    printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                    closesocket(hSocket);
-                }
-                else
-                {
-                    printf("accepted connection %s\n", addr.ToString().c_str());
-                    CNode *pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
+        //
+        // Accept new connections
+        //
+        if (fListenReady)
+        {
+            BOOST_FOREACH (SOCKET hListenSocket, vhListenSocket)
+            {
+                if (hListenSocket != INVALID_SOCKET)
+                    AcceptConnections(hListenSocket);
             }
+        }
 
         //
         // Service each socket
@@ -986,6 +1540,9 @@ void ThreadSocketHandler2(void *parg)
             BOOST_FOREACH (CNode *pnode, vNodesCopy)
                 pnode->AddRef();
         }
+        bool fCheckInactivity = (GetTime() != nLastInactivityCheck);
+        nLastInactivityCheck = GetTime();
+        fRecvPending = false;
         BOOST_FOREACH (CNode *pnode, vNodesCopy)
         {
             if (fShutdown)
@@ -996,19 +1553,20 @@ void ThreadSocketHandler2(void *parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            bool fQueueWork = false;
+            if (pnode->fRecvReady)
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
                 if (lockRecv)
                 {
-                    CDataStream &vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
+                    unsigned int nTotalRecv = pnode->GetTotalRecvSize();
 
-                    if (nPos > ReceiveBufferSize())
+                    if (nTotalRecv > ReceiveBufferSize())
                     {
                         if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%" PRIszu " bytes)\n", vRecv.size());
+                            printf("socket recv flood control disconnect (%u bytes)\n", nTotalRecv);
                         pnode->CloseSocketDisconnect();
+                        pnode->fRecvReady = false;
                     }
                     else
                     {
@@ -1017,11 +1575,21 @@ void ThreadSocketHandler2(void *parg)
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
+                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            {
+                                printf("socket recv invalid message header, disconnecting\n");
+                                pnode->CloseSocketDisconnect();
+                            }
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            fQueueWork = true;
+#ifdef USE_EPOLL
+                            // more may be waiting until recv reports EWOULDBLOCK
+                            fRecvPending = true;
+#else
+                            pnode->fRecvReady = false;
+#endif
                         }
                         else if (nBytes == 0)
                         {
@@ -1034,7 +1602,9 @@ void ThreadSocketHandler2(void *parg)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fRecvReady = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     printf("socket recv error %d\n", nErr);
@@ -1050,27 +1620,38 @@ void ThreadSocketHandler2(void *parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSendReady)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                 {
-                    CDataStream &vSend = pnode->vSend;
-                    if (!vSend.empty())
+                    int64_t nTokens = SendTokensAvailable();
+                    if (!pnode->vSendMsg.empty() && nTokens > 0)
                     {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                        size_t nOffered = 0;
+                        size_t nMaxBytes = (size_t)std::min(nTokens, (int64_t)std::numeric_limits<int>::max());
+                        int nBytes = SocketSendQueue(pnode, nMaxBytes, nOffered);
                         if (nBytes > 0)
                         {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
+                            // a short write means the kernel buffer is full
+                            if ((size_t)nBytes < nOffered)
+                                pnode->fSendReady = false;
+                            // ProcessMessages stops while the send buffer is full
+                            if (pnode->nSendSize >= SendBufferSize() && pnode->nSendSize - nBytes < SendBufferSize())
+                                fQueueWork = true;
+                            SocketSendConsume(pnode, nBytes);
                             pnode->nLastSend = GetTime();
                             pnode->nSendBytes += nBytes;
                             pnode->RecordBytesSent(nBytes);
+                            SendTokensConsume(nBytes);
                         }
                         else if (nBytes < 0)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSendReady = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 printf("socket send error %d\n", nErr);
                                 pnode->CloseSocketDisconnect();
@@ -1080,10 +1661,15 @@ void ThreadSocketHandler2(void *parg)
                 }
             }
 
+            if (fQueueWork)
+                QueueMessageWork(pnode);
+
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
+            if (!fCheckInactivity)
+                continue;
+            if (pnode->nSendSize == 0)
                 pnode->nLastSendEmpty = GetTime();
             if (GetTime() - pnode->nTimeConnected > 60)
             {
@@ -1110,7 +1696,9 @@ void ThreadSocketHandler2(void *parg)
                 pnode->Release();
         }
 
+#ifndef USE_EPOLL
         MilliSleep(10);
+#endif
     }
 }
 
@@ -1489,6 +2077,90 @@ void ThreadOpenConnections(void *parg)
     printf("ThreadOpenConnections exited\n");
 }
 
+// Outbound connection attempts in progress, keyed by destination. Each
+// attempt runs on its own short-lived thread holding an outbound grant, so
+// a dead address (a SOCKS handshake through Tor can take the whole timeout)
+// no longer holds up filling the other slots; semOutbound bounds how many
+// run at once.
+class CConnectAttempt
+{
+  public:
+    CAddress addr;
+    CSemaphoreGrant grant;
+    std::string strDest;
+    bool fOneShot;
+
+    std::string GetKey() const { return strDest.empty() ? addr.ToStringIPPort() : strDest; }
+};
+
+static std::map<std::string, CAddress> mapPendingConnect;
+static CCriticalSection cs_mapPendingConnect;
+
+void static ThreadConnectAttempt(void *parg)
+{
+    RenameThread("ARMR-connect");
+    CConnectAttempt *pattempt = (CConnectAttempt *)parg;
+
+    vnThreadsRunning[THREAD_OPENCONNECTIONS]++;
+    try
+    {
+        const char *pszDest = pattempt->strDest.empty() ? NULL : pattempt->strDest.c_str();
+        if (!OpenNetworkConnection(pattempt->addr, &pattempt->grant, pszDest, pattempt->fOneShot) && pattempt->fOneShot && !fShutdown)
+            AddOneShot(pattempt->strDest);
+    }
+    catch (std::exception &e)
+    {
+        PrintExceptionContinue(&e, "ThreadConnectAttempt()");
+    }
+    catch (...)
+    {
+        PrintExceptionContinue(NULL, "ThreadConnectAttempt()");
+    }
+    vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
+
+    {
+        LOCK(cs_mapPendingConnect);
+        mapPendingConnect.erase(pattempt->GetKey());
+    }
+    delete pattempt;
+}
+
+// Start connecting to addrConnect (or strDest) in the background, taking
+// over grantOutbound. Returns false if an attempt to the same destination is
+// already running or no thread could be started; the grant is kept then.
+static bool StartConnectAttempt(const CAddress &addrConnect, CSemaphoreGrant &grantOutbound, const char *strDest = NULL, bool fOneShot = false)
+{
+    if (fShutdown)
+        return false;
+
+    CConnectAttempt *pattempt = new CConnectAttempt();
+    pattempt->addr = addrConnect;
+    pattempt->strDest = strDest ? strDest : "";
+    pattempt->fOneShot = fOneShot;
+    {
+        LOCK(cs_mapPendingConnect);
+        if (!mapPendingConnect.insert(std::make_pair(pattempt->GetKey(), addrConnect)).second)
+        {
+            delete pattempt;
+            return false;
+        }
+    }
+
+    grantOutbound.MoveTo(pattempt->grant);
+    if (!NewThread(ThreadConnectAttempt, pattempt))
+    {
+        printf("Error: NewThread(ThreadConnectAttempt) failed\n");
+        pattempt->grant.MoveTo(grantOutbound);
+        {
+            LOCK(cs_mapPendingConnect);
+            mapPendingConnect.erase(pattempt->GetKey());
+        }
+        delete pattempt;
+        return false;
+    }
+    return true;
+}
+
 void static ProcessOneShot()
 {
     string strDest;
@@ -1501,11 +2173,8 @@ void static ProcessOneShot()
     }
     CAddress addr;
     CSemaphoreGrant grant(*semOutbound, true);
-    if (grant)
-    {
-        if (!OpenNetworkConnection(addr, &grant, strDest.c_str(), true))
-            AddOneShot(strDest);
-    }
+    if (!grant || !StartConnectAttempt(addr, grant, strDest.c_str(), true))
+        AddOneShot(strDest);
 }
 
 void static ThreadStakeMiner(void *parg)
@@ -1545,7 +2214,8 @@ void ThreadOpenConnections2(void *parg)
             BOOST_FOREACH (string strAddr, mapMultiArgs["-connect"])
             {
                 CAddress addr;
-                OpenNetworkConnection(addr, NULL, strAddr.c_str());
+                CSemaphoreGrant grant;
+                StartConnectAttempt(addr, grant, strAddr.c_str());
                 for (int i = 0; i < 10 && i < nLoop; i++)
                 {
                     MilliSleep(500);
@@ -1559,12 +2229,15 @@ void ThreadOpenConnections2(void *parg)
 
     // Initiate network connections
     int64_t nStart = GetTime();
+    bool fStarted = false;
     while (true)
     {
         ProcessOneShot();
 
+        // Attempts run in the background, so go straight on to the next
+        // free slot after starting one
         vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
-        MilliSleep(500);
+        MilliSleep(fStarted ? 50 : 500);
         vnThreadsRunning[THREAD_OPENCONNECTIONS]++;
         if (fShutdown)
             return;
@@ -1600,7 +2273,8 @@ void ThreadOpenConnections2(void *parg)
         //
         CAddress addrConnect;
 
-        // Only connect out to one peer per network group (/16 for IPv4).
+        // Only connect out to one peer per network group (/16 for IPv4),
+        // counting attempts still in progress.
         // Do this here so we don't have to critsect vNodes inside mapAddresses critsect.
         int nOutbound = 0;
         set<vector<unsigned char> > setConnected;
@@ -1615,6 +2289,15 @@ void ThreadOpenConnections2(void *parg)
                 }
             }
         }
+        {
+            LOCK(cs_mapPendingConnect);
+            BOOST_FOREACH (const PAIRTYPE(std::string, CAddress) &item, mapPendingConnect)
+            {
+                if (item.second.IsValid())
+                    setConnected.insert(item.second.GetGroup());
+                nOutbound++;
+            }
+        }
 
         int64_t nANow = GetAdjustedTime();
 
@@ -1650,8 +2333,7 @@ void ThreadOpenConnections2(void *parg)
             break;
         }
 
-        if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+        fStarted = addrConnect.IsValid() && StartConnectAttempt(addrConnect, grant);
     }
 }
 
@@ -1694,7 +2376,7 @@ void ThreadOpenAddedConnections2(void *parg)
             {
                 CAddress addr;
                 CSemaphoreGrant grant(*semOutbound);
-                OpenNetworkConnection(addr, &grant, strAddNode.c_str());
+                StartConnectAttempt(addr, grant, strAddNode.c_str());
                 MilliSleep(500);
             }
             vnThreadsRunning[THREAD_ADDEDCONNECTIONS]--;
@@ -1738,7 +2420,7 @@ void ThreadOpenAddedConnections2(void *parg)
         BOOST_FOREACH (vector<CService> &vserv, vservConnectAddresses)
         {
             CSemaphoreGrant grant(*semOutbound);
-            OpenNetworkConnection(CAddress(*(vserv.begin())), &grant);
+            StartConnectAttempt(CAddress(*(vserv.begin())), grant);
             MilliSleep(500);
             if (fShutdown)
                 return;
@@ -1809,61 +2491,182 @@ void ThreadMessageHandler(void *parg)
     printf("ThreadMessageHandler exited\n");
 }
 
+//
+// Message handling
+//
+// The socket handler queues a node here whenever it receives data for it or
+// frees space in its send buffer; a small pool of ThreadMessageHandler workers
+// pops nodes and runs ProcessMessages/SendMessages on them. cs_vRecv and
+// cs_vSend keep any one peer on a single worker at a time, so peers are
+// handled in parallel while each peer's messages stay in order. A worker that
+// leaves messages or skipped sends behind queues the peer again. Every
+// MESSAGE_HANDLER_SWEEP_MS one worker also runs SendMessages over all nodes
+// for the timer driven work (trickle, keep-alive ping, getdata), and as a
+// backstop for anything missed.
+//
+static const int MESSAGE_HANDLER_SWEEP_MS = 100;
+static CWaitableCriticalSection csMessageWork;
+static boost::condition_variable condMessageWork;
+static deque<CNode *> vMessageWork;
+static int64_t nLastMessageSweep = 0;
+
+void QueueMessageWork(CNode *pnode)
+{
+    {
+        boost::unique_lock<CWaitableCriticalSection> lock(csMessageWork);
+        if (pnode->fMessageQueued)
+            return;
+        pnode->fMessageQueued = true;
+        {
+            LOCK(cs_vNodes);
+            pnode->AddRef();
+        }
+        vMessageWork.push_back(pnode);
+    }
+    condMessageWork.notify_one();
+}
+
+// Run ProcessMessages/SendMessages on a peer, the caller holds its cs_vRecv.
+// Returns true if the peer should be queued again rather than left for the
+// sweep: a complete message is still waiting (and the send buffer has room
+// to answer it), or SendMessages was skipped because cs_vSend was busy.
+static bool HandleNodeMessages(CNode *pnode, bool fTrickle)
+{
+    ProcessMessages(pnode);
+    if (fShutdown)
+        return false;
+
+    bool fSent = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+        {
+            pnode->fDeferCompress = true;
+            SendMessages(pnode, fTrickle);
+            fSent = true;
+        }
+    }
+    pnode->FlushDeferredSend();
+
+    if (pnode->fDisconnect)
+        return false;
+    if (!fSent)
+        return true;
+    return pnode->nSendSize < SendBufferSize()
+        && !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete();
+}
+
+static void MessageHandlerSweep()
+{
+    vector<CNode *> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH (CNode *pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+
+    // Poll the connected nodes for messages
+    CNode *pnodeTrickle = NULL;
+    if (!vNodesCopy.empty())
+        pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+    BOOST_FOREACH (CNode *pnode, vNodesCopy)
+    {
+        if (fShutdown)
+            break;
+
+        // cs_vRecv is held across both calls so a peer is only ever being
+        // handled by one worker (ProcessMessage and SendMessages both reach
+        // cs_smsg and the peer's cs_vSend, in opposite orders).
+        bool fRequeue = false;
+        {
+            TRY_LOCK(pnode->cs_vRecv, lockRecv);
+            if (!lockRecv)
+                continue;
+            fRequeue = HandleNodeMessages(pnode, pnode == pnodeTrickle);
+        }
+        if (fRequeue)
+            QueueMessageWork(pnode);
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode *pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
+
 void ThreadMessageHandler2(void *parg)
 {
     printf("ThreadMessageHandler started\n");
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (!fShutdown)
     {
-        vector<CNode *> vNodesCopy;
+        CNode *pnode = NULL;
+        bool fSweep = false;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode *pnode, vNodesCopy)
-                pnode->AddRef();
+            // Reduce vnThreadsRunning so StopNode has permission to exit while
+            // we're waiting, but we must always check fShutdown after doing this.
+            vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
+            boost::unique_lock<CWaitableCriticalSection> lock(csMessageWork);
+            while (vMessageWork.empty() && !fShutdown)
+            {
+                int64_t nWait = nLastMessageSweep + MESSAGE_HANDLER_SWEEP_MS - GetTimeMillis();
+                if (nWait <= 0)
+                    break;
+                condMessageWork.timed_wait(lock, boost::posix_time::milliseconds(nWait));
+            }
+            vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
+            if (fShutdown)
+                break;
+            if (!vMessageWork.empty())
+            {
+                pnode = vMessageWork.front();
+                vMessageWork.pop_front();
+                pnode->fMessageQueued = false;
+            }
+            else
+            {
+                fSweep = true;
+                nLastMessageSweep = GetTimeMillis();
+            }
         }
 
-        // Poll the connected nodes for messages
-        CNode *pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-        BOOST_FOREACH (CNode *pnode, vNodesCopy)
+        if (pnode)
         {
-            // Receive messages
+            // If another worker holds cs_vRecv it is handling this peer, and
+            // queues it again itself if messages are left when it is done.
+            // Nothing is received for the peer while cs_vRecv is held.
+            bool fRequeue = false;
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
                 if (lockRecv)
-                    ProcessMessages(pnode);
+                    fRequeue = HandleNodeMessages(pnode, false);
             }
-            if (fShutdown)
-                return;
-
-            // Send messages
+            if (fRequeue)
+                QueueMessageWork(pnode);
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
+                LOCK(cs_vNodes);
+                pnode->Release();
             }
-            if (fShutdown)
-                return;
         }
-
+        else if (fSweep)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode *pnode, vNodesCopy)
-                pnode->Release();
+            MessageHandlerSweep();
+            if (fRequestShutdown)
+                StartShutdown();
         }
+    }
 
-        // Wait and allow messages to bunch up.
-        // Reduce vnThreadsRunning so StopNode has permission to exit while
-        // we're sleeping, but we must always check fShutdown after doing this.
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        MilliSleep(100);
-        if (fRequestShutdown)
-            StartShutdown();
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
-        if (fShutdown)
-            return;
+    // Drop the references held by anything still queued
+    boost::unique_lock<CWaitableCriticalSection> lock(csMessageWork);
+    while (!vMessageWork.empty())
+    {
+        CNode *pnode = vMessageWork.front();
+        vMessageWork.pop_front();
+        pnode->fMessageQueued = false;
+        LOCK(cs_vNodes);
+        pnode->Release();
     }
 }
 
@@ -2059,6 +2862,24 @@ void StartNode(void *parg)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+    {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1)
+            printf("Error: epoll_create1 failed, error %d\n", errno);
+        BOOST_FOREACH (SOCKET hListenSocket, vhListenSocket)
+        {
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN | EPOLLET;
+            event.data.ptr = NULL;
+            if (hEpoll != -1 && epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) == SOCKET_ERROR)
+                printf("Error: epoll_ctl on listen socket failed, error %d\n", errno);
+        }
+    }
+#endif
+
     Discover();
 
     //
@@ -2081,6 +2902,12 @@ void StartNode(void *parg)
     if (fUseUPnP)
         MapPort();
 
+    // Bandwidth limits
+    CNode::SetMaxOutboundTarget(max((int64_t)0, GetArg("-maxuploadtarget", 0)) * 1024 * 1024);
+    nSendRateLimit = max((int64_t)0, GetArg("-maxsendrate", 0)) * 1000;
+    nSendTokens = nSendRateLimit;
+    nSendTokensTime = GetTimeMicros();
+
     // Send and receive from sockets, accept connections
     if (!NewThread(ThreadSocketHandler, NULL))
         printf("Error: NewThread(ThreadSocketHandler) failed\n");
@@ -2094,8 +2921,10 @@ void StartNode(void *parg)
         printf("Error: NewThread(ThreadOpenConnections) failed\n");
 
     // Process messages
-    if (!NewThread(ThreadMessageHandler, NULL))
-        printf("Error: NewThread(ThreadMessageHandler) failed\n");
+    int nMessageHandlerThreads = max(1, (int)GetArg("-msghandthreads", 2));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        if (!NewThread(ThreadMessageHandler, NULL))
+            printf("Error: NewThread(ThreadMessageHandler) failed\n");
 
     // Dump network addresses
     if (!NewThread(ThreadDumpAddress, NULL))
@@ -2113,6 +2942,14 @@ bool StopNode()
     printf("StopNode()\n");
     fShutdown = true;
     nTransactionsUpdated++;
+    {
+        boost::unique_lock<CWaitableCriticalSection> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
+    {
+        boost::unique_lock<CWaitableCriticalSection> lock(csMessageWork);
+        condMessageWork.notify_all();
+    }
     int64_t nStart = GetTime();
     if (semOutbound)
         for (int i = 0; i < MAX_OUTBOUND_CONNECTIONS; i++)
@@ -2177,6 +3014,10 @@ class CNetCleanup
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     printf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+#endif
 
 #ifdef WIN32
         // Shutdown Windows Sockets
@@ -2205,8 +3046,9 @@ void RelayTransaction(const CTransaction &tx, const uint256 &hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // framed once so every peer that asks for it shares the same buffer
+        mapRelay.insert(std::make_pair(inv, MakeNetMessage(inv.GetCommand(), ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
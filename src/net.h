@@ -8,13 +8,14 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
 #include <arpa/inet.h>
 #endif
 
-#include "mruset.h"
+#include "bloom.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
@@ -27,9 +28,54 @@ typedef int NodeId;
 extern NodeId nLastNodeId;
 extern CCriticalSection cs_nLastNodeId;
 
+class CSerializedNetMsg;
+
+/** A complete outgoing message (header and payload), immutable once built.
+ * Send queues hold references, so one serialized block or transaction can be
+ * queued to every peer it goes to without copying it. */
+typedef boost::shared_ptr<const CSerializedNetMsg> CSerializedNetMsgRef;
+
+class CSerializedNetMsg : public CDataStream
+{
+  public:
+    CSerializedNetMsg(int nTypeIn, int nVersionIn) : CDataStream(nTypeIn, nVersionIn), fCompressDone(false) {}
+
+    /** The "lz4" form of this message, compressed on first use and then
+     * shared by every peer it is sent to; null if not worth compressing */
+    CSerializedNetMsgRef GetCompressed() const;
+
+  private:
+    mutable CCriticalSection cs_compressed;
+    mutable bool fCompressDone;
+    mutable CSerializedNetMsgRef msgCompressed;
+};
+
+CSerializedNetMsgRef MakeNetMessage(const char *pszCommand, const CDataStream &ssPayload);
+
+/** Peers with NODE_LZ4 get larger block, transaction and secure messages
+ * wrapped in an "lz4" message: the original command, the payload size and
+ * the LZ4 compressed payload. Returns a null reference if the message is
+ * not one to compress or doesn't get smaller. */
+CSerializedNetMsgRef CompressNetMessage(const CDataStream &msg);
+/** Unwrap the payload of an "lz4" message, replacing strCommand with the original command */
+bool DecompressNetMessage(const CDataStream &vMsg, std::string &strCommand, CDataStream &vPlain);
+
 inline unsigned int ReceiveBufferSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 inline unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
+/** Number of recent inventory items / addresses remembered as known by each peer */
+static const unsigned int INVENTORY_KNOWN_SIZE = 5000;
+static const unsigned int ADDR_KNOWN_SIZE = 5000;
+/** Maximum number of pending getdata requests queued for one peer */
+static const unsigned int MAX_ASKFOR_QUEUE = 50000;
+/** Length of one -maxuploadtarget accounting cycle, in seconds */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** Part of the upload target held back, per minute left in the cycle, for
+ * relaying new blocks once serving historical blocks has stopped */
+static const uint64_t UPLOAD_TARGET_RELAY_RESERVE = 100 * 1000;
+/** Distinct message types counted per peer; the rest are counted as "*other*" */
+static const unsigned int MAX_MSG_TYPE_STATS = 64;
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string &strLine);
 bool GetMyExternalIP(CNetAddr &ipRet);
@@ -45,6 +91,8 @@ bool BindListenPort(const CService &bindAddr, std::string &strError = REF(std::s
 void StartTor(void *parg);
 void StartNode(void *parg);
 bool StopNode();
+void QueueMessageWork(CNode *pnode);
+int64_t GetMaxSendRate(); // -maxsendrate in bytes per second, 0 if unlimited
 
 enum
 {
@@ -126,11 +174,23 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode *> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializedNetMsgRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64_t> mapAlreadyAskedFor;
 
+/** Bytes and number of messages of one message type */
+class CMsgTypeStats
+{
+  public:
+    uint64_t nBytes;
+    uint64_t nCount;
+
+    CMsgTypeStats() : nBytes(0), nCount(0) {}
+};
+
+typedef std::map<std::string, CMsgTypeStats> mapMsgTypeStats_t;
+
 class CNodeStats
 {
   public:
@@ -148,6 +208,8 @@ class CNodeStats
     int nMisbehavior;
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
+    mapMsgTypeStats_t mapSendMsgStats;
+    mapMsgTypeStats_t mapRecvMsgStats;
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
@@ -172,6 +234,7 @@ class SecMsgNode
         ignoreUntil = 0;
         nWakeCounter = 0;
         nPeerId = 0;
+        nVersion = 0;
         fEnabled = false;
     };
 
@@ -182,9 +245,49 @@ class SecMsgNode
     int64_t ignoreUntil;
     uint32_t nWakeCounter;
     uint32_t nPeerId;
+    uint32_t nVersion; // secure messaging protocol version, 0 until the peer sends it
     bool fEnabled;
 };
 
+/** A peer message being received: the 24-byte header is parsed as its bytes
+ * arrive, then the payload is read into a buffer that grows as it arrives. */
+class CNetMessage
+{
+  public:
+    bool in_data; // parsing header (false) or data (true)
+
+    CDataStream hdrbuf; // partially received header
+    CMessageHeader hdr; // complete header
+    unsigned int nHdrPos;
+
+    CDataStream vRecv; // received message data
+    unsigned int nDataPos;
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    {
+        hdrbuf.resize(24);
+        in_data = false;
+        nHdrPos = 0;
+        nDataPos = 0;
+    }
+
+    bool complete() const
+    {
+        if (!in_data)
+            return false;
+        return (hdr.nMessageSize == nDataPos);
+    }
+
+    void SetVersion(int nVersionIn)
+    {
+        hdrbuf.SetVersion(nVersionIn);
+        vRecv.SetVersion(nVersionIn);
+    }
+
+    int readHeader(const char *pch, unsigned int nBytes);
+    int readData(const char *pch, unsigned int nBytes);
+};
+
 /** Information about a peer */
 class CNode
 {
@@ -192,12 +295,23 @@ class CNode
     // socket
     uint64_t nServices;
     SOCKET hSocket;
-    CDataStream vSend;
-    CDataStream vRecv;
+    CDataStream vSend; // message being built between BeginMessage and EndMessage
+    std::deque<CSerializedNetMsgRef> vSendMsg;
+    size_t nSendOffset; // bytes of vSendMsg.front() already sent
+    uint64_t nSendSize; // total bytes queued in vSendMsg
+    // queued during SendMessages, waiting to be compressed (see QueueNetMessage)
+    std::deque<CSerializedNetMsgRef> vSendDeferred;
+    bool fDeferCompress;
+    std::deque<CNetMessage> vRecvMsg;
+    int nRecvVersion;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
+    // queued / received bytes per message type, innermost lock
+    CCriticalSection cs_msgStats;
+    mapMsgTypeStats_t mapSendMsgStats;
+    mapMsgTypeStats_t mapRecvMsgStats;
     int64_t nLastSend;
     int64_t nLastRecv;
     int64_t nLastSendEmpty;
@@ -217,6 +331,12 @@ class CNode
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    bool fCompress; // both sides have NODE_LZ4, set by the version message
+    // socket readiness latched by the socket handler (see ThreadSocketHandler2)
+    bool fRecvReady;
+    bool fSendReady;
+    // queued for a message handler worker, protected by csMessageWork in net.cpp
+    bool fMessageQueued;
     CSemaphoreGrant grantOutbound;
     int nRefCount;
     NodeId id;
@@ -241,24 +361,31 @@ class CNode
     int nStartingHeight;
 
     // flood relay
+    // addr messages may be handled without cs_main, so these have their own lock
     std::vector<CAddress> vAddrToSend;
-    std::set<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown; // last known sent sync-checkpoint
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
-    std::multimap<int64_t, CInv> mapAskFor;
+    // min-heap on request time, see AskFor
+    std::vector<std::pair<int64_t, CInv> > vAskFor;
 
     SecMsgNode smsgData;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn = false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn = false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), addrKnown(ADDR_KNOWN_SIZE, 0.001), filterInventoryKnown(INVENTORY_KNOWN_SIZE, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
+        nRecvVersion = MIN_PROTO_VERSION;
+        nSendOffset = 0;
+        nSendSize = 0;
+        fDeferCompress = false;
         nLastSend = 0;
         nLastRecv = 0;
         nSendBytes = 0;
@@ -279,6 +406,10 @@ class CNode
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fCompress = false;
+        fRecvReady = false;
+        fSendReady = false;
+        fMessageQueued = false;
         nRefCount = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
@@ -287,7 +418,6 @@ class CNode
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
 
         {
             LOCK(cs_nLastNodeId);
@@ -314,6 +444,13 @@ class CNode
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    static mapMsgTypeStats_t mapTotalSendMsgStats;
+    static mapMsgTypeStats_t mapTotalRecvMsgStats;
+
+    // -maxuploadtarget accounting, protected by cs_totalBytesSent
+    static uint64_t nMaxOutboundTarget;
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
     CNode(const CNode &);
     void operator=(const CNode &);
 
@@ -324,6 +461,26 @@ class CNode
         return nRefCount;
     }
 
+    // requires LOCK(cs_vRecv)
+    unsigned int GetTotalRecvSize()
+    {
+        unsigned int total = 0;
+        BOOST_FOREACH (const CNetMessage &msg, vRecvMsg)
+            total += msg.vRecv.size() + 24;
+        return total;
+    }
+
+    // requires LOCK(cs_vRecv)
+    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
+
+    // requires LOCK(cs_vRecv)
+    void SetRecvVersion(int nVersionIn)
+    {
+        nRecvVersion = nVersionIn;
+        BOOST_FOREACH (CNetMessage &msg, vRecvMsg)
+            msg.SetVersion(nVersionIn);
+    }
+
     CNode *AddRef()
     {
         nRefCount++;
@@ -337,7 +494,8 @@ class CNode
 
     void AddAddressKnown(const CAddress &addr)
     {
-        setAddrKnown.insert(addr);
+        LOCK(cs_vAddrToSend);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress &addr)
@@ -345,7 +503,8 @@ class CNode
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr))
+        LOCK(cs_vAddrToSend);
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey()))
             vAddrToSend.push_back(addr);
     }
 
@@ -353,7 +512,7 @@ class CNode
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -361,15 +520,17 @@ class CNode
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
 
     void AskFor(const CInv &inv)
     {
-        // We're using mapAskFor as a priority queue,
-        // the key is the earliest time the request can be sent
+        // vAskFor is a priority queue ordered by the earliest time the
+        // request can be sent
+        if (vAskFor.size() >= MAX_ASKFOR_QUEUE)
+            return;
         int64_t &nRequestTime = mapAlreadyAskedFor[inv];
         if (fDebugNet)
             printf("askfor %s   %" PRId64 " (%s)\n", inv.ToString().c_str(), nRequestTime, DateTimeStrFormat("%H:%M:%S", nRequestTime / 1000000).c_str());
@@ -383,7 +544,8 @@ class CNode
 
         // Each retry is 2 minutes after the last
         nRequestTime = std::max(nRequestTime + 2 * 60 * 1000000, nNow);
-        mapAskFor.insert(std::make_pair(nRequestTime, inv));
+        vAskFor.push_back(std::make_pair(nRequestTime, inv));
+        std::push_heap(vAskFor.begin(), vAskFor.end(), std::greater<std::pair<int64_t, CInv> >());
     }
 
     void BeginMessage(const char *pszCommand)
@@ -439,9 +601,54 @@ class CNode
             printf("(%d bytes)\n", nSize);
         }
 
+        // Hand the finished message to the send queue without copying it
+        boost::shared_ptr<CSerializedNetMsg> pmsg(new CSerializedNetMsg(vSend.nType, vSend.nVersion));
+        pmsg->swap(vSend);
+        vSend.SetVersion(pmsg->nVersion);
+
         nHeaderStart = -1;
         nMessageStart = -1;
         LEAVE_CRITICAL_SECTION(cs_vSend);
+
+        QueueNetMessage(pmsg);
+    }
+
+    // Queue an already framed message, e.g. one shared between several peers
+    void PushNetMessage(CSerializedNetMsgRef msg)
+    {
+        if (fDebug)
+            printf("sending: %.12s (%" PRIszu " bytes, shared)\n", &(*msg)[CMessageHeader::MESSAGE_START_SIZE], msg->size());
+        QueueNetMessage(msg);
+    }
+
+    // Compression happens before cs_vSend is taken, and only once for a
+    // message shared between peers. SendMessages runs with cs_vSend and
+    // cs_main held, so what it queues (and anything queued behind that, to
+    // keep the order) waits in vSendDeferred until FlushDeferredSend
+    // compresses it after the locks are released.
+    void QueueNetMessage(const CSerializedNetMsgRef &msg)
+    {
+        if (fCompress)
+        {
+            LOCK(cs_vSend);
+            if (fDeferCompress || !vSendDeferred.empty())
+            {
+                vSendDeferred.push_back(msg);
+                return;
+            }
+        }
+
+        CSerializedNetMsgRef msgSend = msg;
+        if (fCompress)
+        {
+            CSerializedNetMsgRef msgCompressed = msg->GetCompressed();
+            if (msgCompressed)
+                msgSend = msgCompressed;
+        }
+        LOCK(cs_vSend);
+        nSendSize += msgSend->size();
+        RecordSendMsg(*msg, msgSend->size());
+        vSendMsg.push_back(msgSend);
     }
 
     void EndMessageAbortIfEmpty()
@@ -696,6 +903,22 @@ class CNode
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+    static void GetTotalMsgStats(mapMsgTypeStats_t &mapSend, mapMsgTypeStats_t &mapRecv);
+
+    // Per message type accounting of a framed outgoing message / a received message header
+    void RecordSendMsg(const CDataStream &msg, uint64_t nBytes);
+    // Compress and queue what QueueNetMessage deferred; called without cs_vSend
+    void FlushDeferredSend();
+    void RecordRecvMsg(const CNetMessage &msg);
+
+    // Upload target (-maxuploadtarget), 0 means no target
+    static void SetMaxOutboundTarget(uint64_t nLimit);
+    static uint64_t GetMaxOutboundTarget();
+    // True if the target is used up. With fHistoricalBlockServing, also true
+    // once only the reserve for relaying new blocks is left.
+    static bool OutboundTargetReached(bool fHistoricalBlockServing);
+    static uint64_t GetOutboundTargetBytesLeft();
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
 };
 
 inline void RelayInventory(const CInv &inv)
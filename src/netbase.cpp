@@ -485,6 +485,24 @@ bool IsProxy(const CNetAddr &addr) {
     return false;
 }
 
+// Bound the blocking reads/writes of a SOCKS handshake; a proxy (Tor in
+// particular) can otherwise keep a connect to a dead destination open for
+// minutes. nTimeout 0 removes the bound again.
+static const int SOCKS_HANDSHAKE_TIMEOUT = 20 * 1000;
+
+void static SetSocketTimeout(SOCKET hSocket, int nTimeout)
+{
+#ifdef WIN32
+    DWORD tv = nTimeout;
+#else
+    struct timeval tv;
+    tv.tv_sec = nTimeout / 1000;
+    tv.tv_usec = (nTimeout % 1000) * 1000;
+#endif
+    setsockopt(hSocket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+    setsockopt(hSocket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof(tv));
+}
+
 bool ConnectSocket(const CService &addrDest, SOCKET& hSocketRet, int nTimeout)
 {
     proxyType proxy;
@@ -500,6 +518,7 @@ bool ConnectSocket(const CService &addrDest, SOCKET& hSocketRet, int nTimeout)
         return false;
 
     // do socks negotiation
+    SetSocketTimeout(hSocket, SOCKS_HANDSHAKE_TIMEOUT);
     switch (proxy.second) {
     case 4:
         if (!Socks4(addrDest, hSocket))
@@ -513,6 +532,7 @@ bool ConnectSocket(const CService &addrDest, SOCKET& hSocketRet, int nTimeout)
         closesocket(hSocket);
         return false;
     }
+    SetSocketTimeout(hSocket, 0);
 
     hSocketRet = hSocket;
     return true;
@@ -540,6 +560,7 @@ bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest
     if (!ConnectSocketDirectly(nameproxy.first, hSocket, nTimeout))
         return false;
 
+    SetSocketTimeout(hSocket, SOCKS_HANDSHAKE_TIMEOUT);
     switch(nameproxy.second) {
         default:
         case 4:
@@ -550,6 +571,7 @@ bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest
                 return false;
             break;
     }
+    SetSocketTimeout(hSocket, 0);
 
     hSocketRet = hSocket;
     return true;
@@ -56,7 +56,8 @@ class CMessageHeader
             CHECKSUM_SIZE=sizeof(int),
 
             MESSAGE_SIZE_OFFSET=MESSAGE_START_SIZE+COMMAND_SIZE,
-            CHECKSUM_OFFSET=MESSAGE_SIZE_OFFSET+MESSAGE_SIZE_SIZE
+            CHECKSUM_OFFSET=MESSAGE_SIZE_OFFSET+MESSAGE_SIZE_SIZE,
+            HEADER_SIZE=CHECKSUM_OFFSET+CHECKSUM_SIZE
         };
         char pchMessageStart[MESSAGE_START_SIZE];
         char pchCommand[COMMAND_SIZE];
@@ -68,6 +69,10 @@ class CMessageHeader
 enum
 {
     NODE_NETWORK = (1 << 0),
+    // relays new blocks as "cmpctblock" and answers "getblocktxn"
+    NODE_COMPACT_BLOCKS = (1 << 1),
+    // accepts LZ4 compressed "lz4" messages, see CompressNetMessage
+    NODE_LZ4 = (1 << 2),
 };
 
 /** A CService with information about it as peer */
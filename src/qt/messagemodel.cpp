@@ -24,6 +24,9 @@ Q_DECLARE_METATYPE(std::vector<unsigned char>);
 
 QList<QString> ambiguous; /**< Specifies Ambiguous addresses */
 
+// Messages read from the db at a time when the table is loaded
+static const uint32_t MESSAGE_LOAD_PAGE = 256;
+
 const QString MessageModel::Sent = "Sent";
 const QString MessageModel::Received = "Received";
 
@@ -54,81 +57,71 @@ public:
             return;
         };
 
-        {
-            LOCK(cs_smsgDB);
+        loadMessages("im", MessageTableEntry::Received);
+        loadMessages("sm", MessageTableEntry::Sent);
+    }
 
-            SecMsgDB dbSmsg;
+    // Read the inbox or outbox a page at a time through the time received
+    // index, holding cs_smsgDB only while reading a page
+    void loadMessages(const std::string& sPrefix, MessageTableEntry::Type type)
+    {
+        SecMsgQuery query;
+        query.sPrefix = sPrefix;
+        query.nCount = MESSAGE_LOAD_PAGE;
 
-            if (!dbSmsg.Open("cr+"))
-                //throw runtime_error("Could not open DB.");
-                return;
+        std::vector<std::vector<unsigned char> > vKeys;
+        std::vector<SecMsgStored> vStored;
+        MessageData msg;
+        QDateTime sent_datetime;
+        QDateTime received_datetime;
 
-            unsigned char chKey[18];
-            std::vector<unsigned char> vchKey;
-            vchKey.resize(18);
+        for (;;)
+        {
+            {
+                LOCK(cs_smsgDB);
 
-            SecMsgStored smsgStored;
-            MessageData msg;
-            QString label;
-            QDateTime sent_datetime;
-            QDateTime received_datetime;
+                SecMsgDB dbSmsg;
+                if (!dbSmsg.Open("cr+"))
+                    return;
 
-            std::string sPrefix("im");
-            leveldb::Iterator* it = dbSmsg.pdb->NewIterator(leveldb::ReadOptions());
-            while (dbSmsg.NextSmesg(it, sPrefix, chKey, smsgStored))
-            {
-                uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
-                if (SecureMsgDecrypt(false, smsgStored.sAddrTo, &smsgStored.vchMessage[0], &smsgStored.vchMessage[SMSG_HDR_LEN], nPayload, msg) == 0)
-                {
-                    label = parent->getWalletModel()->getAddressTableModel()->labelForAddress(QString::fromStdString(msg.sFromAddress));
-
-                    sent_datetime    .setTime_t(msg.timestamp);
-                    received_datetime.setTime_t(smsgStored.timeReceived);
-                    
-                    memcpy(&vchKey[0], chKey, 18);
-
-                    addMessageEntry(MessageTableEntry(vchKey,
-                                                      MessageTableEntry::Received,
-                                                      label,
-                                                      QString::fromStdString(smsgStored.sAddrTo),
-                                                      QString::fromStdString(msg.sFromAddress),
-                                                      sent_datetime,
-                                                      received_datetime,
-                                                      (char*)&msg.vchMessage[0]),
-                                    true);
-                }
-            };
+                uint32_t nTotal;
+                if (SecureMsgQueryStored(dbSmsg, query, vKeys, nTotal) != 0)
+                    return;
 
-            delete it;
+                vStored.resize(vKeys.size());
+                for (unsigned int i = 0; i < vKeys.size(); ++i)
+                    if (!dbSmsg.ReadSmesg(&vKeys[i][0], vStored[i]))
+                        vStored[i].vchMessage.clear();
+            }
 
-            sPrefix = "sm";
-            it = dbSmsg.pdb->NewIterator(leveldb::ReadOptions());
-            while (dbSmsg.NextSmesg(it, sPrefix, chKey, smsgStored))
+            for (unsigned int i = 0; i < vKeys.size(); ++i)
             {
-                uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
-                if (SecureMsgDecrypt(false, smsgStored.sAddrOutbox, &smsgStored.vchMessage[0], &smsgStored.vchMessage[SMSG_HDR_LEN], nPayload, msg) == 0)
-                {
-                    label = parent->getWalletModel()->getAddressTableModel()->labelForAddress(QString::fromStdString(smsgStored.sAddrTo));
-
-                    sent_datetime    .setTime_t(msg.timestamp);
-                    received_datetime.setTime_t(smsgStored.timeReceived);
-                    
-                    memcpy(&vchKey[0], chKey, 18);
-
-                    addMessageEntry(MessageTableEntry(vchKey,
-                                                      MessageTableEntry::Sent,
-                                                      label,
-                                                      QString::fromStdString(smsgStored.sAddrTo),
-                                                      QString::fromStdString(msg.sFromAddress),
-                                                      sent_datetime,
-                                                      received_datetime,
-                                                      (char*)&msg.vchMessage[0]),
-                                    true);
-                }
+                SecMsgStored& smsgStored = vStored[i];
+                if (smsgStored.vchMessage.empty()
+                    || SecureMsgDecryptStored(&vKeys[i][0], smsgStored, msg) != 0)
+                    continue;
+
+                QString label = parent->getWalletModel()->getAddressTableModel()->labelForAddress(
+                    QString::fromStdString(type == MessageTableEntry::Sent ? smsgStored.sAddrTo : msg.sFromAddress));
+
+                sent_datetime    .setTime_t(msg.timestamp);
+                received_datetime.setTime_t(smsgStored.timeReceived);
+
+                addMessageEntry(MessageTableEntry(vKeys[i],
+                                                  type,
+                                                  label,
+                                                  QString::fromStdString(smsgStored.sAddrTo),
+                                                  QString::fromStdString(msg.sFromAddress),
+                                                  sent_datetime,
+                                                  received_datetime,
+                                                  (char*)&msg.vchMessage[0]),
+                                true);
             };
 
-            delete it;
-        }
+            if (vKeys.size() < MESSAGE_LOAD_PAGE)
+                return;
+            query.nOffset += vKeys.size();
+        };
     }
 
     void newMessage(const SecMsgStored& inboxHdr)
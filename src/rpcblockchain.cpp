@@ -105,36 +105,41 @@ Value getnetworkhashps(const Array& params, bool fHelp)
     return GetPoWMHashPS();
 }
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail)
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail, CJSONWriter& writer)
 {
-    Object result;
-    result.push_back(Pair("hash", block.GetHash().GetHex()));
-    CMerkleTx txGen(block.vtx[0]);
-    txGen.SetMerkleBranch(&block);
-    result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    result.push_back(Pair("mint", ValueFromAmount(blockindex->nMint)));
-    result.push_back(Pair("time", (boost::int64_t)block.GetBlockTime()));
-    result.push_back(Pair("nonce", (boost::uint64_t)block.nNonce));
-	result.push_back(Pair("bits", HexBits(block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("blocktrust", leftTrim(blockindex->GetBlockTrust().GetHex(), '0')));
-    result.push_back(Pair("chaintrust", leftTrim(blockindex->bnChainTrust.GetHex(), '0')));
-    result.push_back(Pair("chainwork", leftTrim(blockindex->nChainWork.GetHex(), '0')));
-    if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
-
-    result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
-    result.push_back(Pair("proofhash", blockindex->IsProofOfStake()? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex()));
-    result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
-    result.push_back(Pair("modifier", strprintf("%016" PRIx64, blockindex->nStakeModifier)));
-    result.push_back(Pair("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum)));
-    Array txinfo;
+    writer.BeginObject();
+    {
+        // Chain state for the header fields, the transactions need no lock
+        LOCK(cs_main);
+        writer.Write("hash", block.GetHash().GetHex());
+        CMerkleTx txGen(block.vtx[0]);
+        txGen.SetMerkleBranch(&block);
+        writer.Write("confirmations", (int)txGen.GetDepthInMainChain());
+        writer.Write("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+        writer.Write("height", blockindex->nHeight);
+        writer.Write("version", block.nVersion);
+        writer.Write("merkleroot", block.hashMerkleRoot.GetHex());
+        writer.Write("mint", ValueFromAmount(blockindex->nMint));
+        writer.Write("time", (boost::int64_t)block.GetBlockTime());
+        writer.Write("nonce", (boost::uint64_t)block.nNonce);
+        writer.Write("bits", HexBits(block.nBits));
+        writer.Write("difficulty", GetDifficulty(blockindex));
+        writer.Write("blocktrust", leftTrim(blockindex->GetBlockTrust().GetHex(), '0'));
+        writer.Write("chaintrust", leftTrim(blockindex->bnChainTrust.GetHex(), '0'));
+        writer.Write("chainwork", leftTrim(blockindex->nChainWork.GetHex(), '0'));
+        if (blockindex->pprev)
+            writer.Write("previousblockhash", blockindex->pprev->GetBlockHash().GetHex());
+        if (blockindex->pnext)
+            writer.Write("nextblockhash", blockindex->pnext->GetBlockHash().GetHex());
+
+        writer.Write("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": ""));
+        writer.Write("proofhash", blockindex->IsProofOfStake()? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex());
+        writer.Write("entropybit", (int)blockindex->GetStakeEntropyBit());
+        writer.Write("modifier", strprintf("%016" PRIx64, blockindex->nStakeModifier));
+        writer.Write("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum));
+    }
+    writer.Key("tx");
+    writer.BeginArray();
     BOOST_FOREACH (const CTransaction& tx, block.vtx)
     {
         if (fPrintTransactionDetail)
@@ -144,18 +149,24 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPri
             entry.push_back(Pair("txid", tx.GetHash().GetHex()));
             TxToJSON(tx, 0, entry);
 
-            txinfo.push_back(entry);
+            writer.Write(entry);
         }
         else
-            txinfo.push_back(tx.GetHash().GetHex());
+            writer.Write(tx.GetHash().GetHex());
     }
-
-    result.push_back(Pair("tx", txinfo));
+    writer.EndArray();
 
     if (block.IsProofOfStake())
-        result.push_back(Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end())));
+        writer.Write("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end()));
 
-    return result;
+    writer.EndObject();
+}
+
+Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail)
+{
+    CJSONValueWriter writer;
+    blockToJSON(block, blockindex, fPrintTransactionDetail, writer);
+    return writer.GetValue().get_obj();
 }
 
 Value getbestblockhash(const Array& params, bool fHelp)
@@ -207,7 +218,7 @@ Value settxfee(const Array& params, bool fHelp)
     return true;
 }
 
-Value getrawmempool(const Array& params, bool fHelp)
+void getrawmempool(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() != 0)
         throw runtime_error(
@@ -217,11 +228,10 @@ Value getrawmempool(const Array& params, bool fHelp)
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
 
-    Array a;
+    writer.BeginArray();
     BOOST_FOREACH(const uint256& hash, vtxid)
-        a.push_back(hash.ToString());
-
-    return a;
+        writer.Write(hash.ToString());
+    writer.EndArray();
 }
 
 Value getblockhash(const Array& params, bool fHelp)
@@ -241,7 +251,7 @@ Value getblockhash(const Array& params, bool fHelp)
 }
 
 //New getblock RPC Command for Innovaium Compatibility
-Value getblock(const Array& params, bool fHelp)
+void getblock(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -289,8 +299,6 @@ Value getblock(const Array& params, bool fHelp)
             "\nExamples:\n"
         );
 
-    LOCK(cs_main);
-
     std::string strHash = params[0].get_str();
     	uint256 hash(strHash);
     //std::string strHash = params[0].get_str();
@@ -301,22 +309,27 @@ Value getblock(const Array& params, bool fHelp)
             verbosity = params[1].get_bool() ? 1 : 0;
     }
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
+    // Only the lookup and read need cs_main, the block is formatted without
+    // it so batches of getblock run in parallel
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+
+        if (mapBlockIndex.count(hash) == 0)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-	if(!block.ReadFromDisk(pblockindex, true)){
-        // Block not found on disk. This could be because we have the block
-        // header in our index but don't have the block (for example if a
-        // non-whitelisted node sends us an unrequested long chain of valid
-        // blocks, we add the headers to our index, but don't accept the
-        // block).
-		throw JSONRPCError(RPC_MISC_ERROR, "Block not found on disk");
-	}
+        pblockindex = mapBlockIndex[hash];
 
-	block.ReadFromDisk(pblockindex, true);
+        if (!block.ReadFromDisk(pblockindex, true)) {
+            // Block not found on disk. This could be because we have the block
+            // header in our index but don't have the block (for example if a
+            // non-whitelisted node sends us an unrequested long chain of valid
+            // blocks, we add the headers to our index, but don't accept the
+            // block).
+            throw JSONRPCError(RPC_MISC_ERROR, "Block not found on disk");
+        }
+    }
 
     if (verbosity <= 0)
     {
@@ -324,11 +337,12 @@ Value getblock(const Array& params, bool fHelp)
         ssBlock << block;
         std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
 		//strHex.insert(0, "testar ");
-        return strHex;
+        writer.Write(strHex);
+        return;
     }
 
     //return blockToJSON(block, pblockindex, verbosity >= 2);
-	return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+	blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, writer);
 }
 
 //Old getblock RPC Command, Not deprecated
@@ -347,7 +347,14 @@ Value getwork(const Array& params, bool fHelp)
 }
 
 
-Value getblocktemplate(const Array& params, bool fHelp)
+// Interval after which a longpoll with an unchanged tip returns anyway
+// because the mempool has moved on, and the re-check period after that.
+static const int64_t LONGPOLL_MEMPOOL_FIRST_CHECK = 60;
+static const int64_t LONGPOLL_MEMPOOL_RECHECK = 10;
+// Longest wait of a longpoll that could not get a worker to itself
+static const int64_t LONGPOLL_BUSY_WAIT = 5;
+
+void getblocktemplate(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() > 1)
         throw runtime_error(
@@ -367,9 +374,12 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : pass back as \"longpollid\" in [params] to wait for a new template\n"
+            "Each waiting longpoll holds an RPC thread, -rpcthreads must exceed the number of longpolling miners.\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval = Value::null;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -382,6 +392,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
@@ -393,118 +404,174 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "ARMR is downloading blocks...");
 
-    static CReserveKey reservekey(pwalletMain);
-
-    // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlock* pblock;
-    if (pindexPrev != pindexBest ||
-        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    if (lpval.type() == str_type)
     {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
-
-        // Create new block
-        if(pblock)
+        // BIP22 longpoll: hold the request (without cs_main) until the tip
+        // changes, or the mempool has changed and enough time has passed
+        // for a refreshed template to be worth the miner's while.
+        // The wait holds an RPC worker. When all but one are already held
+        // it is cut to LONGPOLL_BUSY_WAIT, so the miner does not poll again
+        // in a tight loop, and the current template is returned then.
+        std::string lpstr = lpval.get_str();
+        if (lpstr.size() < 64)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+        uint256 hashWatchedChain;
+        hashWatchedChain.SetHex(lpstr.substr(0, 64));
+        unsigned int nTransactionsUpdatedLastLP = (unsigned int)atoi64(lpstr.substr(64));
+
+        bool fLongWait = RPCBeginLongWait();
+        boost::system_time checktxtime = boost::get_system_time() +
+            boost::posix_time::seconds(fLongWait ? LONGPOLL_MEMPOOL_FIRST_CHECK : LONGPOLL_BUSY_WAIT);
         {
-            delete pblock;
-            pblock = NULL;
+            boost::unique_lock<CWaitableCriticalSection> lock(csBestBlock);
+            while (hashBestChain == hashWatchedChain && !fShutdown)
+            {
+                if (!cvBlockChange.timed_wait(lock, checktxtime))
+                {
+                    // Timeout: check transactions for update
+                    if (!fLongWait || nTransactionsUpdated != nTransactionsUpdatedLastLP)
+                        break;
+                    checktxtime += boost::posix_time::seconds(LONGPOLL_MEMPOOL_RECHECK);
+                }
+            }
         }
-        pblock = CreateNewBlock(pwalletMain);
-        if (!pblock)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        if (fLongWait)
+            RPCEndLongWait();
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
+        if (fShutdown)
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
     }
 
-    // Update nTime
-    pblock->UpdateTime(pindexPrev);
-    pblock->nNonce = 0;
-
-    Array transactions;
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    CTxDB txdb("r");
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
+    // Everything but curtime is shared between calls until the block is
+    // rebuilt, and written from the shared copy after the locks are released
+    static boost::shared_ptr<const Object> presultCached;
+    boost::shared_ptr<const Object> presult;
+    int64_t nCurTime;
     {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
+        LOCK2(cs_main, pwalletMain->cs_wallet);
 
-        if (i == 1 && tx.IsCoinBase() || tx.IsCoinStake())
-            continue;
+        static CReserveKey reservekey(pwalletMain);
 
-        Object entry;
+        // Update block
+        static unsigned int nTransactionsUpdatedLast;
+        static CBlockIndex* pindexPrev;
+        static int64_t nStart;
+        static CBlock* pblock;
+        if (pindexPrev != pindexBest ||
+            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+        {
+            // Clear pindexPrev so future calls make a new block, despite any failures from here on
+            pindexPrev = NULL;
 
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << tx;
-        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
+            // Store the pindexBest used before CreateNewBlock, to avoid races
+            nTransactionsUpdatedLast = nTransactionsUpdated;
+            CBlockIndex* pindexPrevNew = pindexBest;
+            nStart = GetTime();
 
-        entry.push_back(Pair("hash", txHash.GetHex()));
+            // Create new block
+            if(pblock)
+            {
+                delete pblock;
+                pblock = NULL;
+            }
+            pblock = CreateNewBlock(pwalletMain);
+            if (!pblock)
+                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
-        bool fInvalid = false;
+            // Need to update only after we know CreateNewBlock succeeded
+            pindexPrev = pindexPrevNew;
 
-		if (!tx.IsCoinBase())
-        if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
-        {
-            entry.push_back(Pair("fee", (int64_t)(tx.GetValueIn(mapInputs) - tx.GetValueOut())));
+            // The transaction list, fees and dependencies only change when the
+            // block is rebuilt, so serialize them once and reuse until then.
+            presultCached.reset();
+            Object resultCached;
 
-            Array deps;
-            BOOST_FOREACH (MapPrevTx::value_type& inp, mapInputs)
+            Array transactions;
+            map<uint256, int64_t> setTxIndex;
+            int i = 0;
+            CTxDB txdb("r");
+            BOOST_FOREACH (CTransaction& tx, pblock->vtx)
             {
-                if (setTxIndex.count(inp.first))
-                    deps.push_back(setTxIndex[inp.first]);
-            }
-            entry.push_back(Pair("depends", deps));
+                uint256 txHash = tx.GetHash();
+                setTxIndex[txHash] = i++;
 
-            int64_t nSigOps = tx.GetLegacySigOpCount();
-            nSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            entry.push_back(Pair("sigops", nSigOps));
-        }
+                if (i == 1 && tx.IsCoinBase() || tx.IsCoinStake())
+                    continue;
 
-        transactions.push_back(entry);
-    }
+                Object entry;
 
-    Object aux;
-    aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
+                CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+                ssTx << tx;
+                entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
 
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                entry.push_back(Pair("hash", txHash.GetHex()));
 
-    static Array aMutable;
-    if (aMutable.empty())
-    {
-        aMutable.push_back("time");
-        aMutable.push_back("transactions");
-        aMutable.push_back("prevblock");
+                MapPrevTx mapInputs;
+                map<uint256, CTxIndex> mapUnused;
+                bool fInvalid = false;
+
+                if (!tx.IsCoinBase())
+                if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+                {
+                    entry.push_back(Pair("fee", (int64_t)(tx.GetValueIn(mapInputs) - tx.GetValueOut())));
+
+                    Array deps;
+                    BOOST_FOREACH (MapPrevTx::value_type& inp, mapInputs)
+                    {
+                        if (setTxIndex.count(inp.first))
+                            deps.push_back(setTxIndex[inp.first]);
+                    }
+                    entry.push_back(Pair("depends", deps));
+
+                    int64_t nSigOps = tx.GetLegacySigOpCount();
+                    nSigOps += tx.GetP2SHSigOpCount(mapInputs);
+                    entry.push_back(Pair("sigops", nSigOps));
+                }
+
+                transactions.push_back(entry);
+            }
+
+            Object aux;
+            aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
+
+            uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+
+            Array aMutable;
+            aMutable.push_back("time");
+            aMutable.push_back("transactions");
+            aMutable.push_back("prevblock");
+
+            resultCached.push_back(Pair("version", pblock->nVersion));
+            resultCached.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
+            resultCached.push_back(Pair("transactions", transactions));
+            resultCached.push_back(Pair("coinbaseaux", aux));
+            resultCached.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
+            //resultCached.push_back(Pair("charityvalue", (int64_t)pblock->vtx[0].vout[0].nValue));
+            resultCached.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
+            resultCached.push_back(Pair("target", hashTarget.GetHex()));
+            resultCached.push_back(Pair("mintime", (int64_t)pindexPrev->GetPastTimeLimit()+1));
+            resultCached.push_back(Pair("mutable", aMutable));
+            resultCached.push_back(Pair("noncerange", "00000000ffffffff"));
+            resultCached.push_back(Pair("sigoplimit", (int64_t)MAX_BLOCK_SIGOPS));
+            resultCached.push_back(Pair("sizelimit", (int64_t)MAX_BLOCK_SIZE));
+            resultCached.push_back(Pair("bits", HexBits(pblock->nBits)));
+            resultCached.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+            presultCached.reset(new Object(resultCached));
+        }
+
+        // Update nTime
+        pblock->UpdateTime(pindexPrev);
+        pblock->nNonce = 0;
+
+        presult = presultCached;
+        nCurTime = pblock->nTime;
     }
 
-    Object result;
-    result.push_back(Pair("version", pblock->nVersion));
-    result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
-    result.push_back(Pair("transactions", transactions));
-    result.push_back(Pair("coinbaseaux", aux));
-    result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
-    //result.push_back(Pair("charityvalue", (int64_t)pblock->vtx[0].vout[0].nValue));
-    result.push_back(Pair("target", hashTarget.GetHex()));
-    result.push_back(Pair("mintime", (int64_t)pindexPrev->GetPastTimeLimit()+1));
-    result.push_back(Pair("mutable", aMutable));
-    result.push_back(Pair("noncerange", "00000000ffffffff"));
-    result.push_back(Pair("sigoplimit", (int64_t)MAX_BLOCK_SIGOPS));
-    result.push_back(Pair("sizelimit", (int64_t)MAX_BLOCK_SIZE));
-    result.push_back(Pair("curtime", (int64_t)pblock->nTime));
-    result.push_back(Pair("bits", HexBits(pblock->nBits)));
-    result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
-
-    return result;
+    writer.BeginObject();
+    BOOST_FOREACH(const Pair& pair, *presult)
+        writer.Write(pair.name_, pair.value_);
+    writer.Write("curtime", nCurTime);
+    writer.EndObject();
 }
 
 Value submitblock(const Array& params, bool fHelp)
@@ -533,3 +600,57 @@ Value submitblock(const Array& params, bool fHelp)
     return Value::null;
 }
 
+
+Value generate(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "generate <nblocks>\n"
+            "Mine <nblocks> proof-of-work blocks right away with the wallet's keys (testnet only).\n"
+            "Meant for private test networks, see -netmagic. Returns the block hashes.");
+
+    if (!fTestNet)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "generate is only available on testnet");
+    if (!pwalletMain)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (disabled)");
+
+    int nGenerate = params[0].get_int();
+    if (nGenerate < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter");
+
+    CReserveKey reservekey(pwalletMain);
+    unsigned int nExtraNonce = 0;
+    Array blockHashes;
+    while ((int)blockHashes.size() < nGenerate && !fShutdown)
+    {
+        CBlockIndex* pindexPrev = pindexBest;
+        auto_ptr<CBlock> pblock(CreateNewBlock(pwalletMain));
+        if (!pblock.get())
+            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+
+        // Blocks mined back to back need increasing timestamps; don't get
+        // further ahead of the clock than other nodes accept
+        int64_t nMinTime = pindexPrev->GetPastTimeLimit() + 1;
+        while (nMinTime > FutureDrift(GetAdjustedTime()) && !fShutdown)
+            MilliSleep(100);
+        pblock->nTime = max(pblock->GetBlockTime(), nMinTime);
+        IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
+
+        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        while (pblock->GetHash() > hashTarget)
+        {
+            if (++pblock->nNonce == 0)
+                IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
+        }
+
+        // A block from another node may have come in meanwhile; just retry
+        if (!CheckWork(pblock.get(), *pwalletMain, reservekey))
+        {
+            if (pindexBest != pindexPrev)
+                continue;
+            throw JSONRPCError(RPC_MISC_ERROR, "Generated block was not accepted");
+        }
+        blockHashes.push_back(pblock->GetHash().GetHex());
+    }
+    return blockHashes;
+}
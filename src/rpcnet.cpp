@@ -37,6 +37,19 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static Object MsgTypeStatsToJSON(const mapMsgTypeStats_t& mapStats)
+{
+    Object obj;
+    BOOST_FOREACH(const PAIRTYPE(std::string, CMsgTypeStats)& item, mapStats)
+    {
+        Object entry;
+        entry.push_back(Pair("bytes", (boost::int64_t)item.second.nBytes));
+        entry.push_back(Pair("count", (boost::int64_t)item.second.nCount));
+        obj.push_back(Pair(item.first, entry));
+    }
+    return obj;
+}
+
 Value getpeerinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -64,6 +77,8 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("inbound", stats.fInbound));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        obj.push_back(Pair("sent_per_msg", MsgTypeStatsToJSON(stats.mapSendMsgStats)));
+        obj.push_back(Pair("recv_per_msg", MsgTypeStatsToJSON(stats.mapRecvMsgStats)));
 
         ret.push_back(obj);
     }
@@ -71,6 +86,36 @@ Value getpeerinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getnettotals(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnettotals\n"
+            "Returns information about network traffic, including bytes in, bytes out,\n"
+            "the upload target and send rate limit, traffic per message type, and current time.");
+
+    Object obj;
+    obj.push_back(Pair("totalbytesrecv", (boost::int64_t)CNode::GetTotalBytesRecv()));
+    obj.push_back(Pair("totalbytessent", (boost::int64_t)CNode::GetTotalBytesSent()));
+    obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    Object outboundLimit;
+    outboundLimit.push_back(Pair("timeframe", (boost::int64_t)MAX_UPLOAD_TIMEFRAME));
+    outboundLimit.push_back(Pair("target", (boost::int64_t)CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", (boost::int64_t)CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", (boost::int64_t)CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
+    obj.push_back(Pair("maxsendrate", GetMaxSendRate()));
+
+    mapMsgTypeStats_t mapSend, mapRecv;
+    CNode::GetTotalMsgStats(mapSend, mapRecv);
+    obj.push_back(Pair("sent_per_msg", MsgTypeStatsToJSON(mapSend)));
+    obj.push_back(Pair("recv_per_msg", MsgTypeStatsToJSON(mapRecv)));
+    return obj;
+}
+
 Value addnode(const Array& params, bool fHelp)
 {
     string strCommand;
@@ -87,6 +87,7 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
 
     if (hashBlock != 0)
     {
+        LOCK(cs_main);
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
         map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
@@ -123,8 +124,11 @@ Value getrawtransaction(const Array& params, bool fHelp)
 
     CTransaction tx;
     uint256 hashBlock = 0;
-    if (!GetTransaction(hash, tx, hashBlock))
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available about transaction");
+    {
+        LOCK(cs_main);
+        if (!GetTransaction(hash, tx, hashBlock))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available about transaction");
+    }
 
     CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
     ssTx << tx;
@@ -139,7 +143,23 @@ Value getrawtransaction(const Array& params, bool fHelp)
     return result;
 }
 
-Value listunspent(const Array& params, bool fHelp)
+// What listunspent reports for one output, copied out of the wallet
+struct CUnspentEntry
+{
+    CUnspentEntry() : nOut(0), nValue(0), nDepth(0), fHaveAddress(false), fHaveAccount(false) {}
+
+    uint256 txid;
+    int nOut;
+    CScript scriptPubKey;
+    int64_t nValue;
+    int nDepth;
+    bool fHaveAddress;
+    CTxDestination address;
+    bool fHaveAccount;
+    string strAccount;
+};
+
+void listunspent(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() > 3)
         throw runtime_error(
@@ -175,43 +195,59 @@ Value listunspent(const Array& params, bool fHelp)
         }
     }
 
-    Array results;
-    vector<COutput> vecOutputs;
-    pwalletMain->AvailableCoins(vecOutputs, false);
-    BOOST_FOREACH(const COutput& out, vecOutputs)
+    // Gather the outputs under the locks, write them to the client after
+    vector<CUnspentEntry> vEntries;
     {
-        if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
-            continue;
+        LOCK2(cs_main, pwalletMain->cs_wallet);
 
-        if(setAddress.size())
+        vector<COutput> vecOutputs;
+        pwalletMain->AvailableCoins(vecOutputs, false);
+        BOOST_FOREACH(const COutput& out, vecOutputs)
         {
-            CTxDestination address;
-            if(!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
+            if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
                 continue;
 
-            if (!setAddress.count(address))
-                continue;
+            CUnspentEntry entry;
+            entry.fHaveAddress = ExtractDestination(out.tx->vout[out.i].scriptPubKey, entry.address);
+            if (setAddress.size())
+            {
+                if (!entry.fHaveAddress || !setAddress.count(entry.address))
+                    continue;
+            }
+
+            entry.txid = out.tx->GetHash();
+            entry.nOut = out.i;
+            entry.scriptPubKey = out.tx->vout[out.i].scriptPubKey;
+            entry.nValue = out.tx->vout[out.i].nValue;
+            entry.nDepth = out.nDepth;
+            if (entry.fHaveAddress && pwalletMain->mapAddressBook.count(entry.address))
+            {
+                entry.fHaveAccount = true;
+                entry.strAccount = pwalletMain->mapAddressBook[entry.address];
+            }
+            vEntries.push_back(entry);
         }
+    }
 
-        int64_t nValue = out.tx->vout[out.i].nValue;
-        const CScript& pk = out.tx->vout[out.i].scriptPubKey;
+    writer.BeginArray();
+    BOOST_FOREACH(const CUnspentEntry& out, vEntries)
+    {
+        const CScript& pk = out.scriptPubKey;
         Object entry;
-        entry.push_back(Pair("txid", out.tx->GetHash().GetHex()));
-        entry.push_back(Pair("vout", out.i));
-        CTxDestination address;
-        if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
+        entry.push_back(Pair("txid", out.txid.GetHex()));
+        entry.push_back(Pair("vout", out.nOut));
+        if (out.fHaveAddress)
         {
-            entry.push_back(Pair("address", CBitcoinAddress(address).ToString()));
-            if (pwalletMain->mapAddressBook.count(address))
-                entry.push_back(Pair("account", pwalletMain->mapAddressBook[address]));
+            entry.push_back(Pair("address", CBitcoinAddress(out.address).ToString()));
+            if (out.fHaveAccount)
+                entry.push_back(Pair("account", out.strAccount));
         }
         entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
-        entry.push_back(Pair("amount",ValueFromAmount(nValue)));
+        entry.push_back(Pair("amount",ValueFromAmount(out.nValue)));
         entry.push_back(Pair("confirmations",out.nDepth));
-        results.push_back(entry);
+        writer.Write(entry);
     }
-
-    return results;
+    writer.EndArray();
 }
 
 Value createrawtransaction(const Array& params, bool fHelp)
@@ -346,22 +346,34 @@ Value smsglocalkeys(const Array& params, bool fHelp)
 
 Value smsgscanchain(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "smsgscanchain \n"
-            "Look for public keys in the block chain.");
+            "smsgscanchain [rescan=false]\n"
+            "Show progress of the public key index, which follows the block chain in the background.\n"
+            "rescan true scans the whole chain again.");
     
     if (!fSecMsgEnabled)
         throw runtime_error("Secure messaging is disabled.");
     
+    if (params.size() > 0 && params[0].get_bool())
+        SecureMsgRescanPubkeys();
+    
+    int nHeight;
+    uint32_t nFound;
+    bool fRescanPending;
+    SecureMsgPubkeyScanStatus(nHeight, nFound, fRescanPending);
+    
     Object result;
-    if (!SecureMsgScanBlockChain())
-    {
-        result.push_back(Pair("result", "Scan Chain Failed."));
-    } else
-    {
+    if (fRescanPending)
+        result.push_back(Pair("result", "Scan Chain Started."));
+    else
+    if (nHeight < nBestHeight)
+        result.push_back(Pair("result", "Scan Chain In Progress."));
+    else
         result.push_back(Pair("result", "Scan Chain Completed."));
-    }
+    result.push_back(Pair("height", nHeight));
+    result.push_back(Pair("chain height", nBestHeight));
+    result.push_back(Pair("new keys", (int)nFound));
     return result;
 }
 
@@ -562,12 +574,128 @@ Value smsgsendanon(const Array& params, bool fHelp)
     return result;
 }
 
-Value smsginbox(const Array& params, bool fHelp)
+// -- [offset] [count] [since] [address] of smsginbox and smsgoutbox
+static void SmsgReadQueryParams(const Array& params, SecMsgQuery& query)
 {
-    if (fHelp || params.size() > 1) // defaults to read
+    if (params.size() > 1)
+    {
+        int nOffset = params[1].get_int();
+        if (nOffset < 0)
+            throw runtime_error("offset must not be negative.");
+        query.nOffset = nOffset;
+    };
+    if (params.size() > 2)
+    {
+        int nCount = params[2].get_int();
+        if (nCount < 0)
+            throw runtime_error("count must not be negative.");
+        query.nCount = nCount;
+    };
+    if (params.size() > 3)
+    {
+        query.nSince = params[3].get_int64();
+        if (query.nSince < 0)
+            throw runtime_error("since must not be negative.");
+    };
+    if (params.size() > 4)
+        query.sAddress = params[4].get_str();
+};
+
+static void SmsgThrowQueryError(int rv)
+{
+    switch (rv)
+    {
+        case 1:
+            throw runtime_error("Could not read the message index.");
+        case 2:
+            throw runtime_error("Invalid address.");
+        default:
+            throw runtime_error(strprintf("Message query failed, error %d.", rv));
+    };
+};
+
+// -- the streamers below take cs_smsgDB only while touching the db, never
+//    while writing to the client
+
+static uint32_t SmsgQueryKeys(const SecMsgQuery& query, std::vector<std::vector<unsigned char> >& vKeys)
+{
+    LOCK(cs_smsgDB);
+    
+    SecMsgDB db;
+    if (!db.Open("cr+"))
+        throw runtime_error("Could not open DB.");
+    
+    uint32_t nTotal;
+    int rv = SecureMsgQueryStored(db, query, vKeys, nTotal);
+    if (rv != 0)
+        SmsgThrowQueryError(rv);
+    return nTotal;
+};
+
+static bool SmsgReadStored(std::vector<unsigned char>& vchKey, SecMsgStored& smsgStored)
+{
+    LOCK(cs_smsgDB);
+    
+    SecMsgDB db;
+    if (!db.Open("cr+"))
+        throw runtime_error("Could not open DB.");
+    return db.ReadSmesg(&vchKey[0], smsgStored);
+};
+
+static uint32_t SmsgClearStored(std::string sPrefix)
+{
+    LOCK(cs_smsgDB);
+    
+    SecMsgDB db;
+    if (!db.Open("cr+"))
+        throw runtime_error("Could not open DB.");
+    
+    uint32_t nMessages = 0;
+    unsigned char chKey[18];
+    db.TxnBegin();
+    leveldb::Iterator* it = db.pdb->NewIterator(leveldb::ReadOptions());
+    while (db.NextSmesgKey(it, sPrefix, chKey))
+    {
+        db.EraseSmesg(chKey);
+        nMessages++;
+    };
+    delete it;
+    db.TxnCommit();
+    return nMessages;
+};
+
+static void SmsgMarkRead(std::vector<std::vector<unsigned char> >& vKeys)
+{
+    if (vKeys.empty())
+        return;
+    
+    LOCK(cs_smsgDB);
+    
+    SecMsgDB db;
+    if (!db.Open("cr+"))
+        throw runtime_error("Could not open DB.");
+    
+    SecMsgStored smsgStored;
+    db.TxnBegin();
+    for (std::vector<std::vector<unsigned char> >::iterator it = vKeys.begin(); it != vKeys.end(); ++it)
+    {
+        // -- read again, the message may have changed since it was shown
+        if (!db.ReadSmesg(&(*it)[0], smsgStored))
+            continue;
+        smsgStored.status &= ~SMSG_MASK_UNREAD;
+        db.WriteSmesg(&(*it)[0], smsgStored);
+    };
+    db.TxnCommit();
+};
+
+void smsginbox(const Array& params, bool fHelp, CJSONWriter& writer)
+{
+    if (fHelp || params.size() > 5) // defaults to read
         throw runtime_error(
-            "smsginbox [all|unread|clear]\n" 
-            "Decrypt and display all received messages.\n"
+            "smsginbox [all|unread|clear] [offset=0] [count=0] [since=0] [address]\n" 
+            "Decrypt and display received messages, in order received.\n"
+            "offset and count page through the matches, count 0 shows all.\n"
+            "since is the earliest time received, address limits to messages to one owned address.\n"
             "Warning: clear will delete all messages.");
     
     if (!fSecMsgEnabled)
@@ -582,105 +710,80 @@ Value smsginbox(const Array& params, bool fHelp)
         mode = params[0].get_str();
     }
     
+    SecMsgQuery query;
+    query.sPrefix = "im";
+    query.fUnreadOnly = mode == "unread";
+    SmsgReadQueryParams(params, query);
     
-    Object result;
+    writer.BeginObject();
     
-    std::vector<unsigned char> vchKey;
-    vchKey.resize(16);
-    memset(&vchKey[0], 0, 16);
+    uint32_t nMessages = 0;
+    char cbuf[256];
     
+    if (mode == "clear")
     {
-        LOCK(cs_smsgDB);
+        nMessages = SmsgClearStored("im");
         
-        SecMsgDB dbInbox;
-        
-        if (!dbInbox.Open("cr+"))
-            throw runtime_error("Could not open DB.");
-        
-        uint32_t nMessages = 0;
-        char cbuf[256];
+        snprintf(cbuf, sizeof(cbuf), "Deleted %u messages.", nMessages);
+        writer.Write("result", std::string(cbuf));
+    } else
+    if (mode == "all"
+        || mode == "unread")
+    {
+        std::vector<std::vector<unsigned char> > vKeys;
+        uint32_t nTotal = SmsgQueryKeys(query, vKeys);
         
-        std::string sPrefix("im");
-        unsigned char chKey[18];
+        std::vector<std::vector<unsigned char> > vShown;
+        SecMsgStored smsgStored;
+        MessageData msg;
         
-        if (mode == "clear")
-        {
-            dbInbox.TxnBegin();
-            
-            leveldb::Iterator* it = dbInbox.pdb->NewIterator(leveldb::ReadOptions());
-            while (dbInbox.NextSmesgKey(it, sPrefix, chKey))
-            {
-                dbInbox.EraseSmesg(chKey);
-                nMessages++;
-            };
-            delete it;
-            dbInbox.TxnCommit();
-            
-            snprintf(cbuf, sizeof(cbuf), "Deleted %u messages.", nMessages);
-            result.push_back(Pair("result", std::string(cbuf)));
-        } else
-        if (mode == "all"
-            || mode == "unread")
+        for (std::vector<std::vector<unsigned char> >::iterator it = vKeys.begin(); it != vKeys.end(); ++it)
         {
-            int fCheckReadStatus = mode == "unread" ? 1 : 0;
-            
-            SecMsgStored smsgStored;
-            MessageData msg;
-            
-            dbInbox.TxnBegin();
+            if (!SmsgReadStored(*it, smsgStored))
+                continue;
             
-            leveldb::Iterator* it = dbInbox.pdb->NewIterator(leveldb::ReadOptions());
-            while (dbInbox.NextSmesg(it, sPrefix, chKey, smsgStored))
+            if (SecureMsgDecryptStored(&(*it)[0], smsgStored, msg) == 0)
             {
-                if (fCheckReadStatus
-                    && !(smsgStored.status & SMSG_MASK_UNREAD))
-                    continue;
-                
-                uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
-                if (SecureMsgDecrypt(false, smsgStored.sAddrTo, &smsgStored.vchMessage[0], &smsgStored.vchMessage[SMSG_HDR_LEN], nPayload, msg) == 0)
-                {
-                    Object objM;
-                    objM.push_back(Pair("received", getTimeString(smsgStored.timeReceived, cbuf, sizeof(cbuf))));
-                    objM.push_back(Pair("sent", getTimeString(msg.timestamp, cbuf, sizeof(cbuf))));
-                    objM.push_back(Pair("from", msg.sFromAddress));
-                    objM.push_back(Pair("to", smsgStored.sAddrTo));
-                    objM.push_back(Pair("text", std::string((char*)&msg.vchMessage[0]))); // ugh
-                    
-                    result.push_back(Pair("message", objM));
-                } else
-                {
-                    result.push_back(Pair("message", "Could not decrypt."));
-                };
+                Object objM;
+                objM.push_back(Pair("received", getTimeString(smsgStored.timeReceived, cbuf, sizeof(cbuf))));
+                objM.push_back(Pair("sent", getTimeString(msg.timestamp, cbuf, sizeof(cbuf))));
+                objM.push_back(Pair("from", msg.sFromAddress));
+                objM.push_back(Pair("to", smsgStored.sAddrTo));
+                objM.push_back(Pair("text", std::string((char*)&msg.vchMessage[0]))); // ugh
                 
-                if (fCheckReadStatus)
-                {
-                    smsgStored.status &= ~SMSG_MASK_UNREAD;
-                    dbInbox.WriteSmesg(chKey, smsgStored);
-                };
-                nMessages++;
+                writer.Write("message", objM);
+            } else
+            {
+                writer.Write("message", "Could not decrypt.");
             };
-            delete it;
-            dbInbox.TxnCommit();
-            
-            snprintf(cbuf, sizeof(cbuf), "%u messages shown.", nMessages);
-            result.push_back(Pair("result", std::string(cbuf)));
             
-        } else
-        {
-            result.push_back(Pair("result", "Unknown Mode."));
-            result.push_back(Pair("expected", "[all|unread|clear]."));
+            if (query.fUnreadOnly)
+                vShown.push_back(*it);
+            nMessages++;
         };
-    }
+        SmsgMarkRead(vShown);
+        
+        snprintf(cbuf, sizeof(cbuf), "%u messages shown.", nMessages);
+        writer.Write("result", std::string(cbuf));
+        writer.Write("total", (int)nTotal);
+        
+    } else
+    {
+        writer.Write("result", "Unknown Mode.");
+        writer.Write("expected", "[all|unread|clear].");
+    };
     
-    return result;
+    writer.EndObject();
 };
 
-Value smsgoutbox(const Array& params, bool fHelp)
+void smsgoutbox(const Array& params, bool fHelp, CJSONWriter& writer)
 {
-    if (fHelp || params.size() > 1) // defaults to read
+    if (fHelp || params.size() > 5) // defaults to read
         throw runtime_error(
-            "smsgoutbox [all|clear]\n" 
-            "Decrypt and display all sent messages.\n"
+            "smsgoutbox [all|clear] [offset=0] [count=0] [since=0] [address]\n" 
+            "Decrypt and display sent messages, in order sent.\n"
+            "offset and count page through the matches, count 0 shows all.\n"
+            "since is the earliest time sent, address limits to messages to one recipient.\n"
             "Warning: clear will delete all sent messages.");
     
     if (!fSecMsgEnabled)
@@ -695,77 +798,60 @@ Value smsgoutbox(const Array& params, bool fHelp)
         mode = params[0].get_str();
     }
     
+    SecMsgQuery query;
+    query.sPrefix = "sm";
+    SmsgReadQueryParams(params, query);
     
-    Object result;
+    writer.BeginObject();
     
-    std::string sPrefix("sm");
-    unsigned char chKey[18];
-    memset(&chKey[0], 0, 18);
+    uint32_t nMessages = 0;
+    char cbuf[256];
     
+    if (mode == "clear")
     {
-        LOCK(cs_smsgDB);
-        
-        SecMsgDB dbOutbox;
+        nMessages = SmsgClearStored("sm");
         
-        if (!dbOutbox.Open("cr+"))
-            throw runtime_error("Could not open DB.");
-        
-        uint32_t nMessages = 0;
-        char cbuf[256];
+        snprintf(cbuf, sizeof(cbuf), "Deleted %u messages.", nMessages);
+        writer.Write("result", std::string(cbuf));
+    } else
+    if (mode == "all")
+    {
+        std::vector<std::vector<unsigned char> > vKeys;
+        uint32_t nTotal = SmsgQueryKeys(query, vKeys);
         
-        if (mode == "clear")
+        SecMsgStored smsgStored;
+        MessageData msg;
+        for (std::vector<std::vector<unsigned char> >::iterator it = vKeys.begin(); it != vKeys.end(); ++it)
         {
-            dbOutbox.TxnBegin();
-            
-            leveldb::Iterator* it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
-            while (dbOutbox.NextSmesgKey(it, sPrefix, chKey))
-            {
-                dbOutbox.EraseSmesg(chKey);
-                nMessages++;
-            };
-            delete it;
-            dbOutbox.TxnCommit();
-            
+            if (!SmsgReadStored(*it, smsgStored))
+                continue;
             
-            snprintf(cbuf, sizeof(cbuf), "Deleted %u messages.", nMessages);
-            result.push_back(Pair("result", std::string(cbuf)));
-        } else
-        if (mode == "all")
-        {
-            SecMsgStored smsgStored;
-            MessageData msg;
-            leveldb::Iterator* it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
-            while (dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
+            if (SecureMsgDecryptStored(&(*it)[0], smsgStored, msg) == 0)
             {
-                uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
+                Object objM;
+                objM.push_back(Pair("sent", getTimeString(msg.timestamp, cbuf, sizeof(cbuf))));
+                objM.push_back(Pair("from", msg.sFromAddress));
+                objM.push_back(Pair("to", smsgStored.sAddrTo));
+                objM.push_back(Pair("text", std::string((char*)&msg.vchMessage[0]))); // ugh
                 
-                if (SecureMsgDecrypt(false, smsgStored.sAddrOutbox, &smsgStored.vchMessage[0], &smsgStored.vchMessage[SMSG_HDR_LEN], nPayload, msg) == 0)
-                {
-                    Object objM;
-                    objM.push_back(Pair("sent", getTimeString(msg.timestamp, cbuf, sizeof(cbuf))));
-                    objM.push_back(Pair("from", msg.sFromAddress));
-                    objM.push_back(Pair("to", smsgStored.sAddrTo));
-                    objM.push_back(Pair("text", std::string((char*)&msg.vchMessage[0]))); // ugh
-                    
-                    result.push_back(Pair("message", objM));
-                } else
-                {
-                    result.push_back(Pair("message", "Could not decrypt."));
-                };
-                nMessages++;
+                writer.Write("message", objM);
+            } else
+            {
+                writer.Write("message", "Could not decrypt.");
             };
-            delete it;
-            
-            snprintf(cbuf, sizeof(cbuf), "%u sent messages shown.", nMessages);
-            result.push_back(Pair("result", std::string(cbuf)));
-        } else
-        {
-            result.push_back(Pair("result", "Unknown Mode."));
-            result.push_back(Pair("expected", "[all|clear]."));
+            nMessages++;
         };
-    }
+        
+        snprintf(cbuf, sizeof(cbuf), "%u sent messages shown.", nMessages);
+        writer.Write("result", std::string(cbuf));
+        writer.Write("total", (int)nTotal);
+    } else
+    {
+        writer.Write("result", "Unknown Mode.");
+        writer.Write("expected", "[all|clear].");
+    };
     
-    return result;
+    writer.EndObject();
 };
 
 
@@ -808,7 +894,7 @@ Value smsgbuckets(const Array& params, bool fHelp)
                 snprintf(cbuf, sizeof(cbuf), "%" PRIszu, tokenSet.size());
                 std::string snContents(cbuf);
                 
-                std::string sHash = boost::lexical_cast<std::string>(it->second.hash);
+                std::string sHash = boost::lexical_cast<std::string>(it->second.nDigest);
                 
                 nBuckets++;
                 nMessages += tokenSet.size();
@@ -858,6 +944,30 @@ Value smsgbuckets(const Array& params, bool fHelp)
         objM.push_back(Pair("size", fsReadable(nBytes)));
         result.push_back(Pair("total", objM));
         
+        uint32_t nStoreMessages, nRejected;
+        uint64_t nStoreBytes;
+        SecureMsgStoreUsage(nStoreMessages, nStoreBytes, nRejected);
+        
+        Object objQ;
+        objQ.push_back(Pair("messages", strprintf("%u / %u", nStoreMessages, smsgQuota.nStoreMsgs)));
+        objQ.push_back(Pair("size", fsReadable(nStoreBytes) + " / " + fsReadable(smsgQuota.nStoreBytes)));
+        objQ.push_back(Pair("bucket messages", (int)smsgQuota.nBucketMsgs));
+        objQ.push_back(Pair("bucket size", fsReadable(smsgQuota.nBucketBytes)));
+        objQ.push_back(Pair("refused", (int)nRejected));
+        result.push_back(Pair("quota", objQ));
+        
+        uint32_t nUnlockMessages, nUnlockScanned, nUnlockFound;
+        int nUnlockPercent;
+        if (SecureMsgUnlockScanProgress(nUnlockMessages, nUnlockScanned, nUnlockFound, nUnlockPercent))
+        {
+            Object objU;
+            objU.push_back(Pair("progress", boost::lexical_cast<std::string>(nUnlockPercent) + "%"));
+            objU.push_back(Pair("read", (int)nUnlockMessages));
+            objU.push_back(Pair("scanned", (int)nUnlockScanned));
+            objU.push_back(Pair("received", (int)nUnlockFound));
+            result.push_back(Pair("unlock scan", objU));
+        };
+        
     } else
     if (mode == "dump")
     {
@@ -0,0 +1,141 @@
+// Copyright (c) 2017-2018 The ARMR Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "rpcwriter.h"
+
+#include "json/json_spirit_writer_template.h"
+
+using namespace std;
+using namespace json_spirit;
+
+void CJSONValueWriter::Add(const Value& value, const string& strKeyIn)
+{
+    if (vFrames.empty())
+        result = value;
+    else if (vFrames.back().value.type() == obj_type)
+        vFrames.back().value.get_obj().push_back(Pair(strKeyIn, value));
+    else
+        vFrames.back().value.get_array().push_back(value);
+}
+
+void CJSONValueWriter::BeginObject()
+{
+    Frame frame;
+    frame.value = Object();
+    frame.strKey = strKey;
+    vFrames.push_back(frame);
+}
+
+void CJSONValueWriter::BeginArray()
+{
+    Frame frame;
+    frame.value = Array();
+    frame.strKey = strKey;
+    vFrames.push_back(frame);
+}
+
+void CJSONValueWriter::EndObject()
+{
+    Frame frame = vFrames.back();
+    vFrames.pop_back();
+    Add(frame.value, frame.strKey);
+}
+
+void CJSONValueWriter::EndArray()
+{
+    EndObject();
+}
+
+void CJSONValueWriter::Key(const string& strKeyIn)
+{
+    strKey = strKeyIn;
+}
+
+void CJSONValueWriter::Write(const Value& value)
+{
+    Add(value, strKey);
+}
+
+CJSONStreamWriter::CJSONStreamWriter(boost::function<void (const string&)> fnFlushIn, size_t nChunkSizeIn) :
+    fnFlush(fnFlushIn), nChunkSize(nChunkSizeIn), fAfterKey(false), fFlushed(false)
+{
+    strBuffer.reserve(nChunkSize + 1024);
+}
+
+void CJSONStreamWriter::Separate()
+{
+    if (fAfterKey)
+    {
+        fAfterKey = false;
+        return;
+    }
+    if (vEmpty.empty())
+        return;
+    if (!vEmpty.back())
+        strBuffer += ',';
+    vEmpty.back() = false;
+}
+
+void CJSONStreamWriter::MaybeFlush()
+{
+    if (strBuffer.size() >= nChunkSize)
+        Flush();
+}
+
+void CJSONStreamWriter::Flush()
+{
+    if (strBuffer.empty())
+        return;
+    fnFlush(strBuffer);
+    strBuffer.clear();
+    fFlushed = true;
+}
+
+void CJSONStreamWriter::BeginObject()
+{
+    Separate();
+    strBuffer += '{';
+    vEmpty.push_back(true);
+}
+
+void CJSONStreamWriter::EndObject()
+{
+    strBuffer += '}';
+    vEmpty.pop_back();
+    MaybeFlush();
+}
+
+void CJSONStreamWriter::BeginArray()
+{
+    Separate();
+    strBuffer += '[';
+    vEmpty.push_back(true);
+}
+
+void CJSONStreamWriter::EndArray()
+{
+    strBuffer += ']';
+    vEmpty.pop_back();
+    MaybeFlush();
+}
+
+void CJSONStreamWriter::Key(const string& strKey)
+{
+    Separate();
+    strBuffer += write_string(Value(strKey), false);
+    strBuffer += ':';
+    fAfterKey = true;
+}
+
+void CJSONStreamWriter::Write(const Value& value)
+{
+    Separate();
+    strBuffer += write_string(value, false);
+    MaybeFlush();
+}
+
+void CJSONStreamWriter::Append(const string& str)
+{
+    strBuffer += str;
+    MaybeFlush();
+}
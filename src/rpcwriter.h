@@ -0,0 +1,105 @@
+// Copyright (c) 2017-2018 The ARMR Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_RPCWRITER_H
+#define BITCOIN_RPCWRITER_H
+
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+
+#include "json/json_spirit_value.h"
+
+// Large RPC results are written element by element into a CJSONWriter
+// instead of being returned as one json_spirit tree. Over HTTP the text is
+// sent in chunks as it is produced; batches and the Qt console get the same
+// output built into a json_spirit::Value.
+
+/** Receives one JSON value, built up by the calls in document order. */
+class CJSONWriter
+{
+public:
+    virtual ~CJSONWriter() {}
+
+    virtual void BeginObject() = 0;
+    virtual void EndObject() = 0;
+    virtual void BeginArray() = 0;
+    virtual void EndArray() = 0;
+
+    // Name of the next member, inside an object
+    virtual void Key(const std::string& strKey) = 0;
+    // A complete value: an array element, a member after Key(), or the whole result
+    virtual void Write(const json_spirit::Value& value) = 0;
+
+    void Write(const std::string& strKey, const json_spirit::Value& value)
+    {
+        Key(strKey);
+        Write(value);
+    }
+};
+
+/** Builds a json_spirit::Value. */
+class CJSONValueWriter : public CJSONWriter
+{
+public:
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& strKey);
+    void Write(const json_spirit::Value& value);
+    using CJSONWriter::Write;
+
+    const json_spirit::Value& GetValue() const { return result; }
+
+private:
+    struct Frame
+    {
+        json_spirit::Value value;
+        std::string strKey; // member name in the enclosing object
+    };
+
+    void Add(const json_spirit::Value& value, const std::string& strKeyIn);
+
+    std::vector<Frame> vFrames;
+    std::string strKey;
+    json_spirit::Value result;
+};
+
+/**
+ * Writes compact JSON text, the same as write_string(value, false), passing
+ * it to fnFlush in pieces of about nChunkSize bytes.
+ */
+class CJSONStreamWriter : public CJSONWriter
+{
+public:
+    CJSONStreamWriter(boost::function<void (const std::string&)> fnFlushIn, size_t nChunkSizeIn = 64 * 1024);
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& strKey);
+    void Write(const json_spirit::Value& value);
+    using CJSONWriter::Write;
+
+    void Append(const std::string& str); // raw text, e.g. the trailing newline
+    void Flush();
+
+    // Once text has been flushed the reply can no longer be replaced by an error
+    bool Flushed() const { return fFlushed; }
+
+private:
+    void Separate();
+    void MaybeFlush();
+
+    boost::function<void (const std::string&)> fnFlush;
+    size_t nChunkSize;
+    std::string strBuffer;
+    std::vector<bool> vEmpty; // per open object or array, nothing written in it yet
+    bool fAfterKey;
+    bool fFlushed;
+};
+
+#endif
@@ -807,6 +807,15 @@ public:
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
+    void swap(CDataStream& other)
+    {
+        vch.swap(other.vch);
+        std::swap(nReadPos, other.nReadPos);
+        std::swap(nType, other.nType);
+        std::swap(nVersion, other.nVersion);
+        std::swap(state, other.state);
+        std::swap(exceptmask, other.exceptmask);
+    }
     iterator insert(iterator it, const char& x=char()) { return vch.insert(it, x); }
     void insert(iterator it, size_type n, const char& x) { vch.insert(it, n, x); }
 
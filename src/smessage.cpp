@@ -10,7 +10,9 @@ Notes:
     parameters:
         -nosmsg             Disable secure messaging (fNoSmsg)
         -debugsmsg          Show extra debug messages (fDebug)
-        -smsgscanchain      Scan the block chain for public key addresses on startup
+        -smsgscanchain      Rescan the block chain for public key addresses on startup
+        -smsgmaxbucketmsgs, -smsgmaxbucketmb, -smsgmaxstoremsgs, -smsgmaxstoremb
+                            Budgets for the bucket store (smsgQuota)
     
     
     Wallet Locked
@@ -47,13 +49,18 @@ Notes:
 
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include "base58.h"
 #include "db.h"
 #include "init.h" // pwalletMain
 #include "txdb.h"
+#include "pbkdf2.h"
 
 #include "lz4/lz4.c"
+#include "smsgdict.h"
 
 #include "xxhash/xxhash.h"
 #include "xxhash/xxhash.c"
@@ -85,6 +92,7 @@ bool fSecMsgEnabled = false;
 std::map<int64_t, SecMsgBucket> smsgBuckets;
 std::vector<SecMsgAddress> smsgAddresses;
 SecMsgOptions smsgOptions;
+SecMsgQuota smsgQuota;
 
 uint32_t nPeerIdCounter = 1;
 
@@ -95,2239 +103,3782 @@ leveldb::DB *smsgDB = NULL;
 
 namespace fs = boost::filesystem;
 
-bool SecMsgCrypter::SetKey(const std::vector<unsigned char> &vchNewKey, unsigned char *chNewIV)
-{
+// -- decrypted receive keys, so scanning a message doesn't take every key out
+//    of the (possibly encrypted) wallet again, and the plaintext of stored
+//    inbox/outbox messages by db key. Both are cleared when the wallet locks.
+static std::map<CKeyID, CKey> mapSmsgKeyCache;
+static std::map<std::vector<unsigned char>, MessageData> mapSmsgPlaintextCache;
+static CCriticalSection cs_smsgKeyCache;
 
-    if (vchNewKey.size() < sizeof(chKey))
-        return false;
+static void SecureMsgClearKeyCache()
+{
+    LOCK(cs_smsgKeyCache);
+    mapSmsgKeyCache.clear();
+    mapSmsgPlaintextCache.clear();
+};
 
-    return SetKey(&vchNewKey[0], chNewIV);
+static void SecureMsgForgetPlaintext(const unsigned char *chKey)
+{
+    LOCK(cs_smsgKeyCache);
+    mapSmsgPlaintextCache.erase(std::vector<unsigned char>(chKey, chKey + 18));
 };
 
-bool SecMsgCrypter::SetKey(const unsigned char *chNewKey, unsigned char *chNewIV)
+static void SecureMsgWalletStatusChanged(CCryptoKeyStore *wallet)
 {
-    // -- for EVP_aes_256_cbc() key must be 256 bit, iv must be 128 bit.
-    memcpy(&chKey[0], chNewKey, sizeof(chKey));
-    memcpy(chIV, chNewIV, sizeof(chIV));
+    if (wallet->IsLocked())
+        SecureMsgClearKeyCache();
+};
 
-    fKeySet = true;
-    return true;
+static void SecureMsgWatchWalletLock()
+{
+    static bool fWatching = false;
+    if (fWatching || !pwalletMain)
+        return;
+    pwalletMain->NotifyStatusChanged.connect(&SecureMsgWalletStatusChanged);
+    fWatching = true;
 };
 
-bool SecMsgCrypter::Encrypt(unsigned char *chPlaintext, uint32_t nPlain, std::vector<unsigned char> &vchCiphertext)
+static bool SecureMsgGetReceiveKey(const CKeyID &ckid, CKey &keyOut)
 {
-    if (!fKeySet)
+    LOCK(cs_smsgKeyCache);
+    std::map<CKeyID, CKey>::iterator mi = mapSmsgKeyCache.find(ckid);
+    if (mi != mapSmsgKeyCache.end())
+    {
+        keyOut = mi->second;
+        return true;
+    };
+
+    if (pwalletMain->IsLocked() || !pwalletMain->GetKey(ckid, keyOut))
         return false;
+    mapSmsgKeyCache.insert(std::make_pair(ckid, keyOut));
+    return true;
+};
 
-    // -- max ciphertext len for a n bytes of plaintext is n + AES_BLOCK_SIZE - 1 bytes
-    int nLen = nPlain;
+// -- secondary indexes over the inbox ("im") and outbox ("sm") records, keys only:
+//      it/ot + time + chKey            all messages by time received
+//      iu + time + chKey               unread inbox messages
+//      ia/oa + keyid + time + chKey    by owned address (inbox) or recipient (outbox)
+//    time is stored big endian so each index iterates in order received.
 
-    int nCLen = nLen + AES_BLOCK_SIZE, nFLen = 0;
-    vchCiphertext = std::vector<unsigned char>(nCLen);
+static void SecureMsgIndexKey(std::string &sKey, const char *pPrefix, const CKeyID *pKeyId, int64_t nTime, const unsigned char *chKey)
+{
+    sKey.assign(pPrefix, 2);
+    if (pKeyId)
+        sKey.append((const char*)pKeyId->begin(), 20);
 
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    unsigned char chTime[8];
+    for (int i = 0; i < 8; ++i)
+        chTime[i] = (unsigned char)((uint64_t)nTime >> (56 - 8 * i));
+    sKey.append((const char*)chTime, 8);
 
-    bool fOk = (ctx != NULL);
+    if (chKey)
+        sKey.append((const char*)chKey, 18);
+};
 
-    if (fOk)
-        fOk = EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, &chKey[0], &chIV[0]);
-    if (fOk)
-        fOk = EVP_EncryptUpdate(ctx, &vchCiphertext[0], &nCLen, chPlaintext, nLen);
-    if (fOk)
-        fOk = EVP_EncryptFinal_ex(ctx, (&vchCiphertext[0]) + nCLen, &nFLen);
-    EVP_CIPHER_CTX_cleanup(ctx);
+static bool SecureMsgIndexKeys(const unsigned char *chKey, const SecMsgStored &smsgStored, std::vector<std::string> &vKeys, std::string &sUnreadKey)
+{
+    vKeys.clear();
+    sUnreadKey.clear();
 
-    if (!fOk)
+    bool fInbox = memcmp(chKey, "im", 2) == 0;
+    if (!fInbox && memcmp(chKey, "sm", 2) != 0)
         return false;
 
-    vchCiphertext.resize(nCLen + nFLen);
+    std::string sKey;
+    SecureMsgIndexKey(sKey, fInbox ? "it" : "ot", NULL, smsgStored.timeReceived, chKey);
+    vKeys.push_back(sKey);
+
+    CKeyID keyId;
+    if (CBitcoinAddress(smsgStored.sAddrTo).GetKeyID(keyId))
+    {
+        SecureMsgIndexKey(sKey, fInbox ? "ia" : "oa", &keyId, smsgStored.timeReceived, chKey);
+        vKeys.push_back(sKey);
+    };
+
+    if (fInbox)
+        SecureMsgIndexKey(sUnreadKey, "iu", NULL, smsgStored.timeReceived, chKey);
 
     return true;
 };
 
-bool SecMsgCrypter::Decrypt(unsigned char *chCiphertext, uint32_t nCipher, std::vector<unsigned char> &vchPlaintext)
+static void SecureMsgPutIndexes(leveldb::WriteBatch &batch, const unsigned char *chKey, const SecMsgStored &smsgStored)
 {
-    if (!fKeySet)
-        return false;
+    std::vector<std::string> vKeys;
+    std::string sUnreadKey;
+    if (!SecureMsgIndexKeys(chKey, smsgStored, vKeys, sUnreadKey))
+        return;
 
-    // plaintext will always be equal to or lesser than length of ciphertext
-    int nPLen = nCipher, nFLen = 0;
+    for (std::vector<std::string>::iterator it = vKeys.begin(); it != vKeys.end(); ++it)
+        batch.Put(*it, "");
 
-    vchPlaintext.resize(nCipher);
+    if (!sUnreadKey.empty())
+    {
+        if (smsgStored.status & SMSG_MASK_UNREAD)
+            batch.Put(sUnreadKey, "");
+        else
+            batch.Delete(sUnreadKey);
+    };
+};
 
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+// -- message store
+//    Each bucket is an append-only segment <bucket>_01.dat, with an index
+//    <bucket>_01.idx holding one SecMsgIndexRecord per message in the order
+//    they were appended, so startup only has to read the indexes.
+//    Segments are memory mapped to serve SecureMsgRetrieve.
 
-    bool fOk = (ctx != NULL);
+#pragma pack(push, 1)
+class SecMsgIndexRecord
+{
+public:
+    int64_t timestamp;
+    unsigned char sample[8];
+    int64_t offset;
+    uint32_t nPayload;
+};
+#pragma pack(pop)
 
-    if (fOk)
-        fOk = EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, &chKey[0], &chIV[0]);
-    if (fOk)
-        fOk = EVP_DecryptUpdate(ctx, &vchPlaintext[0], &nPLen, &chCiphertext[0], nCipher);
-    if (fOk)
-        fOk = EVP_DecryptFinal_ex(ctx, (&vchPlaintext[0]) + nPLen, &nFLen);
-    EVP_CIPHER_CTX_free(ctx);
+class SecMsgSegment
+{
+public:
+    boost::interprocess::file_mapping mapping;
+    boost::interprocess::mapped_region region;
+};
 
-    if (!fOk)
-        return false;
+static std::map<int64_t, boost::shared_ptr<SecMsgSegment> > mapSmsgSegments; // guarded by cs_smsg
 
-    vchPlaintext.resize(nPLen + nFLen);
+static fs::path SecureMsgBucketPath(int64_t bucket, const char *suffix)
+{
+    return GetDataDir() / "smsgStore" / (boost::lexical_cast<std::string>(bucket) + suffix);
+};
 
-    return true;
+static void SecureMsgUnmapSegment(int64_t bucket)
+{
+    // -- must lock cs_smsg before calling
+    mapSmsgSegments.erase(bucket);
 };
 
-void SecMsgBucket::hashBucket()
+static const unsigned char *SecureMsgMapSegment(int64_t bucket, uint64_t nNeeded)
 {
-    if (fDebug)
-        printf("SecMsgBucket::hashBucket()\n");
+    /*  Returns the start of the mapped segment file, which is at least nNeeded
+        bytes long, or NULL. The mapping is replaced when the file has grown past
+        it, so pointers into it are only good until the next call.
+        
+        must lock cs_smsg before calling
+    */
+    std::map<int64_t, boost::shared_ptr<SecMsgSegment> >::iterator mi = mapSmsgSegments.find(bucket);
+    if (mi != mapSmsgSegments.end() && mi->second->region.get_size() >= nNeeded)
+        return (const unsigned char *)mi->second->region.get_address();
 
-    timeChanged = GetTime();
+    mapSmsgSegments.erase(bucket);
+    if (mapSmsgSegments.size() >= SMSG_MAX_MAPPED_SEGMENTS)
+        mapSmsgSegments.erase(mapSmsgSegments.begin()); // oldest bucket, least likely to be wanted
 
-    std::set<SecMsgToken>::iterator it;
+    fs::path fullpath = SecureMsgBucketPath(bucket, "_01.dat");
+    try
+    {
+        if (fs::file_size(fullpath) < nNeeded)
+            return NULL;
 
-    void *state = XXH32_init(1);
+        boost::shared_ptr<SecMsgSegment> segment(new SecMsgSegment());
+        boost::interprocess::file_mapping mapping(fullpath.string().c_str(), boost::interprocess::read_only);
+        boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
+        segment->mapping.swap(mapping);
+        segment->region.swap(region);
 
-    for (it = setTokens.begin(); it != setTokens.end(); ++it)
+        mapSmsgSegments[bucket] = segment;
+        return (const unsigned char *)segment->region.get_address();
+    }
+    catch (std::exception &e)
     {
-        XXH32_update(state, it->sample, 8);
+        printf("SecureMsgMapSegment(): Could not map %s, %s\n", fullpath.string().c_str(), e.what());
     };
-
-    hash = XXH32_digest(state);
-
-    if (fDebug)
-        printf("Hashed %" PRIszu " messages, hash %u\n", setTokens.size(), hash);
+    return NULL;
 };
 
-bool SecMsgDB::Open(const char *pszMode)
+static bool SecureMsgWriteIndex(int64_t bucket, const std::vector<SecMsgIndexRecord> &vRecords, bool fAppend)
 {
-    if (smsgDB)
-    {
-        pdb = smsgDB;
+    if (vRecords.empty() && fAppend)
         return true;
-    };
-
-    bool fCreate = strchr(pszMode, 'c');
-
-    fs::path fullpath = GetDataDir() / "smsgDB";
 
-    if (!fCreate && (!fs::exists(fullpath) || !fs::is_directory(fullpath)))
+    fs::path fullpath = SecureMsgBucketPath(bucket, "_01.idx");
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(fullpath.string().c_str(), fAppend ? "ab" : "wb")))
     {
-        printf("SecMsgDB::open() - DB does not exist.\n");
+        printf("Error opening index file: %s\n", strerror(errno));
         return false;
     };
 
-    leveldb::Options options;
-    options.create_if_missing = fCreate;
-    leveldb::Status s = leveldb::DB::Open(options, fullpath.string(), &smsgDB);
-
-    if (!s.ok())
+    if (!vRecords.empty() && fwrite(&vRecords[0], sizeof(SecMsgIndexRecord), vRecords.size(), fp) != vRecords.size())
     {
-        printf("SecMsgDB::open() - Error opening db: %s.\n", s.ToString().c_str());
+        printf("fwrite index failed: %s\n", strerror(errno));
+        fclose(fp);
         return false;
     };
 
-    pdb = smsgDB;
-
+    fclose(fp);
     return true;
 };
 
-class SecMsgBatchScanner : public leveldb::WriteBatch::Handler
+static int SecureMsgLoadBucket(int64_t bucket, SecMsgBucket &bkt)
 {
-  public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
+    /*  Fill the bucket's token set from its index file.
+        
+        Messages appended to the segment after the last indexed one (index
+        missing or behind after a crash) are read from the segment and added
+        to the index. A partly written message at the end of the segment is
+        cut off.
+        
+        must lock cs_smsg before calling
+    */
+    fs::path pathDat = SecureMsgBucketPath(bucket, "_01.dat");
+    fs::path pathIdx = SecureMsgBucketPath(bucket, "_01.idx");
 
-    SecMsgBatchScanner() : foundEntry(false) {}
+    uint64_t nDatSize = fs::file_size(pathDat);
+    uint64_t nIndexed = 0;
+    bool fRewrite = false;
+    std::vector<SecMsgIndexRecord> vRecords;
 
-    virtual void Put(const leveldb::Slice &key, const leveldb::Slice &value)
+    FILE *fp;
+    if (fs::exists(pathIdx) && (fp = fopen(pathIdx.string().c_str(), "rb")))
     {
-        if (key.ToString() == needle)
+        uint64_t nIdxSize = fs::file_size(pathIdx);
+        try
         {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
+            vRecords.resize(nIdxSize / sizeof(SecMsgIndexRecord));
+        }
+        catch (std::exception &e)
+        {
+            printf("SecureMsgLoadBucket(): Could not resize vRecords, %s\n", e.what());
+            fclose(fp);
+            return 1;
+        };
+
+        if (!vRecords.empty() && fread(&vRecords[0], sizeof(SecMsgIndexRecord), vRecords.size(), fp) != vRecords.size())
+            vRecords.clear();
+        fclose(fp);
+
+        // -- keep records while they describe the segment back to back
+        unsigned int nValid = 0;
+        for (; nValid < vRecords.size(); ++nValid)
+        {
+            const SecMsgIndexRecord &rec = vRecords[nValid];
+            if (rec.offset != (int64_t)nIndexed || nIndexed + SMSG_HDR_LEN + rec.nPayload > nDatSize)
+                break;
+            nIndexed += SMSG_HDR_LEN + rec.nPayload;
+        };
+
+        if (nValid != vRecords.size() || nIdxSize % sizeof(SecMsgIndexRecord) != 0)
+        {
+            printf("Index for bucket %" PRId64 " is damaged, keeping %u of %" PRIszu " records.\n", bucket, nValid, vRecords.size());
+            vRecords.resize(nValid);
+            fRewrite = true;
         };
+    } else
+    {
+        fRewrite = true;
     };
 
-    virtual void Delete(const leveldb::Slice &key)
+    unsigned int nFromIndex = vRecords.size();
+
+    if (nIndexed < nDatSize)
     {
-        if (key.ToString() == needle)
+        if (fDebug)
+            printf("Indexing bucket %" PRId64 " from offset %" PRIu64 ".\n", bucket, nIndexed);
+
+        if (!(fp = fopen(pathDat.string().c_str(), "rb")))
         {
-            foundEntry = true;
-            *deleted = true;
+            printf("Error opening file: %s\n", strerror(errno));
+            return 1;
+        };
+
+        SecureMessage smsg;
+        for (;;)
+        {
+            if (fseek(fp, nIndexed, SEEK_SET) != 0
+                || fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN
+                || nIndexed + SMSG_HDR_LEN + smsg.nPayload > nDatSize)
+                break;
+
+            SecMsgIndexRecord rec;
+            rec.timestamp = smsg.timestamp;
+            rec.offset = nIndexed;
+            rec.nPayload = smsg.nPayload;
+            memset(rec.sample, 0, 8);
+            if (smsg.nPayload >= 8 && fread(rec.sample, sizeof(unsigned char), 8, fp) != 8)
+                break;
+
+            vRecords.push_back(rec);
+            nIndexed += SMSG_HDR_LEN + smsg.nPayload;
+        };
+        fclose(fp);
+
+        if (nIndexed < nDatSize)
+        {
+            printf("Truncating bucket %" PRId64 " to %" PRIu64 " bytes, dropping a partly written message.\n", bucket, nIndexed);
+            try
+            {
+                fs::resize_file(pathDat, nIndexed);
+            }
+            catch (const fs::filesystem_error &ex)
+            {
+                printf("Error truncating bucket file %s.\n", ex.what());
+            };
         };
     };
-};
 
-// When performing a read, if we have an active batch we need to check it first
-// before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
-bool SecMsgDB::ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const
-{
-    if (!activeBatch)
-        return false;
+    if (fRewrite)
+        SecureMsgWriteIndex(bucket, vRecords, false);
+    else
+        SecureMsgWriteIndex(bucket, std::vector<SecMsgIndexRecord>(vRecords.begin() + nFromIndex, vRecords.end()), true);
 
-    *deleted = false;
-    SecMsgBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status s = activeBatch->Iterate(&scanner);
-    if (!s.ok())
+    for (std::vector<SecMsgIndexRecord>::iterator it = vRecords.begin(); it != vRecords.end(); ++it)
     {
-        printf("SecMsgDB ScanBatch error: %s\n", s.ToString().c_str());
-        return false;
+        if (it->nPayload < 8)
+            continue;
+
+        SecMsgToken token;
+        token.timestamp = it->timestamp;
+        memcpy(token.sample, it->sample, 8);
+        token.offset = it->offset;
+        bkt.insertToken(token);
     };
+    bkt.nBytes = nIndexed;
 
-    return scanner.foundEntry;
-}
+    return 0;
+};
 
-bool SecMsgDB::TxnBegin()
+// -- store budgets
+//    Messages from peers are only taken while their bucket and the whole store
+//    are within smsgQuota, and buckets at their budget aren't requested.
+//    Buckets can still end up over budget, the budget may have been lowered
+//    or messages sent from here aren't limited, so ThreadSecureMsg trims them.
+
+static uint32_t nSmsgRejected = 0; // messages refused for lack of room, guarded by cs_smsg
+
+static void SecureMsgReadQuota()
 {
-    if (activeBatch)
-        return true;
-    activeBatch = new leveldb::WriteBatch();
-    return true;
+    smsgQuota = SecMsgQuota();
+    smsgQuota.nBucketMsgs = std::max((int64_t)1, GetArg("-smsgmaxbucketmsgs", SMSG_DEFAULT_BUCKET_MSGS));
+    smsgQuota.nBucketBytes = (uint64_t)std::max((int64_t)1, GetArg("-smsgmaxbucketmb", SMSG_DEFAULT_BUCKET_MB)) << 20;
+    smsgQuota.nStoreMsgs = std::max((int64_t)1, GetArg("-smsgmaxstoremsgs", SMSG_DEFAULT_STORE_MSGS));
+    smsgQuota.nStoreBytes = (uint64_t)std::max((int64_t)1, GetArg("-smsgmaxstoremb", SMSG_DEFAULT_STORE_MB)) << 20;
 };
 
-bool SecMsgDB::TxnCommit()
+static void SecureMsgStoreTotals(uint32_t &nMessages, uint64_t &nBytes)
 {
-    if (!activeBatch)
-        return false;
-
-    leveldb::WriteOptions writeOptions;
-    writeOptions.sync = true;
-    leveldb::Status status = pdb->Write(writeOptions, activeBatch);
-    delete activeBatch;
-    activeBatch = NULL;
-
-    if (!status.ok())
+    // -- must lock cs_smsg before calling
+    nMessages = 0;
+    nBytes = 0;
+    for (std::map<int64_t, SecMsgBucket>::iterator it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
     {
-        printf("SecMsgDB batch commit failure: %s\n", status.ToString().c_str());
-        return false;
+        nMessages += it->second.setTokens.size();
+        nBytes += it->second.nBytes;
     };
-
-    return true;
 };
 
-bool SecMsgDB::TxnAbort()
+void SecureMsgStoreUsage(uint32_t &nMessages, uint64_t &nBytes, uint32_t &nRejected)
 {
-    delete activeBatch;
-    activeBatch = NULL;
-    return true;
+    LOCK(cs_smsg);
+    SecureMsgStoreTotals(nMessages, nBytes);
+    nRejected = nSmsgRejected;
 };
 
-bool SecMsgDB::ReadPK(CKeyID &addr, CPubKey &pubkey)
+static int SecureMsgAdmit(int64_t bucket, uint32_t nMessageBytes, uint32_t nStoreMessages, uint64_t nStoreBytes)
 {
-    if (!pdb)
-        return false;
-
-    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-    ssKey.reserve(sizeof(addr) + 2);
-    ssKey << 'p';
-    ssKey << 'k';
-    ssKey << addr;
-    std::string strValue;
-
-    bool readFromDb = true;
-    if (activeBatch)
+    /*  Check a message of nMessageBytes (header + payload) fits the budgets,
+        nMessageBytes 0 checks there is room for any message at all.
+        nStoreMessages and nStoreBytes are the totals from SecureMsgStoreTotals.
+        
+        must lock cs_smsg before calling
+        
+        returns
+            0       Message fits
+            1       Bucket is full
+            2       Store is full
+    */
+    uint32_t nBucketMessages = 0;
+    uint64_t nBucketBytes = 0;
+    std::map<int64_t, SecMsgBucket>::iterator itb = smsgBuckets.find(bucket);
+    if (itb != smsgBuckets.end())
     {
-        // -- check activeBatch first
-        bool deleted = false;
-        readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
-        if (deleted)
-            return false;
+        nBucketMessages = itb->second.setTokens.size();
+        nBucketBytes = itb->second.nBytes;
     };
 
-    if (readFromDb)
-    {
-        leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
-        if (!s.ok())
-        {
-            if (s.IsNotFound())
-                return false;
-            printf("LevelDB read failure: %s\n", s.ToString().c_str());
-            return false;
-        };
+    if (nBucketMessages >= smsgQuota.nBucketMsgs
+        || nBucketBytes + nMessageBytes > smsgQuota.nBucketBytes)
+        return 1;
+
+    if (nStoreMessages >= smsgQuota.nStoreMsgs
+        || nStoreBytes + nMessageBytes > smsgQuota.nStoreBytes)
+        return 2;
+
+    return 0;
+};
+
+static int SecureMsgCompactBucket(int64_t bucket, SecMsgBucket &bkt, uint32_t nMaxMsgs, uint64_t nMaxBytes)
+{
+    /*  Cut the bucket down to at most nMaxMsgs messages and nMaxBytes, keeping
+        the messages that arrived first. Those are the front of the segment, so
+        the segment is truncated and the index rewritten with what is left.
+        
+        The index is brought up to the segment first, messages it is missing
+        (an index append failed) would otherwise never be counted or cut.
+        
+        must lock cs_smsg before calling
+        
+        returns
+            0       Success
+            1       Error
+    */
+    fs::path pathDat = SecureMsgBucketPath(bucket, "_01.dat");
+    fs::path pathIdx = SecureMsgBucketPath(bucket, "_01.idx");
+
+    SecureMsgUnmapSegment(bucket);
+
+    SecMsgBucket bktIndexed;
+    if (SecureMsgLoadBucket(bucket, bktIndexed) != 0)
+        return 1;
+
+    std::vector<SecMsgIndexRecord> vRecords;
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(pathIdx.string().c_str(), "rb")))
+    {
+        printf("Error opening index file: %s\n", strerror(errno));
+        return 1;
     };
 
     try
     {
-        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
-        ssValue >> pubkey;
+        vRecords.resize(fs::file_size(pathIdx) / sizeof(SecMsgIndexRecord));
     }
     catch (std::exception &e)
     {
-        printf("SecMsgDB::ReadPK() unserialize threw: %s.\n", e.what());
-        return false;
-    }
-
-    return true;
-};
+        printf("SecureMsgCompactBucket(): Could not read index, %s\n", e.what());
+        fclose(fp);
+        return 1;
+    };
 
-bool SecMsgDB::WritePK(CKeyID &addr, CPubKey &pubkey)
-{
-    if (!pdb)
-        return false;
+    if (!vRecords.empty() && fread(&vRecords[0], sizeof(SecMsgIndexRecord), vRecords.size(), fp) != vRecords.size())
+    {
+        printf("fread index failed: %s\n", strerror(errno));
+        fclose(fp);
+        return 1;
+    };
+    fclose(fp);
 
-    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-    ssKey.reserve(sizeof(addr) + 2);
-    ssKey << 'p';
-    ssKey << 'k';
-    ssKey << addr;
-    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-    ssValue.reserve(sizeof(pubkey));
-    ssValue << pubkey;
+    uint32_t nKept = 0;
+    uint64_t nKeptBytes = 0;
+    for (; nKept < vRecords.size() && nKept < nMaxMsgs; ++nKept)
+    {
+        uint64_t nSize = SMSG_HDR_LEN + vRecords[nKept].nPayload;
+        if (vRecords[nKept].offset != (int64_t)nKeptBytes
+            || nKeptBytes + nSize > nMaxBytes)
+            break;
+        nKeptBytes += nSize;
+    };
 
-    if (activeBatch)
+    if (nKept == vRecords.size())
     {
-        activeBatch->Put(ssKey.str(), ssValue.str());
-        return true;
+        // -- within budget, the tokens were out of date
+        bktIndexed.hashBucket();
+        bkt = bktIndexed;
+        return 0;
     };
 
-    leveldb::WriteOptions writeOptions;
-    writeOptions.sync = true;
-    leveldb::Status s = pdb->Put(writeOptions, ssKey.str(), ssValue.str());
-    if (!s.ok())
+    try
     {
-        printf("SecMsgDB write failure: %s\n", s.ToString().c_str());
-        return false;
+        fs::resize_file(pathDat, nKeptBytes);
+    }
+    catch (const fs::filesystem_error &ex)
+    {
+        printf("Error truncating bucket file %s.\n", ex.what());
+        return 1;
     };
+    vRecords.resize(nKept);
+    SecureMsgWriteIndex(bucket, vRecords, false);
 
-    return true;
+    SecMsgBucket bktNew;
+    if (SecureMsgLoadBucket(bucket, bktNew) != 0)
+        return 1;
+    bktNew.hashBucket();
+
+    printf("Compacted bucket %" PRId64 ", kept %u of %" PRIszu " messages, %s.\n",
+        bucket, nKept, bkt.setTokens.size(), fsReadable(nKeptBytes).c_str());
+    bkt = bktNew;
+
+    return 0;
 };
 
-bool SecMsgDB::ExistsPK(CKeyID &addr)
+static void SecureMsgCompactStore()
 {
-    if (!pdb)
-        return false;
-
-    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-    ssKey.reserve(sizeof(addr) + 2);
-    ssKey << 'p';
-    ssKey << 'k';
-    ssKey << addr;
-    std::string unused;
+    /*  Bring buckets over budget back within it. While the whole store is over
+        budget the store budget is shared evenly over the retention window.
+        
+        must lock cs_smsg before calling
+    */
+    uint32_t nStoreMessages;
+    uint64_t nStoreBytes;
+    SecureMsgStoreTotals(nStoreMessages, nStoreBytes);
 
-    if (activeBatch)
+    uint32_t nMaxMsgs = smsgQuota.nBucketMsgs;
+    uint64_t nMaxBytes = smsgQuota.nBucketBytes;
+    if (nStoreMessages > smsgQuota.nStoreMsgs || nStoreBytes > smsgQuota.nStoreBytes)
     {
-        bool deleted;
-        if (ScanBatch(ssKey, &unused, &deleted) && !deleted)
-        {
-            return true;
-        };
+        const uint32_t nWindow = SMSG_RETENTION / SMSG_BUCKET_LEN + 1;
+        nMaxMsgs = std::min(nMaxMsgs, std::max(1u, smsgQuota.nStoreMsgs / nWindow));
+        nMaxBytes = std::min(nMaxBytes, smsgQuota.nStoreBytes / nWindow);
     };
 
-    leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
-    return s.IsNotFound() == false;
+    for (std::map<int64_t, SecMsgBucket>::iterator it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
+    {
+        if (it->second.nLockCount > 0 // waiting on a peer
+            || (it->second.setTokens.size() <= nMaxMsgs && it->second.nBytes <= nMaxBytes))
+            continue;
+
+        if (SecureMsgCompactBucket(it->first, it->second, nMaxMsgs, nMaxBytes) != 0)
+            printf("Could not compact bucket %" PRId64 ".\n", it->first);
+    };
 };
 
-bool SecMsgDB::NextSmesg(leveldb::Iterator *it, std::string &prefix, unsigned char *chKey, SecMsgStored &smsgStored)
+bool SecMsgCrypter::SetKey(const std::vector<unsigned char> &vchNewKey, unsigned char *chNewIV)
 {
-    if (!pdb)
-        return false;
-
-    if (!it->Valid()) // first run
-        it->Seek(prefix);
-    else
-        it->Next();
 
-    if (!(it->Valid() && it->key().size() == 18 && memcmp(it->key().data(), prefix.data(), 2) == 0))
+    if (vchNewKey.size() < sizeof(chKey))
         return false;
 
-    memcpy(chKey, it->key().data(), 18);
+    return SetKey(&vchNewKey[0], chNewIV);
+};
 
-    try
-    {
-        CDataStream ssValue(it->value().data(), it->value().data() + it->value().size(), SER_DISK, CLIENT_VERSION);
-        ssValue >> smsgStored;
-    }
-    catch (std::exception &e)
-    {
-        printf("SecMsgDB::NextSmesg() unserialize threw: %s.\n", e.what());
-        return false;
-    }
+bool SecMsgCrypter::SetKey(const unsigned char *chNewKey, unsigned char *chNewIV)
+{
+    // -- for EVP_aes_256_cbc() key must be 256 bit, iv must be 128 bit.
+    memcpy(&chKey[0], chNewKey, sizeof(chKey));
+    memcpy(chIV, chNewIV, sizeof(chIV));
 
+    fKeySet = true;
     return true;
 };
 
-bool SecMsgDB::NextSmesgKey(leveldb::Iterator *it, std::string &prefix, unsigned char *chKey)
+bool SecMsgCrypter::Encrypt(unsigned char *chPlaintext, uint32_t nPlain, std::vector<unsigned char> &vchCiphertext)
 {
-    if (!pdb)
+    if (!fKeySet)
         return false;
 
-    if (!it->Valid()) // first run
-        it->Seek(prefix);
-    else
-        it->Next();
+    // -- max ciphertext len for a n bytes of plaintext is n + AES_BLOCK_SIZE - 1 bytes
+    int nLen = nPlain;
 
-    if (!(it->Valid() && it->key().size() == 18 && memcmp(it->key().data(), prefix.data(), 2) == 0))
+    int nCLen = nLen + AES_BLOCK_SIZE, nFLen = 0;
+    vchCiphertext = std::vector<unsigned char>(nCLen);
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+    bool fOk = (ctx != NULL);
+
+    if (fOk)
+        fOk = EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, &chKey[0], &chIV[0]);
+    if (fOk)
+        fOk = EVP_EncryptUpdate(ctx, &vchCiphertext[0], &nCLen, chPlaintext, nLen);
+    if (fOk)
+        fOk = EVP_EncryptFinal_ex(ctx, (&vchCiphertext[0]) + nCLen, &nFLen);
+    EVP_CIPHER_CTX_cleanup(ctx);
+
+    if (!fOk)
         return false;
 
-    memcpy(chKey, it->key().data(), 18);
+    vchCiphertext.resize(nCLen + nFLen);
 
     return true;
 };
 
-bool SecMsgDB::ReadSmesg(unsigned char *chKey, SecMsgStored &smsgStored)
+bool SecMsgCrypter::Decrypt(unsigned char *chCiphertext, uint32_t nCipher, std::vector<unsigned char> &vchPlaintext)
 {
-    if (!pdb)
+    if (!fKeySet)
         return false;
 
-    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-    ssKey.write((const char *)chKey, 18);
-    std::string strValue;
+    // plaintext will always be equal to or lesser than length of ciphertext
+    int nPLen = nCipher, nFLen = 0;
 
-    bool readFromDb = true;
-    if (activeBatch)
-    {
-        // -- check activeBatch first
-        bool deleted = false;
-        readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
-        if (deleted)
-            return false;
-    };
+    vchPlaintext.resize(nCipher);
 
-    if (readFromDb)
-    {
-        leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
-        if (!s.ok())
-        {
-            if (s.IsNotFound())
-                return false;
-            printf("LevelDB read failure: %s\n", s.ToString().c_str());
-            return false;
-        };
-    };
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
 
-    try
-    {
-        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
-        ssValue >> smsgStored;
-    }
-    catch (std::exception &e)
-    {
-        printf("SecMsgDB::ReadSmesg() unserialize threw: %s.\n", e.what());
+    bool fOk = (ctx != NULL);
+
+    if (fOk)
+        fOk = EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, &chKey[0], &chIV[0]);
+    if (fOk)
+        fOk = EVP_DecryptUpdate(ctx, &vchPlaintext[0], &nPLen, &chCiphertext[0], nCipher);
+    if (fOk)
+        fOk = EVP_DecryptFinal_ex(ctx, (&vchPlaintext[0]) + nPLen, &nFLen);
+    EVP_CIPHER_CTX_free(ctx);
+
+    if (!fOk)
         return false;
-    }
+
+    vchPlaintext.resize(nPLen + nFLen);
 
     return true;
 };
 
-bool SecMsgDB::WriteSmesg(unsigned char *chKey, SecMsgStored &smsgStored)
+uint32_t SecMsgTokenHash(const SecMsgToken &token)
 {
-    if (!pdb)
-        return false;
+    unsigned char data[16];
+    memcpy(&data[0], &token.timestamp, 8);
+    memcpy(&data[8], token.sample, 8);
+    return XXH32(data, 16, 1);
+};
 
-    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-    ssKey.write((const char *)chKey, 18);
-    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-    ssValue << smsgStored;
+void SecMsgBucket::hashBucket()
+{
+    // -- contents changed, nDigest is kept up to date by insertToken
+    //    and the legacy hash is recomputed when next asked for
+    timeChanged = GetTime();
+    fHashStale = true;
+};
 
-    if (activeBatch)
-    {
-        activeBatch->Put(ssKey.str(), ssValue.str());
-        return true;
-    };
+uint32_t SecMsgBucket::legacyHash()
+{
+    if (!fHashStale)
+        return hash;
 
-    leveldb::WriteOptions writeOptions;
-    writeOptions.sync = true;
-    leveldb::Status s = pdb->Put(writeOptions, ssKey.str(), ssValue.str());
-    if (!s.ok())
+    std::set<SecMsgToken>::iterator it;
+
+    void *state = XXH32_init(1);
+
+    for (it = setTokens.begin(); it != setTokens.end(); ++it)
     {
-        printf("SecMsgDB write failed: %s\n", s.ToString().c_str());
-        return false;
+        XXH32_update(state, it->sample, 8);
     };
 
-    return true;
+    hash = XXH32_digest(state);
+    fHashStale = false;
+
+    if (fDebug)
+        printf("Hashed %" PRIszu " messages, hash %u\n", setTokens.size(), hash);
+
+    return hash;
 };
 
-bool SecMsgDB::ExistsSmesg(unsigned char *chKey)
+bool SecMsgBucket::insertToken(const SecMsgToken &token)
 {
-    if (!pdb)
+    if (!setTokens.insert(token).second)
         return false;
+    nDigest ^= SecMsgTokenHash(token);
+    fHashStale = true;
+    return true;
+};
 
-    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-    ssKey.write((const char *)chKey, 18);
-    std::string unused;
+void SecMsgBucket::getSketch(uint32_t *pCount, uint32_t *pDigest) const
+{
+    // -- message count and digest of each of the SMSG_SKETCH_PARTS partitions
+    memset(pCount, 0, sizeof(uint32_t) * SMSG_SKETCH_PARTS);
+    memset(pDigest, 0, sizeof(uint32_t) * SMSG_SKETCH_PARTS);
 
-    if (activeBatch)
+    for (std::set<SecMsgToken>::const_iterator it = setTokens.begin(); it != setTokens.end(); ++it)
     {
-        bool deleted;
-        if (ScanBatch(ssKey, &unused, &deleted) && !deleted)
-        {
-            return true;
-        };
+        uint32_t h = SecMsgTokenHash(*it);
+        unsigned int nPart = SecMsgTokenPart(h);
+        pCount[nPart]++;
+        pDigest[nPart] ^= h;
     };
-
-    leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
-    return s.IsNotFound() == false;
-    return true;
 };
 
-bool SecMsgDB::EraseSmesg(unsigned char *chKey)
+bool SecMsgDB::Open(const char *pszMode)
 {
-    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-    ssKey.write((const char *)chKey, 18);
-
-    if (activeBatch)
+    if (smsgDB)
     {
-        activeBatch->Delete(ssKey.str());
+        pdb = smsgDB;
         return true;
     };
 
-    leveldb::WriteOptions writeOptions;
-    writeOptions.sync = true;
-    leveldb::Status s = pdb->Delete(writeOptions, ssKey.str());
+    bool fCreate = strchr(pszMode, 'c');
 
-    if (s.ok() || s.IsNotFound())
-        return true;
-    printf("SecMsgDB erase failed: %s\n", s.ToString().c_str());
-    return false;
-};
+    fs::path fullpath = GetDataDir() / "smsgDB";
 
-void ThreadSecureMsg(void *parg)
-{
-    // -- bucket management thread
-    RenameThread("shadowcoin-smsg"); // Make this thread recognisable
+    if (!fCreate && (!fs::exists(fullpath) || !fs::is_directory(fullpath)))
+    {
+        printf("SecMsgDB::open() - DB does not exist.\n");
+        return false;
+    };
 
-    uint32_t delay = 0;
+    leveldb::Options options;
+    options.create_if_missing = fCreate;
+    leveldb::Status s = leveldb::DB::Open(options, fullpath.string(), &smsgDB);
 
-    while (fSecMsgEnabled)
+    if (!s.ok())
     {
-        // shutdown thread waits 5 seconds, this should be less
-        MilliSleep(1000); // milliseconds
+        printf("SecMsgDB::open() - Error opening db: %s.\n", s.ToString().c_str());
+        return false;
+    };
 
-        if (!fSecMsgEnabled) // check again after sleep
-            break;
+    pdb = smsgDB;
 
-        delay++;
-        if (delay < SMSG_THREAD_DELAY) // check every SMSG_THREAD_DELAY seconds
-            continue;
-        delay = 0;
+    BuildIndexes();
 
-        int64_t now = GetTime();
+    return true;
+};
 
-        if (fDebug)
-            printf("SecureMsgThread %" PRId64 " \n", now);
+class SecMsgBatchScanner : public leveldb::WriteBatch::Handler
+{
+  public:
+    std::string needle;
+    bool *deleted;
+    std::string *foundValue;
+    bool foundEntry;
 
-        int64_t cutoffTime = now - SMSG_RETENTION;
+    SecMsgBatchScanner() : foundEntry(false) {}
 
+    virtual void Put(const leveldb::Slice &key, const leveldb::Slice &value)
+    {
+        if (key.ToString() == needle)
         {
-            LOCK(cs_smsg);
-            std::map<int64_t, SecMsgBucket>::iterator it;
-            it = smsgBuckets.begin();
+            foundEntry = true;
+            *deleted = false;
+            *foundValue = value.ToString();
+        };
+    };
 
-            while (it != smsgBuckets.end())
-            {
-                //if (fDebug)
-                //    printf("Checking bucket %"PRId64", size %"PRIszu" \n", it->first, it->second.setTokens.size());
-                if (it->first < cutoffTime)
-                {
-                    if (fDebug)
-                        printf("Removing bucket %" PRId64 " \n", it->first);
-                    std::string fileName = boost::lexical_cast<std::string>(it->first) + "_01.dat";
-                    fs::path fullPath = GetDataDir() / "smsgStore" / fileName;
-                    if (fs::exists(fullPath))
-                    {
-                        try
-                        {
-                            fs::remove(fullPath);
-                        }
-                        catch (const fs::filesystem_error &ex)
-                        {
-                            printf("Error removing bucket file %s.\n", ex.what());
-                        };
-                    }
-                    else
-                        printf("Path %s does not exist \n", fullPath.string().c_str());
+    virtual void Delete(const leveldb::Slice &key)
+    {
+        if (key.ToString() == needle)
+        {
+            foundEntry = true;
+            *deleted = true;
+        };
+    };
+};
 
-                    // -- look for a wl file, it stores incoming messages when wallet is locked
-                    fileName = boost::lexical_cast<std::string>(it->first) + "_01_wl.dat";
-                    fullPath = GetDataDir() / "smsgStore" / fileName;
-                    if (fs::exists(fullPath))
-                    {
-                        try
-                        {
-                            fs::remove(fullPath);
-                        }
-                        catch (const fs::filesystem_error &ex)
-                        {
-                            printf("Error removing wallet locked file %s.\n", ex.what());
-                        };
-                    };
+// When performing a read, if we have an active batch we need to check it first
+// before reading from the database, as the rest of the code assumes that once
+// a database transaction begins reads are consistent with it. It would be good
+// to change that assumption in future and avoid the performance hit, though in
+// practice it does not appear to be large.
+bool SecMsgDB::ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const
+{
+    if (!activeBatch)
+        return false;
 
-                    smsgBuckets.erase(it++);
-                }
-                else
-                {
-                    // -- tick down nLockCount, so will eventually expire if peer never sends data
-                    if (it->second.nLockCount > 0)
-                    {
-                        it->second.nLockCount--;
+    *deleted = false;
+    SecMsgBatchScanner scanner;
+    scanner.needle = key.str();
+    scanner.deleted = deleted;
+    scanner.foundValue = value;
+    leveldb::Status s = activeBatch->Iterate(&scanner);
+    if (!s.ok())
+    {
+        printf("SecMsgDB ScanBatch error: %s\n", s.ToString().c_str());
+        return false;
+    };
 
-                        if (it->second.nLockCount == 0) // lock timed out
-                        {
-                            uint32_t nPeerId = it->second.nLockPeerId;
-                            int64_t ignoreUntil = GetTime() + SMSG_TIME_IGNORE;
+    return scanner.foundEntry;
+}
 
-                            if (fDebug)
-                                printf("Lock on bucket %" PRId64 " for peer %u timed out.\n", it->first, nPeerId);
-                            // -- look through the nodes for the peer that locked this bucket
-                            LOCK(cs_vNodes);
-                            BOOST_FOREACH (CNode *pnode, vNodes)
-                            {
-                                if (pnode->smsgData.nPeerId != nPeerId)
-                                    continue;
-                                pnode->smsgData.ignoreUntil = ignoreUntil;
+bool SecMsgDB::TxnBegin()
+{
+    if (activeBatch)
+        return true;
+    activeBatch = new leveldb::WriteBatch();
+    return true;
+};
 
-                                // -- alert peer that they are being ignored
-                                std::vector<unsigned char> vchData;
-                                vchData.resize(8);
-                                memcpy(&vchData[0], &ignoreUntil, 8);
-                                pnode->PushMessage("smsgIgnore", vchData);
+bool SecMsgDB::TxnCommit()
+{
+    if (!activeBatch)
+        return false;
 
-                                if (fDebug)
-                                    printf("This node will ignore peer %u until %" PRId64 ".\n", nPeerId, ignoreUntil);
-                                break;
-                            };
-                            it->second.nLockPeerId = 0;
-                        }; // if (it->second.nLockCount == 0)
-                    };
-                    ++it;
-                }; // ! if (it->first < cutoffTime)
-            };
-        }; // LOCK(cs_smsg);
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status status = pdb->Write(writeOptions, activeBatch);
+    delete activeBatch;
+    activeBatch = NULL;
+
+    if (!status.ok())
+    {
+        printf("SecMsgDB batch commit failure: %s\n", status.ToString().c_str());
+        return false;
     };
 
-    printf("ThreadSecureMsg exited.\n");
+    return true;
 };
 
-void ThreadSecureMsgPow(void *parg)
+bool SecMsgDB::TxnAbort()
 {
-    // -- proof of work thread
-    RenameThread("shadowcoin-smsg-pow"); // Make this thread recognisable
+    delete activeBatch;
+    activeBatch = NULL;
+    return true;
+};
 
-    int rv;
-    std::vector<unsigned char> vchKey;
-    SecMsgStored smsgStored;
+bool SecMsgDB::ReadPK(CKeyID &addr, CPubKey &pubkey)
+{
+    if (!pdb)
+        return false;
 
-    std::string sPrefix("qm");
-    unsigned char chKey[18];
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey.reserve(sizeof(addr) + 2);
+    ssKey << 'p';
+    ssKey << 'k';
+    ssKey << addr;
+    std::string strValue;
 
-    while (fSecMsgEnabled)
+    bool readFromDb = true;
+    if (activeBatch)
     {
-        // -- sleep at end, then fSecMsgEnabled is tested on wake
+        // -- check activeBatch first
+        bool deleted = false;
+        readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
+        if (deleted)
+            return false;
+    };
 
-        SecMsgDB dbOutbox;
-        leveldb::Iterator *it;
+    if (readFromDb)
+    {
+        leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
+        if (!s.ok())
         {
-            LOCK(cs_smsgDB);
+            if (s.IsNotFound())
+                return false;
+            printf("LevelDB read failure: %s\n", s.ToString().c_str());
+            return false;
+        };
+    };
 
-            if (!dbOutbox.Open("cr+"))
-                continue;
-
-            // -- fifo (smallest key first)
-            it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
-        }
-        // -- break up lock, SecureMsgSetHash will take long
-
-        for (;;)
-        {
-            {
-                LOCK(cs_smsgDB);
-                if (!dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
-                    break;
-            }
-
-            unsigned char *pHeader = &smsgStored.vchMessage[0];
-            unsigned char *pPayload = &smsgStored.vchMessage[SMSG_HDR_LEN];
-            SecureMessage *psmsg = (SecureMessage *)pHeader;
-
-            // -- do proof of work
-            rv = SecureMsgSetHash(pHeader, pPayload, psmsg->nPayload);
-            if (rv == 2)
-                break; // /eave message in db, if terminated due to shutdown
+    try
+    {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> pubkey;
+    }
+    catch (std::exception &e)
+    {
+        printf("SecMsgDB::ReadPK() unserialize threw: %s.\n", e.what());
+        return false;
+    }
 
-            // -- message is removed here, no matter what
-            {
-                LOCK(cs_smsgDB);
-                dbOutbox.EraseSmesg(chKey);
-            }
-            if (rv != 0)
-            {
-                printf("SecMsgPow: Could not get proof of work hash, message removed.\n");
-                continue;
-            };
+    return true;
+};
 
-            // -- add to message store
-            {
-                LOCK(cs_smsg);
-                if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload, true) != 0)
-                {
-                    printf("SecMsgPow: Could not place message in buckets, message removed.\n");
-                    continue;
-                };
-            }
+bool SecMsgDB::WritePK(CKeyID &addr, CPubKey &pubkey)
+{
+    if (!pdb)
+        return false;
 
-            // -- test if message was sent to self
-            if (SecureMsgScanMessage(pHeader, pPayload, psmsg->nPayload, true) != 0)
-            {
-                // message recipient is not this node (or failed)
-            };
-        };
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey.reserve(sizeof(addr) + 2);
+    ssKey << 'p';
+    ssKey << 'k';
+    ssKey << addr;
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue.reserve(sizeof(pubkey));
+    ssValue << pubkey;
 
-        {
-            LOCK(cs_smsg);
-            delete it;
-        }
+    if (activeBatch)
+    {
+        activeBatch->Put(ssKey.str(), ssValue.str());
+        return true;
+    };
 
-        // -- shutdown thread waits 5 seconds, this should be less
-        MilliSleep(1000); // milliseconds
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status s = pdb->Put(writeOptions, ssKey.str(), ssValue.str());
+    if (!s.ok())
+    {
+        printf("SecMsgDB write failure: %s\n", s.ToString().c_str());
+        return false;
     };
 
-    printf("ThreadSecureMsgPow exited.\n");
+    return true;
 };
 
-std::string getTimeString(int64_t timestamp, char *buffer, size_t nBuffer)
+bool SecMsgDB::ExistsPK(CKeyID &addr)
 {
-    struct tm *dt;
-    time_t t = timestamp;
-    dt = localtime(&t);
+    if (!pdb)
+        return false;
 
-    strftime(buffer, nBuffer, "%Y-%m-%d %H:%M:%S %z", dt); // %Z shows long strings on windows
-    return std::string(buffer);                            // copies the null-terminated character sequence
-};
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey.reserve(sizeof(addr) + 2);
+    ssKey << 'p';
+    ssKey << 'k';
+    ssKey << addr;
+    std::string unused;
 
-std::string fsReadable(uint64_t nBytes)
-{
-    char buffer[128];
-    if (nBytes >= 1024ll * 1024ll * 1024ll * 1024ll)
-        snprintf(buffer, sizeof(buffer), "%.2f TB", nBytes / 1024.0 / 1024.0 / 1024.0 / 1024.0);
-    else if (nBytes >= 1024 * 1024 * 1024)
-        snprintf(buffer, sizeof(buffer), "%.2f GB", nBytes / 1024.0 / 1024.0 / 1024.0);
-    else if (nBytes >= 1024 * 1024)
-        snprintf(buffer, sizeof(buffer), "%.2f MB", nBytes / 1024.0 / 1024.0);
-    else if (nBytes >= 1024)
-        snprintf(buffer, sizeof(buffer), "%.2f KB", nBytes / 1024.0);
-    else
-        snprintf(buffer, sizeof(buffer), "%" PRIu64 " bytes", nBytes);
-    return std::string(buffer);
+    if (activeBatch)
+    {
+        bool deleted;
+        if (ScanBatch(ssKey, &unused, &deleted) && !deleted)
+        {
+            return true;
+        };
+    };
+
+    leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
+    return s.IsNotFound() == false;
 };
 
-int SecureMsgBuildBucketSet()
+bool SecMsgDB::ReadPKHeight(int &nHeight, uint256 &hashBlock)
 {
-    /*
-        Build the bucket set by scanning the files in the smsgStore dir.
-        
-        smsgBuckets should be empty
-    */
-
-    if (fDebug)
-        printf("SecureMsgBuildBucketSet()\n");
+    if (!pdb)
+        return false;
 
-    int64_t now = GetTime();
-    uint32_t nFiles = 0;
-    uint32_t nMessages = 0;
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 'p';
+    ssKey << 'h';
+    std::string strValue;
 
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-    fs::directory_iterator itend;
+    leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
+    if (!s.ok())
+    {
+        if (!s.IsNotFound())
+            printf("LevelDB read failure: %s\n", s.ToString().c_str());
+        return false;
+    };
 
-    if (!fs::exists(pathSmsgDir) || !fs::is_directory(pathSmsgDir))
+    try
     {
-        printf("Message store directory does not exist.\n");
-        return 0; // not an error
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> nHeight;
+        ssValue >> hashBlock;
     }
-
-    for (fs::directory_iterator itd(pathSmsgDir); itd != itend; ++itd)
+    catch (std::exception &e)
     {
-        if (!fs::is_regular_file(itd->status()))
-            continue;
+        printf("SecMsgDB::ReadPKHeight() unserialize threw: %s.\n", e.what());
+        return false;
+    }
 
-        std::string fileType = (*itd).path().extension().string();
+    return true;
+};
 
-        if (fileType.compare(".dat") != 0)
-            continue;
+bool SecMsgDB::WritePKHeight(int nHeight, uint256 &hashBlock)
+{
+    if (!pdb)
+        return false;
 
-        std::string fileName = (*itd).path().filename().string();
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 'p';
+    ssKey << 'h';
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << nHeight;
+    ssValue << hashBlock;
 
-        if (fDebug)
-            printf("Processing file: %s.\n", fileName.c_str());
+    if (activeBatch)
+    {
+        activeBatch->Put(ssKey.str(), ssValue.str());
+        return true;
+    };
 
-        nFiles++;
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status s = pdb->Put(writeOptions, ssKey.str(), ssValue.str());
+    if (!s.ok())
+    {
+        printf("SecMsgDB write failure: %s\n", s.ToString().c_str());
+        return false;
+    };
 
-        // TODO files must be split if > 2GB
-        // time_noFile.dat
-        size_t sep = fileName.find_first_of("_");
-        if (sep == std::string::npos)
-            continue;
+    return true;
+};
 
-        std::string stime = fileName.substr(0, sep);
+bool SecMsgDB::ReadPayloadVersion(CKeyID &addr, unsigned char &nVersion)
+{
+    if (!pdb)
+        return false;
 
-        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey.reserve(sizeof(addr) + 2);
+    ssKey << 'p';
+    ssKey << 'v';
+    ssKey << addr;
+    std::string strValue;
 
-        if (fileTime < now - SMSG_RETENTION)
-        {
-            printf("Dropping file %s, expired.\n", fileName.c_str());
-            try
-            {
-                fs::remove((*itd).path());
-            }
-            catch (const fs::filesystem_error &ex)
-            {
-                printf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
-            };
-            continue;
-        };
+    leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
+    if (!s.ok())
+    {
+        if (!s.IsNotFound())
+            printf("LevelDB read failure: %s\n", s.ToString().c_str());
+        return false;
+    };
 
-        if (boost::algorithm::ends_with(fileName, "_wl.dat"))
-        {
-            if (fDebug)
-                printf("Skipping wallet locked file: %s.\n", fileName.c_str());
-            continue;
-        };
+    if (strValue.size() != 1)
+        return false;
+    nVersion = strValue[0];
+    return true;
+};
 
-        SecureMessage smsg;
-        std::set<SecMsgToken> &tokenSet = smsgBuckets[fileTime].setTokens;
+bool SecMsgDB::WritePayloadVersion(CKeyID &addr, unsigned char nVersion)
+{
+    if (!pdb)
+        return false;
 
-        {
-            LOCK(cs_smsg);
-            FILE *fp;
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey.reserve(sizeof(addr) + 2);
+    ssKey << 'p';
+    ssKey << 'v';
+    ssKey << addr;
+    std::string strValue(1, (char)nVersion);
 
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                printf("Error opening file: %s\n", strerror(errno));
-                continue;
-            };
-
-            for (;;)
-            {
-                long int ofs = ftell(fp);
-                SecMsgToken token;
-                token.offset = ofs;
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        printf("fread header failed: %s\n", strerror(errno));
-                    }
-                    else
-                    {
-                        //printf("End of file.\n");
-                    };
-                    break;
-                };
-                token.timestamp = smsg.timestamp;
-
-                if (smsg.nPayload < 8)
-                    continue;
+    if (activeBatch)
+    {
+        activeBatch->Put(ssKey.str(), strValue);
+        return true;
+    };
 
-                if (fread(token.sample, sizeof(unsigned char), 8, fp) != 8)
-                {
-                    printf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
+    leveldb::Status s = pdb->Put(leveldb::WriteOptions(), ssKey.str(), strValue);
+    if (!s.ok())
+    {
+        printf("SecMsgDB write failure: %s\n", s.ToString().c_str());
+        return false;
+    };
 
-                if (fseek(fp, smsg.nPayload - 8, SEEK_CUR) != 0)
-                {
-                    printf("fseek, strerror: %s.\n", strerror(errno));
-                    break;
-                };
+    return true;
+};
 
-                tokenSet.insert(token);
-            };
+bool SecMsgDB::NextSmesg(leveldb::Iterator *it, std::string &prefix, unsigned char *chKey, SecMsgStored &smsgStored)
+{
+    if (!pdb)
+        return false;
 
-            fclose(fp);
-        };
-        smsgBuckets[fileTime].hashBucket();
+    if (!it->Valid()) // first run
+        it->Seek(prefix);
+    else
+        it->Next();
 
-        nMessages += tokenSet.size();
+    if (!(it->Valid() && it->key().size() == 18 && memcmp(it->key().data(), prefix.data(), 2) == 0))
+        return false;
 
-        if (fDebug)
-            printf("Bucket %" PRId64 " contains %" PRIszu " messages.\n", fileTime, tokenSet.size());
-    };
+    memcpy(chKey, it->key().data(), 18);
 
-    printf("Processed %u files, loaded %" PRIszu " buckets containing %u messages.\n", nFiles, smsgBuckets.size(), nMessages);
+    try
+    {
+        CDataStream ssValue(it->value().data(), it->value().data() + it->value().size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> smsgStored;
+    }
+    catch (std::exception &e)
+    {
+        printf("SecMsgDB::NextSmesg() unserialize threw: %s.\n", e.what());
+        return false;
+    }
 
-    return 0;
+    return true;
 };
 
-int SecureMsgAddWalletAddresses()
+bool SecMsgDB::NextSmesgKey(leveldb::Iterator *it, std::string &prefix, unsigned char *chKey)
 {
-    if (fDebug)
-        printf("SecureMsgAddWalletAddresses()\n");
+    if (!pdb)
+        return false;
 
-    uint32_t nAdded = 0;
-    BOOST_FOREACH (const PAIRTYPE(CTxDestination, std::string) & entry, pwalletMain->mapAddressBook)
-    {
-        if (!IsMine(*pwalletMain, entry.first))
-            continue;
+    if (!it->Valid()) // first run
+        it->Seek(prefix);
+    else
+        it->Next();
 
-        CBitcoinAddress coinAddress(entry.first);
-        if (!coinAddress.IsValid())
-            continue;
+    if (!(it->Valid() && it->key().size() == 18 && memcmp(it->key().data(), prefix.data(), 2) == 0))
+        return false;
 
-        std::string address;
-        std::string strPublicKey;
-        address = coinAddress.ToString();
+    memcpy(chKey, it->key().data(), 18);
 
-        bool fExists = 0;
-        for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
-        {
-            if (address != it->sAddress)
-                continue;
-            fExists = 1;
-            break;
-        };
+    return true;
+};
 
-        if (fExists)
-            continue;
+bool SecMsgDB::ReadSmesg(unsigned char *chKey, SecMsgStored &smsgStored)
+{
+    if (!pdb)
+        return false;
 
-        bool recvEnabled = 1;
-        bool recvAnon = 1;
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey.write((const char *)chKey, 18);
+    std::string strValue;
 
-        smsgAddresses.push_back(SecMsgAddress(address, recvEnabled, recvAnon));
-        nAdded++;
+    bool readFromDb = true;
+    if (activeBatch)
+    {
+        // -- check activeBatch first
+        bool deleted = false;
+        readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
+        if (deleted)
+            return false;
     };
 
-    if (fDebug)
-        printf("Added %u addresses to whitelist.\n", nAdded);
+    if (readFromDb)
+    {
+        leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
+        if (!s.ok())
+        {
+            if (s.IsNotFound())
+                return false;
+            printf("LevelDB read failure: %s\n", s.ToString().c_str());
+            return false;
+        };
+    };
 
-    return 0;
+    try
+    {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> smsgStored;
+    }
+    catch (std::exception &e)
+    {
+        printf("SecMsgDB::ReadSmesg() unserialize threw: %s.\n", e.what());
+        return false;
+    }
+
+    return true;
 };
 
-int SecureMsgReadIni()
+bool SecMsgDB::WriteSmesg(unsigned char *chKey, SecMsgStored &smsgStored)
 {
-    if (!fSecMsgEnabled)
+    if (!pdb)
         return false;
 
-    if (fDebug)
-        printf("SecureMsgReadIni()\n");
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey.write((const char *)chKey, 18);
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << smsgStored;
 
-    fs::path fullpath = GetDataDir() / "smsg.ini";
+    // -- the record and its index entries are written together
+    leveldb::WriteBatch batch;
+    leveldb::WriteBatch *pbatch = activeBatch ? activeBatch : &batch;
+    pbatch->Put(ssKey.str(), ssValue.str());
+    SecureMsgPutIndexes(*pbatch, chKey, smsgStored);
 
-    FILE *fp;
-    errno = 0;
-    if (!(fp = fopen(fullpath.string().c_str(), "r")))
+    if (activeBatch)
+        return true;
+
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status s = pdb->Write(writeOptions, &batch);
+    if (!s.ok())
     {
-        printf("Error opening file: %s\n", strerror(errno));
-        return 1;
+        printf("SecMsgDB write failed: %s\n", s.ToString().c_str());
+        return false;
     };
 
-    char cLine[512];
-    char *pName, *pValue;
+    return true;
+};
 
-    char cAddress[64];
-    int addrRecv, addrRecvAnon;
+bool SecMsgDB::ExistsSmesg(unsigned char *chKey)
+{
+    if (!pdb)
+        return false;
 
-    while (fgets(cLine, 512, fp))
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey.write((const char *)chKey, 18);
+    std::string unused;
+
+    if (activeBatch)
     {
-        cLine[strcspn(cLine, "\n")] = '\0';
-        cLine[strcspn(cLine, "\r")] = '\0';
-        cLine[511] = '\0'; // for safety
+        bool deleted;
+        if (ScanBatch(ssKey, &unused, &deleted) && !deleted)
+        {
+            return true;
+        };
+    };
 
-        // -- check that line contains a name value pair and is not a comment, or section header
-        if (cLine[0] == '#' || cLine[0] == '[' || strcspn(cLine, "=") < 1)
-            continue;
+    leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
+    return s.IsNotFound() == false;
+    return true;
+};
 
-        if (!(pName = strtok(cLine, "=")) || !(pValue = strtok(NULL, "=")))
-            continue;
+bool SecMsgDB::EraseSmesg(unsigned char *chKey)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey.write((const char *)chKey, 18);
 
-        if (strcmp(pName, "newAddressRecv") == 0)
-        {
-            smsgOptions.fNewAddressRecv = (strcmp(pValue, "true") == 0) ? true : false;
-        }
-        else if (strcmp(pName, "newAddressAnon") == 0)
-        {
-            smsgOptions.fNewAddressAnon = (strcmp(pValue, "true") == 0) ? true : false;
-        }
-        else if (strcmp(pName, "key") == 0)
+    leveldb::WriteBatch batch;
+    leveldb::WriteBatch *pbatch = activeBatch ? activeBatch : &batch;
+    pbatch->Delete(ssKey.str());
+
+    // -- index keys are derived from fields that never change, so the committed
+    //    record is enough; only fall back to the batch for one written in it.
+    std::vector<std::string> vKeys;
+    std::string sUnreadKey, strValue;
+    SecMsgStored smsgStored;
+    bool fFound = false;
+    if (memcmp(chKey, "im", 2) == 0 || memcmp(chKey, "sm", 2) == 0)
+    {
+        if (pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue).ok())
         {
-            int rv = sscanf(pValue, "%64[^|]|%d|%d", cAddress, &addrRecv, &addrRecvAnon);
-            if (rv == 3)
+            try
             {
-                smsgAddresses.push_back(SecMsgAddress(std::string(cAddress), addrRecv, addrRecvAnon));
+                CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> smsgStored;
+                fFound = true;
             }
-            else
+            catch (std::exception &e)
             {
-                printf("Could not parse key line %s, rv %d.\n", pValue, rv);
+                printf("SecMsgDB::EraseSmesg() unserialize threw: %s.\n", e.what());
             }
-        }
-        else
+        } else
+        if (activeBatch)
         {
-            printf("Unknown setting name: '%s'.", pName);
+            fFound = ReadSmesg(chKey, smsgStored);
         };
+        SecureMsgForgetPlaintext(chKey);
     };
 
-    printf("Loaded %" PRIszu " addresses.\n", smsgAddresses.size());
+    if (fFound && SecureMsgIndexKeys(chKey, smsgStored, vKeys, sUnreadKey))
+    {
+        for (std::vector<std::string>::iterator it = vKeys.begin(); it != vKeys.end(); ++it)
+            pbatch->Delete(*it);
+        if (!sUnreadKey.empty())
+            pbatch->Delete(sUnreadKey);
+    };
 
-    fclose(fp);
+    if (activeBatch)
+        return true;
 
-    return 0;
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status s = pdb->Write(writeOptions, &batch);
+
+    if (s.ok() || s.IsNotFound())
+        return true;
+    printf("SecMsgDB erase failed: %s\n", s.ToString().c_str());
+    return false;
 };
 
-int SecureMsgWriteIni()
+bool SecMsgDB::BuildIndexes()
 {
-    if (!fSecMsgEnabled)
+    // -- index the inbox and outbox of a db written before the indexes existed
+    if (!pdb)
         return false;
 
-    if (fDebug)
-        printf("SecureMsgWriteIni()\n");
+    std::string strValue;
+    if (pdb->Get(leveldb::ReadOptions(), "iv", &strValue).ok()
+        && strValue == boost::lexical_cast<std::string>(SMSG_INDEX_VERSION))
+        return true;
 
-    fs::path fullpath = GetDataDir() / "smsg.ini~";
-
-    FILE *fp;
-    errno = 0;
-    if (!(fp = fopen(fullpath.string().c_str(), "w")))
-    {
-        printf("Error opening file: %s\n", strerror(errno));
-        return 1;
-    };
+    printf("SecMsgDB: building inbox and outbox indexes.\n");
 
-    if (fwrite("[Options]\n", sizeof(char), 10, fp) != 10)
-    {
-        printf("fwrite error: %s\n", strerror(errno));
-        fclose(fp);
-        return false;
-    };
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
 
-    if (fprintf(fp, "newAddressRecv=%s\n", smsgOptions.fNewAddressRecv ? "true" : "false") < 0 || fprintf(fp, "newAddressAnon=%s\n", smsgOptions.fNewAddressAnon ? "true" : "false") < 0)
+    uint32_t nIndexed = 0;
+    const char *prefixes[] = {"im", "sm"};
+    for (int i = 0; i < 2; ++i)
     {
-        printf("fprintf error: %s\n", strerror(errno));
-        fclose(fp);
-        return false;
-    }
+        std::string sPrefix(prefixes[i]);
+        unsigned char chKey[18];
+        SecMsgStored smsgStored;
+        leveldb::WriteBatch batch;
+        uint32_t nBatch = 0;
 
-    if (fwrite("\n[Keys]\n", sizeof(char), 8, fp) != 8)
-    {
-        printf("fwrite error: %s\n", strerror(errno));
-        fclose(fp);
-        return false;
-    };
-    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
-    {
-        errno = 0;
-        if (fprintf(fp, "key=%s|%d|%d\n", it->sAddress.c_str(), it->fReceiveEnabled, it->fReceiveAnon) < 0)
+        leveldb::Iterator *it = pdb->NewIterator(leveldb::ReadOptions());
+        while (NextSmesg(it, sPrefix, chKey, smsgStored))
         {
-            printf("fprintf error: %s\n", strerror(errno));
-            continue;
+            SecureMsgPutIndexes(batch, chKey, smsgStored);
+            nIndexed++;
+            if (++nBatch < 1000)
+                continue;
+            pdb->Write(writeOptions, &batch);
+            batch.Clear();
+            nBatch = 0;
         };
-    };
+        delete it;
 
-    fclose(fp);
+        if (nBatch > 0)
+            pdb->Write(writeOptions, &batch);
+    };
 
-    try
-    {
-        fs::path finalpath = GetDataDir() / "smsg.ini";
-        fs::rename(fullpath, finalpath);
-    }
-    catch (const fs::filesystem_error &ex)
+    leveldb::Status s = pdb->Put(writeOptions, "iv", boost::lexical_cast<std::string>(SMSG_INDEX_VERSION));
+    if (!s.ok())
     {
-        printf("Error renaming file %s, %s.\n", fullpath.string().c_str(), ex.what());
+        printf("SecMsgDB::BuildIndexes() failed: %s\n", s.ToString().c_str());
+        return false;
     };
-    return 0;
+
+    printf("SecMsgDB: indexed %u messages.\n", nIndexed);
+    return true;
 };
 
-/** called from AppInit2() in init.cpp */
-bool SecureMsgStart(bool fDontStart, bool fScanChain)
+void ThreadSecureMsg(void *parg)
 {
-    if (fDontStart)
+    // -- bucket management thread
+    RenameThread("shadowcoin-smsg"); // Make this thread recognisable
+
+    uint32_t delay = 0;
+
+    while (fSecMsgEnabled)
     {
-        printf("Secure messaging not started.\n");
-        return false;
-    };
+        // shutdown thread waits 5 seconds, this should be less
+        MilliSleep(1000); // milliseconds
 
-    printf("Secure messaging starting.\n");
+        if (!fSecMsgEnabled) // check again after sleep
+            break;
 
-    fSecMsgEnabled = true;
+        delay++;
+        if (delay < SMSG_THREAD_DELAY) // check every SMSG_THREAD_DELAY seconds
+            continue;
+        delay = 0;
 
-    if (SecureMsgReadIni() != 0)
-        printf("Failed to read smsg.ini\n");
+        int64_t now = GetTime();
 
-    if (smsgAddresses.size() < 1)
-    {
-        printf("No address keys loaded.\n");
-        if (SecureMsgAddWalletAddresses() != 0)
-            printf("Failed to load addresses from wallet.\n");
-    };
+        if (fDebug)
+            printf("SecureMsgThread %" PRId64 " \n", now);
 
-    if (fScanChain)
-    {
-        SecureMsgScanBlockChain();
-    };
+        int64_t cutoffTime = now - SMSG_RETENTION;
 
-    if (SecureMsgBuildBucketSet() != 0)
-    {
-        printf("SecureMsg could not load bucket sets, secure messaging disabled.\n");
-        fSecMsgEnabled = false;
-        return false;
-    };
+        {
+            LOCK(cs_smsg);
+            std::map<int64_t, SecMsgBucket>::iterator it;
+            it = smsgBuckets.begin();
 
-    // -- start threads
-    if (!NewThread(ThreadSecureMsg, NULL) || !NewThread(ThreadSecureMsgPow, NULL))
-    {
-        printf("SecureMsg could not start threads, secure messaging disabled.\n");
-        fSecMsgEnabled = false;
-        return false;
-    };
+            while (it != smsgBuckets.end())
+            {
+                //if (fDebug)
+                //    printf("Checking bucket %"PRId64", size %"PRIszu" \n", it->first, it->second.setTokens.size());
+                if (it->first < cutoffTime)
+                {
+                    if (fDebug)
+                        printf("Removing bucket %" PRId64 " \n", it->first);
+                    SecureMsgUnmapSegment(it->first);
+                    std::string fileName = boost::lexical_cast<std::string>(it->first) + "_01.dat";
+                    fs::path fullPath = GetDataDir() / "smsgStore" / fileName;
+                    if (fs::exists(fullPath))
+                    {
+                        try
+                        {
+                            fs::remove(fullPath);
+                        }
+                        catch (const fs::filesystem_error &ex)
+                        {
+                            printf("Error removing bucket file %s.\n", ex.what());
+                        };
+                    }
+                    else
+                        printf("Path %s does not exist \n", fullPath.string().c_str());
 
-    return true;
-};
+                    fullPath = SecureMsgBucketPath(it->first, "_01.idx");
+                    if (fs::exists(fullPath))
+                    {
+                        try
+                        {
+                            fs::remove(fullPath);
+                        }
+                        catch (const fs::filesystem_error &ex)
+                        {
+                            printf("Error removing bucket index %s.\n", ex.what());
+                        };
+                    };
 
-/** called from Shutdown() in init.cpp */
-bool SecureMsgShutdown()
-{
-    if (!fSecMsgEnabled)
-        return false;
+                    // -- look for a wl file, it stores incoming messages when wallet is locked
+                    fileName = boost::lexical_cast<std::string>(it->first) + "_01_wl.dat";
+                    fullPath = GetDataDir() / "smsgStore" / fileName;
+                    if (fs::exists(fullPath))
+                    {
+                        try
+                        {
+                            fs::remove(fullPath);
+                        }
+                        catch (const fs::filesystem_error &ex)
+                        {
+                            printf("Error removing wallet locked file %s.\n", ex.what());
+                        };
+                    };
 
-    printf("Stopping secure messaging.\n");
+                    smsgBuckets.erase(it++);
+                }
+                else
+                {
+                    // -- tick down nLockCount, so will eventually expire if peer never sends data
+                    if (it->second.nLockCount > 0)
+                    {
+                        it->second.nLockCount--;
 
-    if (SecureMsgWriteIni() != 0)
-        printf("Failed to save smsg.ini\n");
+                        if (it->second.nLockCount == 0) // lock timed out
+                        {
+                            uint32_t nPeerId = it->second.nLockPeerId;
+                            int64_t ignoreUntil = GetTime() + SMSG_TIME_IGNORE;
 
-    fSecMsgEnabled = false;
+                            if (fDebug)
+                                printf("Lock on bucket %" PRId64 " for peer %u timed out.\n", it->first, nPeerId);
+                            // -- look through the nodes for the peer that locked this bucket
+                            LOCK(cs_vNodes);
+                            BOOST_FOREACH (CNode *pnode, vNodes)
+                            {
+                                if (pnode->smsgData.nPeerId != nPeerId)
+                                    continue;
+                                pnode->smsgData.ignoreUntil = ignoreUntil;
 
-    if (smsgDB)
-    {
-        LOCK(cs_smsgDB);
-        delete smsgDB;
-        smsgDB = NULL;
-    };
+                                // -- alert peer that they are being ignored
+                                std::vector<unsigned char> vchData;
+                                vchData.resize(8);
+                                memcpy(&vchData[0], &ignoreUntil, 8);
+                                pnode->PushMessage("smsgIgnore", vchData);
 
-    // -- main program will wait 5 seconds for threads to terminate.
+                                if (fDebug)
+                                    printf("This node will ignore peer %u until %" PRId64 ".\n", nPeerId, ignoreUntil);
+                                break;
+                            };
+                            it->second.nLockPeerId = 0;
+                        }; // if (it->second.nLockCount == 0)
+                    };
+                    ++it;
+                }; // ! if (it->first < cutoffTime)
+            };
 
-    return true;
+            SecureMsgCompactStore();
+        }; // LOCK(cs_smsg);
+    };
+
+    printf("ThreadSecureMsg exited.\n");
 };
 
-bool SecureMsgEnable()
+void ThreadSecureMsgPow(void *parg)
 {
-    // -- start secure messaging at runtime
-    if (fSecMsgEnabled)
-    {
-        printf("SecureMsgEnable: secure messaging is already enabled.\n");
-        return false;
-    };
-
-    {
-        LOCK(cs_smsg);
-        fSecMsgEnabled = true;
+    // -- proof of work thread
+    RenameThread("shadowcoin-smsg-pow"); // Make this thread recognisable
 
-        smsgAddresses.clear(); // should be empty already
-        if (SecureMsgReadIni() != 0)
-            printf("Failed to read smsg.ini\n");
+    int rv;
+    std::vector<unsigned char> vchKey;
+    SecMsgStored smsgStored;
 
-        if (smsgAddresses.size() < 1)
-        {
-            printf("No address keys loaded.\n");
-            if (SecureMsgAddWalletAddresses() != 0)
-                printf("Failed to load addresses from wallet.\n");
-        };
+    std::string sPrefix("qm");
+    unsigned char chKey[18];
 
-        smsgBuckets.clear(); // should be empty already
+    while (fSecMsgEnabled)
+    {
+        // -- sleep at end, then fSecMsgEnabled is tested on wake
 
-        if (SecureMsgBuildBucketSet() != 0)
+        SecMsgDB dbOutbox;
+        leveldb::Iterator *it;
         {
-            printf("SecureMsgEnable: could not load bucket sets, secure messaging disabled.\n");
-            fSecMsgEnabled = false;
-            return false;
-        };
+            LOCK(cs_smsgDB);
 
-    }; // LOCK(cs_smsg);
+            if (!dbOutbox.Open("cr+"))
+                continue;
 
-    // -- start threads
-    if (!NewThread(ThreadSecureMsg, NULL) || !NewThread(ThreadSecureMsgPow, NULL))
-    {
-        printf("SecureMsgEnable could not start threads, secure messaging disabled.\n");
-        fSecMsgEnabled = false;
-        return false;
-    };
+            // -- fifo (smallest key first)
+            it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
+        }
+        // -- break up lock, SecureMsgSetHash will take long
 
-    // -- ping each peer, don't know which have messaging enabled
-    {
-        LOCK(cs_vNodes);
-        BOOST_FOREACH (CNode *pnode, vNodes)
+        for (;;)
         {
-            pnode->PushMessage("smsgPing");
-            pnode->PushMessage("smsgPong"); // Send pong as have missed initial ping sent by peer when it connected
+            {
+                LOCK(cs_smsgDB);
+                if (!dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
+                    break;
+            }
+
+            unsigned char *pHeader = &smsgStored.vchMessage[0];
+            unsigned char *pPayload = &smsgStored.vchMessage[SMSG_HDR_LEN];
+            SecureMessage *psmsg = (SecureMessage *)pHeader;
+
+            // -- do proof of work
+            rv = SecureMsgSetHash(pHeader, pPayload, psmsg->nPayload);
+            if (rv == 2)
+                break; // /eave message in db, if terminated due to shutdown
+
+            // -- message is removed here, no matter what
+            {
+                LOCK(cs_smsgDB);
+                dbOutbox.EraseSmesg(chKey);
+            }
+            if (rv != 0)
+            {
+                printf("SecMsgPow: Could not get proof of work hash, message removed.\n");
+                continue;
+            };
+
+            // -- add to message store
+            {
+                LOCK(cs_smsg);
+                if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload, true) != 0)
+                {
+                    printf("SecMsgPow: Could not place message in buckets, message removed.\n");
+                    continue;
+                };
+            }
+
+            // -- test if message was sent to self
+            if (SecureMsgScanMessage(pHeader, pPayload, psmsg->nPayload, true) != 0)
+            {
+                // message recipient is not this node (or failed)
+            };
         };
-    }
 
-    printf("Secure messaging enabled.\n");
-    return true;
+        {
+            LOCK(cs_smsg);
+            delete it;
+        }
+
+        // -- shutdown thread waits 5 seconds, this should be less
+        MilliSleep(1000); // milliseconds
+    };
+
+    printf("ThreadSecureMsgPow exited.\n");
 };
 
-bool SecureMsgDisable()
+std::string getTimeString(int64_t timestamp, char *buffer, size_t nBuffer)
 {
-    // -- stop secure messaging at runtime
-    if (!fSecMsgEnabled)
+    struct tm *dt;
+    time_t t = timestamp;
+    dt = localtime(&t);
+
+    strftime(buffer, nBuffer, "%Y-%m-%d %H:%M:%S %z", dt); // %Z shows long strings on windows
+    return std::string(buffer);                            // copies the null-terminated character sequence
+};
+
+std::string fsReadable(uint64_t nBytes)
+{
+    char buffer[128];
+    if (nBytes >= 1024ll * 1024ll * 1024ll * 1024ll)
+        snprintf(buffer, sizeof(buffer), "%.2f TB", nBytes / 1024.0 / 1024.0 / 1024.0 / 1024.0);
+    else if (nBytes >= 1024 * 1024 * 1024)
+        snprintf(buffer, sizeof(buffer), "%.2f GB", nBytes / 1024.0 / 1024.0 / 1024.0);
+    else if (nBytes >= 1024 * 1024)
+        snprintf(buffer, sizeof(buffer), "%.2f MB", nBytes / 1024.0 / 1024.0);
+    else if (nBytes >= 1024)
+        snprintf(buffer, sizeof(buffer), "%.2f KB", nBytes / 1024.0);
+    else
+        snprintf(buffer, sizeof(buffer), "%" PRIu64 " bytes", nBytes);
+    return std::string(buffer);
+};
+
+int SecureMsgBuildBucketSet()
+{
+    /*
+        Build the bucket set by scanning the files in the smsgStore dir.
+        
+        smsgBuckets should be empty
+    */
+
+    if (fDebug)
+        printf("SecureMsgBuildBucketSet()\n");
+
+    int64_t now = GetTime();
+    uint32_t nFiles = 0;
+    uint32_t nMessages = 0;
+
+    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
+    fs::directory_iterator itend;
+
+    if (!fs::exists(pathSmsgDir) || !fs::is_directory(pathSmsgDir))
     {
-        printf("SecureMsgDisable: secure messaging is already disabled.\n");
-        return false;
-    };
+        printf("Message store directory does not exist.\n");
+        return 0; // not an error
+    }
 
+    for (fs::directory_iterator itd(pathSmsgDir); itd != itend; ++itd)
     {
-        LOCK(cs_smsg);
-        fSecMsgEnabled = false;
+        if (!fs::is_regular_file(itd->status()))
+            continue;
 
-        // -- clear smsgBuckets
-        std::map<int64_t, SecMsgBucket>::iterator it;
-        it = smsgBuckets.begin();
-        for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
+        std::string fileType = (*itd).path().extension().string();
+
+        if (fileType.compare(".dat") != 0 && fileType.compare(".idx") != 0)
+            continue;
+
+        std::string fileName = (*itd).path().filename().string();
+
+        if (fDebug)
+            printf("Processing file: %s.\n", fileName.c_str());
+
+        nFiles++;
+
+        // TODO files must be split if > 2GB
+        // time_noFile.dat
+        size_t sep = fileName.find_first_of("_");
+        if (sep == std::string::npos)
+            continue;
+
+        std::string stime = fileName.substr(0, sep);
+
+        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
+
+        if (fileTime < now - SMSG_RETENTION)
         {
-            it->second.setTokens.clear();
+            printf("Dropping file %s, expired.\n", fileName.c_str());
+            try
+            {
+                fs::remove((*itd).path());
+            }
+            catch (const fs::filesystem_error &ex)
+            {
+                printf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
+            };
+            continue;
         };
-        smsgBuckets.clear();
 
-        // -- tell each smsg enabled peer that this node is disabling
+        if (boost::algorithm::ends_with(fileName, "_wl.dat"))
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode *pnode, vNodes)
-            {
-                if (!pnode->smsgData.fEnabled)
-                    continue;
+            if (fDebug)
+                printf("Skipping wallet locked file: %s.\n", fileName.c_str());
+            continue;
+        };
 
-                pnode->PushMessage("smsgDisabled");
-                pnode->smsgData.fEnabled = false;
-            };
-        }
+        // -- indexes are read with their segment
+        if (fileType.compare(".idx") == 0)
+            continue;
 
-        if (SecureMsgWriteIni() != 0)
-            printf("Failed to save smsg.ini\n");
+        std::set<SecMsgToken> &tokenSet = smsgBuckets[fileTime].setTokens;
 
-        smsgAddresses.clear();
+        {
+            LOCK(cs_smsg);
+            if (SecureMsgLoadBucket(fileTime, smsgBuckets[fileTime]) != 0)
+                printf("Could not load bucket %" PRId64 ".\n", fileTime);
+        };
+        smsgBuckets[fileTime].hashBucket();
 
-    }; // LOCK(cs_smsg);
+        nMessages += tokenSet.size();
 
-    // -- allow time for threads to stop
-    MilliSleep(3000); // milliseconds
-    // TODO be certain that threads have stopped
+        if (fDebug)
+            printf("Bucket %" PRId64 " contains %" PRIszu " messages.\n", fileTime, tokenSet.size());
+    };
 
-    if (smsgDB)
+    printf("Processed %u files, loaded %" PRIszu " buckets containing %u messages.\n", nFiles, smsgBuckets.size(), nMessages);
+
+    return 0;
+};
+
+int SecureMsgAddWalletAddresses()
+{
+    if (fDebug)
+        printf("SecureMsgAddWalletAddresses()\n");
+
+    uint32_t nAdded = 0;
+    BOOST_FOREACH (const PAIRTYPE(CTxDestination, std::string) & entry, pwalletMain->mapAddressBook)
     {
-        LOCK(cs_smsgDB);
-        delete smsgDB;
-        smsgDB = NULL;
+        if (!IsMine(*pwalletMain, entry.first))
+            continue;
+
+        CBitcoinAddress coinAddress(entry.first);
+        if (!coinAddress.IsValid())
+            continue;
+
+        std::string address;
+        std::string strPublicKey;
+        address = coinAddress.ToString();
+
+        bool fExists = 0;
+        for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+        {
+            if (address != it->sAddress)
+                continue;
+            fExists = 1;
+            break;
+        };
+
+        if (fExists)
+            continue;
+
+        bool recvEnabled = 1;
+        bool recvAnon = 1;
+
+        smsgAddresses.push_back(SecMsgAddress(address, recvEnabled, recvAnon));
+        nAdded++;
     };
 
-    printf("Secure messaging disabled.\n");
-    return true;
+    if (fDebug)
+        printf("Added %u addresses to whitelist.\n", nAdded);
+
+    return 0;
 };
 
-bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRecv)
+int SecureMsgReadIni()
 {
-    /*
-        Called from ProcessMessage
-        Runs in ThreadMessageHandler2
-    */
+    if (!fSecMsgEnabled)
+        return false;
 
     if (fDebug)
-        printf("SecureMsgReceiveData() %s %s.\n", pfrom->addrName.c_str(), strCommand.c_str());
+        printf("SecureMsgReadIni()\n");
 
-    {
-        // break up?
+    fs::path fullpath = GetDataDir() / "smsg.ini";
+
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(fullpath.string().c_str(), "r")))
+    {
+        printf("Error opening file: %s\n", strerror(errno));
+        return 1;
+    };
+
+    char cLine[512];
+    char *pName, *pValue;
+
+    char cAddress[64];
+    int addrRecv, addrRecvAnon;
+
+    while (fgets(cLine, 512, fp))
+    {
+        cLine[strcspn(cLine, "\n")] = '\0';
+        cLine[strcspn(cLine, "\r")] = '\0';
+        cLine[511] = '\0'; // for safety
+
+        // -- check that line contains a name value pair and is not a comment, or section header
+        if (cLine[0] == '#' || cLine[0] == '[' || strcspn(cLine, "=") < 1)
+            continue;
+
+        if (!(pName = strtok(cLine, "=")) || !(pValue = strtok(NULL, "=")))
+            continue;
+
+        if (strcmp(pName, "newAddressRecv") == 0)
+        {
+            smsgOptions.fNewAddressRecv = (strcmp(pValue, "true") == 0) ? true : false;
+        }
+        else if (strcmp(pName, "newAddressAnon") == 0)
+        {
+            smsgOptions.fNewAddressAnon = (strcmp(pValue, "true") == 0) ? true : false;
+        }
+        else if (strcmp(pName, "key") == 0)
+        {
+            int rv = sscanf(pValue, "%64[^|]|%d|%d", cAddress, &addrRecv, &addrRecvAnon);
+            if (rv == 3)
+            {
+                smsgAddresses.push_back(SecMsgAddress(std::string(cAddress), addrRecv, addrRecvAnon));
+            }
+            else
+            {
+                printf("Could not parse key line %s, rv %d.\n", pValue, rv);
+            }
+        }
+        else
+        {
+            printf("Unknown setting name: '%s'.", pName);
+        };
+    };
+
+    printf("Loaded %" PRIszu " addresses.\n", smsgAddresses.size());
+
+    fclose(fp);
+
+    return 0;
+};
+
+int SecureMsgWriteIni()
+{
+    if (!fSecMsgEnabled)
+        return false;
+
+    if (fDebug)
+        printf("SecureMsgWriteIni()\n");
+
+    fs::path fullpath = GetDataDir() / "smsg.ini~";
+
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(fullpath.string().c_str(), "w")))
+    {
+        printf("Error opening file: %s\n", strerror(errno));
+        return 1;
+    };
+
+    if (fwrite("[Options]\n", sizeof(char), 10, fp) != 10)
+    {
+        printf("fwrite error: %s\n", strerror(errno));
+        fclose(fp);
+        return false;
+    };
+
+    if (fprintf(fp, "newAddressRecv=%s\n", smsgOptions.fNewAddressRecv ? "true" : "false") < 0 || fprintf(fp, "newAddressAnon=%s\n", smsgOptions.fNewAddressAnon ? "true" : "false") < 0)
+    {
+        printf("fprintf error: %s\n", strerror(errno));
+        fclose(fp);
+        return false;
+    }
+
+    if (fwrite("\n[Keys]\n", sizeof(char), 8, fp) != 8)
+    {
+        printf("fwrite error: %s\n", strerror(errno));
+        fclose(fp);
+        return false;
+    };
+    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    {
+        errno = 0;
+        if (fprintf(fp, "key=%s|%d|%d\n", it->sAddress.c_str(), it->fReceiveEnabled, it->fReceiveAnon) < 0)
+        {
+            printf("fprintf error: %s\n", strerror(errno));
+            continue;
+        };
+    };
+
+    fclose(fp);
+
+    try
+    {
+        fs::path finalpath = GetDataDir() / "smsg.ini";
+        fs::rename(fullpath, finalpath);
+    }
+    catch (const fs::filesystem_error &ex)
+    {
+        printf("Error renaming file %s, %s.\n", fullpath.string().c_str(), ex.what());
+    };
+    return 0;
+};
+
+/** called from AppInit2() in init.cpp */
+bool SecureMsgStart(bool fDontStart, bool fScanChain)
+{
+    if (fDontStart)
+    {
+        printf("Secure messaging not started.\n");
+        return false;
+    };
+
+    printf("Secure messaging starting.\n");
+
+    fSecMsgEnabled = true;
+    SecureMsgWatchWalletLock();
+    SecureMsgReadQuota();
+
+    if (SecureMsgReadIni() != 0)
+        printf("Failed to read smsg.ini\n");
+
+    if (smsgAddresses.size() < 1)
+    {
+        printf("No address keys loaded.\n");
+        if (SecureMsgAddWalletAddresses() != 0)
+            printf("Failed to load addresses from wallet.\n");
+    };
+
+    if (fScanChain)
+    {
+        SecureMsgRescanPubkeys();
+    };
+
+    if (SecureMsgBuildBucketSet() != 0)
+    {
+        printf("SecureMsg could not load bucket sets, secure messaging disabled.\n");
+        fSecMsgEnabled = false;
+        return false;
+    };
+
+    // -- start threads
+    if (!NewThread(ThreadSecureMsg, NULL) || !NewThread(ThreadSecureMsgPow, NULL)
+        || !NewThread(ThreadSecureMsgPubkeys, NULL))
+    {
+        printf("SecureMsg could not start threads, secure messaging disabled.\n");
+        fSecMsgEnabled = false;
+        return false;
+    };
+
+    return true;
+};
+
+/** called from Shutdown() in init.cpp */
+bool SecureMsgShutdown()
+{
+    if (!fSecMsgEnabled)
+        return false;
+
+    printf("Stopping secure messaging.\n");
+
+    if (SecureMsgWriteIni() != 0)
+        printf("Failed to save smsg.ini\n");
+
+    fSecMsgEnabled = false;
+    SecureMsgClearKeyCache();
+
+    {
         LOCK(cs_smsg);
+        mapSmsgSegments.clear();
+    };
 
-        if (strCommand == "smsgInv")
+    if (smsgDB)
+    {
+        LOCK(cs_smsgDB);
+        delete smsgDB;
+        smsgDB = NULL;
+    };
+
+    // -- main program will wait 5 seconds for threads to terminate.
+
+    return true;
+};
+
+bool SecureMsgEnable()
+{
+    // -- start secure messaging at runtime
+    if (fSecMsgEnabled)
+    {
+        printf("SecureMsgEnable: secure messaging is already enabled.\n");
+        return false;
+    };
+
+    {
+        LOCK(cs_smsg);
+        fSecMsgEnabled = true;
+        SecureMsgWatchWalletLock();
+        SecureMsgReadQuota();
+
+        smsgAddresses.clear(); // should be empty already
+        if (SecureMsgReadIni() != 0)
+            printf("Failed to read smsg.ini\n");
+
+        if (smsgAddresses.size() < 1)
+        {
+            printf("No address keys loaded.\n");
+            if (SecureMsgAddWalletAddresses() != 0)
+                printf("Failed to load addresses from wallet.\n");
+        };
+
+        smsgBuckets.clear(); // should be empty already
+
+        if (SecureMsgBuildBucketSet() != 0)
+        {
+            printf("SecureMsgEnable: could not load bucket sets, secure messaging disabled.\n");
+            fSecMsgEnabled = false;
+            return false;
+        };
+
+    }; // LOCK(cs_smsg);
+
+    // -- start threads
+    if (!NewThread(ThreadSecureMsg, NULL) || !NewThread(ThreadSecureMsgPow, NULL)
+        || !NewThread(ThreadSecureMsgPubkeys, NULL))
+    {
+        printf("SecureMsgEnable could not start threads, secure messaging disabled.\n");
+        fSecMsgEnabled = false;
+        return false;
+    };
+
+    // -- ping each peer, don't know which have messaging enabled
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode *pnode, vNodes)
+        {
+            pnode->PushMessage("smsgPing", SMSG_PROTOCOL_VERSION);
+            pnode->PushMessage("smsgPong", SMSG_PROTOCOL_VERSION); // Send pong as have missed initial ping sent by peer when it connected
+        };
+    }
+
+    printf("Secure messaging enabled.\n");
+    return true;
+};
+
+bool SecureMsgDisable()
+{
+    // -- stop secure messaging at runtime
+    if (!fSecMsgEnabled)
+    {
+        printf("SecureMsgDisable: secure messaging is already disabled.\n");
+        return false;
+    };
+
+    {
+        LOCK(cs_smsg);
+        fSecMsgEnabled = false;
+
+        // -- clear smsgBuckets
+        std::map<int64_t, SecMsgBucket>::iterator it;
+        it = smsgBuckets.begin();
+        for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
+        {
+            it->second.setTokens.clear();
+        };
+        smsgBuckets.clear();
+        mapSmsgSegments.clear();
+
+        // -- tell each smsg enabled peer that this node is disabling
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH (CNode *pnode, vNodes)
+            {
+                if (!pnode->smsgData.fEnabled)
+                    continue;
+
+                pnode->PushMessage("smsgDisabled");
+                pnode->smsgData.fEnabled = false;
+            };
+        }
+
+        if (SecureMsgWriteIni() != 0)
+            printf("Failed to save smsg.ini\n");
+
+        smsgAddresses.clear();
+        SecureMsgClearKeyCache();
+
+    }; // LOCK(cs_smsg);
+
+    // -- allow time for threads to stop
+    MilliSleep(3000); // milliseconds
+    // TODO be certain that threads have stopped
+
+    if (smsgDB)
+    {
+        LOCK(cs_smsgDB);
+        delete smsgDB;
+        smsgDB = NULL;
+    };
+
+    printf("Secure messaging disabled.\n");
+    return true;
+};
+
+bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRecv)
+{
+    /*
+        Called from ProcessMessage
+        Runs in ThreadMessageHandler2
+    */
+
+    if (fDebug)
+        printf("SecureMsgReceiveData() %s %s.\n", pfrom->addrName.c_str(), strCommand.c_str());
+
+    {
+        // break up?
+        LOCK(cs_smsg);
+
+        if (strCommand == "smsgInv")
+        {
+            std::vector<unsigned char> vchData;
+            vRecv >> vchData;
+
+            if (vchData.size() < 4)
+            {
+                pfrom->Misbehaving(1);
+                return false; // not enough data received to be a valid smsgInv
+            };
+
+            int64_t now = GetTime();
+
+            if (now < pfrom->smsgData.ignoreUntil)
+            {
+                if (fDebug)
+                    printf("Node is ignoring peer %u until %" PRId64 ".\n", pfrom->smsgData.nPeerId, pfrom->smsgData.ignoreUntil);
+                return false;
+            };
+
+            uint32_t nBuckets = smsgBuckets.size();
+            uint32_t nLocked = 0; // no. of locked buckets on this node
+            uint32_t nInvBuckets; // no. of bucket headers sent by peer in smsgInv
+            memcpy(&nInvBuckets, &vchData[0], 4);
+            if (fDebug)
+                printf("Remote node sent %d bucket headers, this has %d.\n", nInvBuckets, nBuckets);
+
+            // -- Check no of buckets:
+            if (nInvBuckets > (SMSG_RETENTION / SMSG_BUCKET_LEN) + 1) // +1 for some leeway
+            {
+                printf("Peer sent more bucket headers than possible %u, %u.\n", nInvBuckets, (SMSG_RETENTION / SMSG_BUCKET_LEN));
+                pfrom->Misbehaving(1);
+                return false;
+            };
+
+            if (vchData.size() < 4 + nInvBuckets * 16)
+            {
+                printf("Remote node did not send enough data.\n");
+                pfrom->Misbehaving(1);
+                return false;
+            };
+
+            bool fReconcile = pfrom->smsgData.nVersion >= SMSG_VERSION_RECONCILE;
+
+            uint32_t nStoreMessages;
+            uint64_t nStoreBytes;
+            SecureMsgStoreTotals(nStoreMessages, nStoreBytes);
+
+            std::vector<unsigned char> vchDataOut;
+            vchDataOut.reserve(4 + 8 * nInvBuckets); // reserve max possible size
+            vchDataOut.resize(4);
+            uint32_t nShowBuckets = 0;
+
+            unsigned char *p = &vchData[4];
+            for (uint32_t i = 0; i < nInvBuckets; ++i)
+            {
+                int64_t time;
+                uint32_t ncontent, hash;
+                memcpy(&time, p, 8);
+                memcpy(&ncontent, p + 8, 4);
+                memcpy(&hash, p + 12, 4);
+
+                p += 16;
+
+                // Check time valid:
+                if (time < now - SMSG_RETENTION)
+                {
+                    if (fDebug)
+                        printf("Not interested in peer bucket %" PRId64 ", has expired.\n", time);
+
+                    if (time < now - SMSG_RETENTION - SMSG_TIME_LEEWAY)
+                        pfrom->Misbehaving(1);
+                    continue;
+                };
+                if (time > now + SMSG_TIME_LEEWAY)
+                {
+                    if (fDebug)
+                        printf("Not interested in peer bucket %" PRId64 ", in the future.\n", time);
+                    pfrom->Misbehaving(1);
+                    continue;
+                };
+
+                if (ncontent < 1)
+                {
+                    if (fDebug)
+                        printf("Peer sent empty bucket, ignore %" PRId64 " %u %u.\n", time, ncontent, hash);
+                    continue;
+                };
+
+                if (fDebug)
+                {
+                    printf("peer bucket %" PRId64 " %u %u.\n", time, ncontent, hash);
+                    printf("this bucket %" PRId64 " %" PRIszu " %u.\n", time, smsgBuckets[time].setTokens.size(), smsgBuckets[time].nDigest);
+                };
+
+                if (smsgBuckets[time].nLockCount > 0)
+                {
+                    if (fDebug)
+                        printf("Bucket is locked %u, waiting for peer %u to send data.\n", smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
+                    nLocked++;
+                    continue;
+                };
+
+                if (SecureMsgAdmit(time, 0, nStoreMessages, nStoreBytes) != 0)
+                {
+                    if (fDebug)
+                        printf("No room for bucket %" PRId64 ", not requesting.\n", time);
+                    continue;
+                };
+
+                // -- if this node has more than the peer node, peer node will pull from this
+                //    if then peer node has more this node will pull fom peer
+                uint32_t nThisHash = fReconcile ? smsgBuckets[time].nDigest : smsgBuckets[time].legacyHash();
+                if (smsgBuckets[time].setTokens.size() < ncontent || (smsgBuckets[time].setTokens.size() == ncontent && nThisHash != hash)) // if same amount in buckets check hash
+                {
+                    if (fDebug)
+                        printf("Requesting contents of bucket %" PRId64 ".\n", time);
+
+                    uint32_t sz = vchDataOut.size();
+                    vchDataOut.resize(sz + 8);
+                    memcpy(&vchDataOut[sz], &time, 8);
+
+                    nShowBuckets++;
+                };
+            };
+
+            // TODO: should include hash?
+            memcpy(&vchDataOut[0], &nShowBuckets, 4);
+            if (vchDataOut.size() > 4)
+            {
+                pfrom->PushMessage("smsgShow", vchDataOut);
+            }
+            else if (nLocked < 1) // Don't report buckets as matched if any are locked
+            {
+                // -- peer has no buckets we want, don't send them again until something changes
+                //    peer will still request buckets from this node if needed (< ncontent)
+                vchDataOut.resize(8);
+                memcpy(&vchDataOut[0], &now, 8);
+                pfrom->PushMessage("smsgMatch", vchDataOut);
+                if (fDebug)
+                    printf("Sending smsgMatch, %" PRId64 ".\n", now);
+            };
+        }
+        else if (strCommand == "smsgShow")
+        {
+            std::vector<unsigned char> vchData;
+            vRecv >> vchData;
+
+            if (vchData.size() < 4)
+                return false;
+
+            uint32_t nBuckets;
+            memcpy(&nBuckets, &vchData[0], 4);
+
+            if (vchData.size() < 4 + nBuckets * 8)
+                return false;
+
+            if (fDebug)
+                printf("smsgShow: peer wants to see content of %u buckets.\n", nBuckets);
+
+            std::map<int64_t, SecMsgBucket>::iterator itb;
+            std::set<SecMsgToken>::iterator it;
+
+            std::vector<unsigned char> vchDataOut;
+            int64_t time;
+            unsigned char *pIn = &vchData[4];
+            for (uint32_t i = 0; i < nBuckets; ++i, pIn += 8)
+            {
+                memcpy(&time, pIn, 8);
+
+                itb = smsgBuckets.find(time);
+                if (itb == smsgBuckets.end())
+                {
+                    if (fDebug)
+                        printf("Don't have bucket %" PRId64 ".\n", time);
+                    continue;
+                };
+
+                std::set<SecMsgToken> &tokenSet = (*itb).second.setTokens;
+
+                // -- peers that can reconcile get a sketch of the bucket and ask for the
+                //    partitions that differ, unless the full token list is smaller
+                if (pfrom->smsgData.nVersion >= SMSG_VERSION_RECONCILE && 16 * tokenSet.size() > 8 * SMSG_SKETCH_PARTS)
+                {
+                    uint32_t nCount[SMSG_SKETCH_PARTS], nDigest[SMSG_SKETCH_PARTS];
+                    (*itb).second.getSketch(nCount, nDigest);
+
+                    vchDataOut.resize(8 + 8 * SMSG_SKETCH_PARTS);
+                    memcpy(&vchDataOut[0], &time, 8);
+                    unsigned char *p = &vchDataOut[8];
+                    for (unsigned int k = 0; k < SMSG_SKETCH_PARTS; ++k, p += 8)
+                    {
+                        memcpy(p, &nCount[k], 4);
+                        memcpy(p + 4, &nDigest[k], 4);
+                    };
+                    pfrom->PushMessage("smsgSketch", vchDataOut);
+                    continue;
+                };
+
+                try
+                {
+                    vchDataOut.resize(8 + 16 * tokenSet.size());
+                }
+                catch (std::exception &e)
+                {
+                    printf("vchDataOut.resize %" PRIszu " threw: %s.\n", 8 + 16 * tokenSet.size(), e.what());
+                    continue;
+                };
+                memcpy(&vchDataOut[0], &time, 8);
+
+                unsigned char *p = &vchDataOut[8];
+                for (it = tokenSet.begin(); it != tokenSet.end(); ++it)
+                {
+                    memcpy(p, &it->timestamp, 8);
+                    memcpy(p + 8, &it->sample, 8);
+
+                    p += 16;
+                };
+                pfrom->PushMessage("smsgHave", vchDataOut);
+            };
+        }
+        else if (strCommand == "smsgHave")
+        {
+            // -- peer has these messages in bucket
+            std::vector<unsigned char> vchData;
+            vRecv >> vchData;
+
+            if (vchData.size() < 8)
+                return false;
+
+            int n = (vchData.size() - 8) / 16;
+
+            int64_t time;
+            memcpy(&time, &vchData[0], 8);
+
+            // -- Check time valid:
+            int64_t now = GetTime();
+            if (time < now - SMSG_RETENTION)
+            {
+                if (fDebug)
+                    printf("Not interested in peer bucket %" PRId64 ", has expired.\n", time);
+                return false;
+            };
+            if (time > now + SMSG_TIME_LEEWAY)
+            {
+                if (fDebug)
+                    printf("Not interested in peer bucket %" PRId64 ", in the future.\n", time);
+                pfrom->Misbehaving(1);
+                return false;
+            };
+
+            if (smsgBuckets[time].nLockCount > 0)
+            {
+                if (fDebug)
+                    printf("Bucket %" PRId64 " lock count %u, waiting for message data from peer %u.\n", time, smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
+                return false;
+            };
+
+            uint32_t nStoreMessages;
+            uint64_t nStoreBytes;
+            SecureMsgStoreTotals(nStoreMessages, nStoreBytes);
+            if (SecureMsgAdmit(time, 0, nStoreMessages, nStoreBytes) != 0)
+            {
+                if (fDebug)
+                    printf("No room for bucket %" PRId64 ", not requesting.\n", time);
+                return false;
+            };
+
+            if (fDebug)
+                printf("Sifting through bucket %" PRId64 ".\n", time);
+
+            std::vector<unsigned char> vchDataOut;
+            vchDataOut.resize(8);
+            memcpy(&vchDataOut[0], &vchData[0], 8);
+
+            std::set<SecMsgToken> &tokenSet = smsgBuckets[time].setTokens;
+            std::set<SecMsgToken>::iterator it;
+            SecMsgToken token;
+            unsigned char *p = &vchData[8];
+
+            for (int i = 0; i < n; ++i)
+            {
+                memcpy(&token.timestamp, p, 8);
+                memcpy(&token.sample, p + 8, 8);
+
+                it = tokenSet.find(token);
+                if (it == tokenSet.end())
+                {
+                    int nd = vchDataOut.size();
+                    try
+                    {
+                        vchDataOut.resize(nd + 16);
+                    }
+                    catch (std::exception &e)
+                    {
+                        printf("vchDataOut.resize %d threw: %s.\n", nd + 16, e.what());
+                        continue;
+                    };
+
+                    memcpy(&vchDataOut[nd], p, 16);
+                };
+
+                p += 16;
+            };
+
+            if (vchDataOut.size() > 8)
+            {
+                if (fDebug)
+                {
+                    printf("Asking peer for  %" PRIszu " messages.\n", (vchDataOut.size() - 8) / 16);
+                    printf("Locking bucket %" PRIszu " for peer %u.\n", time, pfrom->smsgData.nPeerId);
+                };
+                smsgBuckets[time].nLockCount = 3; // lock this bucket for at most 3 * SMSG_THREAD_DELAY seconds, unset when peer sends smsgMsg
+                smsgBuckets[time].nLockPeerId = pfrom->smsgData.nPeerId;
+                pfrom->PushMessage("smsgWant", vchDataOut);
+            };
+        }
+        else if (strCommand == "smsgSketch")
+        {
+            // -- peer's partition counts and digests for a bucket, ask for the
+            //    tokens of the partitions that differ from ours
+            std::vector<unsigned char> vchData;
+            vRecv >> vchData;
+
+            if (vchData.size() != 8 + SMSG_SKETCH_PARTS * 8)
+            {
+                pfrom->Misbehaving(1);
+                return false;
+            };
+
+            int64_t time;
+            memcpy(&time, &vchData[0], 8);
+
+            int64_t now = GetTime();
+            if (time < now - SMSG_RETENTION)
+            {
+                if (fDebug)
+                    printf("Not interested in peer bucket %" PRId64 ", has expired.\n", time);
+                return false;
+            };
+            if (time > now + SMSG_TIME_LEEWAY)
+            {
+                if (fDebug)
+                    printf("Not interested in peer bucket %" PRId64 ", in the future.\n", time);
+                pfrom->Misbehaving(1);
+                return false;
+            };
+
+            SecMsgBucket &bkt = smsgBuckets[time];
+            if (bkt.nLockCount > 0)
+            {
+                if (fDebug)
+                    printf("Bucket %" PRId64 " lock count %u, waiting for message data from peer %u.\n", time, bkt.nLockCount, bkt.nLockPeerId);
+                return false;
+            };
+
+            uint32_t nCount[SMSG_SKETCH_PARTS], nDigest[SMSG_SKETCH_PARTS];
+            bkt.getSketch(nCount, nDigest);
+
+            uint64_t nMask = 0;
+            unsigned char *p = &vchData[8];
+            for (unsigned int i = 0; i < SMSG_SKETCH_PARTS; ++i, p += 8)
+            {
+                uint32_t nPeerCount, nPeerDigest;
+                memcpy(&nPeerCount, p, 4);
+                memcpy(&nPeerDigest, p + 4, 4);
+                if (nPeerCount > 0 && (nPeerCount != nCount[i] || nPeerDigest != nDigest[i]))
+                    nMask |= (uint64_t)1 << i;
+            };
+
+            if (nMask != 0)
+            {
+                if (fDebug)
+                    printf("Bucket %" PRId64 " differs from peer in partitions %016" PRIx64 ".\n", time, nMask);
+
+                std::vector<unsigned char> vchDataOut(16);
+                memcpy(&vchDataOut[0], &time, 8);
+                memcpy(&vchDataOut[8], &nMask, 8);
+                pfrom->PushMessage("smsgShowPart", vchDataOut);
+            };
+        }
+        else if (strCommand == "smsgShowPart")
         {
+            // -- peer wants the tokens of some partitions of a bucket
             std::vector<unsigned char> vchData;
             vRecv >> vchData;
 
-            if (vchData.size() < 4)
+            if (vchData.size() != 16)
             {
                 pfrom->Misbehaving(1);
-                return false; // not enough data received to be a valid smsgInv
+                return false;
             };
 
-            int64_t now = GetTime();
+            int64_t time;
+            uint64_t nMask;
+            memcpy(&time, &vchData[0], 8);
+            memcpy(&nMask, &vchData[8], 8);
 
-            if (now < pfrom->smsgData.ignoreUntil)
+            std::map<int64_t, SecMsgBucket>::iterator itb = smsgBuckets.find(time);
+            if (itb == smsgBuckets.end())
             {
                 if (fDebug)
-                    printf("Node is ignoring peer %u until %" PRId64 ".\n", pfrom->smsgData.nPeerId, pfrom->smsgData.ignoreUntil);
+                    printf("Don't have bucket %" PRId64 ".\n", time);
                 return false;
             };
 
-            uint32_t nBuckets = smsgBuckets.size();
-            uint32_t nLocked = 0; // no. of locked buckets on this node
-            uint32_t nInvBuckets; // no. of bucket headers sent by peer in smsgInv
-            memcpy(&nInvBuckets, &vchData[0], 4);
-            if (fDebug)
-                printf("Remote node sent %d bucket headers, this has %d.\n", nInvBuckets, nBuckets);
+            std::vector<unsigned char> vchDataOut(8);
+            memcpy(&vchDataOut[0], &time, 8);
 
-            // -- Check no of buckets:
-            if (nInvBuckets > (SMSG_RETENTION / SMSG_BUCKET_LEN) + 1) // +1 for some leeway
+            std::set<SecMsgToken> &tokenSet = itb->second.setTokens;
+            for (std::set<SecMsgToken>::iterator it = tokenSet.begin(); it != tokenSet.end(); ++it)
             {
-                printf("Peer sent more bucket headers than possible %u, %u.\n", nInvBuckets, (SMSG_RETENTION / SMSG_BUCKET_LEN));
-                pfrom->Misbehaving(1);
-                return false;
+                if (!(nMask & ((uint64_t)1 << SecMsgTokenPart(SecMsgTokenHash(*it)))))
+                    continue;
+
+                unsigned int nd = vchDataOut.size();
+                vchDataOut.resize(nd + 16);
+                memcpy(&vchDataOut[nd], &it->timestamp, 8);
+                memcpy(&vchDataOut[nd + 8], it->sample, 8);
             };
 
-            if (vchData.size() < 4 + nInvBuckets * 16)
-            {
-                printf("Remote node did not send enough data.\n");
-                pfrom->Misbehaving(1);
+            if (vchDataOut.size() > 8)
+                pfrom->PushMessage("smsgHave", vchDataOut);
+        }
+        else if (strCommand == "smsgWant")
+        {
+            std::vector<unsigned char> vchData;
+            vRecv >> vchData;
+
+            if (vchData.size() < 8)
                 return false;
-            };
 
-            std::vector<unsigned char> vchDataOut;
-            vchDataOut.reserve(4 + 8 * nInvBuckets); // reserve max possible size
-            vchDataOut.resize(4);
-            uint32_t nShowBuckets = 0;
+            std::vector<unsigned char> vchBunch;
 
-            unsigned char *p = &vchData[4];
-            for (uint32_t i = 0; i < nInvBuckets; ++i)
+            vchBunch.resize(4 + 8); // nmessages + bucketTime
+
+            int n = (vchData.size() - 8) / 16;
+
+            int64_t time;
+            uint32_t nBunch = 0;
+            memcpy(&time, &vchData[0], 8);
+
+            std::map<int64_t, SecMsgBucket>::iterator itb;
+            itb = smsgBuckets.find(time);
+            if (itb == smsgBuckets.end())
             {
-                int64_t time;
-                uint32_t ncontent, hash;
-                memcpy(&time, p, 8);
-                memcpy(&ncontent, p + 8, 4);
-                memcpy(&hash, p + 12, 4);
+                if (fDebug)
+                    printf("Don't have bucket %" PRId64 ".\n", time);
+                return false;
+            };
 
-                p += 16;
+            std::set<SecMsgToken> &tokenSet = itb->second.setTokens;
+            std::set<SecMsgToken>::iterator it;
+            SecMsgToken token;
+            unsigned char *p = &vchData[8];
+            for (int i = 0; i < n; ++i)
+            {
+                memcpy(&token.timestamp, p, 8);
+                memcpy(&token.sample, p + 8, 8);
 
-                // Check time valid:
-                if (time < now - SMSG_RETENTION)
+                it = tokenSet.find(token);
+                if (it == tokenSet.end())
                 {
                     if (fDebug)
-                        printf("Not interested in peer bucket %" PRId64 ", has expired.\n", time);
-
-                    if (time < now - SMSG_RETENTION - SMSG_TIME_LEEWAY)
-                        pfrom->Misbehaving(1);
-                    continue;
-                };
-                if (time > now + SMSG_TIME_LEEWAY)
+                        printf("Don't have wanted message %" PRId64 ".\n", token.timestamp);
+                }
+                else
                 {
-                    if (fDebug)
-                        printf("Not interested in peer bucket %" PRId64 ", in the future.\n", time);
-                    pfrom->Misbehaving(1);
-                    continue;
-                };
+                    //printf("Have message at %"PRId64".\n", it->offset); // DEBUG
+                    token.offset = it->offset;
+                    //printf("winb before SecureMsgRetrieve %"PRId64".\n", token.timestamp);
 
-                if (ncontent < 1)
-                {
-                    if (fDebug)
-                        printf("Peer sent empty bucket, ignore %" PRId64 " %u %u.\n", time, ncontent, hash);
-                    continue;
+                    // -- copied straight out of the mapped bucket file
+                    const unsigned char *pOne;
+                    uint32_t nOne;
+                    if (SecureMsgRetrieve(token, pOne, nOne) == 0)
+                    {
+                        nBunch++;
+                        vchBunch.insert(vchBunch.end(), pOne, pOne + nOne); // append
+                    }
+                    else
+                    {
+                        printf("SecureMsgRetrieve failed %" PRId64 ".\n", token.timestamp);
+                    };
+
+                    if (nBunch >= 500 || vchBunch.size() >= 96000)
+                    {
+                        if (fDebug)
+                            printf("Break bunch %u, %" PRIszu ".\n", nBunch, vchBunch.size());
+                        break; // end here, peer will send more want messages if needed.
+                    };
                 };
+                p += 16;
+            };
 
+            if (nBunch > 0)
+            {
                 if (fDebug)
-                {
-                    printf("peer bucket %" PRId64 " %u %u.\n", time, ncontent, hash);
-                    printf("this bucket %" PRId64 " %" PRIszu " %u.\n", time, smsgBuckets[time].setTokens.size(), smsgBuckets[time].hash);
-                };
+                    printf("Sending block of %u messages for bucket %" PRId64 ".\n", nBunch, time);
 
-                if (smsgBuckets[time].nLockCount > 0)
-                {
-                    if (fDebug)
-                        printf("Bucket is locked %u, waiting for peer %u to send data.\n", smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
-                    nLocked++;
-                    continue;
-                };
+                memcpy(&vchBunch[0], &nBunch, 4);
+                memcpy(&vchBunch[4], &time, 8);
+                pfrom->PushMessage("smsgMsg", vchBunch);
+            };
+        }
+        else if (strCommand == "smsgMsg")
+        {
+            std::vector<unsigned char> vchData;
+            vRecv >> vchData;
 
-                // -- if this node has more than the peer node, peer node will pull from this
-                //    if then peer node has more this node will pull fom peer
-                if (smsgBuckets[time].setTokens.size() < ncontent || (smsgBuckets[time].setTokens.size() == ncontent && smsgBuckets[time].hash != hash)) // if same amount in buckets check hash
-                {
-                    if (fDebug)
-                        printf("Requesting contents of bucket %" PRId64 ".\n", time);
+            if (fDebug)
+                printf("smsgMsg vchData.size() %" PRIszu ".\n", vchData.size());
 
-                    uint32_t sz = vchDataOut.size();
-                    vchDataOut.resize(sz + 8);
-                    memcpy(&vchDataOut[sz], &time, 8);
+            SecureMsgReceive(pfrom, vchData);
+        }
+        else if (strCommand == "smsgMatch")
+        {
+            std::vector<unsigned char> vchData;
+            vRecv >> vchData;
 
-                    nShowBuckets++;
-                };
+            if (vchData.size() < 8)
+            {
+                printf("smsgMatch, not enough data %" PRIszu ".\n", vchData.size());
+                pfrom->Misbehaving(1);
+                return false;
             };
 
-            // TODO: should include hash?
-            memcpy(&vchDataOut[0], &nShowBuckets, 4);
-            if (vchDataOut.size() > 4)
-            {
-                pfrom->PushMessage("smsgShow", vchDataOut);
-            }
-            else if (nLocked < 1) // Don't report buckets as matched if any are locked
+            int64_t time;
+            memcpy(&time, &vchData[0], 8);
+
+            int64_t now = GetTime();
+            if (time > now + SMSG_TIME_LEEWAY)
             {
-                // -- peer has no buckets we want, don't send them again until something changes
-                //    peer will still request buckets from this node if needed (< ncontent)
-                vchDataOut.resize(8);
-                memcpy(&vchDataOut[0], &now, 8);
-                pfrom->PushMessage("smsgMatch", vchDataOut);
+                printf("Warning: Peer buckets matched in the future: %" PRId64 ".\nEither this node or the peer node has the incorrect time set.\n", time);
                 if (fDebug)
-                    printf("Sending smsgMatch, %" PRId64 ".\n", now);
+                    printf("Peer match time set to now.\n");
+                time = now;
             };
+
+            pfrom->smsgData.lastMatched = time;
+
+            if (fDebug)
+                printf("Peer buckets matched at %" PRId64 ".\n", time);
         }
-        else if (strCommand == "smsgShow")
+        else if (strCommand == "smsgPing")
+        {
+            // -- smsgPing is the initial message, send reply
+            if (vRecv.size() >= 4)
+                vRecv >> pfrom->smsgData.nVersion;
+            pfrom->PushMessage("smsgPong", SMSG_PROTOCOL_VERSION);
+        }
+        else if (strCommand == "smsgPong")
+        {
+            if (vRecv.size() >= 4)
+                vRecv >> pfrom->smsgData.nVersion;
+
+            if (fDebug)
+                printf("Peer replied, secure messaging enabled, version %u.\n", pfrom->smsgData.nVersion);
+
+            pfrom->smsgData.fEnabled = true;
+        }
+        else if (strCommand == "smsgDisabled")
+        {
+            // -- peer has disabled secure messaging.
+
+            pfrom->smsgData.fEnabled = false;
+
+            if (fDebug)
+                printf("Peer %u has disabled secure messaging.\n", pfrom->smsgData.nPeerId);
+        }
+        else if (strCommand == "smsgIgnore")
         {
+            // -- peer is reporting that it will ignore this node until time.
+            //    Ignore peer too
             std::vector<unsigned char> vchData;
             vRecv >> vchData;
 
-            if (vchData.size() < 4)
-                return false;
+            if (vchData.size() < 8)
+            {
+                printf("smsgIgnore, not enough data %" PRIszu ".\n", vchData.size());
+                pfrom->Misbehaving(1);
+                return false;
+            };
+
+            int64_t time;
+            memcpy(&time, &vchData[0], 8);
+
+            pfrom->smsgData.ignoreUntil = time;
+
+            if (fDebug)
+                printf("Peer %u is ignoring this node until %" PRId64 ", ignore peer too.\n", pfrom->smsgData.nPeerId, time);
+        }
+        else
+        {
+            // Unknown message
+        };
+
+    }; //  LOCK(cs_smsg);
+
+    return true;
+};
+
+bool SecureMsgSendData(CNode *pto, bool fSendTrickle)
+{
+    /*
+        Called from ProcessMessage
+        Runs in ThreadMessageHandler2
+    */
+
+    //printf("SecureMsgSendData() %s.\n", pto->addrName.c_str());
+
+    int64_t now = GetTime();
+
+    if (pto->smsgData.lastSeen == 0)
+    {
+        // -- first contact
+        pto->smsgData.nPeerId = nPeerIdCounter++;
+        if (fDebug)
+            printf("SecureMsgSendData() new node %s, peer id %u.\n", pto->addrName.c_str(), pto->smsgData.nPeerId);
+        // -- Send smsgPing once, do nothing until receive 1st smsgPong (then set fEnabled)
+        pto->PushMessage("smsgPing", SMSG_PROTOCOL_VERSION);
+        pto->smsgData.lastSeen = GetTime();
+        return true;
+    }
+    else if (!pto->smsgData.fEnabled || now - pto->smsgData.lastSeen < SMSG_SEND_DELAY || now < pto->smsgData.ignoreUntil)
+    {
+        return true;
+    };
+
+    // -- When nWakeCounter == 0, resend bucket inventory.
+    if (pto->smsgData.nWakeCounter < 1)
+    {
+        pto->smsgData.lastMatched = 0;
+        pto->smsgData.nWakeCounter = 10 + GetRandInt(300); // set to a random time between [10, 300] * SMSG_SEND_DELAY seconds
 
-            uint32_t nBuckets;
-            memcpy(&nBuckets, &vchData[0], 4);
+        if (fDebug)
+            printf("SecureMsgSendData(): nWakeCounter expired, sending bucket inventory to %s.\n"
+                   "Now %" PRId64 " next wake counter %u\n",
+                   pto->addrName.c_str(), now, pto->smsgData.nWakeCounter);
+    };
+    pto->smsgData.nWakeCounter--;
 
-            if (vchData.size() < 4 + nBuckets * 8)
-                return false;
+    {
+        LOCK(cs_smsg);
+        std::map<int64_t, SecMsgBucket>::iterator it;
 
-            if (fDebug)
-                printf("smsgShow: peer wants to see content of %u buckets.\n", nBuckets);
+        uint32_t nBuckets = smsgBuckets.size();
+        if (nBuckets > 0) // no need to send keep alive pkts, coin messages already do that
+        {
+            std::vector<unsigned char> vchData;
+            // should reserve?
+            vchData.reserve(4 + nBuckets * 16); // timestamp + size + hash
 
-            std::map<int64_t, SecMsgBucket>::iterator itb;
-            std::set<SecMsgToken>::iterator it;
+            uint32_t nBucketsShown = 0;
+            vchData.resize(4);
 
-            std::vector<unsigned char> vchDataOut;
-            int64_t time;
-            unsigned char *pIn = &vchData[4];
-            for (uint32_t i = 0; i < nBuckets; ++i, pIn += 8)
+            unsigned char *p = &vchData[4];
+            for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
             {
-                memcpy(&time, pIn, 8);
+                SecMsgBucket &bkt = it->second;
 
-                itb = smsgBuckets.find(time);
-                if (itb == smsgBuckets.end())
-                {
-                    if (fDebug)
-                        printf("Don't have bucket %" PRId64 ".\n", time);
+                uint32_t nMessages = bkt.setTokens.size();
+
+                if (bkt.timeChanged < pto->smsgData.lastMatched // peer has this bucket
+                    || nMessages < 1)                           // this bucket is empty
                     continue;
-                };
 
-                std::set<SecMsgToken> &tokenSet = (*itb).second.setTokens;
+                uint32_t hash = pto->smsgData.nVersion >= SMSG_VERSION_RECONCILE ? bkt.nDigest : bkt.legacyHash();
 
                 try
                 {
-                    vchDataOut.resize(8 + 16 * tokenSet.size());
+                    vchData.resize(vchData.size() + 16);
                 }
                 catch (std::exception &e)
                 {
-                    printf("vchDataOut.resize %" PRIszu " threw: %s.\n", 8 + 16 * tokenSet.size(), e.what());
+                    printf("vchData.resize %" PRIszu " threw: %s.\n", vchData.size() + 16, e.what());
                     continue;
                 };
-                memcpy(&vchDataOut[0], &time, 8);
+                memcpy(p, &it->first, 8);
+                memcpy(p + 8, &nMessages, 4);
+                memcpy(p + 12, &hash, 4);
 
-                unsigned char *p = &vchDataOut[8];
-                for (it = tokenSet.begin(); it != tokenSet.end(); ++it)
-                {
-                    memcpy(p, &it->timestamp, 8);
-                    memcpy(p + 8, &it->sample, 8);
+                p += 16;
+                nBucketsShown++;
+                //if (fDebug)
+                //    printf("Sending bucket %"PRId64", size %d \n", it->first, it->second.size());
+            };
 
-                    p += 16;
-                };
-                pfrom->PushMessage("smsgHave", vchDataOut);
+            if (vchData.size() > 4)
+            {
+                memcpy(&vchData[0], &nBucketsShown, 4);
+                if (fDebug)
+                    printf("Sending %d bucket headers.\n", nBucketsShown);
+
+                pto->PushMessage("smsgInv", vchData);
             };
+        };
+    }
+
+    pto->smsgData.lastSeen = GetTime();
+
+    return true;
+};
+
+static int SecureMsgInsertAddress(CKeyID &hashKey, CPubKey &pubKey, SecMsgDB &addrpkdb)
+{
+    /* insert key hash and public key to addressdb
+        
+        should have LOCK(cs_smsg) where db is opened
+        
+        returns
+            0 success
+            1 error
+            4 address is already in db
+    */
+
+    if (addrpkdb.ExistsPK(hashKey))
+    {
+        //printf("DB already contains public key for address.\n");
+        CPubKey cpkCheck;
+        if (!addrpkdb.ReadPK(hashKey, cpkCheck))
+        {
+            printf("addrpkdb.Read failed.\n");
         }
-        else if (strCommand == "smsgHave")
+        else
         {
-            // -- peer has these messages in bucket
-            std::vector<unsigned char> vchData;
-            vRecv >> vchData;
-
-            if (vchData.size() < 8)
-                return false;
+            if (cpkCheck != pubKey)
+                printf("DB already contains existing public key that does not match .\n");
+        };
+        return 4;
+    };
 
-            int n = (vchData.size() - 8) / 16;
+    if (!addrpkdb.WritePK(hashKey, pubKey))
+    {
+        printf("Write pair failed.\n");
+        return 1;
+    };
 
-            int64_t time;
-            memcpy(&time, &vchData[0], 8);
+    return 0;
+};
 
-            // -- Check time valid:
-            int64_t now = GetTime();
-            if (time < now - SMSG_RETENTION)
-            {
-                if (fDebug)
-                    printf("Not interested in peer bucket %" PRId64 ", has expired.\n", time);
-                return false;
-            };
-            if (time > now + SMSG_TIME_LEEWAY)
-            {
-                if (fDebug)
-                    printf("Not interested in peer bucket %" PRId64 ", in the future.\n", time);
-                pfrom->Misbehaving(1);
-                return false;
-            };
+int SecureMsgInsertAddress(CKeyID &hashKey, CPubKey &pubKey)
+{
+    int rv;
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB addrpkdb;
 
-            if (smsgBuckets[time].nLockCount > 0)
-            {
-                if (fDebug)
-                    printf("Bucket %" PRId64 " lock count %u, waiting for message data from peer %u.\n", time, smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
-                return false;
-            };
+        if (!addrpkdb.Open("cr+"))
+            return 1;
 
-            if (fDebug)
-                printf("Sifting through bucket %" PRId64 ".\n", time);
+        rv = SecureMsgInsertAddress(hashKey, pubKey, addrpkdb);
+    }
+    return rv;
+};
 
-            std::vector<unsigned char> vchDataOut;
-            vchDataOut.resize(8);
-            memcpy(&vchDataOut[0], &vchData[0], 8);
+// -- public key index
+//    Public keys are harvested from the inputs of connected blocks into smsgDB.
+//    The height and hash of the last block scanned are kept with them, so the
+//    history is scanned once, in the background, and connected blocks are
+//    added as they arrive. Keys stay when a block is disconnected, the pairing
+//    of a key with its hash is valid on any chain, only the marker moves back.
 
-            std::set<SecMsgToken> &tokenSet = smsgBuckets[time].setTokens;
-            std::set<SecMsgToken>::iterator it;
-            SecMsgToken token;
-            unsigned char *p = &vchData[8];
+static CCriticalSection cs_smsgPubkeyScan;      // cs_main before this, cs_smsgDB after
+static bool fPubkeyScanLoaded = false;
+static bool fPubkeyScanBusy = false;            // a range is being scanned outside the lock
+static bool fPubkeyRescan = false;
+static int nPubkeyScanHeight = -1;              // -1 before genesis
+static uint256 hashPubkeyScan = 0;
+static uint32_t nPubkeysFound = 0;              // new keys this session
 
-            for (int i = 0; i < n; ++i)
-            {
-                memcpy(&token.timestamp, p, 8);
-                memcpy(&token.sample, p + 8, 8);
+typedef std::vector<std::pair<CKeyID, CPubKey> > SecMsgPubkeys;
 
-                it = tokenSet.find(token);
-                if (it == tokenSet.end())
-                {
-                    int nd = vchDataOut.size();
-                    try
-                    {
-                        vchDataOut.resize(nd + 16);
-                    }
-                    catch (std::exception &e)
-                    {
-                        printf("vchDataOut.resize %d threw: %s.\n", nd + 16, e.what());
-                        continue;
-                    };
+static void SecureMsgExtractPubkeys(const CBlock &block, CKey &key, SecMsgPubkeys &vFound)
+{
+    // -- public keys are pushed in txin.scriptSig, the address an input spends
+    //    from is the hash of the key, so the previous output needn't be read.
+    BOOST_FOREACH (const CTransaction &tx, block.vtx)
+    {
+        if (!IsStandardTx(tx))
+            continue; // leave out coinbase and others
 
-                    memcpy(&vchDataOut[nd], p, 16);
-                };
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            const CScript &script = tx.vin[i].scriptSig;
 
-                p += 16;
-            };
+            opcodetype opcode;
+            valtype vch;
+            CScript::const_iterator pc = script.begin();
+            CScript::const_iterator pend = script.end();
 
-            if (vchDataOut.size() > 8)
+            while (pc < pend)
             {
-                if (fDebug)
+                if (!script.GetOp(pc, opcode, vch))
+                    break;
+                // -- opcode is the length of the following data, compressed public key is always 33
+                if (opcode != 33)
+                    continue;
+
+                if (!key.SetPubKey(vch))
+                    break;
+                key.SetCompressedPubKey(); // ensure key is compressed
+                CPubKey pubKey = key.GetPubKey();
+
+                if (!pubKey.IsValid() || !pubKey.IsCompressed())
                 {
-                    printf("Asking peer for  %" PRIszu " messages.\n", (vchDataOut.size() - 8) / 16);
-                    printf("Locking bucket %" PRIszu " for peer %u.\n", time, pfrom->smsgData.nPeerId);
+                    printf("Public key is invalid %s.\n", ValueString(pubKey.Raw()).c_str());
+                    continue;
                 };
-                smsgBuckets[time].nLockCount = 3; // lock this bucket for at most 3 * SMSG_THREAD_DELAY seconds, unset when peer sends smsgMsg
-                smsgBuckets[time].nLockPeerId = pfrom->smsgData.nPeerId;
-                pfrom->PushMessage("smsgWant", vchDataOut);
+
+                vFound.push_back(std::make_pair(pubKey.GetID(), pubKey));
+                break;
             };
-        }
-        else if (strCommand == "smsgWant")
+        };
+    };
+};
+
+static void SecureMsgPubkeyWorker(const std::vector<CBlockIndex*> &vpindex, unsigned int nBegin, unsigned int nEnd, SecMsgPubkeys &vFound)
+{
+    CKey key;
+    for (unsigned int i = nBegin; i < nEnd && !fShutdown; ++i)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(vpindex[i], true))
         {
-            std::vector<unsigned char> vchData;
-            vRecv >> vchData;
+            printf("SecureMsgPubkeyWorker() could not read block %d.\n", vpindex[i]->nHeight);
+            continue;
+        };
+        SecureMsgExtractPubkeys(block, key, vFound);
+    };
+};
 
-            if (vchData.size() < 8)
-                return false;
+static bool SecureMsgWritePubkeys(const std::vector<SecMsgPubkeys> &vFound, CBlockIndex *pindexLast)
+{
+    // -- should have LOCK(cs_smsgPubkeyScan)
+    //    New keys and the marker go in one batch. Keys are checked against the
+    //    db before the batch opens, reads inside a batch scan the whole batch.
+    uint32_t nNew = 0;
+    {
+        LOCK(cs_smsgDB);
 
-            std::vector<unsigned char> vchOne;
-            std::vector<unsigned char> vchBunch;
+        SecMsgDB addrpkdb;
+        if (!addrpkdb.Open("cw"))
+            return false;
 
-            vchBunch.resize(4 + 8); // nmessages + bucketTime
+        std::set<CKeyID> setSeen;
+        SecMsgPubkeys vNew;
+        for (std::vector<SecMsgPubkeys>::const_iterator it = vFound.begin(); it != vFound.end(); ++it)
+        {
+            for (SecMsgPubkeys::const_iterator ik = it->begin(); ik != it->end(); ++ik)
+            {
+                CKeyID keyId = ik->first;
+                if (!setSeen.insert(keyId).second
+                    || addrpkdb.ExistsPK(keyId))
+                    continue;
+                vNew.push_back(*ik);
+            };
+        };
+
+        if (!addrpkdb.TxnBegin())
+            return false;
+
+        for (SecMsgPubkeys::iterator it = vNew.begin(); it != vNew.end(); ++it)
+            addrpkdb.WritePK(it->first, it->second);
 
-            int n = (vchData.size() - 8) / 16;
+        uint256 hashBlock = pindexLast->GetBlockHash();
+        addrpkdb.WritePKHeight(pindexLast->nHeight, hashBlock);
 
-            int64_t time;
-            uint32_t nBunch = 0;
-            memcpy(&time, &vchData[0], 8);
+        if (!addrpkdb.TxnCommit())
+            return false;
+        nNew = vNew.size();
+    }
 
-            std::map<int64_t, SecMsgBucket>::iterator itb;
-            itb = smsgBuckets.find(time);
-            if (itb == smsgBuckets.end())
-            {
-                if (fDebug)
-                    printf("Don't have bucket %" PRId64 ".\n", time);
-                return false;
-            };
+    nPubkeyScanHeight = pindexLast->nHeight;
+    hashPubkeyScan = pindexLast->GetBlockHash();
+    nPubkeysFound += nNew;
 
-            std::set<SecMsgToken> &tokenSet = itb->second.setTokens;
-            std::set<SecMsgToken>::iterator it;
-            SecMsgToken token;
-            unsigned char *p = &vchData[8];
-            for (int i = 0; i < n; ++i)
-            {
-                memcpy(&token.timestamp, p, 8);
-                memcpy(&token.sample, p + 8, 8);
+    return true;
+};
 
-                it = tokenSet.find(token);
-                if (it == tokenSet.end())
-                {
-                    if (fDebug)
-                        printf("Don't have wanted message %" PRId64 ".\n", token.timestamp);
-                }
-                else
-                {
-                    //printf("Have message at %"PRId64".\n", it->offset); // DEBUG
-                    token.offset = it->offset;
-                    //printf("winb before SecureMsgRetrieve %"PRId64".\n", token.timestamp);
+static void SecureMsgLoadPubkeyScan()
+{
+    // -- should have LOCK(cs_smsgPubkeyScan)
+    if (fPubkeyScanLoaded)
+        return;
+    fPubkeyScanLoaded = true;
+
+    LOCK(cs_smsgDB);
+    SecMsgDB addrpkdb;
+    if (!addrpkdb.Open("cw")
+        || !addrpkdb.ReadPKHeight(nPubkeyScanHeight, hashPubkeyScan))
+    {
+        nPubkeyScanHeight = -1;
+        hashPubkeyScan = 0;
+    };
+};
 
-                    // -- place in vchOne so if SecureMsgRetrieve fails it won't corrupt vchBunch
-                    if (SecureMsgRetrieve(token, vchOne) == 0)
-                    {
-                        nBunch++;
-                        vchBunch.insert(vchBunch.end(), vchOne.begin(), vchOne.end()); // append
-                    }
-                    else
-                    {
-                        printf("SecureMsgRetrieve failed %" PRId64 ".\n", token.timestamp);
-                    };
+static unsigned int SecureMsgPubkeyCatchUp()
+{
+    /* Scan the next range of blocks after the marker
+        
+        returns the number of blocks scanned, 0 when up to date
+    */
 
-                    if (nBunch >= 500 || vchBunch.size() >= 96000)
-                    {
-                        if (fDebug)
-                            printf("Break bunch %u, %" PRIszu ".\n", nBunch, vchBunch.size());
-                        break; // end here, peer will send more want messages if needed.
-                    };
-                };
-                p += 16;
-            };
+    std::vector<CBlockIndex*> vpindex;
+    {
+        LOCK2(cs_main, cs_smsgPubkeyScan);
+        if (fPubkeyScanBusy)
+            return 0;
 
-            if (nBunch > 0)
-            {
-                if (fDebug)
-                    printf("Sending block of %u messages for bucket %" PRId64 ".\n", nBunch, time);
+        SecureMsgLoadPubkeyScan();
+        if (fPubkeyRescan)
+        {
+            printf("Rescanning block chain for public keys.\n");
+            nPubkeyScanHeight = -1;
+            hashPubkeyScan = 0;
+            fPubkeyRescan = false;
+        };
 
-                memcpy(&vchBunch[0], &nBunch, 4);
-                memcpy(&vchBunch[4], &time, 8);
-                pfrom->PushMessage("smsgMsg", vchBunch);
-            };
-        }
-        else if (strCommand == "smsgMsg")
+        // -- after a reorg the marker walks back to the fork
+        CBlockIndex *pindex = NULL;
+        if (nPubkeyScanHeight >= 0)
         {
-            std::vector<unsigned char> vchData;
-            vRecv >> vchData;
+            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPubkeyScan);
+            if (mi != mapBlockIndex.end())
+                pindex = mi->second;
+            while (pindex && !pindex->IsInMainChain())
+                pindex = pindex->pprev;
+        };
+        nPubkeyScanHeight = pindex ? pindex->nHeight : -1;
+        hashPubkeyScan = pindex ? pindex->GetBlockHash() : 0;
 
-            if (fDebug)
-                printf("smsgMsg vchData.size() %" PRIszu ".\n", vchData.size());
+        for (CBlockIndex *pindexNext = pindex ? pindex->pnext : pindexGenesisBlock;
+             pindexNext && vpindex.size() < SMSG_PUBKEY_SCAN_RANGE;
+             pindexNext = pindexNext->pnext)
+            vpindex.push_back(pindexNext);
 
-            SecureMsgReceive(pfrom, vchData);
-        }
-        else if (strCommand == "smsgMatch")
-        {
-            std::vector<unsigned char> vchData;
-            vRecv >> vchData;
+        if (vpindex.empty())
+            return 0;
+        fPubkeyScanBusy = true;
+    }
 
-            if (vchData.size() < 8)
-            {
-                printf("smsgMatch, not enough data %" PRIszu ".\n", vchData.size());
-                pfrom->Misbehaving(1);
-                return false;
-            };
+    int64_t nStart = GetTimeMillis();
 
-            int64_t time;
-            memcpy(&time, &vchData[0], 8);
+    // -- split the range between threads, each reads and scans its own blocks
+    unsigned int nThreads = std::min(boost::thread::hardware_concurrency(), SMSG_MAX_POW_THREADS);
+    nThreads = std::max(1u, std::min(nThreads, (unsigned int)vpindex.size() / SMSG_PUBKEY_BLOCKS_PER_THREAD));
 
-            int64_t now = GetTime();
-            if (time > now + SMSG_TIME_LEEWAY)
-            {
-                printf("Warning: Peer buckets matched in the future: %" PRId64 ".\nEither this node or the peer node has the incorrect time set.\n", time);
-                if (fDebug)
-                    printf("Peer match time set to now.\n");
-                time = now;
-            };
+    std::vector<SecMsgPubkeys> vFound(nThreads);
+    if (nThreads == 1)
+    {
+        SecureMsgPubkeyWorker(vpindex, 0, vpindex.size(), vFound[0]);
+    } else
+    {
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nThreads; ++i)
+            threads.create_thread(boost::bind(&SecureMsgPubkeyWorker, boost::cref(vpindex),
+                (i * vpindex.size()) / nThreads, ((i + 1) * vpindex.size()) / nThreads, boost::ref(vFound[i])));
+        threads.join_all();
+    };
 
-            pfrom->smsgData.lastMatched = time;
+    LOCK(cs_smsgPubkeyScan);
+    fPubkeyScanBusy = false;
 
-            if (fDebug)
-                printf("Peer buckets matched at %" PRId64 ".\n", time);
-        }
-        else if (strCommand == "smsgPing")
-        {
-            // -- smsgPing is the initial message, send reply
-            pfrom->PushMessage("smsgPong");
-        }
-        else if (strCommand == "smsgPong")
-        {
-            if (fDebug)
-                printf("Peer replied, secure messaging enabled.\n");
+    if (fShutdown || fPubkeyRescan)
+        return 0;
 
-            pfrom->smsgData.fEnabled = true;
-        }
-        else if (strCommand == "smsgDisabled")
-        {
-            // -- peer has disabled secure messaging.
+    if (!SecureMsgWritePubkeys(vFound, vpindex.back()))
+    {
+        printf("SecureMsgPubkeyCatchUp() could not write public keys.\n");
+        return 0;
+    };
 
-            pfrom->smsgData.fEnabled = false;
+    if (fDebug)
+        printf("Scanned blocks %d to %d for public keys on %u threads in %" PRId64 " ms.\n",
+            vpindex.front()->nHeight, vpindex.back()->nHeight, nThreads, GetTimeMillis() - nStart);
 
-            if (fDebug)
-                printf("Peer %u has disabled secure messaging.\n", pfrom->smsgData.nPeerId);
-        }
-        else if (strCommand == "smsgIgnore")
-        {
-            // -- peer is reporting that it will ignore this node until time.
-            //    Ignore peer too
-            std::vector<unsigned char> vchData;
-            vRecv >> vchData;
+    return vpindex.size();
+};
 
-            if (vchData.size() < 8)
-            {
-                printf("smsgIgnore, not enough data %" PRIszu ".\n", vchData.size());
-                pfrom->Misbehaving(1);
-                return false;
-            };
+void ThreadSecureMsgPubkeys(void *parg)
+{
+    // -- public key index thread
+    RenameThread("shadowcoin-smsg-pubkeys"); // Make this thread recognisable
 
-            int64_t time;
-            memcpy(&time, &vchData[0], 8);
+    while (fSecMsgEnabled)
+    {
+        MilliSleep(1000); // milliseconds
 
-            pfrom->smsgData.ignoreUntil = time;
+        if (!fSecMsgEnabled || fShutdown)
+            break;
 
-            if (fDebug)
-                printf("Peer %u is ignoring this node until %" PRId64 ", ignore peer too.\n", pfrom->smsgData.nPeerId, time);
+        try
+        {
+            while (fSecMsgEnabled && !fShutdown
+                && SecureMsgPubkeyCatchUp() > 0);
         }
-        else
+        catch (std::exception &e)
         {
-            // Unknown message
+            printf("SecureMsgPubkeyCatchUp() threw: %s.\n", e.what());
         };
+    };
 
-    }; //  LOCK(cs_smsg);
+    printf("ThreadSecureMsgPubkeys exited.\n");
+};
 
-    return true;
+void SecureMsgBlockConnected(const CBlock &block, CBlockIndex *pindex)
+{
+    // -- called from ConnectBlock, with cs_main held
+    if (!fSecMsgEnabled)
+        return;
+
+    // -- when behind, or busy, the index thread will get to this block
+    TRY_LOCK(cs_smsgPubkeyScan, lockScan);
+    if (!lockScan
+        || fPubkeyScanBusy
+        || !fPubkeyScanLoaded
+        || !pindex->pprev
+        || hashPubkeyScan != pindex->pprev->GetBlockHash())
+        return;
+
+    CKey key;
+    std::vector<SecMsgPubkeys> vFound(1);
+    SecureMsgExtractPubkeys(block, key, vFound[0]);
+    if (!SecureMsgWritePubkeys(vFound, pindex))
+        printf("SecureMsgBlockConnected() could not write public keys.\n");
 };
 
-bool SecureMsgSendData(CNode *pto, bool fSendTrickle)
+void SecureMsgBlockDisconnected(CBlockIndex *pindex)
 {
-    /*
-        Called from ProcessMessage
-        Runs in ThreadMessageHandler2
-    */
+    // -- called from DisconnectBlock, with cs_main held
+    if (!fSecMsgEnabled)
+        return;
+
+    // -- otherwise the index thread finds the fork when it next runs
+    TRY_LOCK(cs_smsgPubkeyScan, lockScan);
+    if (!lockScan
+        || fPubkeyScanBusy
+        || hashPubkeyScan != pindex->GetBlockHash()
+        || !pindex->pprev)
+        return;
+
+    nPubkeyScanHeight = pindex->pprev->nHeight;
+    hashPubkeyScan = pindex->pprev->GetBlockHash();
+
+    LOCK(cs_smsgDB);
+    SecMsgDB addrpkdb;
+    if (addrpkdb.Open("cw"))
+        addrpkdb.WritePKHeight(nPubkeyScanHeight, hashPubkeyScan);
+};
 
-    //printf("SecureMsgSendData() %s.\n", pto->addrName.c_str());
+void SecureMsgRescanPubkeys()
+{
+    LOCK(cs_smsgPubkeyScan);
+    fPubkeyRescan = true;
+};
+
+void SecureMsgPubkeyScanStatus(int &nHeight, uint32_t &nFound, bool &fRescanPending)
+{
+    LOCK(cs_smsgPubkeyScan);
+    nHeight = nPubkeyScanHeight;
+    nFound = nPubkeysFound;
+    fRescanPending = fPubkeyRescan;
+};
+
+bool SecureMsgScanBuckets()
+{
+    if (fDebug)
+        printf("SecureMsgScanBuckets()\n");
+
+    if (!fSecMsgEnabled || pwalletMain->IsLocked())
+        return false;
 
+    int64_t mStart = GetTimeMillis();
     int64_t now = GetTime();
+    uint32_t nFiles = 0;
+    uint32_t nMessages = 0;
+    uint32_t nFoundMessages = 0;
 
-    if (pto->smsgData.lastSeen == 0)
-    {
-        // -- first contact
-        pto->smsgData.nPeerId = nPeerIdCounter++;
-        if (fDebug)
-            printf("SecureMsgSendData() new node %s, peer id %u.\n", pto->addrName.c_str(), pto->smsgData.nPeerId);
-        // -- Send smsgPing once, do nothing until receive 1st smsgPong (then set fEnabled)
-        pto->PushMessage("smsgPing");
-        pto->smsgData.lastSeen = GetTime();
-        return true;
-    }
-    else if (!pto->smsgData.fEnabled || now - pto->smsgData.lastSeen < SMSG_SEND_DELAY || now < pto->smsgData.ignoreUntil)
+    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
+    fs::directory_iterator itend;
+
+    if (!fs::exists(pathSmsgDir) || !fs::is_directory(pathSmsgDir))
     {
-        return true;
+        printf("Message store directory does not exist.\n");
+        return 0; // not an error
     };
 
-    // -- When nWakeCounter == 0, resend bucket inventory.
-    if (pto->smsgData.nWakeCounter < 1)
+    SecureMessage smsg;
+    std::vector<unsigned char> vchData;
+
+    for (fs::directory_iterator itd(pathSmsgDir); itd != itend; ++itd)
     {
-        pto->smsgData.lastMatched = 0;
-        pto->smsgData.nWakeCounter = 10 + GetRandInt(300); // set to a random time between [10, 300] * SMSG_SEND_DELAY seconds
+        if (!fs::is_regular_file(itd->status()))
+            continue;
+
+        std::string fileType = (*itd).path().extension().string();
+
+        if (fileType.compare(".dat") != 0)
+            continue;
+
+        std::string fileName = (*itd).path().filename().string();
 
         if (fDebug)
-            printf("SecureMsgSendData(): nWakeCounter expired, sending bucket inventory to %s.\n"
-                   "Now %" PRId64 " next wake counter %u\n",
-                   pto->addrName.c_str(), now, pto->smsgData.nWakeCounter);
-    };
-    pto->smsgData.nWakeCounter--;
+            printf("Processing file: %s.\n", fileName.c_str());
 
-    {
-        LOCK(cs_smsg);
-        std::map<int64_t, SecMsgBucket>::iterator it;
+        nFiles++;
+
+        // TODO files must be split if > 2GB
+        // time_noFile.dat
+        size_t sep = fileName.find_first_of("_");
+        if (sep == std::string::npos)
+            continue;
+
+        std::string stime = fileName.substr(0, sep);
+
+        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
+
+        if (fileTime < now - SMSG_RETENTION)
+        {
+            printf("Dropping file %s, expired.\n", fileName.c_str());
+            try
+            {
+                fs::remove((*itd).path());
+            }
+            catch (const fs::filesystem_error &ex)
+            {
+                printf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
+            };
+            continue;
+        };
 
-        uint32_t nBuckets = smsgBuckets.size();
-        if (nBuckets > 0) // no need to send keep alive pkts, coin messages already do that
+        if (boost::algorithm::ends_with(fileName, "_wl.dat"))
         {
-            std::vector<unsigned char> vchData;
-            // should reserve?
-            vchData.reserve(4 + nBuckets * 16); // timestamp + size + hash
+            if (fDebug)
+                printf("Skipping wallet locked file: %s.\n", fileName.c_str());
+            continue;
+        };
 
-            uint32_t nBucketsShown = 0;
-            vchData.resize(4);
+        {
+            LOCK(cs_smsg);
+            FILE *fp;
+            errno = 0;
+            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
+            {
+                printf("Error opening file: %s\n", strerror(errno));
+                continue;
+            };
 
-            unsigned char *p = &vchData[4];
-            for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
+            for (;;)
             {
-                SecMsgBucket &bkt = it->second;
+                errno = 0;
+                if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+                {
+                    if (errno != 0)
+                    {
+                        printf("fread header failed: %s\n", strerror(errno));
+                    }
+                    else
+                    {
+                        //printf("End of file.\n");
+                    };
+                    break;
+                };
 
-                uint32_t nMessages = bkt.setTokens.size();
+                try
+                {
+                    vchData.resize(smsg.nPayload);
+                }
+                catch (std::exception &e)
+                {
+                    printf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
+                    fclose(fp);
+                    return 1;
+                };
 
-                if (bkt.timeChanged < pto->smsgData.lastMatched // peer has this bucket
-                    || nMessages < 1)                           // this bucket is empty
-                    continue;
+                if (fread(&vchData[0], sizeof(unsigned char), smsg.nPayload, fp) != smsg.nPayload)
+                {
+                    printf("fread data failed: %s\n", strerror(errno));
+                    break;
+                };
 
-                uint32_t hash = bkt.hash;
+                // -- don't report to gui,
+                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
 
-                try
+                if (rv == 0)
                 {
-                    vchData.resize(vchData.size() + 16);
+                    nFoundMessages++;
                 }
-                catch (std::exception &e)
+                else if (rv != 0)
                 {
-                    printf("vchData.resize %" PRIszu " threw: %s.\n", vchData.size() + 16, e.what());
-                    continue;
+                    // SecureMsgScanMessage failed
                 };
-                memcpy(p, &it->first, 8);
-                memcpy(p + 8, &nMessages, 4);
-                memcpy(p + 12, &hash, 4);
 
-                p += 16;
-                nBucketsShown++;
-                //if (fDebug)
-                //    printf("Sending bucket %"PRId64", size %d \n", it->first, it->second.size());
+                nMessages++;
             };
 
-            if (vchData.size() > 4)
-            {
-                memcpy(&vchData[0], &nBucketsShown, 4);
-                if (fDebug)
-                    printf("Sending %d bucket headers.\n", nBucketsShown);
+            fclose(fp);
 
-                pto->PushMessage("smsgInv", vchData);
+            // -- remove wl file when scanned
+            try
+            {
+                fs::remove((*itd).path());
+            }
+            catch (const boost::filesystem::filesystem_error &ex)
+            {
+                printf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
+                return 1;
             };
         };
-    }
+    };
 
-    pto->smsgData.lastSeen = GetTime();
+    printf("Processed %u files, scanned %u messages, received %u messages.\n", nFiles, nMessages, nFoundMessages);
+    printf("Took %" PRId64 " ms\n", GetTimeMillis() - mStart);
 
     return true;
-};
+}
 
-static int SecureMsgInsertAddress(CKeyID &hashKey, CPubKey &pubKey, SecMsgDB &addrpkdb)
+int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode)
 {
-    /* insert key hash and public key to addressdb
-        
-        should have LOCK(cs_smsg) where db is opened
-        
-        returns
-            0 success
-            1 error
-            4 address is already in db
-    */
+    if (!fSecMsgEnabled)
+        return 0;
+
+    printf("SecureMsgWalletKeyChanged()\n");
+
+    // TODO: default recv and recvAnon
 
-    if (addrpkdb.ExistsPK(hashKey))
     {
-        //printf("DB already contains public key for address.\n");
-        CPubKey cpkCheck;
-        if (!addrpkdb.ReadPK(hashKey, cpkCheck))
+        LOCK(cs_smsg);
+
+        switch (mode)
         {
-            printf("addrpkdb.Read failed.\n");
+        case CT_NEW:
+            smsgAddresses.push_back(SecMsgAddress(sAddress, smsgOptions.fNewAddressRecv, smsgOptions.fNewAddressAnon));
+            break;
+        case CT_DELETED:
+            for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+            {
+                if (sAddress != it->sAddress)
+                    continue;
+                smsgAddresses.erase(it);
+                break;
+            };
+            SecureMsgClearKeyCache();
+            break;
+        default:
+            break;
         }
-        else
-        {
-            if (cpkCheck != pubKey)
-                printf("DB already contains existing public key that does not match .\n");
-        };
-        return 4;
-    };
 
-    if (!addrpkdb.WritePK(hashKey, pubKey))
-    {
-        printf("Write pair failed.\n");
-        return 1;
-    };
+    }; // LOCK(cs_smsg);
 
     return 0;
 };
 
-int SecureMsgInsertAddress(CKeyID &hashKey, CPubKey &pubKey)
+static bool SecureMsgGetKeyR(const SecureMessage *psmsg, CKey &keyR)
 {
-    int rv;
+    std::vector<unsigned char> vchR(psmsg->cpkR, psmsg->cpkR + 33); // would be neater to override CPubKey() instead
+    CPubKey cpkR(vchR);
+    if (!cpkR.IsValid())
     {
-        LOCK(cs_smsgDB);
-        SecMsgDB addrpkdb;
-
-        if (!addrpkdb.Open("cr+"))
-            return 1;
+        printf("Could not get public key for key R.\n");
+        return false;
+    };
+    if (!keyR.SetPubKey(cpkR))
+    {
+        printf("Could not set pubkey for R: %s.\n", ValueString(cpkR.Raw()).c_str());
+        return false;
+    };
 
-        rv = SecureMsgInsertAddress(hashKey, pubKey, addrpkdb);
-    }
-    return rv;
+    cpkR = keyR.GetPubKey();
+    if (!cpkR.IsValid() || !cpkR.IsCompressed())
+    {
+        printf("Could not get compressed public key for key R.\n");
+        return false;
+    };
+    return true;
 };
 
-static bool ScanBlock(CBlock &block, CTxDB &txdb, SecMsgDB &addrpkdb,
-                      uint32_t &nTransactions, uint32_t &nInputs, uint32_t &nPubkeys, uint32_t &nDuplicates)
+static bool SecureMsgSharedKeys(CKey &keyDest, CKey &keyR, unsigned char *key_e, unsigned char *key_m)
 {
-    // -- should have LOCK(cs_smsg) where db is opened
-    BOOST_FOREACH (CTransaction &tx, block.vtx)
+    // -- Do an EC point multiply with private key k and public key R. This gives you public key P.
+    unsigned char chP[32];
+    EC_KEY *pkeyk = keyDest.GetECKey();
+    EC_KEY *pkeyR = keyR.GetECKey();
+
+    EC_KEY_SET_DEFAULT_METHOD(pkeyk);
+    int lenPdec = ECDH_compute_key(chP, 32, EC_KEY_get0_public_key(pkeyR), pkeyk, NULL);
+
+    if (lenPdec != 32)
     {
-        if (!IsStandardTx(tx))
-            continue; // leave out coinbase and others
+        printf("ECDH_compute_key failed, lenPdec: %d.\n", lenPdec);
+        return false;
+    };
 
-        /*
-        Look at the inputs of every tx.
-        If the inputs are standard, get the pubkey from scriptsig and
-        look for the corresponding output (the input(output of other tx) to the input of this tx)
-        get the address from scriptPubKey
-        add to db if address is unique.
-        
-        Would make more sense to do this the other way around, get address first for early out.
-        
-        */
+    // -- Use public key P to calculate the SHA512 hash H.
+    //    The first 32 bytes of H are called key_e and the last 32 bytes are called key_m.
+    unsigned char chHashed[64];
+    SHA512(chP, 32, chHashed);
+    memcpy(key_e, &chHashed[0], 32);
+    memcpy(key_m, &chHashed[32], 32);
+    OPENSSL_cleanse(chP, 32);
+    OPENSSL_cleanse(chHashed, 64);
+    return true;
+};
 
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
-        {
-            CScript *script = &tx.vin[i].scriptSig;
+static bool SecureMsgCheckMac(const unsigned char *key_m, const SecureMessage *psmsg, const unsigned char *pPayload, uint32_t nPayload)
+{
+    // -- Message authentication code, (hash of timestamp + destination + payload)
+    unsigned char MAC[32];
+    HMAC_SHA256_CTX ctx;
+    HMAC_SHA256_Init(&ctx, key_m, 32);
+    HMAC_SHA256_Update(&ctx, &psmsg->timestamp, sizeof(psmsg->timestamp));
+    HMAC_SHA256_Update(&ctx, pPayload, nPayload);
+    HMAC_SHA256_Final(MAC, &ctx);
 
-            opcodetype opcode;
-            valtype vch;
-            CScript::const_iterator pc = script->begin();
-            CScript::const_iterator pend = script->end();
+    return memcmp(MAC, psmsg->mac, 32) == 0;
+};
 
-            uint256 prevoutHash;
-            CKey key;
+class SecMsgScanKeys
+{
+// -- the receiving addresses and their private keys, gathered once and
+//    then tried against any number of messages
+public:
+    std::vector<SecMsgAddress> vAddresses;
+    std::vector<CKey> vKeys;
+};
 
-            // -- matching address is in scriptPubKey of previous tx output
-            while (pc < pend)
-            {
-                if (!script->GetOp(pc, opcode, vch))
-                    break;
-                // -- opcode is the length of the following data, compressed public key is always 33
-                if (opcode == 33)
-                {
-                    key.SetPubKey(vch);
+static void SecureMsgGatherKeys(SecMsgScanKeys &keys)
+{
+    keys.vAddresses.clear();
+    keys.vKeys.clear();
 
-                    key.SetCompressedPubKey(); // ensure key is compressed
-                    CPubKey pubKey = key.GetPubKey();
+    LOCK(cs_smsg);
+    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    {
+        if (!it->fReceiveEnabled)
+            continue;
 
-                    if (!pubKey.IsValid() || !pubKey.IsCompressed())
-                    {
-                        printf("Public key is invalid %s.\n", ValueString(pubKey.Raw()).c_str());
-                        continue;
-                    };
+        CBitcoinAddress coinAddress(it->sAddress);
+        CKeyID ckid;
+        CKey key;
+        if (!coinAddress.GetKeyID(ckid) || !SecureMsgGetReceiveKey(ckid, key))
+            continue;
 
-                    prevoutHash = tx.vin[i].prevout.hash;
-                    CTransaction txOfPrevOutput;
-                    if (!txdb.ReadDiskTx(prevoutHash, txOfPrevOutput))
-                    {
-                        printf("Could not get transaction for hash: %s.\n", prevoutHash.ToString().c_str());
-                        continue;
-                    };
+        keys.vAddresses.push_back(*it);
+        keys.vKeys.push_back(key);
+    };
+};
 
-                    unsigned int nOut = tx.vin[i].prevout.n;
-                    if (nOut >= txOfPrevOutput.vout.size())
-                    {
-                        printf("Output %u, not in transaction: %s.\n", nOut, prevoutHash.ToString().c_str());
-                        continue;
-                    };
+class SecMsgScanJob
+{
+// -- trial of one message against a list of receive keys, split over threads
+public:
+    const SecureMessage *psmsg;
+    const unsigned char *pPayload;
+    uint32_t nPayload;
+    SecMsgScanKeys &keys;
 
-                    CTxOut *txOut = &txOfPrevOutput.vout[nOut];
+    CCriticalSection cs;
+    int nMatch; // index into keys, -1 if none
 
-                    CTxDestination addressRet;
-                    if (!ExtractDestination(txOut->scriptPubKey, addressRet))
-                    {
-                        printf("ExtractDestination failed: %s.\n", prevoutHash.ToString().c_str());
-                        break;
-                    };
+    SecMsgScanJob(const SecureMessage *psmsgIn, const unsigned char *pPayloadIn, uint32_t nPayloadIn, SecMsgScanKeys &keysIn)
+        : psmsg(psmsgIn), pPayload(pPayloadIn), nPayload(nPayloadIn), keys(keysIn), nMatch(-1) {};
 
-                    CBitcoinAddress coinAddress(addressRet);
-                    CKeyID hashKey;
-                    if (!coinAddress.GetKeyID(hashKey))
-                    {
-                        printf("coinAddress.GetKeyID failed: %s.\n", coinAddress.ToString().c_str());
-                        break;
-                    };
+    int GetMatch()
+    {
+        LOCK(cs);
+        return nMatch;
+    };
+};
 
-                    int rv = SecureMsgInsertAddress(hashKey, pubKey, addrpkdb);
-                    if (rv != 0)
-                    {
-                        if (rv == 4)
-                            nDuplicates++;
-                        break;
-                    };
-                    nPubkeys++;
-                    break;
-                };
+static void SecureMsgScanWorker(SecMsgScanJob *job, unsigned int nBegin, unsigned int nEnd)
+{
+    // -- only the MAC is checked here, AES and LZ4 are left for the one key that matches
+    CKey keyR;
+    if (!SecureMsgGetKeyR(job->psmsg, keyR))
+        return;
 
-                //printf("opcode %d, %s, value %s.\n", opcode, GetOpName(opcode), ValueString(vch).c_str());
-            };
-            nInputs++;
-        };
-        nTransactions++;
+    unsigned char key_e[32], key_m[32];
+    for (unsigned int i = nBegin; i < nEnd; ++i)
+    {
+        int nMatch = job->GetMatch();
+        if (nMatch >= 0 && nMatch < (int)i)
+            return;
 
-        if (nTransactions % 10000 == 0) // for ScanChainForPublicKeys
-        {
-            printf("Scanning transaction no. %u.\n", nTransactions);
-        };
+        if (!SecureMsgSharedKeys(job->keys.vKeys[i], keyR, key_e, key_m))
+            continue;
+        if (!SecureMsgCheckMac(key_m, job->psmsg, job->pPayload, job->nPayload))
+            continue;
+
+        LOCK(job->cs);
+        if (job->nMatch < 0 || (int)i < job->nMatch)
+            job->nMatch = i;
+        return;
     };
-    return true;
 };
 
-bool SecureMsgScanBlock(CBlock &block)
+static bool SecureMsgFindOwner(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload,
+                               SecMsgScanKeys &keys, bool fParallel, std::string &addressTo)
 {
-    /*
-    scan block for public key addresses
-    called from ProcessMessage() in main where strCommand == "block"
+    /*  Returns true if the message is for one of the receiving addresses in
+        keys, and should go to the inbox. With fParallel the keys are split
+        over threads when there are enough to be worth it.
     */
+    SecMsgScanJob job((SecureMessage *)pHeader, pPayload, nPayload, keys);
 
-    if (fDebug)
-        printf("SecureMsgScanBlock().\n");
+    unsigned int nKeys = keys.vKeys.size();
+    unsigned int nThreads = fParallel ? std::min(boost::thread::hardware_concurrency(), nKeys / SMSG_SCAN_KEYS_PER_THREAD) : 1;
+    if (nThreads <= 1)
+    {
+        SecureMsgScanWorker(&job, 0, nKeys);
+    } else
+    {
+        boost::thread_group threadGroup;
+        unsigned int nPerThread = (nKeys + nThreads - 1) / nThreads;
+        for (unsigned int nBegin = 0; nBegin < nKeys; nBegin += nPerThread)
+        {
+            unsigned int nEnd = std::min(nKeys, nBegin + nPerThread);
+            try {
+                threadGroup.create_thread(boost::bind(&SecureMsgScanWorker, &job, nBegin, nEnd));
+            } catch (boost::thread_resource_error &e)
+            {
+                SecureMsgScanWorker(&job, nBegin, nEnd);
+            };
+        };
+        threadGroup.join_all();
+    };
+
+    int nMatch = job.GetMatch();
+    if (nMatch < 0)
+        return false;
 
-    uint32_t nTransactions = 0;
-    uint32_t nInputs = 0;
-    uint32_t nPubkeys = 0;
-    uint32_t nDuplicates = 0;
+    CBitcoinAddress coinAddress(keys.vAddresses[nMatch].sAddress);
+    addressTo = coinAddress.ToString();
 
+    if (keys.vAddresses[nMatch].fReceiveAnon)
     {
-        LOCK(cs_smsgDB);
-        CTxDB txdb("r");
+        if (fDebug)
+            printf("Decrypted message with %s.\n", addressTo.c_str());
+        return true;
+    };
 
-        SecMsgDB addrpkdb;
-        if (!addrpkdb.Open("cw") || !addrpkdb.TxnBegin())
-            return false;
+    // -- have to do full decrypt to see address from
+    MessageData msg;
+    if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) != 0)
+        return false;
 
-        ScanBlock(block, txdb, addrpkdb,
-                  nTransactions, nInputs, nPubkeys, nDuplicates);
+    if (fDebug)
+        printf("Decrypted message with %s.\n", addressTo.c_str());
 
-        addrpkdb.TxnCommit();
-    }
+    return msg.sFromAddress.compare("anon") != 0;
+};
 
-    if (fDebug)
-        printf("Found %u transactions, %u inputs, %u new public keys, %u duplicates.\n", nTransactions, nInputs, nPubkeys, nDuplicates);
+static int SecureMsgInboxRecord(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload,
+                                const std::string &addressTo, unsigned char *chKey, SecMsgStored &smsgInbox)
+{
+    SecureMessage *psmsg = (SecureMessage *)pHeader;
+    std::string sPrefix("im");
+    memcpy(&chKey[0], sPrefix.data(), 2);
+    memcpy(&chKey[2], &psmsg->timestamp, 8);
+    memcpy(&chKey[10], pPayload, 8);
 
-    return true;
+    smsgInbox.timeReceived = GetTime();
+    smsgInbox.status = (SMSG_MASK_UNREAD)&0xFF;
+    smsgInbox.sAddrTo = addressTo;
+
+    // -- data may not be contiguous
+    try
+    {
+        smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
+    }
+    catch (std::exception &e)
+    {
+        printf("SecureMsgInboxRecord(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
+        return 1;
+    };
+    memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
+    memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
+    return 0;
 };
 
-bool ScanChainForPublicKeys(CBlockIndex *pindexStart)
+int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, bool reportToGui)
 {
-    printf("Scanning block chain for public keys.\n");
-    int64_t nStart = GetTimeMillis();
+    /* 
+    Check if message belongs to this node.
+    If so add to inbox db.
+    
+    if !reportToGui don't fire NotifySecMsgInboxChanged
+     - loads messages received when wallet locked in bulk.
+    
+    returns
+        0 success,
+        1 error
+        2 no match
+        3 wallet is locked - message stored for scanning later.
+    */
 
     if (fDebug)
-        printf("From height %u.\n", pindexStart->nHeight);
+        printf("SecureMsgScanMessage()\n");
+
+    if (pwalletMain->IsLocked())
+    {
+        SecureMsgClearKeyCache();
 
-    // -- public keys are in txin.scriptSig
-    //    matching addresses are in scriptPubKey of txin's referenced output
+        if (fDebug)
+            printf("ScanMessage: Wallet is locked, storing message to scan later.\n");
 
-    uint32_t nBlocks = 0;
-    uint32_t nTransactions = 0;
-    uint32_t nInputs = 0;
-    uint32_t nPubkeys = 0;
-    uint32_t nDuplicates = 0;
+        int rv;
+        if ((rv = SecureMsgStoreUnscanned(pHeader, pPayload, nPayload)) != 0)
+            return 1;
 
-    {
-        LOCK(cs_smsgDB);
+        return 3;
+    };
 
-        CTxDB txdb("r");
+    SecMsgScanKeys keys;
+    SecureMsgGatherKeys(keys);
 
-        SecMsgDB addrpkdb;
-        if (!addrpkdb.Open("cw") || !addrpkdb.TxnBegin())
-            return false;
+    std::string addressTo;
+    if (SecureMsgFindOwner(pHeader, pPayload, nPayload, keys, true, addressTo))
+    {
+        // -- save to inbox
+        unsigned char chKey[18];
+        SecMsgStored smsgInbox;
+        if (SecureMsgInboxRecord(pHeader, pPayload, nPayload, addressTo, chKey, smsgInbox) != 0)
+            return 1;
 
-        CBlockIndex *pindex = pindexStart;
-        while (pindex)
         {
-            nBlocks++;
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-
-            ScanBlock(block, txdb, addrpkdb,
-                      nTransactions, nInputs, nPubkeys, nDuplicates);
+            LOCK(cs_smsgDB);
+            SecMsgDB dbInbox;
 
-            pindex = pindex->pnext;
-        };
+            if (dbInbox.Open("cw"))
+            {
+                if (dbInbox.ExistsSmesg(chKey))
+                {
+                    if (fDebug)
+                        printf("Message already exists in inbox db.\n");
+                }
+                else
+                {
+                    dbInbox.WriteSmesg(chKey, smsgInbox);
 
-        addrpkdb.TxnCommit();
+                    if (reportToGui)
+                        NotifySecMsgInboxChanged(smsgInbox);
+                    printf("SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
+                };
+            };
+        }
     };
 
-    printf("Scanned %u blocks, %u transactions, %u inputs\n", nBlocks, nTransactions, nInputs);
-    printf("Found %u public keys, %u duplicates.\n", nPubkeys, nDuplicates);
-    printf("Took %" PRId64 " ms\n", GetTimeMillis() - nStart);
-
-    return true;
+    return 0;
 };
 
-bool SecureMsgScanBlockChain()
+template <typename T>
+class SecMsgQueue
 {
-    TRY_LOCK(cs_main, lockMain);
-    if (lockMain)
+// -- bounded queue between the stages of the unlock scan
+public:
+    SecMsgQueue(size_t nMaxIn) : nMax(nMaxIn), fClosed(false) {};
+
+    void Push(const T &item)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.size() >= nMax && !fClosed)
+            condNotFull.wait(lock);
+        if (fClosed)
+            return;
+        queue.push_back(item);
+        condNotEmpty.notify_one();
+    };
+
+    // -- blocks until there is an item, returns false once closed and empty,
+    //    or at once when fWait is false and the queue is empty
+    bool Pop(T &item, bool fWait = true)
     {
-        CBlockIndex *pindexScan = pindexGenesisBlock;
-        if (pindexScan == NULL)
-        {
-            printf("Error: pindexGenesisBlock not set.\n");
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty() && !fClosed && fWait)
+            condNotEmpty.wait(lock);
+        if (queue.empty())
             return false;
-        };
+        item = queue.front();
+        queue.pop_front();
+        condNotFull.notify_one();
+        return true;
+    };
 
-        try
-        { // -- in try to catch errors opening db,
-            if (!ScanChainForPublicKeys(pindexScan))
-                return false;
-        }
-        catch (std::exception &e)
-        {
-            printf("ScanChainForPublicKeys() threw: %s.\n", e.what());
-            return false;
-        };
-    }
-    else
+    void Close()
     {
-        printf("ScanChainForPublicKeys() Could not lock main.\n");
-        return false;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fClosed = true;
+        condNotEmpty.notify_all();
+        condNotFull.notify_all();
     };
 
-    return true;
+private:
+    boost::mutex mutex;
+    boost::condition_variable condNotEmpty;
+    boost::condition_variable condNotFull;
+    std::deque<T> queue;
+    size_t nMax;
+    bool fClosed;
 };
 
-bool SecureMsgScanBuckets()
-{
-    if (fDebug)
-        printf("SecureMsgScanBuckets()\n");
+typedef std::vector<std::vector<unsigned char> > SecMsgBatch;
 
-    if (!fSecMsgEnabled || pwalletMain->IsLocked())
-        return false;
+class SecMsgInboxItem
+{
+public:
+    unsigned char chKey[18];
+    SecMsgStored smsgStored;
+};
 
-    int64_t mStart = GetTimeMillis();
-    int64_t now = GetTime();
-    uint32_t nFiles = 0;
-    uint32_t nMessages = 0;
-    uint32_t nFoundMessages = 0;
+class SecMsgUnlockScan
+{
+// -- state shared by the reader, decrypt workers and inbox writer
+public:
+    SecMsgQueue<boost::shared_ptr<SecMsgBatch> > queueBatches;
+    SecMsgQueue<boost::shared_ptr<SecMsgInboxItem> > queueInbox;
 
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-    fs::directory_iterator itend;
+    SecMsgUnlockScan() : queueBatches(SMSG_UNLOCK_QUEUE_BATCHES), queueInbox(SMSG_UNLOCK_WRITE_BATCH * 4), fFailed(false) {};
 
-    if (!fs::exists(pathSmsgDir) || !fs::is_directory(pathSmsgDir))
+    // -- set by the inbox writer, read by every thread
+    void SetFailed()
     {
-        printf("Message store directory does not exist.\n");
-        return 0; // not an error
+        LOCK(cs_failed);
+        fFailed = true;
     };
 
-    SecureMessage smsg;
-    std::vector<unsigned char> vchData;
+    bool Failed()
+    {
+        LOCK(cs_failed);
+        return fFailed;
+    };
 
-    for (fs::directory_iterator itd(pathSmsgDir); itd != itend; ++itd)
+    bool Aborted()
     {
-        if (!fs::is_regular_file(itd->status()))
-            continue;
+        return Failed() || !fSecMsgEnabled || fShutdown || pwalletMain->IsLocked();
+    };
 
-        std::string fileType = (*itd).path().extension().string();
+private:
+    CCriticalSection cs_failed;
+    bool fFailed;   // the inbox could not be written, keep the files for another try
+};
 
-        if (fileType.compare(".dat") != 0)
-            continue;
+static CCriticalSection cs_smsgUnlockScan;
+static CCriticalSection cs_smsgUnscanned;       // the _wl.dat files, taken after cs_smsg
+static bool fUnlockScanRunning = false;
+static bool fUnlockScanAgain = false;
+static uint64_t nUnlockScanBytes = 0;       // in the files being scanned
+static uint64_t nUnlockScanBytesRead = 0;
+static uint32_t nUnlockScanMessages = 0;    // read
+static uint32_t nUnlockScanScanned = 0;     // tried against the keys
+static uint32_t nUnlockScanFound = 0;       // written to the inbox
+
+bool SecureMsgUnlockScanProgress(uint32_t &nMessages, uint32_t &nScanned, uint32_t &nFound, int &nPercent)
+{
+    LOCK(cs_smsgUnlockScan);
+    nMessages = nUnlockScanMessages;
+    nScanned = nUnlockScanScanned;
+    nFound = nUnlockScanFound;
+    nPercent = nUnlockScanBytes > 0 ? (int)(nUnlockScanBytesRead * 100 / nUnlockScanBytes) : 100;
+    return fUnlockScanRunning;
+};
 
-        std::string fileName = (*itd).path().filename().string();
+static void SecureMsgUnlockScanDecrypt(SecMsgUnlockScan *scan)
+{
+    // -- each worker has its own copy of the keys, CKey can't be shared between threads
+    SecMsgScanKeys keys;
+    SecureMsgGatherKeys(keys);
 
-        if (fDebug)
-            printf("Processing file: %s.\n", fileName.c_str());
+    boost::shared_ptr<SecMsgBatch> batch;
+    while (scan->queueBatches.Pop(batch))
+    {
+        uint32_t nScanned = 0;
+        for (SecMsgBatch::iterator it = batch->begin(); it != batch->end(); ++it)
+        {
+            if (scan->Aborted())
+                break;
 
-        nFiles++;
+            unsigned char *pHeader = &(*it)[0];
+            unsigned char *pPayload = &(*it)[SMSG_HDR_LEN];
+            uint32_t nPayload = it->size() - SMSG_HDR_LEN;
+            nScanned++;
 
-        // TODO files must be split if > 2GB
-        // time_noFile.dat
-        size_t sep = fileName.find_first_of("_");
-        if (sep == std::string::npos)
-            continue;
+            std::string addressTo;
+            if (!SecureMsgFindOwner(pHeader, pPayload, nPayload, keys, false, addressTo))
+                continue;
 
-        std::string stime = fileName.substr(0, sep);
+            boost::shared_ptr<SecMsgInboxItem> item(new SecMsgInboxItem());
+            if (SecureMsgInboxRecord(pHeader, pPayload, nPayload, addressTo, item->chKey, item->smsgStored) == 0)
+                scan->queueInbox.Push(item);
+        };
 
-        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
+        LOCK(cs_smsgUnlockScan);
+        nUnlockScanScanned += nScanned;
+    };
+};
 
-        if (fileTime < now - SMSG_RETENTION)
-        {
-            printf("Dropping file %s, expired.\n", fileName.c_str());
-            try
-            {
-                fs::remove((*itd).path());
-            }
-            catch (const fs::filesystem_error &ex)
-            {
-                printf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
-            };
-            continue;
-        };
+static void SecureMsgUnlockScanWrite(SecMsgUnlockScan *scan)
+{
+    // -- write found messages to the inbox db, in batches of up to SMSG_UNLOCK_WRITE_BATCH
+    boost::shared_ptr<SecMsgInboxItem> item;
+    while (scan->queueInbox.Pop(item))
+    {
+        std::vector<boost::shared_ptr<SecMsgInboxItem> > vItems(1, item);
+        while (vItems.size() < SMSG_UNLOCK_WRITE_BATCH && scan->queueInbox.Pop(item, false))
+            vItems.push_back(item);
 
-        if (boost::algorithm::ends_with(fileName, "_wl.dat"))
-        {
-            if (fDebug)
-                printf("Skipping wallet locked file: %s.\n", fileName.c_str());
+        // -- once aborted or failed only drain the queue, the files are kept
+        //    and scanned again, messages already written are skipped then
+        if (scan->Aborted())
             continue;
-        };
 
+        uint32_t nWritten = 0;
         {
-            LOCK(cs_smsg);
-            FILE *fp;
-            errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
+            LOCK(cs_smsgDB);
+            SecMsgDB dbInbox;
+            if (!dbInbox.Open("cw") || !dbInbox.TxnBegin())
             {
-                printf("Error opening file: %s\n", strerror(errno));
+                printf("SecureMsgUnlockScan: could not open inbox.\n");
+                scan->SetFailed();
                 continue;
             };
 
-            for (;;)
+            for (unsigned int i = 0; i < vItems.size(); ++i)
             {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        printf("fread header failed: %s\n", strerror(errno));
-                    }
-                    else
-                    {
-                        //printf("End of file.\n");
-                    };
-                    break;
-                };
-
-                try
-                {
-                    vchData.resize(smsg.nPayload);
-                }
-                catch (std::exception &e)
-                {
-                    printf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
-
-                if (fread(&vchData[0], sizeof(unsigned char), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    printf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
-
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                }
-                else if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
-
-                nMessages++;
+                if (dbInbox.ExistsSmesg(vItems[i]->chKey))
+                    continue;
+                dbInbox.WriteSmesg(vItems[i]->chKey, vItems[i]->smsgStored);
+                nWritten++;
             };
 
-            fclose(fp);
-
-            // -- remove wl file when scanned
-            try
-            {
-                fs::remove((*itd).path());
-            }
-            catch (const boost::filesystem::filesystem_error &ex)
+            if (!dbInbox.TxnCommit())
             {
-                printf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
-                return 1;
+                printf("SecureMsgUnlockScan: inbox write failed.\n");
+                scan->SetFailed();
+                continue;
             };
-        };
-    };
-
-    printf("Processed %u files, scanned %u messages, received %u messages.\n", nFiles, nMessages, nFoundMessages);
-    printf("Took %" PRId64 " ms\n", GetTimeMillis() - mStart);
+        }
 
-    return true;
-}
+        LOCK(cs_smsgUnlockScan);
+        nUnlockScanFound += nWritten;
+    };
+};
 
-int SecureMsgWalletUnlocked()
+static int SecureMsgUnlockScanFiles()
 {
     /*
-    When the wallet is unlocked scan messages received while wallet was locked.
+    Scan messages received while the wallet was locked.
+    
+    The wl files are renamed before reading, so messages received while the
+    scan runs go to new files. A renamed file is only removed once the whole
+    scan has finished, if it was interrupted it is picked up on the next unlock.
+    
+    Reads batches of messages into a queue for the decrypt workers, which
+    pass matches to a single inbox writer. cs_smsg is not held.
     */
-    if (!fSecMsgEnabled)
-        return 0;
-
-    printf("SecureMsgWalletUnlocked()\n");
-
-    if (pwalletMain->IsLocked())
-    {
-        printf("Error: Wallet is locked.\n");
-        return 1;
-    };
-
     int64_t now = GetTime();
     uint32_t nFiles = 0;
-    uint32_t nMessages = 0;
-    uint32_t nFoundMessages = 0;
 
     fs::path pathSmsgDir = GetDataDir() / "smsgStore";
     fs::directory_iterator itend;
@@ -2338,9 +3889,8 @@ int SecureMsgWalletUnlocked()
         return 0; // not an error
     };
 
-    SecureMessage smsg;
-    std::vector<unsigned char> vchData;
-
+    std::vector<fs::path> vScanFiles;
+    uint64_t nBytes = 0;
     for (fs::directory_iterator itd(pathSmsgDir); itd != itend; ++itd)
     {
         if (!fs::is_regular_file(itd->status()))
@@ -2348,275 +3898,247 @@ int SecureMsgWalletUnlocked()
 
         std::string fileName = (*itd).path().filename().string();
 
-        if (!boost::algorithm::ends_with(fileName, "_wl.dat"))
+        bool fLeftover = boost::algorithm::ends_with(fileName, ".scan");
+        if (!fLeftover && !boost::algorithm::ends_with(fileName, "_wl.dat"))
             continue;
 
-        if (fDebug)
-            printf("Processing file: %s.\n", fileName.c_str());
-
-        nFiles++;
-
-        // TODO files must be split if > 2GB
-        // time_noFile_wl.dat
+        // time_noFile_wl.dat, time_noFile_wl_unique.scan
         size_t sep = fileName.find_first_of("_");
         if (sep == std::string::npos)
             continue;
 
-        std::string stime = fileName.substr(0, sep);
-
-        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
+        int64_t fileTime;
+        try
+        {
+            fileTime = boost::lexical_cast<int64_t>(fileName.substr(0, sep));
+        }
+        catch (boost::bad_lexical_cast &)
+        {
+            continue;
+        };
 
-        if (fileTime < now - SMSG_RETENTION)
+        try
         {
-            printf("Dropping wallet locked file %s, expired.\n", fileName.c_str());
-            try
+            if (fileTime < now - SMSG_RETENTION)
             {
+                printf("Dropping wallet locked file %s, expired.\n", fileName.c_str());
                 fs::remove((*itd).path());
-            }
-            catch (const boost::filesystem::filesystem_error &ex)
+                continue;
+            };
+
+            fs::path path = (*itd).path();
+            if (!fLeftover)
             {
-                printf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
-                return 1;
+                // -- not while SecureMsgStoreUnscanned is appending to it
+                fs::path pathScan = pathSmsgDir / (fileName.substr(0, fileName.size() - 4) + "_" + boost::lexical_cast<std::string>(GetTimeMicros()) + ".scan");
+                LOCK(cs_smsgUnscanned);
+                fs::rename(path, pathScan);
+                path = pathScan;
             };
-            continue;
+
+            nBytes += fs::file_size(path);
+            vScanFiles.push_back(path);
+        }
+        catch (const boost::filesystem::filesystem_error &ex)
+        {
+            printf("Error preparing wl file %s - %s\n", fileName.c_str(), ex.what());
         };
+    };
+
+    {
+        LOCK(cs_smsgUnlockScan);
+        nUnlockScanBytes = nBytes;
+        nUnlockScanBytesRead = 0;
+        nUnlockScanMessages = nUnlockScanScanned = nUnlockScanFound = 0;
+    }
+
+    if (vScanFiles.empty())
+        return 0;
 
+    SecMsgUnlockScan scan;
+    boost::thread_group threadGroup;
+    unsigned int nWorkers = std::max(1u, std::min(boost::thread::hardware_concurrency(), SMSG_MAX_POW_THREADS));
+    try {
+        for (unsigned int i = 0; i < nWorkers; ++i)
+            threadGroup.create_thread(boost::bind(&SecureMsgUnlockScanDecrypt, &scan));
+        boost::thread *writer = new boost::thread(boost::bind(&SecureMsgUnlockScanWrite, &scan));
+
+        int64_t nLastReport = GetTimeMillis();
+        SecureMessage smsg;
+        for (std::vector<fs::path>::iterator itf = vScanFiles.begin(); itf != vScanFiles.end() && !scan.Aborted(); ++itf)
         {
-            LOCK(cs_smsg);
+            if (fDebug)
+                printf("Processing file: %s.\n", itf->filename().string().c_str());
+
             FILE *fp;
             errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
+            if (!(fp = fopen(itf->string().c_str(), "rb")))
             {
                 printf("Error opening file: %s\n", strerror(errno));
                 continue;
             };
+            nFiles++;
 
+            boost::shared_ptr<SecMsgBatch> batch(new SecMsgBatch());
+            uint64_t nRead = 0;
             for (;;)
             {
                 errno = 0;
                 if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
                 {
                     if (errno != 0)
-                    {
                         printf("fread header failed: %s\n", strerror(errno));
-                    }
-                    else
-                    {
-                        //printf("End of file.\n");
-                    };
                     break;
                 };
 
-                try
-                {
-                    vchData.resize(smsg.nPayload);
-                }
-                catch (std::exception &e)
+                if (smsg.nPayload > SMSG_MAX_MSG_WORST)
                 {
-                    printf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
+                    printf("SecureMsgUnlockScan: bad payload size %u in %s.\n", smsg.nPayload, itf->filename().string().c_str());
+                    break;
                 };
 
-                if (fread(&vchData[0], sizeof(unsigned char), smsg.nPayload, fp) != smsg.nPayload)
+                batch->push_back(std::vector<unsigned char>(SMSG_HDR_LEN + smsg.nPayload));
+                std::vector<unsigned char> &vchMessage = batch->back();
+                memcpy(&vchMessage[0], &smsg.hash[0], SMSG_HDR_LEN);
+                if (smsg.nPayload > 0 && fread(&vchMessage[SMSG_HDR_LEN], sizeof(unsigned char), smsg.nPayload, fp) != smsg.nPayload)
                 {
                     printf("fread data failed: %s\n", strerror(errno));
+                    batch->pop_back();
                     break;
                 };
+                nRead += SMSG_HDR_LEN + smsg.nPayload;
 
-                // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
-
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                }
-                else if (rv != 0)
+                if (batch->size() >= SMSG_UNLOCK_READ_BATCH)
                 {
-                    // SecureMsgScanMessage failed
+                    {
+                        LOCK(cs_smsgUnlockScan);
+                        nUnlockScanMessages += batch->size();
+                        nUnlockScanBytesRead += nRead;
+                    }
+                    nRead = 0;
+                    scan.queueBatches.Push(batch);
+                    batch.reset(new SecMsgBatch());
+
+                    if (scan.Aborted())
+                        break;
                 };
 
-                nMessages++;
+                if (GetTimeMillis() - nLastReport > 5000)
+                {
+                    uint32_t nMessages, nScanned, nFound;
+                    int nPercent;
+                    SecureMsgUnlockScanProgress(nMessages, nScanned, nFound, nPercent);
+                    printf("SecureMsgUnlockScan: %d%%, scanned %u of %u messages read, received %u.\n", nPercent, nScanned, nMessages, nFound);
+                    nLastReport = GetTimeMillis();
+                };
             };
-
             fclose(fp);
 
-            // -- remove wl file when scanned
-            try
             {
-                fs::remove((*itd).path());
+                LOCK(cs_smsgUnlockScan);
+                nUnlockScanMessages += batch->size();
+                nUnlockScanBytesRead += nRead;
             }
-            catch (const boost::filesystem::filesystem_error &ex)
-            {
-                printf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
-                return 1;
-            };
+            if (!batch->empty())
+                scan.queueBatches.Push(batch);
         };
+
+        scan.queueBatches.Close();
+        threadGroup.join_all();
+        scan.queueInbox.Close();
+        writer->join();
+        delete writer;
+    } catch (boost::thread_resource_error &e)
+    {
+        printf("SecureMsgUnlockScan: could not start threads: %s\n", e.what());
+        scan.queueBatches.Close();
+        scan.queueInbox.Close();
+        threadGroup.join_all();
+        return 1;
     };
 
-    printf("Processed %u files, scanned %u messages, received %u messages.\n", nFiles, nMessages, nFoundMessages);
+    if (scan.Failed())
+    {
+        printf("SecureMsgUnlockScan: failed, the messages will be scanned again on the next unlock.\n");
+        return 1;
+    };
+    if (scan.Aborted())
+    {
+        printf("SecureMsgUnlockScan: interrupted, the rest will be scanned on the next unlock.\n");
+        return 1;
+    };
 
-    // -- notify gui
-    NotifySecMsgWalletUnlocked();
+    for (std::vector<fs::path>::iterator itf = vScanFiles.begin(); itf != vScanFiles.end(); ++itf)
+    {
+        try
+        {
+            fs::remove(*itf);
+        }
+        catch (const boost::filesystem::filesystem_error &ex)
+        {
+            printf("Error removing wl file %s - %s\n", itf->string().c_str(), ex.what());
+        };
+    };
 
+    uint32_t nMessages, nScanned, nFound;
+    int nPercent;
+    SecureMsgUnlockScanProgress(nMessages, nScanned, nFound, nPercent);
+    printf("Processed %u files, scanned %u messages, received %u messages.\n", nFiles, nScanned, nFound);
     return 0;
 };
 
-int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode)
+void ThreadSecureMsgUnlockScan(void *parg)
 {
-    if (!fSecMsgEnabled)
-        return 0;
-
-    printf("SecureMsgWalletKeyChanged()\n");
-
-    // TODO: default recv and recvAnon
+    RenameThread("shadowcoin-smsg-unlock"); // Make this thread recognisable
 
+    for (;;)
     {
-        LOCK(cs_smsg);
+        SecureMsgUnlockScanFiles();
 
-        switch (mode)
+        LOCK(cs_smsgUnlockScan);
+        if (!fUnlockScanAgain || !fSecMsgEnabled || fShutdown)
         {
-        case CT_NEW:
-            smsgAddresses.push_back(SecMsgAddress(sAddress, smsgOptions.fNewAddressRecv, smsgOptions.fNewAddressAnon));
-            break;
-        case CT_DELETED:
-            for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
-            {
-                if (sAddress != it->sAddress)
-                    continue;
-                smsgAddresses.erase(it);
-                break;
-            };
-            break;
-        default:
+            fUnlockScanRunning = false;
             break;
-        }
-
-    }; // LOCK(cs_smsg);
+        };
+        fUnlockScanAgain = false;
+    };
 
-    return 0;
+    // -- notify gui
+    NotifySecMsgWalletUnlocked();
 };
 
-int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, bool reportToGui)
+int SecureMsgWalletUnlocked()
 {
-    /* 
-    Check if message belongs to this node.
-    If so add to inbox db.
-    
-    if !reportToGui don't fire NotifySecMsgInboxChanged
-     - loads messages received when wallet locked in bulk.
-    
-    returns
-        0 success,
-        1 error
-        2 no match
-        3 wallet is locked - message stored for scanning later.
+    /*
+    When the wallet is unlocked scan messages received while wallet was locked.
+    The scan runs in its own thread, the unlock doesn't wait for it.
     */
+    if (!fSecMsgEnabled)
+        return 0;
 
-    if (fDebug)
-        printf("SecureMsgScanMessage()\n");
+    printf("SecureMsgWalletUnlocked()\n");
 
     if (pwalletMain->IsLocked())
     {
-        if (fDebug)
-            printf("ScanMessage: Wallet is locked, storing message to scan later.\n");
-
-        int rv;
-        if ((rv = SecureMsgStoreUnscanned(pHeader, pPayload, nPayload)) != 0)
-            return 1;
-
-        return 3;
+        printf("Error: Wallet is locked.\n");
+        return 1;
     };
 
-    std::string addressTo;
-    MessageData msg; // placeholder
-    bool fOwnMessage = false;
-
-    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    LOCK(cs_smsgUnlockScan);
+    if (fUnlockScanRunning)
     {
-        if (!it->fReceiveEnabled)
-            continue;
-
-        CBitcoinAddress coinAddress(it->sAddress);
-        addressTo = coinAddress.ToString();
-
-        if (!it->fReceiveAnon)
-        {
-            // -- have to do full decrypt to see address from
-            if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebug)
-                    printf("Decrypted message with %s.\n", addressTo.c_str());
-
-                if (msg.sFromAddress.compare("anon") != 0)
-                    fOwnMessage = true;
-                break;
-            };
-        }
-        else
-        {
-
-            if (SecureMsgDecrypt(true, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebug)
-                    printf("Decrypted message with %s.\n", addressTo.c_str());
-
-                fOwnMessage = true;
-                break;
-            };
-        }
+        // -- the running scan goes round again to pick up anything new
+        fUnlockScanAgain = true;
+        return 0;
     };
 
-    if (fOwnMessage)
+    if (!NewThread(ThreadSecureMsgUnlockScan, NULL))
     {
-        // -- save to inbox
-        SecureMessage *psmsg = (SecureMessage *)pHeader;
-        std::string sPrefix("im");
-        unsigned char chKey[18];
-        memcpy(&chKey[0], sPrefix.data(), 2);
-        memcpy(&chKey[2], &psmsg->timestamp, 8);
-        memcpy(&chKey[10], pPayload, 8);
-
-        SecMsgStored smsgInbox;
-        smsgInbox.timeReceived = GetTime();
-        smsgInbox.status = (SMSG_MASK_UNREAD)&0xFF;
-        smsgInbox.sAddrTo = addressTo;
-
-        // -- data may not be contiguous
-        try
-        {
-            smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
-        }
-        catch (std::exception &e)
-        {
-            printf("SecureMsgScanMessage(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
-            return 1;
-        };
-        memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
-        memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
-
-        {
-            LOCK(cs_smsgDB);
-            SecMsgDB dbInbox;
-
-            if (dbInbox.Open("cw"))
-            {
-                if (dbInbox.ExistsSmesg(chKey))
-                {
-                    if (fDebug)
-                        printf("Message already exists in inbox db.\n");
-                }
-                else
-                {
-                    dbInbox.WriteSmesg(chKey, smsgInbox);
-
-                    if (reportToGui)
-                        NotifySecMsgInboxChanged(smsgInbox);
-                    printf("SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
-                };
-            };
-        }
+        printf("SecureMsgWalletUnlocked(): could not start scan thread.\n");
+        return 1;
     };
+    fUnlockScanRunning = true;
 
     return 0;
 };
@@ -2754,70 +4276,56 @@ int SecureMsgAddAddress(std::string &address, std::string &publicKey)
     return SecureMsgInsertAddress(hashKey, pubKey);
 };
 
-int SecureMsgRetrieve(SecMsgToken &token, std::vector<unsigned char> &vchData)
+int SecureMsgRetrieve(SecMsgToken &token, const unsigned char *&pData, uint32_t &nData)
 {
+    /*  Point pData at the stored message, header and payload, inside the
+        mapped bucket segment. pData is only valid until the next call and
+        while cs_smsg is held.
+    */
     if (fDebug)
         printf("SecureMsgRetrieve() %" PRId64 ".\n", token.timestamp);
 
     // -- has cs_smsg lock from SecureMsgReceiveData
 
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-
-    //printf("token.offset %"PRId64".\n", token.offset); // DEBUG
     int64_t bucket = token.timestamp - (token.timestamp % SMSG_BUCKET_LEN);
-    std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
-    fs::path fullpath = pathSmsgDir / fileName;
-
-    //printf("bucket %"PRId64".\n", bucket);
-    //printf("bucket lld %lld.\n", bucket);
-    //printf("fileName %s.\n", fileName.c_str());
-
-    FILE *fp;
-    errno = 0;
-    if (!(fp = fopen(fullpath.string().c_str(), "rb")))
+
+    const unsigned char *pSegment;
+    if (token.offset < 0 || !(pSegment = SecureMsgMapSegment(bucket, token.offset + SMSG_HDR_LEN)))
     {
-        printf("Error opening file: %s\nPath %s\n", strerror(errno), fullpath.string().c_str());
+        printf("SecureMsgRetrieve(): Offset %" PRId64 " is not in bucket %" PRId64 ".\n", token.offset, bucket);
         return 1;
     };
 
-    errno = 0;
-    if (fseek(fp, token.offset, SEEK_SET) != 0)
+    const SecureMessage *psmsg = (const SecureMessage *)(pSegment + token.offset);
+    uint32_t nPayload = psmsg->nPayload;
+    if (!(pSegment = SecureMsgMapSegment(bucket, token.offset + SMSG_HDR_LEN + nPayload)))
     {
-        printf("fseek, strerror: %s.\n", strerror(errno));
-        fclose(fp);
+        printf("SecureMsgRetrieve(): Bucket %" PRId64 " is too short for message at %" PRId64 ".\n", bucket, token.offset);
         return 1;
     };
 
-    SecureMessage smsg;
-    errno = 0;
-    if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-    {
-        printf("fread header failed: %s\n", strerror(errno));
-        fclose(fp);
+    pData = pSegment + token.offset;
+    nData = SMSG_HDR_LEN + nPayload;
+    return 0;
+};
+
+int SecureMsgRetrieve(SecMsgToken &token, std::vector<unsigned char> &vchData)
+{
+    const unsigned char *pData;
+    uint32_t nData;
+    if (SecureMsgRetrieve(token, pData, nData) != 0)
         return 1;
-    };
 
     try
     {
-        vchData.resize(SMSG_HDR_LEN + smsg.nPayload);
+        vchData.assign(pData, pData + nData);
     }
     catch (std::exception &e)
     {
-        printf("SecureMsgRetrieve(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + smsg.nPayload, e.what());
-        return 1;
-    };
-
-    memcpy(&vchData[0], &smsg.hash[0], SMSG_HDR_LEN);
-    errno = 0;
-    if (fread(&vchData[SMSG_HDR_LEN], sizeof(unsigned char), smsg.nPayload, fp) != smsg.nPayload)
-    {
-        printf("fread data failed: %s. Wanted %u bytes.\n", strerror(errno), smsg.nPayload);
-        fclose(fp);
+        printf("SecureMsgRetrieve(): Could not resize vchData, %u, %s\n", nData, e.what());
         return 1;
     };
 
-    fclose(fp);
-
     return 0;
 };
 
@@ -2872,6 +4380,11 @@ int SecureMsgReceive(CNode *pfrom, std::vector<unsigned char> &vchData)
 
     uint32_t n = 12;
 
+    // -- admission control, refuse what doesn't fit before the proof of work is checked
+    uint32_t nStoreMessages, nRejected = 0;
+    uint64_t nStoreBytes;
+    SecureMsgStoreTotals(nStoreMessages, nStoreBytes);
+
     for (uint32_t i = 0; i < nBunch; ++i)
     {
         if (vchData.size() - n < SMSG_HDR_LEN)
@@ -2882,6 +4395,17 @@ int SecureMsgReceive(CNode *pfrom, std::vector<unsigned char> &vchData)
 
         SecureMessage *psmsg = (SecureMessage *)&vchData[n];
 
+        uint32_t nMessageBytes = SMSG_HDR_LEN + psmsg->nPayload;
+        int64_t bucket = psmsg->timestamp - (psmsg->timestamp % SMSG_BUCKET_LEN);
+        if (SecureMsgAdmit(bucket, nMessageBytes, nStoreMessages, nStoreBytes) != 0)
+        {
+            nRejected++;
+            if (vchData.size() - n < nMessageBytes)
+                break;
+            n += nMessageBytes;
+            continue;
+        };
+
         int rv;
         if ((rv = SecureMsgValidate(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload)) != 0)
         {
@@ -2903,6 +4427,8 @@ int SecureMsgReceive(CNode *pfrom, std::vector<unsigned char> &vchData)
             // message dropped
             break; // continue?
         };
+        nStoreMessages++;
+        nStoreBytes += nMessageBytes;
 
         if (SecureMsgScanMessage(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload, true) != 0)
         {
@@ -2912,6 +4438,12 @@ int SecureMsgReceive(CNode *pfrom, std::vector<unsigned char> &vchData)
         n += SMSG_HDR_LEN + psmsg->nPayload;
     };
 
+    if (nRejected > 0)
+    {
+        nSmsgRejected += nRejected;
+        printf("SecureMsgReceive(): store budget reached, refused %u messages for bucket %" PRId64 ".\n", nRejected, bktTime);
+    };
+
     // -- if messages have been added, bucket must exist now
     itb = smsgBuckets.find(bktTime);
     if (itb == smsgBuckets.end())
@@ -2974,6 +4506,9 @@ int SecureMsgStoreUnscanned(unsigned char *pHeader, unsigned char *pPayload, uin
     std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01_wl.dat";
     fs::path fullpath = pathSmsgDir / fileName;
 
+    // -- the unlock scan renames these files
+    LOCK(cs_smsgUnscanned);
+
     FILE *fp;
     errno = 0;
     if (!(fp = fopen(fullpath.string().c_str(), "ab")))
@@ -3102,8 +4637,17 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
 
         token.offset = ofs;
 
+        std::vector<SecMsgIndexRecord> vRecord(1);
+        vRecord[0].timestamp = token.timestamp;
+        memcpy(vRecord[0].sample, token.sample, 8);
+        vRecord[0].offset = ofs;
+        vRecord[0].nPayload = nPayload;
+        if (!SecureMsgWriteIndex(bucket, vRecord, true))
+            printf("Could not index message, bucket %" PRId64 " will be reindexed on the next start.\n", bucket);
+
         //printf("token.offset: %"PRId64"\n", token.offset); // DEBUG
-        tokenSet.insert(token);
+        smsgBuckets[bucket].insertToken(token);
+        smsgBuckets[bucket].nBytes = ofs + SMSG_HDR_LEN + nPayload;
 
         if (fUpdateBucket)
             smsgBuckets[bucket].hashBucket();
@@ -3119,6 +4663,31 @@ int SecureMsgStore(SecureMessage &smsg, bool fUpdateBucket)
     return SecureMsgStore(&smsg.hash[0], smsg.pPayload, smsg.nPayload, fUpdateBucket);
 };
 
+// Proof of work hash: HMAC-SHA256 keyed with the nonce repeated 8 times,
+// over the header (less the checksum) and the payload twice.
+// The nonce is part of the key, which is hashed first, so nothing past the
+// key can be carried over between nonces.
+static void SecureMsgPowHash(const unsigned char *pHeader, const unsigned char *pPayload, uint32_t nPayload, unsigned char *pHash)
+{
+    const SecureMessage *psmsg = (const SecureMessage *)pHeader;
+
+    unsigned char civ[32];
+    for (int i = 0; i < 32; i += 4)
+        memcpy(civ + i, &psmsg->nonse[0], 4);
+
+    HMAC_SHA256_CTX ctx;
+    HMAC_SHA256_Init(&ctx, civ, 32);
+    HMAC_SHA256_Update(&ctx, pHeader + 4, SMSG_HDR_LEN - 4);
+    HMAC_SHA256_Update(&ctx, pPayload, nPayload);
+    HMAC_SHA256_Update(&ctx, pPayload, nPayload);
+    HMAC_SHA256_Final(pHash, &ctx);
+};
+
+static inline bool SecureMsgPowHashValid(const unsigned char *pHash)
+{
+    return pHash[31] == 0 && pHash[30] == 0 && (~(pHash[29]) & ((1 << 0) | (1 << 1) | (1 << 2)));
+};
+
 int SecureMsgValidate(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload)
 {
     /*
@@ -3138,48 +4707,96 @@ int SecureMsgValidate(unsigned char *pHeader, unsigned char *pPayload, uint32_t
     if (nPayload > SMSG_MAX_MSG_WORST)
         return 5;
 
-    unsigned char civ[32];
     unsigned char sha256Hash[32];
     int rv = 2; // invalid
 
-    uint32_t nonse;
-    memcpy(&nonse, &psmsg->nonse[0], 4);
-
     if (fDebug)
+    {
+        uint32_t nonse;
+        memcpy(&nonse, &psmsg->nonse[0], 4);
         printf("SecureMsgValidate() nonse %u.\n", nonse);
+    };
 
-    for (int i = 0; i < 32; i += 4)
-        memcpy(civ + i, &nonse, 4);
+    SecureMsgPowHash(pHeader, pPayload, nPayload, sha256Hash);
 
-    HMAC_CTX *ctx = HMAC_CTX_new();
+    if (SecureMsgPowHashValid(sha256Hash))
+    {
+        if (fDebug)
+            printf("Hash Valid.\n");
+        rv = 0; // smsg is valid
+    };
 
-    unsigned int nBytes;
-    if (!HMAC_Init_ex(ctx, &civ[0], 32, EVP_sha256(), NULL) || !HMAC_Update(ctx, (unsigned char *)pHeader + 4, SMSG_HDR_LEN - 4) || !HMAC_Update(ctx, (unsigned char *)pPayload, nPayload) || !HMAC_Update(ctx, pPayload, nPayload) || !HMAC_Final(ctx, sha256Hash, &nBytes) || nBytes != 32)
+    if (memcmp(psmsg->hash, sha256Hash, 4) != 0)
     {
         if (fDebug)
-            printf("HMAC error.\n");
-        rv = 1; // error
-    }
-    else
+            printf("Checksum mismatch.\n");
+        rv = 3; // checksum mismatch
+    };
+
+    return rv;
+};
+
+class SecMsgPowSearch
+{
+// -- nonce search shared by the proof of work threads
+public:
+    const unsigned char *pHeader;
+    const unsigned char *pPayload;
+    uint32_t nPayload;
+    uint32_t nThreads;
+
+    CCriticalSection cs;
+    bool fFound;
+    uint32_t nonse;
+    unsigned char hash[32];
+
+    SecMsgPowSearch(const unsigned char *pHeaderIn, const unsigned char *pPayloadIn, uint32_t nPayloadIn, uint32_t nThreadsIn)
+        : pHeader(pHeaderIn), pPayload(pPayloadIn), nPayload(nPayloadIn), nThreads(nThreadsIn),
+          fFound(false), nonse(0)
     {
-        if (sha256Hash[31] == 0 && sha256Hash[30] == 0 && (~(sha256Hash[29]) & ((1 << 0) | (1 << 1) | (1 << 2))))
-        {
-            if (fDebug)
-                printf("Hash Valid.\n");
-            rv = 0; // smsg is valid
-        };
+        memset(hash, 0, sizeof(hash));
+    };
 
-        if (memcmp(psmsg->hash, sha256Hash, 4) != 0)
-        {
-            if (fDebug)
-                printf("Checksum mismatch.\n");
-            rv = 3; // checksum mismatch
-        }
-    }
+    bool Done()
+    {
+        LOCK(cs);
+        return fFound || !fSecMsgEnabled;
+    };
+};
 
-    HMAC_CTX_free(ctx);
+static void SecureMsgPowWorker(SecMsgPowSearch *search, uint32_t nFirst)
+{
+    // -- thread n tries nonces n, n + nThreads, n + 2 * nThreads, ...
+    //    each works on its own copy of the header as the nonce is part of it
+    unsigned char header[SMSG_HDR_LEN];
+    memcpy(header, search->pHeader, SMSG_HDR_LEN);
+    SecureMessage *psmsg = (SecureMessage *)header;
 
-    return rv;
+    unsigned char sha256Hash[32];
+    uint32_t nStride = search->nThreads;
+
+    for (uint64_t n = nFirst; n <= 4294967295U; n += nStride)
+    {
+        if ((n / nStride) % 1024 == 0 && search->Done())
+            return;
+
+        uint32_t nonse = (uint32_t)n;
+        memcpy(&psmsg->nonse[0], &nonse, 4);
+        SecureMsgPowHash(header, search->pPayload, search->nPayload, sha256Hash);
+
+        if (SecureMsgPowHashValid(sha256Hash))
+        {
+            LOCK(search->cs);
+            // -- keep the lowest nonce if several threads match at once
+            if (!search->fFound || nonse < search->nonse)
+            {
+                search->fFound = true;
+                search->nonse = nonse;
+                memcpy(search->hash, sha256Hash, 32);
+            };
+            return;
+        };
+    };
 };
 
 int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload)
@@ -3187,6 +4804,7 @@ int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t n
     /*  proof of work and checksum
         
         May run in a thread, if shutdown detected, return.
+        The nonce space is split over -smsgpowthreads threads.
         
         returns:
             0 success
@@ -3198,94 +4816,129 @@ int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t n
     SecureMessage *psmsg = (SecureMessage *)pHeader;
 
     int64_t nStart = GetTimeMillis();
-    unsigned char civ[32];
-    unsigned char sha256Hash[32];
 
-    //std::vector<unsigned char> vchHash;
-    //vchHash.resize(32);
+    int64_t nThreads = GetArg("-smsgpowthreads", 0);
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    if (nThreads <= 0)
+        nThreads = 1;
+    if (nThreads > SMSG_MAX_POW_THREADS)
+        nThreads = SMSG_MAX_POW_THREADS;
 
-    bool found = false;
-    HMAC_CTX *ctx = HMAC_CTX_new();
-
-    uint32_t nonse = 0;
+    SecMsgPowSearch search(pHeader, pPayload, nPayload, (uint32_t)nThreads);
 
-    //CBigNum bnTarget(2);
-    //bnTarget = bnTarget.pow(256 - 40);
-
-    // -- break for HMAC_CTX_cleanup
-    for (;;)
+    if (nThreads == 1)
     {
-        if (!fSecMsgEnabled)
-            break;
-
-        //psmsg->timestamp = GetTime();
-        //memcpy(&psmsg->timestamp, &now, 8);
-        memcpy(&psmsg->nonse[0], &nonse, 4);
-
-        for (int i = 0; i < 32; i += 4)
-            memcpy(civ + i, &nonse, 4);
-
-        unsigned int nBytes;
-        if (!HMAC_Init_ex(ctx, &civ[0], 32, EVP_sha256(), NULL) || !HMAC_Update(ctx, (unsigned char *)pHeader + 4, SMSG_HDR_LEN - 4) || !HMAC_Update(ctx, (unsigned char *)pPayload, nPayload) || !HMAC_Update(ctx, pPayload, nPayload) || !HMAC_Final(ctx, sha256Hash, &nBytes)
-            //|| !HMAC_Final(&ctx, &vchHash[0], &nBytes)
-            || nBytes != 32)
-            break;
-
-        /*
-        if (CBigNum(vchHash) <= bnTarget)
+        SecureMsgPowWorker(&search, 0);
+    } else
+    {
+        boost::thread_group threadGroup;
+        try {
+            for (uint32_t i = 0; i < search.nThreads; ++i)
+                threadGroup.create_thread(boost::bind(&SecureMsgPowWorker, &search, i));
+        } catch (boost::thread_resource_error &e)
         {
-            found = true;
-            if (fDebug)
-                printf("Match %u\n", nonse);
-            break;
+            // -- the nonces of the missing threads go unsearched, usually enough are left
+            printf("SecureMsgSetHash() could not start all threads: %s\n", e.what());
         };
-        */
-
-        if (sha256Hash[31] == 0 && sha256Hash[30] == 0 && (~(sha256Hash[29]) & ((1 << 0) | (1 << 1) | (1 << 2))))
-        //    && sha256Hash[29] == 0)
-        {
-            found = true;
-            //if (fDebug)
-            //    printf("Match %u\n", nonse);
-            break;
-        }
-
-        //if (nonse >= UINT32_MAX)
-        if (nonse >= 4294967295U)
-        {
-            if (fDebug)
-                printf("No match %u\n", nonse);
-            break;
-            //return 1;
-        }
-        nonse++;
+        threadGroup.join_all();
     };
 
-    HMAC_CTX_free(ctx);
-
-    if (!fSecMsgEnabled)
+    if (!fSecMsgEnabled && !search.fFound)
     {
         if (fDebug)
             printf("SecureMsgSetHash() stopped, shutdown detected.\n");
         return 2;
     };
 
-    if (!found)
+    if (!search.fFound)
     {
         if (fDebug)
-            printf("SecureMsgSetHash() failed, took %" PRId64 " ms, nonse %u\n", GetTimeMillis() - nStart, nonse);
+            printf("SecureMsgSetHash() failed, took %" PRId64 " ms, %d threads\n", GetTimeMillis() - nStart, (int)nThreads);
         return 1;
     };
 
-    memcpy(psmsg->hash, sha256Hash, 4);
-    //memcpy(psmsg->hash, &vchHash[0], 4);
+    memcpy(&psmsg->nonse[0], &search.nonse, 4);
+    memcpy(psmsg->hash, search.hash, 4);
 
     if (fDebug)
-        printf("SecureMsgSetHash() took %" PRId64 " ms, nonse %u\n", GetTimeMillis() - nStart, nonse);
+        printf("SecureMsgSetHash() took %" PRId64 " ms, nonse %u, %d threads\n", GetTimeMillis() - nStart, search.nonse, (int)nThreads);
+
+    return 0;
+};
+
+// -- dictionary payloads
+//    The dictionary and the message are compressed as two consecutive blocks
+//    of one LZ4 stream, only the output of the second block is sent. The
+//    recipient decodes behind a 64KB prefix ending in the same dictionary, so
+//    matches against it resolve and no offset can reach outside the buffer.
+//    Senders mark version[1] of the header, the recipient remembers which
+//    addresses have done so and only those are sent dictionary payloads.
+
+int SecureMsgCompressDict(const unsigned char *pMessage, uint32_t nMessage, std::vector<unsigned char> &vchCompressed)
+{
+    const uint32_t nDict = sizeof(smsgDictionary) - 1;
+    std::vector<char> vchInput(nDict + nMessage);
+    memcpy(&vchInput[0], smsgDictionary, nDict);
+    if (nMessage > 0)
+        memcpy(&vchInput[nDict], pMessage, nMessage);
+
+    std::vector<char> vchDiscard(LZ4_compressBound(nDict));
+    vchCompressed.resize(LZ4_compressBound(nMessage));
+
+    void *lz4ds = LZ4_create(&vchInput[0]);
+    if (!lz4ds)
+        return 8;
+
+    int lenComp = 0;
+    if (LZ4_compress_continue(lz4ds, &vchInput[0], &vchDiscard[0], nDict) > 0)
+        lenComp = LZ4_compress_continue(lz4ds, &vchInput[nDict], (char *)&vchCompressed[0], nMessage);
+    LZ4_free(lz4ds);
+
+    if (lenComp < 1)
+        return 9;
+
+    vchCompressed.resize(lenComp);
+    return 0;
+};
+
+int SecureMsgDecompressDict(const unsigned char *pData, uint32_t nData, unsigned char *pPlain, uint32_t nPlain)
+{
+    const uint32_t nPrefix = 64 * 1024;
+    const uint32_t nDict = sizeof(smsgDictionary) - 1;
+    std::vector<char> vchBuffer(nPrefix + nPlain, 0);
+    memcpy(&vchBuffer[nPrefix - nDict], smsgDictionary, nDict);
+
+    if (LZ4_decompress_safe_withPrefix64k((const char *)pData, &vchBuffer[nPrefix], nData, nPlain) != (int)nPlain)
+        return 1;
 
+    if (nPlain > 0)
+        memcpy(pPlain, &vchBuffer[nPrefix], nPlain);
     return 0;
 };
 
+static bool SecureMsgReadsDict(CKeyID &ckid)
+{
+    if (pwalletMain && pwalletMain->HaveKey(ckid))
+        return true;
+
+    LOCK(cs_smsgDB);
+    SecMsgDB db;
+    unsigned char nVersion;
+    return db.Open("r") && db.ReadPayloadVersion(ckid, nVersion) && nVersion >= SMSG_VERSION_DICT;
+};
+
+static void SecureMsgNotePayloadVersion(CKeyID &ckid, unsigned char nVersion)
+{
+    LOCK(cs_smsgDB);
+    SecMsgDB db;
+    unsigned char nStored;
+    if (!db.Open("cr+")
+        || (db.ReadPayloadVersion(ckid, nStored) && nStored >= nVersion))
+        return;
+    db.WritePayloadVersion(ckid, nVersion);
+};
+
 int SecureMsgEncrypt(SecureMessage &smsg, std::string &addressFrom, std::string &addressTo, std::string &message)
 {
     /* Create a secure message
@@ -3321,7 +4974,7 @@ int SecureMsgEncrypt(SecureMessage &smsg, std::string &addressFrom, std::string
     };
 
     smsg.version[0] = 1;
-    smsg.version[1] = 1;
+    smsg.version[1] = SMSG_VERSION_DICT;
     smsg.timestamp = GetTime();
 
     bool fSendAnonymous;
@@ -3432,7 +5085,17 @@ int SecureMsgEncrypt(SecureMessage &smsg, std::string &addressFrom, std::string
     uint32_t lenMsgData;
 
     uint32_t lenMsg = message.size();
-    if (lenMsg > 128)
+    uint32_t lenPlainField = lenMsg;
+    if (SecureMsgReadsDict(ckidDest)
+        && SecureMsgCompressDict((const unsigned char *)message.c_str(), lenMsg, vchCompressed) == 0
+        && vchCompressed.size() < lenMsg)
+    {
+        // -- recipient has the dictionary and it saved bytes
+        pMsgData = &vchCompressed[0];
+        lenMsgData = vchCompressed.size();
+        lenPlainField |= SMSG_PLAIN_DICT;
+    }
+    else if (lenMsg > 128)
     {
         // -- only compress if over 128 bytes
         int worstCase = LZ4_compressBound(message.size());
@@ -3479,7 +5142,7 @@ int SecureMsgEncrypt(SecureMessage &smsg, std::string &addressFrom, std::string
 
         vchPayload[0] = 250; // id as anonymous message
         // -- next 4 bytes are unused - there to ensure encrypted payload always > 8 bytes
-        memcpy(&vchPayload[5], &lenMsg, 4); // length of uncompressed plain text
+        memcpy(&vchPayload[5], &lenPlainField, 4); // length of uncompressed plain text
     }
     else
     {
@@ -3510,7 +5173,7 @@ int SecureMsgEncrypt(SecureMessage &smsg, std::string &addressFrom, std::string
         memcpy(&vchPayload[1], (static_cast<CKeyID_B *>(&ckidFrom))->GetPPN(), 20);      // memcpy(&vchPayload[1], ckidDest.pn, 20);
 
         memcpy(&vchPayload[1 + 20], &vchSignature[0], vchSignature.size());
-        memcpy(&vchPayload[1 + 20 + 65], &lenMsg, 4); // length of uncompressed plain text
+        memcpy(&vchPayload[1 + 20 + 65], &lenPlainField, 4); // length of uncompressed plain text
     };
 
     SecMsgCrypter crypter;
@@ -3798,74 +5461,21 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, unsigned char *pHeade
         printf("coinAddrDest.GetKeyID failed: %s.\n", coinAddrDest.ToString().c_str());
         return 3;
     };
-    if (!pwalletMain->GetKey(ckidDest, keyDest))
+    if (!SecureMsgGetReceiveKey(ckidDest, keyDest))
     {
         printf("Could not get private key for addressDest.\n");
         return 3;
     };
 
     CKey keyR;
-    std::vector<unsigned char> vchR(psmsg->cpkR, psmsg->cpkR + 33); // would be neater to override CPubKey() instead
-    CPubKey cpkR(vchR);
-    if (!cpkR.IsValid())
-    {
-        printf("Could not get public key for key R.\n");
-        return 1;
-    };
-    if (!keyR.SetPubKey(cpkR))
-    {
-        printf("Could not set pubkey for R: %s.\n", ValueString(cpkR.Raw()).c_str());
-        return 1;
-    };
-
-    cpkR = keyR.GetPubKey();
-    if (!cpkR.IsValid() || !cpkR.IsCompressed())
-    {
-        printf("Could not get compressed public key for key R.\n");
-        return 1;
-    };
-
-    // -- Do an EC point multiply with private key k and public key R. This gives you public key P.
-    std::vector<unsigned char> vchP;
-    vchP.resize(32);
-    EC_KEY *pkeyk = keyDest.GetECKey();
-    EC_KEY *pkeyR = keyR.GetECKey();
-
-    EC_KEY_SET_DEFAULT_METHOD(pkeyk);
-    int lenPdec = ECDH_compute_key(&vchP[0], 32, EC_KEY_get0_public_key(pkeyR), pkeyk, NULL);
-
-    if (lenPdec != 32)
-    {
-        printf("ECDH_compute_key failed, lenPdec: %d.\n", lenPdec);
+    if (!SecureMsgGetKeyR(psmsg, keyR))
         return 1;
-    };
 
-    // -- Use public key P to calculate the SHA512 hash H.
-    //    The first 32 bytes of H are called key_e and the last 32 bytes are called key_m.
-    std::vector<unsigned char> vchHashedDec;
-    vchHashedDec.resize(64); // 512 bits
-    SHA512(&vchP[0], vchP.size(), (unsigned char *)&vchHashedDec[0]);
-    std::vector<unsigned char> key_e(&vchHashedDec[0], &vchHashedDec[0] + 32);
-    std::vector<unsigned char> key_m(&vchHashedDec[32], &vchHashedDec[32] + 32);
-
-    // -- Message authentication code, (hash of timestamp + destination + payload)
-    unsigned char MAC[32];
-    bool fHmacOk = true;
-    unsigned int nBytes = 32;
-    HMAC_CTX *ctx = HMAC_CTX_new();
-
-    if (!HMAC_Init_ex(ctx, &key_m[0], 32, EVP_sha256(), NULL) || !HMAC_Update(ctx, (unsigned char *)&psmsg->timestamp, sizeof(psmsg->timestamp)) || !HMAC_Update(ctx, pPayload, nPayload) || !HMAC_Final(ctx, MAC, &nBytes) || nBytes != 32)
-        fHmacOk = false;
-
-    HMAC_CTX_free(ctx);
-
-    if (!fHmacOk)
-    {
-        printf("Could not generate MAC.\n");
+    unsigned char key_e[32], key_m[32];
+    if (!SecureMsgSharedKeys(keyDest, keyR, key_e, key_m))
         return 1;
-    };
 
-    if (memcmp(MAC, psmsg->mac, 32) != 0)
+    if (!SecureMsgCheckMac(key_m, psmsg, pPayload, nPayload))
     {
         if (fDebug)
             printf("MAC does not match.\n"); // expected if message is not to address on node
@@ -3906,6 +5516,14 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, unsigned char *pHeade
         pMsgData = &vchPayload[SMSG_PL_HDR_LEN];
     };
 
+    bool fDict = lenPlain & SMSG_PLAIN_DICT;
+    lenPlain &= ~SMSG_PLAIN_DICT;
+    if (lenPlain > SMSG_MAX_MSG_BYTES)
+    {
+        printf("Plain text length is too large, %u.\n", lenPlain);
+        return 1;
+    };
+
     try
     {
         msg.vchMessage.resize(lenPlain + 1);
@@ -3916,7 +5534,15 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, unsigned char *pHeade
         return 8;
     };
 
-    if (lenPlain > 128)
+    if (fDict)
+    {
+        if (SecureMsgDecompressDict(pMsgData, lenData, &msg.vchMessage[0], lenPlain) != 0)
+        {
+            printf("Could not decompress message data.\n");
+            return 1;
+        };
+    }
+    else if (lenPlain > 128)
     {
         // -- decompress
         if (LZ4_decompress_safe((char *)pMsgData, (char *)&msg.vchMessage[0], lenData, lenPlain) != (int)lenPlain)
@@ -4006,6 +5632,9 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, unsigned char *pHeade
             break;
         };
 
+        if (psmsg->version[1] >= SMSG_VERSION_DICT)
+            SecureMsgNotePayloadVersion(ckidFrom, psmsg->version[1]);
+
         msg.sFromAddress = coinAddrFrom.ToString();
     };
 
@@ -4018,4 +5647,117 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, unsigned char *pHeade
 int SecureMsgDecrypt(bool fTestOnly, std::string &address, SecureMessage &smsg, MessageData &msg)
 {
     return SecureMsgDecrypt(fTestOnly, address, &smsg.hash[0], smsg.pPayload, smsg.nPayload, msg);
-};
\ No newline at end of file
+};
+int SecureMsgDecryptStored(const unsigned char *chKey, SecMsgStored &smsgStored, MessageData &msg)
+{
+    /* Decrypt an inbox ("im") or outbox ("sm") record, chKey is its db key.
+        
+        While the wallet is unlocked the plaintext is kept, so listing the same
+        messages again costs no ECDH or AES.
+        
+        returns as SecureMsgDecrypt
+    */
+    
+    if (smsgStored.vchMessage.size() < SMSG_HDR_LEN)
+        return 1;
+    
+    std::vector<unsigned char> vchKey(chKey, chKey + 18);
+    
+    {
+        LOCK(cs_smsgKeyCache);
+        std::map<std::vector<unsigned char>, MessageData>::iterator mi = mapSmsgPlaintextCache.find(vchKey);
+        if (mi != mapSmsgPlaintextCache.end())
+        {
+            msg = mi->second;
+            return 0;
+        };
+    }
+    
+    std::string &address = memcmp(chKey, "sm", 2) == 0 ? smsgStored.sAddrOutbox : smsgStored.sAddrTo;
+    uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
+    int rv = SecureMsgDecrypt(false, address, &smsgStored.vchMessage[0], &smsgStored.vchMessage[SMSG_HDR_LEN], nPayload, msg);
+    if (rv != 0)
+        return rv;
+    
+    // -- checked under the cache lock so a clear on locking can't be missed
+    LOCK(cs_smsgKeyCache);
+    if (!pwalletMain || pwalletMain->IsLocked())
+        return 0;
+    
+    if (mapSmsgPlaintextCache.size() >= SMSG_MAX_PLAINTEXT_CACHE)
+        mapSmsgPlaintextCache.erase(mapSmsgPlaintextCache.begin());
+    mapSmsgPlaintextCache[vchKey] = msg;
+    
+    return 0;
+};
+
+int SecureMsgQueryStored(SecMsgDB &db, const SecMsgQuery &query, std::vector<std::vector<unsigned char> > &vKeys, uint32_t &nTotal)
+{
+    /* Collect the db keys of the inbox or outbox messages matching query,
+        in order received, from the secondary indexes.
+        
+        nTotal is the number of matches before nOffset and nCount are applied.
+        
+        returns
+            0       Success
+            1       Error
+            2       Invalid address
+    */
+    
+    vKeys.clear();
+    nTotal = 0;
+    
+    bool fInbox = query.sPrefix == "im";
+    if (!db.pdb
+        || (!fInbox && query.sPrefix != "sm")
+        || (!fInbox && query.fUnreadOnly))
+        return 1;
+    
+    std::string sSeek;
+    CKeyID keyId;
+    bool fAddress = !query.sAddress.empty();
+    if (fAddress)
+    {
+        if (!CBitcoinAddress(query.sAddress).GetKeyID(keyId))
+            return 2;
+        SecureMsgIndexKey(sSeek, fInbox ? "ia" : "oa", &keyId, query.nSince, NULL);
+    } else
+    {
+        SecureMsgIndexKey(sSeek, query.fUnreadOnly ? "iu" : fInbox ? "it" : "ot", NULL, query.nSince, NULL);
+    };
+    
+    size_t nPrefix = sSeek.size() - 8;
+    
+    // -- unread messages of one address: walk the address index, probe the unread one
+    bool fProbeUnread = fAddress && query.fUnreadOnly;
+    std::string sUnreadKey, strValue;
+    
+    leveldb::Iterator *it = db.pdb->NewIterator(leveldb::ReadOptions());
+    for (it->Seek(sSeek); it->Valid(); it->Next())
+    {
+        leveldb::Slice key = it->key();
+        if (key.size() < nPrefix || memcmp(key.data(), sSeek.data(), nPrefix) != 0)
+            break;
+        if (key.size() != nPrefix + 8 + 18)
+            continue;
+        
+        const unsigned char *pTime = (const unsigned char*)key.data() + nPrefix;
+        const unsigned char *chKey = pTime + 8;
+        
+        if (fProbeUnread)
+        {
+            sUnreadKey.assign("iu", 2);
+            sUnreadKey.append((const char*)pTime, 8 + 18);
+            if (!db.pdb->Get(leveldb::ReadOptions(), sUnreadKey, &strValue).ok())
+                continue;
+        };
+        
+        if (nTotal >= query.nOffset
+            && (query.nCount == 0 || vKeys.size() < query.nCount))
+            vKeys.push_back(std::vector<unsigned char>(chKey, chKey + 18));
+        nTotal++;
+    };
+    delete it;
+    
+    return 0;
+};
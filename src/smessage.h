@@ -20,6 +20,27 @@ const unsigned int SMSG_BUCKET_LEN      = 60 * 10;           // in seconds
 const unsigned int SMSG_RETENTION       = 60 * 60 * 48;      // in seconds
 const unsigned int SMSG_SEND_DELAY      = 2;                 // in seconds, SecureMsgSendData will delay this long between firing
 const unsigned int SMSG_THREAD_DELAY    = 20;
+const unsigned int SMSG_MAX_POW_THREADS = 64;                // upper limit for -smsgpowthreads
+const unsigned int SMSG_SCAN_KEYS_PER_THREAD = 16;           // receive keys tried per thread when scanning a message
+const unsigned int SMSG_MAX_MAPPED_SEGMENTS = 64;            // bucket files kept memory mapped for serving smsgWant
+const unsigned int SMSG_UNLOCK_READ_BATCH = 64;               // messages per batch handed to the unlock scan workers
+const unsigned int SMSG_UNLOCK_QUEUE_BATCHES = 16;           // batches read ahead by the unlock scan
+const unsigned int SMSG_UNLOCK_WRITE_BATCH = 256;            // inbox records per db write in the unlock scan
+const unsigned int SMSG_DEFAULT_BUCKET_MSGS = 8192;          // -smsgmaxbucketmsgs
+const unsigned int SMSG_DEFAULT_BUCKET_MB = 64;              // -smsgmaxbucketmb
+const unsigned int SMSG_DEFAULT_STORE_MSGS = 250000;         // -smsgmaxstoremsgs
+const unsigned int SMSG_DEFAULT_STORE_MB = 1024;             // -smsgmaxstoremb
+const unsigned int SMSG_PUBKEY_SCAN_RANGE = 2000;            // blocks scanned for public keys per pass of the index thread
+const unsigned int SMSG_PUBKEY_BLOCKS_PER_THREAD = 100;      // at least this many blocks per thread in a pass
+const unsigned int SMSG_MAX_PLAINTEXT_CACHE = 4096;          // decrypted inbox/outbox messages kept while the wallet is unlocked
+const int SMSG_INDEX_VERSION            = 1;                 // inbox/outbox index layout, rebuilt when the stored version differs
+
+const uint32_t SMSG_PROTOCOL_VERSION    = 2;                 // sent with smsgPing and smsgPong, older nodes send nothing
+const uint32_t SMSG_VERSION_RECONCILE   = 2;                 // bucket digests are xor of token hashes, buckets are reconciled by sketch
+const unsigned int SMSG_SKETCH_PARTS    = 64;                // partitions in a bucket sketch, one bit each in smsgShowPart
+
+const unsigned char SMSG_VERSION_DICT   = 2;                 // header version[1], sender can read SMSG_PLAIN_DICT payloads
+const uint32_t SMSG_PLAIN_DICT          = 1u << 31;          // set in the plain text length when the payload is compressed with smsgDictionary
 
 const unsigned int SMSG_TIME_LEEWAY     = 60;
 const unsigned int SMSG_TIME_IGNORE     = 90;                // seconds that a peer is ignored for if they fail to deliver messages for a smsgWant
@@ -53,11 +74,16 @@ extern boost::signals2::signal<void ()> NotifySecMsgWalletUnlocked;
 class SecMsgBucket;
 class SecMsgAddress;
 class SecMsgOptions;
+class SecMsgQuota;
 
 extern std::map<int64_t, SecMsgBucket>  smsgBuckets;
 extern std::vector<SecMsgAddress>       smsgAddresses;
 extern SecMsgOptions                    smsgOptions;
+extern SecMsgQuota                      smsgQuota;
 
+// Lock order: cs_main, cs_smsg, cs_smsgDB. Peer messages reach the smsg
+// handlers both with and without cs_main held, so nothing may take cs_main
+// while holding cs_smsg or cs_smsgDB.
 extern CCriticalSection cs_smsg;            // all except inbox and outbox
 extern CCriticalSection cs_smsgDB;
 
@@ -139,6 +165,9 @@ public:
 };
 
 
+uint32_t SecMsgTokenHash(const SecMsgToken& token);
+inline unsigned int SecMsgTokenPart(uint32_t nTokenHash) { return nTokenHash % SMSG_SKETCH_PARTS; };
+
 class SecMsgBucket
 {
 public:
@@ -146,17 +175,26 @@ public:
     {
         timeChanged     = 0;
         hash            = 0;
+        fHashStale      = false;
+        nDigest         = 0;
         nLockCount      = 0;
         nLockPeerId     = 0;
+        nBytes          = 0;
     };
     ~SecMsgBucket() {};
     
     void hashBucket();
+    uint32_t legacyHash();
+    bool insertToken(const SecMsgToken& token);
+    void getSketch(uint32_t* pCount, uint32_t* pDigest) const;
     
     int64_t                     timeChanged;
-    uint32_t                    hash;           // token set should get ordered the same on each node
+    uint32_t                    hash;           // token set should get ordered the same on each node, for peers older than SMSG_VERSION_RECONCILE
+    bool                        fHashStale;     // hash needs recomputing
+    uint32_t                    nDigest;        // xor of SecMsgTokenHash over setTokens, updated on insert
     uint32_t                    nLockCount;     // set when smsgWant first sent, unset at end of smsgMsg, ticks down in ThreadSecureMsg()
     uint32_t                    nLockPeerId;    // id of peer that bucket is locked for
+    uint64_t                    nBytes;         // size of the segment file
     std::set<SecMsgToken>       setTokens;
     
 };
@@ -205,6 +243,24 @@ public:
     );
 };
 
+class SecMsgQuota
+{
+// -- Budgets for the bucket store, from -smsgmax* on start
+public:
+    SecMsgQuota()
+    {
+        nBucketMsgs     = SMSG_DEFAULT_BUCKET_MSGS;
+        nBucketBytes    = (uint64_t)SMSG_DEFAULT_BUCKET_MB << 20;
+        nStoreMsgs      = SMSG_DEFAULT_STORE_MSGS;
+        nStoreBytes     = (uint64_t)SMSG_DEFAULT_STORE_MB << 20;
+    };
+    
+    uint32_t nBucketMsgs;
+    uint64_t nBucketBytes;
+    uint32_t nStoreMsgs;
+    uint64_t nStoreBytes;
+};
+
 class SecMsgOptions
 {
 public:
@@ -305,6 +361,12 @@ public:
     bool WritePK(CKeyID& addr, CPubKey& pubkey);
     bool ExistsPK(CKeyID& addr);
     
+    bool ReadPKHeight(int& nHeight, uint256& hashBlock);
+    bool WritePKHeight(int nHeight, uint256& hashBlock);
+    
+    bool ReadPayloadVersion(CKeyID& addr, unsigned char& nVersion);
+    bool WritePayloadVersion(CKeyID& addr, unsigned char nVersion);
+    
     bool NextSmesg(leveldb::Iterator* it, std::string& prefix, unsigned char* vchKey, SecMsgStored& smsgStored);
     bool NextSmesgKey(leveldb::Iterator* it, std::string& prefix, unsigned char* vchKey);
     bool ReadSmesg(unsigned char* chKey, SecMsgStored& smsgStored);
@@ -312,11 +374,33 @@ public:
     bool ExistsSmesg(unsigned char* chKey);
     bool EraseSmesg(unsigned char* chKey);
     
+    bool BuildIndexes();
+    
     leveldb::DB *pdb;       // points to the global instance
     leveldb::WriteBatch *activeBatch;
     
 };
 
+class SecMsgQuery
+{
+// -- Selects inbox or outbox messages through the secondary indexes
+public:
+    SecMsgQuery()
+    {
+        fUnreadOnly = false;
+        nSince = 0;
+        nOffset = 0;
+        nCount = 0;
+    };
+    
+    std::string                 sPrefix;            // "im" inbox or "sm" outbox
+    bool                        fUnreadOnly;        // inbox only
+    std::string                 sAddress;           // owned address for inbox, recipient for outbox, empty for all
+    int64_t                     nSince;             // earliest timeReceived
+    uint32_t                    nOffset;            // matches skipped
+    uint32_t                    nCount;             // matches returned, 0 for all
+};
+
 std::string getTimeString(int64_t timestamp, char *buffer, size_t nBuffer);
 std::string fsReadable(uint64_t nBytes);
 
@@ -337,13 +421,17 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
 bool SecureMsgSendData(CNode* pto, bool fSendTrickle);
 
 
-bool SecureMsgScanBlock(CBlock& block);
-bool ScanChainForPublicKeys(CBlockIndex* pindexStart);
-bool SecureMsgScanBlockChain();
+void ThreadSecureMsgPubkeys(void* parg);
+void SecureMsgBlockConnected(const CBlock& block, CBlockIndex* pindex);
+void SecureMsgBlockDisconnected(CBlockIndex* pindex);
+void SecureMsgRescanPubkeys();
+void SecureMsgPubkeyScanStatus(int& nHeight, uint32_t& nFound, bool& fRescanPending);
 bool SecureMsgScanBuckets();
 
 
 int SecureMsgWalletUnlocked();
+void SecureMsgStoreUsage(uint32_t &nMessages, uint64_t &nBytes, uint32_t &nRejected);
+bool SecureMsgUnlockScanProgress(uint32_t &nMessages, uint32_t &nScanned, uint32_t &nFound, int &nPercent);
 int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode);
 
 int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, bool reportToGui);
@@ -354,6 +442,7 @@ int SecureMsgGetLocalPublicKey(std::string& strAddress, std::string& strPublicKe
 
 int SecureMsgAddAddress(std::string& address, std::string& publicKey);
 
+int SecureMsgRetrieve(SecMsgToken &token, const unsigned char *&pData, uint32_t &nData);
 int SecureMsgRetrieve(SecMsgToken &token, std::vector<unsigned char>& vchData);
 
 int SecureMsgReceive(CNode* pfrom, std::vector<unsigned char>& vchData);
@@ -369,10 +458,16 @@ int SecureMsgSend(std::string& addressFrom, std::string& addressTo, std::string&
 int SecureMsgValidate(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload);
 int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload);
 
+int SecureMsgCompressDict(const unsigned char* pMessage, uint32_t nMessage, std::vector<unsigned char>& vchCompressed);
+int SecureMsgDecompressDict(const unsigned char* pData, uint32_t nData, unsigned char* pPlain, uint32_t nPlain);
+
 int SecureMsgEncrypt(SecureMessage& smsg, std::string& addressFrom, std::string& addressTo, std::string& message);
 
 int SecureMsgDecrypt(bool fTestOnly, std::string& address, unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, MessageData& msg);
 int SecureMsgDecrypt(bool fTestOnly, std::string& address, SecureMessage& smsg, MessageData& msg);
+int SecureMsgDecryptStored(const unsigned char* chKey, SecMsgStored& smsgStored, MessageData& msg);
+
+int SecureMsgQueryStored(SecMsgDB& db, const SecMsgQuery& query, std::vector<std::vector<unsigned char> >& vKeys, uint32_t& nTotal);
 
 
 
@@ -0,0 +1,47 @@
+// Copyright (c) 2017-2018 The ARMR Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SEC_MESSAGE_DICT_H
+#define SEC_MESSAGE_DICT_H
+
+// Shared dictionary for secure message payloads (SMSG_PLAIN_DICT).
+// The compressor is primed with this text, so short messages find matches
+// in it. Sender and recipient must hold the exact same bytes: the text is
+// part of the payload format and must never be edited. A different
+// dictionary needs a new payload version.
+static const char smsgDictionary[] =
+    " the of and to in is it that for you was with on as have be at not this are but from or by"
+    " one had all they we her she there were an which their what so up out if about who get would"
+    " them make can like time just him know take people into year your good some could see other"
+    " than then now look only come its over think also back after use two how our work first well"
+    " way even new want because any these give day most us is there are was were has been will be"
+    " Hello, Hi, Hey, Dear Thanks, Thank you, Thank you very much. Thanks again, Best regards, Kind regards,"
+    " Regards, Cheers, Sorry, Please, Yes, No, OK, Okay, Sure, Great, Good morning, Good evening,"
+    " How are you? I'm fine, thanks. I am I'm I have I've I will I'll I would I'd I don't I can't"
+    " you're you've you'll don't doesn't didn't isn't aren't wasn't won't can't couldn't wouldn't"
+    " shouldn't haven't hasn't it's that's there's what's let's let me know if you have any questions."
+    " Let me know when Please let me know Could you please Can you please Would you like to"
+    " I would like to I was wondering if Do you want to Do you have Are you still interested in"
+    " as soon as possible at the moment in the meantime for example on the other hand by the way"
+    " as well as at least in order to in the future right now later today tomorrow yesterday"
+    " this week next week last week this month next month tonight this morning this afternoon"
+    " Monday Tuesday Wednesday Thursday Friday Saturday Sunday January February March April May"
+    " June July August September October November December minutes hours days weeks months years"
+    " message messages send sent sending receive received reply replied address addresses wallet"
+    " coins coin balance amount payment pay paid price fee fees transaction transactions tx txid"
+    " confirmations confirmed unconfirmed block blocks blockchain stake staking mining node nodes"
+    " network peers connection connected sync synced update version client exchange order buy sell"
+    " trade market escrow deposit withdraw withdrawal transfer refund invoice receipt shipping"
+    " shipped delivery delivered tracking number product item items quantity total discount"
+    " account password private key public key encrypted encryption secure secret backup restore"
+    " https://www. http://www. .com .org .net @gmail.com email contact support team help issue"
+    " problem error working works worked check checked checking confirm please confirm received"
+    " payment received I have sent I sent you the I received your message Thank you for your"
+    " message Thank you for your payment Looking forward to hearing from you Have a nice day"
+    " should be would be will be has been have been had been could be might be is not are not"
+    " with the from the to the of the in the on the for the at the and the is the that the"
+    " something anything everything nothing someone anyone everyone nobody here there where when"
+    " why how what who which whose very much many more less really actually probably maybe"
+    " still already again also only just even never always sometimes often usually soon\n";
+
+#endif // SEC_MESSAGE_DICT_H
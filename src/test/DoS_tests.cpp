@@ -20,6 +20,9 @@ extern bool AddOrphanTx(const CDataStream& vMsg);
 extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
 extern std::map<uint256, CDataStream*> mapOrphanTransactions;
 extern std::map<uint256, std::map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
+extern bool AcceptBlockHeader(CNode* pfrom, const CBlock& header, int& nHeight);
+extern uint256 hashBestHeader;
+extern CBigNum bnProofOfStakeLimit;
 
 CService ip(uint32_t i)
 {
@@ -223,6 +226,60 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
 }
 
+// A header that claims proof-of-stake: its hash must miss its own target
+static CBlock StakeHeader(const uint256& hashPrev, unsigned int nTime, CBigNum bnTarget)
+{
+    CBlock header;
+    header.hashPrevBlock = hashPrev;
+    header.nTime = nTime;
+    header.nBits = bnTarget.GetCompact();
+    while (header.GetHash() <= bnTarget.getuint256())
+        header.nNonce++;
+    return header;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_cheapheaders)
+{
+    LOCK(cs_main);
+    CNode dummyNode1(INVALID_SOCKET, CAddress(ip(0xa0b0c001)), "", true);
+    CNode dummyNode2(INVALID_SOCKET, CAddress(ip(0xa0b0c002)), "", true);
+    InitializeNode(dummyNode1.GetId());
+    InitializeNode(dummyNode2.GetId());
+
+    // Ten stake headers at the easiest target, like a real chain after genesis
+    CBigNum bnTarget;
+    bnTarget.SetCompact(bnProofOfStakeLimit.GetCompact());
+    uint256 hashPrev = pindexGenesisBlock->GetBlockHash();
+    for (int i = 1; i <= 10; i++)
+    {
+        CBlock header = StakeHeader(hashPrev, pindexGenesisBlock->nTime + i * 60, bnTarget);
+        int nHeight = -1;
+        BOOST_CHECK(AcceptBlockHeader(&dummyNode1, header, nHeight));
+        BOOST_CHECK_EQUAL(nHeight, i);
+        hashPrev = header.GetHash();
+    }
+    BOOST_CHECK(hashBestHeader == hashPrev);
+    uint256 hashBest = hashPrev;
+
+    // As many headers from another peer, each claiming harder stake than the
+    // last as far as retargeting allows. Nobody has checked their kernels, so
+    // they must not outrank the first chain.
+    hashPrev = pindexGenesisBlock->GetBlockHash();
+    for (int i = 1; i <= 10; i++)
+    {
+        bnTarget.SetCompact((bnTarget * 60 / 61).GetCompact());
+        CBlock header = StakeHeader(hashPrev, pindexGenesisBlock->nTime + i * 60 + 1, bnTarget);
+        int nHeight = -1;
+        BOOST_CHECK(AcceptBlockHeader(&dummyNode2, header, nHeight));
+        BOOST_CHECK_EQUAL(nHeight, i);
+        hashPrev = header.GetHash();
+        BOOST_CHECK(hashBestHeader == hashBest);
+    }
+
+    FinalizeNode(dummyNode1.GetId());
+    FinalizeNode(dummyNode2.GetId());
+}
+
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
 {
     // Test signature caching code (see key.cpp Verify() methods)
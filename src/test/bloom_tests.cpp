@@ -0,0 +1,58 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bloom.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // last-100-entry, 1% false positive:
+    CRollingBloomFilter rb1(100, 0.01);
+
+    // Overfill:
+    static const int DATASIZE = 399;
+    vector<uint256> data;
+    for (int i = 0; i < DATASIZE; i++)
+    {
+        data.push_back(GetRandHash());
+        rb1.insert(data.back());
+    }
+    // Last 100 guaranteed to be remembered:
+    for (int i = DATASIZE - 100; i < DATASIZE; i++)
+        BOOST_CHECK(rb1.contains(data[i]));
+
+    // false positive rate is 1%, so we should get about 100 hits if
+    // testing 10,000 random keys. We get worst-case false positive
+    // behavior when the filter is as full as possible, which is
+    // when we've inserted one minus an integer multiple of nElement*2.
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++)
+    {
+        if (rb1.contains(GetRandHash()))
+            ++nHits;
+    }
+    // Run test_bitcoin with --log_level=message to see BOOST_TEST_MESSAGEs:
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~100 expected)");
+
+    // Insanely unlikely to get a fp count outside this range:
+    BOOST_CHECK(nHits > 25);
+    BOOST_CHECK(nHits < 175);
+
+    // Nothing is left after a reset
+    rb1.reset();
+    nHits = 0;
+    for (int i = DATASIZE - 100; i < DATASIZE; i++)
+        if (rb1.contains(data[i]))
+            ++nHits;
+    BOOST_CHECK(nHits < 5);
+
+    // Variable-length keys, as used for addresses
+    vector<unsigned char> vKey(18, 0x42);
+    rb1.insert(vKey);
+    BOOST_CHECK(rb1.contains(vKey));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
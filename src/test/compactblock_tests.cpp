@@ -0,0 +1,108 @@
+#include <boost/test/unit_test.hpp>
+
+#include "compactblock.h"
+#include "util.h"
+
+using namespace std;
+
+static CTransaction RandomTx()
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    return tx;
+}
+
+static CBlock RandomBlock(int nTx)
+{
+    CBlock block;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = GetTime();
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig << OP_0 << OP_0;
+    txCoinbase.vout.resize(1);
+    block.vtx.push_back(txCoinbase);
+    for (int i = 0; i < nTx; i++)
+        block.vtx.push_back(RandomTx());
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+BOOST_AUTO_TEST_CASE(compactblock_serialize)
+{
+    CBlock block = RandomBlock(10);
+    CCompactBlock cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxs.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.vShortTxIds.size(), 10U);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CCompactBlock cmpctblock2;
+    ss >> cmpctblock2;
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock2.BlockTxCount(), block.vtx.size());
+    BOOST_CHECK(cmpctblock2.GetShortTxId(block.vtx[1].GetHash()) == cmpctblock.vShortTxIds[0].Get());
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_rebuild)
+{
+    CBlock block = RandomBlock(10);
+    CCompactBlock cmpctblock(block);
+
+    // Everything but transactions 3 and 7 is in the pool
+    map<uint256, CTransaction> mapPool, mapOrphans;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        if (i != 3 && i != 7)
+            mapPool[block.vtx[i].GetHash()] = block.vtx[i];
+    for (int i = 0; i < 20; i++)
+    {
+        CTransaction tx = RandomTx();
+        mapPool[tx.GetHash()] = tx;
+    }
+    mapOrphans[block.vtx[7].GetHash()] = block.vtx[7];
+
+    CPartialBlock partial;
+    BOOST_CHECK(partial.Init(cmpctblock, mapPool, mapOrphans));
+    BOOST_CHECK_EQUAL(partial.GetMissing().size(), 1U);
+    BOOST_CHECK_EQUAL(partial.GetMissing()[0], 3);
+
+    // A wrong answer fails the merkle root check
+    CPartialBlock partialBad = partial;
+    BOOST_CHECK(!partialBad.Fill(vector<CTransaction>(1, RandomTx())));
+
+    BOOST_CHECK(partial.Fill(vector<CTransaction>(1, block.vtx[3])));
+    BOOST_CHECK(partial.block.GetHash() == block.GetHash());
+    BOOST_CHECK(partial.block.vtx.size() == block.vtx.size());
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_malformed)
+{
+    CBlock block = RandomBlock(2);
+    CCompactBlock cmpctblock(block);
+    map<uint256, CTransaction> mapEmpty;
+    CPartialBlock partial;
+
+    // Duplicate short id
+    CCompactBlock cmpctDup = cmpctblock;
+    cmpctDup.vShortTxIds[1] = cmpctDup.vShortTxIds[0];
+    BOOST_CHECK(!partial.Init(cmpctDup, mapEmpty, mapEmpty));
+
+    // Prefilled index out of range
+    CCompactBlock cmpctRange = cmpctblock;
+    cmpctRange.vPrefilledTxs[0].nIndex = 3;
+    BOOST_CHECK(!partial.Init(cmpctRange, mapEmpty, mapEmpty));
+
+    BOOST_CHECK(partial.Init(cmpctblock, mapEmpty, mapEmpty));
+    BOOST_CHECK_EQUAL(partial.GetMissing().size(), 2U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
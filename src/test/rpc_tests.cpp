@@ -1,8 +1,10 @@
 #include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 
 #include "base58.h"
 #include "util.h"
+#include "net.h"
 #include "bitcoinrpc.h"
 
 using namespace std;
@@ -59,4 +61,166 @@ BOOST_AUTO_TEST_CASE(rpc_addmultisig)
     BOOST_CHECK_THROW(addmultisig(createArgs(2, short2.c_str()), false), runtime_error);
 }
 
+static void WriteSample(CJSONWriter& writer)
+{
+    writer.BeginObject();
+    writer.Write("name", "a \"quoted\" string");
+    writer.Key("list");
+    writer.BeginArray();
+    for (int i = 0; i < 100; i++)
+    {
+        Object entry;
+        entry.push_back(Pair("n", i));
+        entry.push_back(Pair("amount", ValueFromAmount(i * COIN)));
+        writer.Write(entry);
+    }
+    writer.BeginArray();
+    writer.EndArray();
+    writer.EndArray();
+    writer.Key("empty");
+    writer.BeginObject();
+    writer.EndObject();
+    writer.Write("null", Value::null);
+    writer.EndObject();
+}
+
+static void AppendChunk(vector<string>* pvChunks, const string& strChunk)
+{
+    pvChunks->push_back(strChunk);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_writer)
+{
+    CJSONValueWriter valueWriter;
+    WriteSample(valueWriter);
+    const Value& value = valueWriter.GetValue();
+    BOOST_REQUIRE(value.type() == obj_type);
+    BOOST_CHECK_EQUAL(find_value(value.get_obj(), "list").get_array().size(), 101U);
+
+    // Streamed text is write_string's, split into pieces of about the chunk size
+    vector<string> vChunks;
+    CJSONStreamWriter streamWriter(boost::bind(&AppendChunk, &vChunks, _1), 256);
+    WriteSample(streamWriter);
+    streamWriter.Flush();
+    BOOST_CHECK(vChunks.size() > 4);
+    BOOST_CHECK(streamWriter.Flushed());
+
+    string strStreamed;
+    BOOST_FOREACH(const string& strChunk, vChunks)
+        strStreamed += strChunk;
+    BOOST_CHECK_EQUAL(strStreamed, write_string(value, false));
+
+    // A streaming command's actor returns the same result
+    rpcfn_type getrawmempool = tableRPC["getrawmempool"]->actor;
+    BOOST_CHECK(tableRPC["getrawmempool"]->streamer != NULL);
+    Value v;
+    BOOST_CHECK_NO_THROW(v = getrawmempool(Array(), false));
+    BOOST_CHECK(v.type() == array_type);
+    BOOST_CHECK_THROW(getrawmempool(Array(), true), runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_parallel)
+{
+    // Reads may share a batch with other workers, anything with side effects
+    // is a barrier
+    BOOST_CHECK(tableRPC["getblock"]->okParallel);
+    BOOST_CHECK(tableRPC["getblockhash"]->okParallel);
+    BOOST_CHECK(tableRPC["getrawtransaction"]->okParallel);
+    BOOST_CHECK(!tableRPC["sendtoaddress"]->okParallel);
+    BOOST_CHECK(!tableRPC["walletpassphrase"]->okParallel);
+    BOOST_CHECK(!tableRPC["stop"]->okParallel);
+}
+
+// Records when each batch entry starts and ends, in one sequence
+struct CBatchTrace
+{
+    CBatchTrace() : nSeq(0) {}
+
+    Object ExecOne(const Value& req)
+    {
+        int nId = find_value(req.get_obj(), "id").get_int();
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapStart[nId] = nSeq++;
+        }
+        MilliSleep(20);
+        if (find_value(req.get_obj(), "params").get_array().size() > 0)
+            throw 0; // not a std::exception
+        Object result;
+        result.push_back(Pair("id", nId));
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapEnd[nId] = nSeq++;
+        }
+        return result;
+    }
+
+    boost::mutex mutex;
+    int nSeq;
+    map<int, int> mapStart;
+    map<int, int> mapEnd;
+};
+
+static Value BatchEntry(const string& strMethod, int nId, bool fThrow = false)
+{
+    Array params;
+    if (fThrow)
+        params.push_back(1);
+    Object req;
+    req.push_back(Pair("method", strMethod));
+    req.push_back(Pair("params", params));
+    req.push_back(Pair("id", nId));
+    return req;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_batch)
+{
+    StartRPCWorkers(4);
+
+    // getblockcount may run in parallel, settxfee and unknown methods are barriers
+    Array vReq;
+    vReq.push_back(BatchEntry("getblockcount", 0));
+    vReq.push_back(BatchEntry("getblockcount", 1));
+    vReq.push_back(BatchEntry("getblockcount", 2));
+    vReq.push_back(BatchEntry("settxfee", 3));
+    vReq.push_back(BatchEntry("getblockcount", 4));
+    vReq.push_back(BatchEntry("getblockcount", 5, true));
+    vReq.push_back(BatchEntry("getblockcount", 6));
+    vReq.push_back(BatchEntry("nosuchmethod", 7));
+    vReq.push_back(BatchEntry("getblockcount", 8));
+
+    CBatchTrace trace;
+    Array vResults = RPCExecBatch(vReq, boost::bind(&CBatchTrace::ExecOne, &trace, _1));
+
+    // Results in request order, a throwing entry still gets its reply
+    BOOST_REQUIRE_EQUAL(vResults.size(), vReq.size());
+    for (int i = 0; i < (int)vResults.size(); i++)
+    {
+        const Object& result = vResults[i].get_obj();
+        BOOST_CHECK_EQUAL(find_value(result, "id").get_int(), i);
+        BOOST_CHECK_EQUAL(find_value(result, "error").type() != null_type, i == 5);
+    }
+
+    // Nothing crosses a barrier
+    const int vBarriers[] = {3, 7};
+    BOOST_FOREACH(int nBarrier, vBarriers)
+    {
+        for (int i = 0; i < (int)vReq.size(); i++)
+        {
+            if (i < nBarrier && trace.mapEnd.count(i))
+                BOOST_CHECK(trace.mapEnd[i] < trace.mapStart[nBarrier]);
+            if (i < nBarrier)
+                BOOST_CHECK(trace.mapStart[i] < trace.mapStart[nBarrier]);
+            if (i > nBarrier)
+                BOOST_CHECK(trace.mapStart[i] > trace.mapEnd[nBarrier]);
+        }
+    }
+
+    // Stop the workers again
+    fShutdown = true;
+    while (vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+        MilliSleep(10);
+    fShutdown = false;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,187 @@
+#include <boost/test/unit_test.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include "base58.h"
+#include "smessage.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(smsg_tests)
+
+BOOST_AUTO_TEST_CASE(smsg_pow)
+{
+    bool fEnabledOld = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+
+    vector<unsigned char> vchMessage(SMSG_HDR_LEN + 300);
+    RandAddSeedPerfmon();
+    RAND_bytes(&vchMessage[0], vchMessage.size());
+    unsigned char *pHeader = &vchMessage[0];
+    unsigned char *pPayload = &vchMessage[SMSG_HDR_LEN];
+    SecureMessage *psmsg = (SecureMessage *)pHeader;
+    psmsg->version[0] = 1;
+    psmsg->nPayload = 300;
+
+    // Single and multi-threaded searches both find a valid nonce
+    const char *threads[] = {"1", "4"};
+    for (int i = 0; i < 2; i++)
+    {
+        mapArgs["-smsgpowthreads"] = threads[i];
+        BOOST_CHECK(SecureMsgSetHash(pHeader, pPayload, 300) == 0);
+        BOOST_CHECK(SecureMsgValidate(pHeader, pPayload, 300) == 0);
+    }
+    mapArgs.erase("-smsgpowthreads");
+
+    // Changing the payload invalidates the proof of work
+    pPayload[0] ^= 1;
+    BOOST_CHECK(SecureMsgValidate(pHeader, pPayload, 300) != 0);
+
+    fSecMsgEnabled = fEnabledOld;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_bucket_digest)
+{
+    // The digest doesn't depend on insertion order and a sketch pins down
+    // the partition a new token lands in
+    vector<SecMsgToken> vTokens;
+    for (int i = 0; i < 200; i++)
+    {
+        uint256 r = GetRandHash();
+        vTokens.push_back(SecMsgToken(1000 + i, (unsigned char *)&r, 32, 0));
+    }
+
+    SecMsgBucket a, b;
+    for (unsigned int i = 0; i < vTokens.size(); i++)
+    {
+        BOOST_CHECK(a.insertToken(vTokens[i]));
+        BOOST_CHECK(b.insertToken(vTokens[vTokens.size() - 1 - i]));
+    }
+    BOOST_CHECK(!a.insertToken(vTokens[0]));
+    BOOST_CHECK_EQUAL(a.nDigest, b.nDigest);
+    BOOST_CHECK_EQUAL(a.legacyHash(), b.legacyHash());
+
+    uint256 r = GetRandHash();
+    SecMsgToken extra(2000, (unsigned char *)&r, 32, 0);
+    a.insertToken(extra);
+    BOOST_CHECK(a.nDigest != b.nDigest);
+
+    uint32_t nCountA[SMSG_SKETCH_PARTS], nDigestA[SMSG_SKETCH_PARTS];
+    uint32_t nCountB[SMSG_SKETCH_PARTS], nDigestB[SMSG_SKETCH_PARTS];
+    a.getSketch(nCountA, nDigestA);
+    b.getSketch(nCountB, nDigestB);
+    unsigned int nPart = SecMsgTokenPart(SecMsgTokenHash(extra));
+    for (unsigned int i = 0; i < SMSG_SKETCH_PARTS; i++)
+    {
+        BOOST_CHECK_EQUAL(nCountA[i], nCountB[i] + (i == nPart ? 1 : 0));
+        BOOST_CHECK_EQUAL(nDigestA[i] == nDigestB[i], i != nPart);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(smsg_index_query)
+{
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() / strprintf("test_smsgdb_%lu", (unsigned long)GetTime());
+    leveldb::DB *pdb = NULL;
+    leveldb::Options options;
+    options.create_if_missing = true;
+    BOOST_REQUIRE(leveldb::DB::Open(options, path.string(), &pdb).ok());
+
+    SecMsgDB db;
+    db.pdb = pdb;
+
+    // Six inbox messages to two addresses, received out of key order
+    std::string addr[2];
+    for (int i = 0; i < 2; i++)
+    {
+        uint256 r = GetRandHash();
+        addr[i] = CBitcoinAddress(CKeyID(uint160(vector<unsigned char>(r.begin(), r.begin() + 20)))).ToString();
+    }
+    vector<vector<unsigned char> > vKeys;
+    for (int i = 0; i < 6; i++)
+    {
+        unsigned char chKey[18];
+        memcpy(chKey, "im", 2);
+        RAND_bytes(&chKey[2], 16);
+        SecMsgStored smsgStored;
+        smsgStored.timeReceived = 1000 + (i * 7) % 6;
+        smsgStored.status = (i % 3 == 0) ? SMSG_MASK_UNREAD : 0;
+        smsgStored.folderId = 0;
+        smsgStored.sAddrTo = addr[i % 2];
+        BOOST_CHECK(db.WriteSmesg(chKey, smsgStored));
+        vKeys.push_back(vector<unsigned char>(chKey, chKey + 18));
+    }
+
+    SecMsgQuery query;
+    query.sPrefix = "im";
+    vector<vector<unsigned char> > vFound;
+    uint32_t nTotal;
+    BOOST_CHECK(SecureMsgQueryStored(db, query, vFound, nTotal) == 0);
+    BOOST_CHECK_EQUAL(nTotal, 6U);
+    BOOST_CHECK_EQUAL(vFound.size(), 6U);
+
+    // Paging follows time received
+    query.nOffset = 1;
+    query.nCount = 2;
+    query.nSince = 1002;
+    BOOST_CHECK(SecureMsgQueryStored(db, query, vFound, nTotal) == 0);
+    BOOST_CHECK_EQUAL(nTotal, 4U);
+    BOOST_REQUIRE_EQUAL(vFound.size(), 2U);
+    SecMsgStored smsgStored;
+    BOOST_CHECK(db.ReadSmesg(&vFound[0][0], smsgStored) && smsgStored.timeReceived == 1003);
+    BOOST_CHECK(db.ReadSmesg(&vFound[1][0], smsgStored) && smsgStored.timeReceived == 1004);
+
+    // Messages 0 and 3 are unread, 0 went to addr[0] and 3 to addr[1]
+    query = SecMsgQuery();
+    query.sPrefix = "im";
+    query.fUnreadOnly = true;
+    BOOST_CHECK(SecureMsgQueryStored(db, query, vFound, nTotal) == 0);
+    BOOST_CHECK_EQUAL(nTotal, 2U);
+    query.sAddress = addr[1];
+    BOOST_CHECK(SecureMsgQueryStored(db, query, vFound, nTotal) == 0);
+    BOOST_REQUIRE_EQUAL(vFound.size(), 1U);
+    BOOST_CHECK(vFound[0] == vKeys[3]);
+
+    // Marking read and erasing keep the indexes in step
+    BOOST_CHECK(db.ReadSmesg(&vKeys[3][0], smsgStored));
+    smsgStored.status = 0;
+    BOOST_CHECK(db.WriteSmesg(&vKeys[3][0], smsgStored));
+    BOOST_CHECK(SecureMsgQueryStored(db, query, vFound, nTotal) == 0);
+    BOOST_CHECK_EQUAL(nTotal, 0U);
+
+    BOOST_CHECK(db.EraseSmesg(&vKeys[0][0]));
+    query = SecMsgQuery();
+    query.sPrefix = "im";
+    BOOST_CHECK(SecureMsgQueryStored(db, query, vFound, nTotal) == 0);
+    BOOST_CHECK_EQUAL(nTotal, 5U);
+    query.sAddress = addr[0];
+    BOOST_CHECK(SecureMsgQueryStored(db, query, vFound, nTotal) == 0);
+    BOOST_CHECK_EQUAL(nTotal, 2U);
+
+    query.sAddress = "not an address";
+    BOOST_CHECK(SecureMsgQueryStored(db, query, vFound, nTotal) == 2);
+
+    delete pdb;
+    boost::filesystem::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(smsg_dict_payload)
+{
+    string sMessage = "Hi, thank you for your message. I have sent the payment, please let me know when you received it.";
+    vector<unsigned char> vchCompressed;
+    BOOST_REQUIRE(SecureMsgCompressDict((const unsigned char *)sMessage.c_str(), sMessage.size(), vchCompressed) == 0);
+    BOOST_CHECK(vchCompressed.size() < sMessage.size() * 3 / 4);
+
+    vector<unsigned char> vchPlain(sMessage.size());
+    BOOST_CHECK(SecureMsgDecompressDict(&vchCompressed[0], vchCompressed.size(), &vchPlain[0], vchPlain.size()) == 0);
+    BOOST_CHECK(string(vchPlain.begin(), vchPlain.end()) == sMessage);
+
+    // A wrong length or a corrupt payload is refused
+    BOOST_CHECK(SecureMsgDecompressDict(&vchCompressed[0], vchCompressed.size(), &vchPlain[0], vchPlain.size() - 1) != 0);
+    vector<unsigned char> vchJunk(64);
+    for (unsigned int i = 0; i < vchJunk.size(); i++)
+        vchJunk[i] = i * 37;
+    BOOST_CHECK(SecureMsgDecompressDict(&vchJunk[0], vchJunk.size(), &vchPlain[0], vchPlain.size()) != 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()